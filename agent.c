@@ -0,0 +1,448 @@
+/**
+ * NXT bootstrap interface; resident agent protocol.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+#include "crc32.h"
+#include "agent.h"
+
+#include "agent_routine.h"
+
+/* Request frames are a header of four words, magic/opcode/sequence,
+ * address, argument and payload length, then the payload and the
+ * CRC32 of everything before it. Replies are the same, with a three
+ * word header: magic/status/sequence, value and payload length.
+ */
+#define AGENT_HEADER        16
+#define AGENT_REPLY_HEADER  12
+#define AGENT_REQUEST_MAGIC 0xA5
+#define AGENT_REPLY_MAGIC   0x5A
+#define AGENT_VERSION       1
+
+enum nxt_agent_ops
+{
+  AGENT_PING = 0,
+  AGENT_WRITE = 1,
+  AGENT_READ = 2,
+  AGENT_FLASH = 3,
+  AGENT_CRC = 4,
+  AGENT_FILL = 5,
+  AGENT_EXIT = 6,
+};
+
+enum nxt_agent_status
+{
+  AGENT_OK = 0,
+  AGENT_BAD_CRC = 1,
+  AGENT_BAD_FRAME = 2,
+  AGENT_BAD_ADDRESS = 3,
+  AGENT_FLASH_ERROR = 4,
+};
+
+/* Streamed frames in flight at once. The agent blocks sending a reply
+ * until the host reads the one before it, and the host blocks sending
+ * a frame until the agent reads it: with more than two in flight,
+ * both could end up waiting on each other.
+ */
+#define AGENT_WINDOW  2
+
+/* Times a frame is resent after arriving corrupted. */
+#define AGENT_RETRIES 3
+
+struct nxt_agent_frame {
+  enum nxt_agent_ops op;
+  nxt_addr_t addr;
+  nxt_word_t arg;
+  char *data;
+  int len;   /* Bytes of data */
+  int size;  /* Payload size, the data zero-padded */
+  unsigned short seq;
+  int tries;
+};
+
+struct nxt_agent_pipe {
+  struct nxt_agent_frame frames[AGENT_WINDOW];
+  int first;
+  int n;
+};
+
+
+int
+nxt_agent_running(nxt_t *nxt)
+{
+  return nxt_agent_state_of(nxt)->running;
+}
+
+
+static nxt_error_t
+nxt_agent_error(enum nxt_agent_status status)
+{
+  switch (status)
+    {
+    case AGENT_OK:
+      return NXT_OK;
+    case AGENT_FLASH_ERROR:
+      return NXT_FLASH_ERROR;
+    case AGENT_BAD_ADDRESS:
+      return NXT_AGENT_ERROR;
+    default:
+      return NXT_SAMBA_PROTOCOL_ERROR;
+    }
+}
+
+
+static nxt_error_t
+nxt_agent_send(nxt_t *nxt, struct nxt_agent_frame *fr)
+{
+  char buf[AGENT_HEADER + NXT_AGENT_MAX_PAYLOAD + 4];
+  int n = AGENT_HEADER + fr->size;
+
+  fr->seq = nxt_agent_state_of(nxt)->seq++;
+  nxt_store_word(buf, AGENT_REQUEST_MAGIC | (fr->op << 8) | (fr->seq << 16));
+  nxt_store_word(buf + 4, fr->addr);
+  nxt_store_word(buf + 8, fr->arg);
+  nxt_store_word(buf + 12, fr->size);
+  if (fr->len > 0)
+    memcpy(buf + AGENT_HEADER, fr->data, fr->len);
+  memset(buf + AGENT_HEADER + fr->len, 0, fr->size - fr->len);
+  nxt_store_word(buf + n, nxt_crc32(buf, n));
+
+  return nxt_send_buf(nxt, buf, n + 4);
+}
+
+
+/* Receive the reply to frame seq. Successful replies carry exactly
+ * reply_len bytes. Failed ones carry none, and end the transfer early
+ * with a short packet.
+ */
+static nxt_error_t
+nxt_agent_recv(nxt_t *nxt, unsigned short seq,
+               enum nxt_agent_status *status, nxt_word_t *value,
+               char *reply, int reply_len)
+{
+  char buf[AGENT_REPLY_HEADER + NXT_AGENT_MAX_PAYLOAD + 4];
+  nxt_word_t w;
+  int len;
+
+  NXT_ERR(nxt_recv_buf(nxt, buf, AGENT_REPLY_HEADER + reply_len + 4));
+
+  w = nxt_load_word(buf);
+  len = nxt_load_word(buf + 8);
+  if ((w & 0xFF) != AGENT_REPLY_MAGIC || len < 0 || len > reply_len ||
+      nxt_crc32(buf, AGENT_REPLY_HEADER + len) !=
+      nxt_load_word(buf + AGENT_REPLY_HEADER + len) ||
+      (w >> 16) != seq)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  *status = (w >> 8) & 0xFF;
+  if (*status == AGENT_OK && len != reply_len)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  if (value != NULL)
+    *value = nxt_load_word(buf + 4);
+  if (len > 0)
+    memcpy(reply, buf + AGENT_REPLY_HEADER, len);
+
+  return NXT_OK;
+}
+
+
+/* Send a frame and wait for its reply. */
+static nxt_error_t
+nxt_agent_transact(nxt_t *nxt, struct nxt_agent_frame *fr,
+                   nxt_word_t *value, char *reply, int reply_len)
+{
+  enum nxt_agent_status status;
+
+  for (;;)
+    {
+      NXT_ERR(nxt_agent_send(nxt, fr));
+      NXT_ERR(nxt_agent_recv(nxt, fr->seq, &status, value,
+                             reply, reply_len));
+
+      if (status != AGENT_BAD_CRC || fr->tries++ >= AGENT_RETRIES)
+        return nxt_agent_error(status);
+    }
+}
+
+
+static nxt_error_t nxt_agent_post(nxt_t *nxt, struct nxt_agent_pipe *pipe,
+                                  struct nxt_agent_frame *fr);
+
+/* Collect the reply to the oldest frame in flight, resending it if it
+ * arrived corrupted. Streamed frames don't depend on each other, so
+ * the resent one can overtake those sent after it.
+ */
+static nxt_error_t
+nxt_agent_complete(nxt_t *nxt, struct nxt_agent_pipe *pipe)
+{
+  struct nxt_agent_frame fr = pipe->frames[pipe->first];
+  enum nxt_agent_status status;
+
+  pipe->first = (pipe->first + 1) % AGENT_WINDOW;
+  pipe->n--;
+
+  NXT_ERR(nxt_agent_recv(nxt, fr.seq, &status, NULL, NULL, 0));
+  if (status == AGENT_BAD_CRC && fr.tries < AGENT_RETRIES)
+    {
+      fr.tries++;
+      return nxt_agent_post(nxt, pipe, &fr);
+    }
+
+  return nxt_agent_error(status);
+}
+
+
+/* Send a frame without waiting for its reply, once there is room. */
+static nxt_error_t
+nxt_agent_post(nxt_t *nxt, struct nxt_agent_pipe *pipe,
+               struct nxt_agent_frame *fr)
+{
+  struct nxt_agent_frame *slot;
+
+  while (pipe->n == AGENT_WINDOW)
+    NXT_ERR(nxt_agent_complete(nxt, pipe));
+
+  slot = &pipe->frames[(pipe->first + pipe->n) % AGENT_WINDOW];
+  *slot = *fr;
+  pipe->n++;
+
+  return nxt_agent_send(nxt, slot);
+}
+
+
+/* Collect the replies still due, to keep the stream in step after
+ * the agent refused a frame. A transfer error leaves it out of step
+ * anyway, so there is no point waiting for them then.
+ */
+static nxt_error_t
+nxt_agent_drain(nxt_t *nxt, struct nxt_agent_pipe *pipe, nxt_error_t err)
+{
+  while (pipe->n > 0 && (err == NXT_OK || err == NXT_AGENT_ERROR ||
+                         err == NXT_FLASH_ERROR))
+    {
+      nxt_error_t e = nxt_agent_complete(nxt, pipe);
+
+      if (err == NXT_OK)
+        err = e;
+    }
+
+  return err;
+}
+
+
+nxt_error_t
+nxt_agent_ping(nxt_t *nxt)
+{
+  struct nxt_agent_frame fr = { AGENT_PING };
+  nxt_word_t version;
+
+  NXT_ERR(nxt_agent_transact(nxt, &fr, &version, NULL, 0));
+  return version == AGENT_VERSION ? NXT_OK : NXT_AGENT_ERROR;
+}
+
+
+nxt_error_t
+nxt_agent_start(nxt_t *nxt)
+{
+  nxt_agent_state_t *state = nxt_agent_state_of(nxt);
+  nxt_error_t err;
+
+  if (state->running)
+    return NXT_OK;
+
+  NXT_ERR(nxt_write_mem(nxt, NXT_AGENT_ADDR, agent_bin, agent_len));
+  NXT_ERR(nxt_jump(nxt, NXT_AGENT_ADDR));
+
+  state->running = 1;
+  state->seq = 0;
+
+  err = nxt_agent_ping(nxt);
+  if (err)
+    state->running = 0;
+
+  return err;
+}
+
+
+void
+nxt_agent_note_send(nxt_t *nxt, const char *buf, int len)
+{
+  nxt_agent_state_t *state = nxt_agent_state_of(nxt);
+  char jump[20];
+
+  // The jump to the agent always ends its packet
+  snprintf(jump, sizeof(jump), "G%08X#", NXT_AGENT_ADDR);
+  if (!state->running && len >= strlen(jump) &&
+      memcmp(buf + len - strlen(jump), jump, strlen(jump)) == 0)
+    {
+      state->running = 1;
+      state->seq = 0;
+    }
+  else if (state->running && len >= AGENT_HEADER &&
+           (unsigned char)buf[0] == AGENT_REQUEST_MAGIC &&
+           buf[1] == AGENT_EXIT)
+    state->running = 0;
+}
+
+
+nxt_error_t
+nxt_agent_stop(nxt_t *nxt)
+{
+  nxt_agent_state_t *state = nxt_agent_state_of(nxt);
+  struct nxt_agent_frame fr = { AGENT_EXIT };
+  nxt_word_t pad = 0;
+  nxt_error_t err;
+  char c = 0;
+
+  if (!state->running)
+    return NXT_OK;
+
+  state->running = 0;
+  err = nxt_agent_transact(nxt, &fr, &pad, NULL, 0);
+
+  /* SAM-BA reads its packets from alternating banks of the endpoint,
+   * and counts on the next one being in the bank after the jump to
+   * the agent. The agent says when it takes one more packet to get
+   * there, even when reporting a flash error.
+   */
+  if ((err == NXT_OK || err == NXT_FLASH_ERROR) && pad)
+    NXT_ERR(nxt_send_buf(nxt, &c, 1));
+
+  return err;
+}
+
+
+nxt_error_t
+nxt_agent_write(nxt_t *nxt, nxt_addr_t addr, char *buf, int len)
+{
+  struct nxt_agent_pipe pipe;
+  nxt_error_t err = NXT_OK;
+  int off;
+
+  pipe.first = pipe.n = 0;
+  for (off = 0; off < len && err == NXT_OK; off += NXT_AGENT_MAX_PAYLOAD)
+    {
+      int n = len - off;
+      struct nxt_agent_frame fr = { AGENT_WRITE, addr + off, 0, buf + off };
+
+      if (n > NXT_AGENT_MAX_PAYLOAD)
+        n = NXT_AGENT_MAX_PAYLOAD;
+      fr.len = fr.size = n;
+      err = nxt_agent_post(nxt, &pipe, &fr);
+    }
+
+  return nxt_agent_drain(nxt, &pipe, err);
+}
+
+
+nxt_error_t
+nxt_agent_read(nxt_t *nxt, nxt_addr_t addr, char *buf, int len)
+{
+  int off;
+
+  // Reads are answered with the data, so they can't be streamed
+  for (off = 0; off < len; off += NXT_AGENT_MAX_PAYLOAD)
+    {
+      int n = len - off;
+      struct nxt_agent_frame fr = { AGENT_READ, addr + off };
+
+      if (n > NXT_AGENT_MAX_PAYLOAD)
+        n = NXT_AGENT_MAX_PAYLOAD;
+      fr.arg = n;
+      NXT_ERR(nxt_agent_transact(nxt, &fr, NULL, buf + off, n));
+    }
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_agent_fill(nxt_t *nxt, nxt_addr_t addr, nxt_word_t w, int len)
+{
+  char pattern[4];
+  struct nxt_agent_frame fr = { AGENT_FILL, addr, len, pattern, 4, 4 };
+
+  nxt_store_word(pattern, w);
+  return nxt_agent_transact(nxt, &fr, NULL, NULL, 0);
+}
+
+
+nxt_error_t
+nxt_agent_crc(nxt_t *nxt, nxt_addr_t addr, nxt_word_t chunk_len,
+              int n_chunks, nxt_word_t *crcs)
+{
+  char buf[NXT_AGENT_MAX_PAYLOAD];
+  char count[4];
+  int i, n;
+
+  for (; n_chunks > 0; n_chunks -= n)
+    {
+      struct nxt_agent_frame fr = { AGENT_CRC, addr, chunk_len, count, 4, 4 };
+
+      n = n_chunks;
+      if (n > NXT_AGENT_MAX_PAYLOAD / 4)
+        n = NXT_AGENT_MAX_PAYLOAD / 4;
+
+      nxt_store_word(count, n);
+      NXT_ERR(nxt_agent_transact(nxt, &fr, NULL, buf, n * 4));
+
+      for (i = 0; i < n; i++)
+        *crcs++ = nxt_load_word(buf + i * 4);
+      addr += n * chunk_len;
+    }
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_agent_flash(nxt_t *nxt, int first_page, char *data, int len)
+{
+  struct nxt_agent_pipe pipe;
+  nxt_error_t err = NXT_OK;
+  int off;
+
+  if (len <= 0)
+    {
+      struct nxt_agent_frame fr = { AGENT_FLASH, first_page };
+      return nxt_agent_transact(nxt, &fr, NULL, NULL, 0);
+    }
+
+  pipe.first = pipe.n = 0;
+  for (off = 0; off < len && err == NXT_OK; off += NXT_AGENT_MAX_PAYLOAD)
+    {
+      struct nxt_agent_frame fr = { AGENT_FLASH, first_page + off / 256,
+                                    0, data + off };
+
+      fr.len = len - off;
+      if (fr.len > NXT_AGENT_MAX_PAYLOAD)
+        fr.len = NXT_AGENT_MAX_PAYLOAD;
+      fr.size = (fr.len + 255) & ~255;
+      err = nxt_agent_post(nxt, &pipe, &fr);
+    }
+
+  return nxt_agent_drain(nxt, &pipe, err);
+}
@@ -0,0 +1,82 @@
+/**
+ * NXT bootstrap interface; resident agent protocol.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __AGENT_H__
+#define __AGENT_H__
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+
+/* The agent is a small program libnxt can run on the brick in place
+ * of SAM-BA's command loop (see flash_write/agent.c). It speaks a
+ * binary protocol over the same bulk endpoints: CRC32-checked frames
+ * carrying up to NXT_AGENT_MAX_PAYLOAD bytes, with sequence numbers
+ * so that writes can be streamed with several frames in flight.
+ *
+ * While it runs, the samba.c reads and writes and the firmware.c
+ * flashing and checksumming go through it. nxt_jump(), and anything
+ * else needing SAM-BA, hands the brick back to SAM-BA first.
+ *
+ * The agent owns the SRAM from NXT_AGENT_ADDR up, and refuses writes
+ * there. It doesn't handle USB enumeration, so a USB reset while it
+ * runs leaves the brick waiting for a manual reset.
+ */
+#define NXT_AGENT_ADDR 0x20C000
+#define NXT_AGENT_MAX_PAYLOAD 2048
+
+nxt_error_t nxt_agent_start(nxt_t *nxt);
+nxt_error_t nxt_agent_stop(nxt_t *nxt);
+int nxt_agent_running(nxt_t *nxt);
+
+/* Check that the agent is there and answering. */
+nxt_error_t nxt_agent_ping(nxt_t *nxt);
+
+nxt_error_t nxt_agent_write(nxt_t *nxt, nxt_addr_t addr, char *buf, int len);
+nxt_error_t nxt_agent_read(nxt_t *nxt, nxt_addr_t addr, char *buf, int len);
+nxt_error_t nxt_agent_fill(nxt_t *nxt, nxt_addr_t addr, nxt_word_t w,
+                           int len);
+
+/* CRC32 of n_chunks consecutive chunks of chunk_len bytes at addr. */
+nxt_error_t nxt_agent_crc(nxt_t *nxt, nxt_addr_t addr, nxt_word_t chunk_len,
+                          int n_chunks, nxt_word_t *crcs);
+
+/* Program flash pages from first_page on with len bytes of data,
+ * zero-padded to whole pages, unlocking their regions as needed. The
+ * last page may still be programming on return; flashing no pages at
+ * all waits for it, and reports any error.
+ */
+nxt_error_t nxt_agent_flash(nxt_t *nxt, int first_page, char *data, int len);
+
+/* Per-handle agent state, kept in the handle by lowlevel.c. */
+typedef struct {
+  int running;
+  unsigned short seq;
+} nxt_agent_state_t;
+
+nxt_agent_state_t *nxt_agent_state_of(nxt_t *nxt);
+
+/* Follow the agent starting and stopping from the bytes sent over a
+ * handle, for nxtd: its clients run the agent through its handles.
+ */
+void nxt_agent_note_send(nxt_t *nxt, const char *buf, int len);
+
+#endif /* __AGENT_H__ */
@@ -0,0 +1,55 @@
+/**
+ * NXT bootstrap interface; CRC32 checksum code.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "crc32.h"
+
+/* Nibble-wise lookup table for the reflected 0xEDB88320 polynomial, as
+ * used by the onboard CRC routine (flash_write/crc.c).
+ */
+static const nxt_word_t crc32_nibble[16] = {
+  0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+  0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+  0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+  0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+nxt_word_t
+nxt_crc32_update(nxt_word_t crc, const char *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+
+  crc = ~crc;
+  while (len--)
+    {
+      crc ^= *p++;
+      crc = (crc >> 4) ^ crc32_nibble[crc & 0xF];
+      crc = (crc >> 4) ^ crc32_nibble[crc & 0xF];
+    }
+
+  return ~crc;
+}
+
+
+nxt_word_t
+nxt_crc32(const char *buf, size_t len)
+{
+  return nxt_crc32_update(0, buf, len);
+}
@@ -0,0 +1,31 @@
+/**
+ * NXT bootstrap interface; CRC32 checksum code.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __CRC32_H__
+#define __CRC32_H__
+
+#include <stddef.h>
+#include "samba.h"
+
+nxt_word_t nxt_crc32(const char *buf, size_t len);
+nxt_word_t nxt_crc32_update(nxt_word_t crc, const char *buf, size_t len);
+
+#endif /* __CRC32_H__ */
@@ -0,0 +1,443 @@
+/**
+ * NXT bootstrap interface; nxtd client and protocol.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+// For struct ucred
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+#include "transport.h"
+#include "daemon.h"
+
+/* Room for the LIST reply, at a few dozen bytes per brick. */
+#define NXTD_LIST_MAX 4096
+
+struct nxtd_client {
+  int fd;
+  char location[64];
+};
+
+static int nxt_daemon_disabled = 0;
+
+
+void
+nxt_daemon_socket_path(char *buf, int len)
+{
+  char *path = getenv("NXTD_SOCKET");
+  char *dir = getenv("XDG_RUNTIME_DIR");
+
+  if (path != NULL && *path != '\0')
+    snprintf(buf, len, "%s", path);
+  else if (dir != NULL && *dir != '\0')
+    snprintf(buf, len, "%s/nxtd", dir);
+  else
+    snprintf(buf, len, "/tmp/nxtd-%d/socket", (int)getuid());
+}
+
+
+int
+nxt_daemon_peer_trusted(int fd)
+{
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    return 0;
+  return cred.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+
+  if (getpeereid(fd, &uid, &gid) < 0)
+    return 0;
+  return uid == geteuid();
+#endif
+}
+
+
+static int
+nxt_daemon_connect(void)
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  if (nxt_daemon_disabled || getenv("NXT_NO_DAEMON") != NULL)
+    return -1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  nxt_daemon_socket_path(sa.sun_path, sizeof(sa.sun_path));
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  // Whoever else listens there is no daemon of ours
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+      !nxt_daemon_peer_trusted(fd))
+    {
+      close(fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+
+int
+nxt_daemon_available(void)
+{
+  int fd = nxt_daemon_connect();
+
+  if (fd < 0)
+    return 0;
+
+  close(fd);
+  return 1;
+}
+
+
+void
+nxt_daemon_disable(void)
+{
+  nxt_daemon_disabled = 1;
+}
+
+
+static int
+nxt_daemon_write_full(int fd, const char *buf, int len)
+{
+  while (len > 0)
+    {
+      // A dead peer must not take the process down with SIGPIPE
+      ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      buf += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+
+static int
+nxt_daemon_read_full(int fd, char *buf, int len)
+{
+  while (len > 0)
+    {
+      ssize_t n = recv(fd, buf, len, 0);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      buf += n;
+      len -= n;
+    }
+
+  return 0;
+}
+
+
+nxt_error_t
+nxt_daemon_send_msg(int fd, int type, const char *payload, int len)
+{
+  char header[4];
+
+  if (len > NXTD_MAX_PAYLOAD)
+    return NXT_DAEMON_ERROR;
+
+  nxt_store_word(header, type | (len << 8));
+  if (nxt_daemon_write_full(fd, header, 4) < 0 ||
+      nxt_daemon_write_full(fd, payload, len) < 0)
+    return NXT_DAEMON_ERROR;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_daemon_recv_msg(int fd, int *type, char *payload, int max, int *len)
+{
+  char header[4];
+  nxt_word_t w;
+
+  if (nxt_daemon_read_full(fd, header, 4) < 0)
+    return NXT_DAEMON_ERROR;
+
+  w = nxt_load_word(header);
+  *type = w & 0xFF;
+  *len = w >> 8;
+  if (*len > max || nxt_daemon_read_full(fd, payload, *len) < 0)
+    return NXT_DAEMON_ERROR;
+
+  return NXT_OK;
+}
+
+
+/* One request and its reply. Returns the error the reply carries. */
+static nxt_error_t
+nxt_daemon_call(int fd, int type, const char *payload, int len,
+                char *reply, int max, int *reply_len)
+{
+  int status, n;
+
+  NXT_ERR(nxt_daemon_send_msg(fd, type, payload, len));
+  NXT_ERR(nxt_daemon_recv_msg(fd, &status, reply, max,
+                              reply_len ? reply_len : &n));
+
+  return (nxt_error_t)status;
+}
+
+
+static nxt_error_t
+nxtd_open(nxt_t *nxt, int interface)
+{
+  struct nxtd_client *c = nxt_transport_data(nxt);
+  char buf[12 + sizeof(c->location)];
+  int len = strlen(c->location) + 1;
+
+  // The daemon's handle goes by the settings of ours
+  nxt_store_word(buf, interface);
+  nxt_store_word(buf + 4, nxt_get_timeout(nxt));
+  nxt_store_word(buf + 8, nxt_get_retries(nxt));
+  memcpy(buf + 12, c->location, len);
+
+  return nxt_daemon_call(c->fd, NXTD_OPEN, buf, 12 + len, NULL, 0, NULL);
+}
+
+
+static nxt_error_t
+nxtd_send(nxt_t *nxt, char *buf, int len)
+{
+  struct nxtd_client *c = nxt_transport_data(nxt);
+  int n;
+
+  /* Pieces are a whole number of packets, so the brick sees the same
+   * stream either way.
+   */
+  do
+    {
+      n = len < NXTD_MAX_PAYLOAD ? len : NXTD_MAX_PAYLOAD;
+      NXT_ERR(nxt_daemon_call(c->fd, NXTD_SEND, buf, n, NULL, 0, NULL));
+      buf += n;
+      len -= n;
+    }
+  while (len > 0);
+
+  return NXT_OK;
+}
+
+
+static nxt_error_t
+nxtd_recv(nxt_t *nxt, char *buf, int len, int *n_read)
+{
+  struct nxtd_client *c = nxt_transport_data(nxt);
+  char req[4];
+
+  *n_read = 0;
+  if (len > NXTD_MAX_PAYLOAD)
+    len = NXTD_MAX_PAYLOAD;
+
+  nxt_store_word(req, len);
+  return nxt_daemon_call(c->fd, NXTD_RECV, req, 4, buf, len, n_read);
+}
+
+
+static void
+nxtd_close(nxt_t *nxt)
+{
+  struct nxtd_client *c = nxt_transport_data(nxt);
+
+  nxt_daemon_call(c->fd, NXTD_CLOSE, NULL, 0, NULL, 0, NULL);
+  close(c->fd);
+  free(c);
+}
+
+
+static nxt_error_t
+nxtd_reconnect(nxt_t *nxt, int timeout_ms)
+{
+  struct nxtd_client *c = nxt_transport_data(nxt);
+  char req[4];
+
+  nxt_store_word(req, timeout_ms);
+  return nxt_daemon_call(c->fd, NXTD_RECONNECT, req, 4, NULL, 0, NULL);
+}
+
+
+static void
+nxtd_location(nxt_t *nxt, char *buf, int len)
+{
+  struct nxtd_client *c = nxt_transport_data(nxt);
+
+  snprintf(buf, len, "%s", c->location);
+}
+
+
+static const nxt_transport_t nxt_daemon_transport = {
+  "nxtd",
+  nxtd_open,
+  nxtd_send,
+  nxtd_recv,
+  nxtd_close,
+  nxtd_reconnect,
+  nxtd_location,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+};
+
+
+/* Whether a brick at location answers to path, which is a port path,
+ * a sysfs device directory or a "bus:device" address.
+ */
+static int
+nxt_daemon_path_matches(const char *location, const char *path)
+{
+  const char *base;
+  int bus, dev, l_bus, l_dev;
+
+  if (path == NULL)
+    return 1;
+
+  if (sscanf(path, "%d:%d", &bus, &dev) == 2)
+    return (sscanf(location, "%d:%d", &l_bus, &l_dev) == 2 &&
+            bus == l_bus && dev == l_dev);
+
+  base = strrchr(path, '/');
+  return strcmp(location, base ? base + 1 : path) == 0;
+}
+
+
+static nxt_error_t
+nxt_daemon_attach(nxt_t *nxt, int fd, const char *location, int fw)
+{
+  struct nxtd_client *c = calloc(1, sizeof(*c));
+
+  if (c == NULL)
+    return NXT_CONFIGURATION_ERROR;
+
+  c->fd = fd;
+  snprintf(c->location, sizeof(c->location), "%s", location);
+  nxt_set_transport(nxt, &nxt_daemon_transport, c, fw);
+
+  return NXT_OK;
+}
+
+
+/* The bricks nxtd knows, as a firmware byte followed by a location
+ * string per brick.
+ */
+static nxt_error_t
+nxt_daemon_list(int fd, char *list, int *len)
+{
+  NXT_ERR(nxt_daemon_call(fd, NXTD_LIST, NULL, 0, list, NXTD_LIST_MAX - 1,
+                          len));
+  list[*len] = '\0';
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_daemon_find(nxt_t *nxt, char *path, int fw)
+{
+  char list[NXTD_LIST_MAX], *p;
+  int fd, len;
+
+  fd = nxt_daemon_connect();
+  if (fd < 0)
+    return NXT_DAEMON_ERROR;
+
+  if (nxt_daemon_list(fd, list, &len) == NXT_OK)
+    for (p = list; p < list + len; p += strlen(p + 1) + 2)
+      if ((fw < 0 || p[0] == fw) && nxt_daemon_path_matches(p + 1, path))
+        return nxt_daemon_attach(nxt, fd, p + 1, p[0]);
+
+  close(fd);
+  return NXT_NOT_PRESENT;
+}
+
+
+nxt_error_t
+nxt_daemon_find_all(nxt_t ***nxts, int *n_nxts)
+{
+  char list[NXTD_LIST_MAX], *p;
+  nxt_t **handles = NULL;
+  int fd, len, n = 0;
+
+  fd = nxt_daemon_connect();
+  if (fd < 0)
+    return NXT_DAEMON_ERROR;
+
+  if (nxt_daemon_list(fd, list, &len) != NXT_OK)
+    len = 0;
+  close(fd);
+
+  // Each handle gets a connection of its own
+  for (p = list; p < list + len; p += strlen(p + 1) + 2)
+    {
+      nxt_t **grown = realloc(handles, (n + 1) * sizeof(*handles));
+
+      if (grown == NULL)
+        break;
+      handles = grown;
+
+      fd = nxt_daemon_connect();
+      if (fd < 0)
+        break;
+      handles[n] = NULL;
+      if (nxt_init(&handles[n]) != NXT_OK || handles[n] == NULL ||
+          nxt_daemon_attach(handles[n], fd, p + 1, p[0]) != NXT_OK)
+        {
+          free(handles[n]);
+          close(fd);
+          break;
+        }
+      n++;
+    }
+
+  if (n == 0)
+    {
+      free(handles);
+      return NXT_NOT_PRESENT;
+    }
+
+  *nxts = handles;
+  *n_nxts = n;
+  return NXT_OK;
+}
@@ -0,0 +1,88 @@
+/**
+ * NXT bootstrap interface; nxtd client and protocol.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include "error.h"
+#include "lowlevel.h"
+
+/* nxtd (see main_nxtd.c) keeps the attached bricks open and serves
+ * local programs over a Unix domain socket. While it runs, the
+ * nxt_find() family hands out handles that go through it, skipping
+ * the bus scan and USB setup, and letting several programs share the
+ * bricks. A program has its brick to itself from nxt_open() to
+ * nxt_close(); others opening it meanwhile wait their turn.
+ *
+ * The socket is $NXTD_SOCKET, or nxtd in $XDG_RUNTIME_DIR, or else
+ * socket in a /tmp/nxtd-<uid> directory only its owner can get into.
+ * Each end of a connection checks the other runs as the same user.
+ * Setting NXT_NO_DAEMON in the environment bypasses the daemon.
+ */
+void nxt_daemon_socket_path(char *buf, int len);
+
+/* Whether the process at the other end of a connection runs as the
+ * same user as this one.
+ */
+int nxt_daemon_peer_trusted(int fd);
+
+/* Whether nxtd answers, and handles should go through it. */
+int nxt_daemon_available(void);
+
+/* Keep this process off nxtd, as nxtd itself must. */
+void nxt_daemon_disable(void);
+
+/* Point nxt at the first brick nxtd knows running fw (any firmware
+ * when fw is negative), and found at path when that isn't NULL.
+ * Paths are matched like nxt_find_path() does.
+ */
+nxt_error_t nxt_daemon_find(nxt_t *nxt, char *path, int fw);
+nxt_error_t nxt_daemon_find_all(nxt_t ***nxts, int *n_nxts);
+
+/* The wire protocol. Each message starts with a little-endian word
+ * holding its type in the low 8 bits and the length of the payload
+ * that follows in the upper 24. Every request gets one reply, whose
+ * type is an nxt_error_t. Payload words are little-endian too.
+ */
+#define NXTD_MAX_PAYLOAD (1 << 20)
+
+/* How long NXTD_OPEN waits for other clients to be done with the
+ * brick, before replying NXT_IN_USE.
+ */
+#define NXTD_OPEN_WAIT_MS 60000
+
+enum {
+  NXTD_LIST = 1,  /* reply: firmware byte, location, NUL, per brick */
+  NXTD_OPEN,      /* interface, timeout, retries words, then location */
+  NXTD_SEND,      /* the data to write */
+  NXTD_RECV,      /* length word; reply: the data read */
+  NXTD_CLOSE,
+  NXTD_RECONNECT, /* timeout word */
+};
+
+nxt_error_t nxt_daemon_send_msg(int fd, int type, const char *payload,
+                                int len);
+
+/* Receive a message, with a payload of at most max bytes. */
+nxt_error_t nxt_daemon_recv_msg(int fd, int *type, char *payload, int max,
+                                int *len);
+
+#endif /* __DAEMON_H__ */
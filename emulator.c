@@ -0,0 +1,1113 @@
+/**
+ * NXT bootstrap interface; SAM-BA emulator.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "transport.h"
+#include "samba.h"
+#include "crc32.h"
+#include "lz.h"
+#include "emulator.h"
+#include "flash_routine.h"
+#include "crc_routine.h"
+#include "unlz_routine.h"
+#include "seq_routine.h"
+#include "agent_routine.h"
+#include "csum_routine.h"
+#include "regs_routine.h"
+
+#define SRAM_BASE  0x00200000
+#define FLASH_BASE 0x00100000
+#define FLASH_PAGE_SIZE 256
+#define FLASH_REGION_PAGES 64
+
+/* Memory controller flash registers. */
+#define MC_FMR 0xFFFFFF60
+#define MC_FCR 0xFFFFFF64
+#define MC_FSR 0xFFFFFF68
+
+#define FSR_FRDY  0x1
+#define FSR_LOCKE 0x4
+#define FSR_PROGE 0x8
+#define FMR_NEBP  0x80
+
+enum emu_flash_commands
+{
+  FCMD_WP = 0x1,   /* Write page */
+  FCMD_SLB = 0x2,  /* Set lock bit */
+  FCMD_WPL = 0x3,  /* Write page and lock */
+  FCMD_CLB = 0x4,  /* Clear lock bit */
+  FCMD_EA = 0x8,   /* Erase all */
+};
+
+/* Fixed SRAM addresses used by the onboard routines (see flash_write/).
+ * The others find their parameters relative to where they run.
+ */
+#define FLASH_BATCH_ADDR  0x202300
+#define CRC_PARAMS_ADDR   0x202800
+#define CRC_TABLE_ADDR    0x203000
+#define ROUTINE_MAILBOX   0x400
+
+#define SEQ_SET_FMR    1
+#define SEQ_COMMAND    2
+#define SEQ_WRITE_PAGE 3
+#define SEQ_DONE       0x80000000
+
+/* The resident agent's protocol (see flash_write/agent.c). */
+#define AGENT_HEADER        16
+#define AGENT_REPLY_HEADER  12
+#define AGENT_MAX_PAYLOAD   2048
+#define AGENT_FRAME_SIZE    (AGENT_HEADER + AGENT_MAX_PAYLOAD + 4)
+#define AGENT_REQUEST_MAGIC 0xA5
+#define AGENT_REPLY_MAGIC   0x5A
+#define AGENT_VERSION       1
+#define AGENT_SRAM_END      0x00210000
+
+#define AGENT_PING   0
+#define AGENT_WRITE  1
+#define AGENT_READ   2
+#define AGENT_FLASH  3
+#define AGENT_CRC    4
+#define AGENT_FILL   5
+#define AGENT_EXIT   6
+
+#define AGENT_OK          0
+#define AGENT_BAD_CRC     1
+#define AGENT_BAD_FRAME   2
+#define AGENT_BAD_ADDRESS 3
+#define AGENT_FLASH_ERROR 4
+
+/* Replies the agent can have queued before the host reads them. The
+ * real one has two banks, and blocks; the host never needs more.
+ */
+#define AGENT_QUEUE 8
+
+#define USB_PACKET_SIZE 64
+
+/* Longest command SAM-BA accepts, "S00202000,00001000#" and the like. */
+#define CMD_MAX 32
+
+struct nxt_emu {
+  unsigned char sram[NXT_EMU_SRAM_SIZE];
+  unsigned char flash[NXT_EMU_FLASH_SIZE];
+  unsigned char latch[FLASH_PAGE_SIZE];
+
+  nxt_word_t fmr;
+  nxt_word_t fsr_errors;
+  nxt_word_t locks;
+
+  /* Times in microseconds: when the flash controller will be ready
+   * again, and when SAM-BA is back from the code it jumped to.
+   */
+  long long flash_busy_until;
+  long long cpu_busy_until;
+  int latency_us;
+  int program_us;
+
+  // Command parser
+  char cmd[CMD_MAX];
+  int cmd_len;
+  nxt_addr_t data_addr;
+  nxt_word_t data_left;
+
+  // Replies waiting to be read by the host
+  unsigned char *out;
+  int out_len;
+  int out_pos;
+  int out_size;
+
+  /* The agent, while it runs instead of SAM-BA. Its replies are
+   * separate transfers, ending at the offsets in reply_ends.
+   */
+  int agent;
+  nxt_addr_t agent_base;
+  unsigned long agent_packets;
+  nxt_word_t agent_errors;
+  int agent_pad;
+  int reply_ends[AGENT_QUEUE];
+  int n_replies;
+
+  int halted;
+};
+
+
+static long long
+emu_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+/* Stall the host like a transfer to a busy brick would. SAM-BA only
+ * services USB once the code it jumped to has returned.
+ */
+static void
+emu_delay(nxt_emu_t *emu)
+{
+  long long t = emu_now();
+  long long until = t;
+
+  if (emu->cpu_busy_until > until)
+    until = emu->cpu_busy_until;
+  until += emu->latency_us;
+
+  if (until > t)
+    {
+      struct timespec ts;
+
+      ts.tv_sec = (until - t) / 1000000;
+      ts.tv_nsec = (until - t) % 1000000 * 1000;
+      nanosleep(&ts, NULL);
+    }
+}
+
+
+static unsigned char *
+emu_sram(nxt_emu_t *emu, nxt_addr_t addr, nxt_word_t len)
+{
+  if (addr < SRAM_BASE || addr - SRAM_BASE > NXT_EMU_SRAM_SIZE ||
+      len > NXT_EMU_SRAM_SIZE - (addr - SRAM_BASE))
+    return NULL;
+
+  return emu->sram + (addr - SRAM_BASE);
+}
+
+
+static void
+emu_flash_command(nxt_emu_t *emu, nxt_word_t cmd, long long t)
+{
+  int page = (cmd >> 8) & 0x3FF;
+  nxt_word_t region = 1 << (page / FLASH_REGION_PAGES);
+  unsigned char *dst = emu->flash + page * FLASH_PAGE_SIZE;
+  int i;
+
+  if ((cmd >> 24) != 0x5A || t < emu->flash_busy_until)
+    {
+      emu->fsr_errors |= FSR_PROGE;
+      return;
+    }
+
+  switch (cmd & 0xF)
+    {
+    case FCMD_WP:
+    case FCMD_WPL:
+      if (emu->locks & region)
+        {
+          emu->fsr_errors |= FSR_LOCKE;
+          return;
+        }
+
+      // Without erase before programming, bits can only be cleared
+      for (i = 0; i < FLASH_PAGE_SIZE; i++)
+        dst[i] = (emu->fmr & FMR_NEBP) ? dst[i] & emu->latch[i]
+                                       : emu->latch[i];
+
+      if ((cmd & 0xF) == FCMD_WPL)
+        emu->locks |= region;
+      break;
+
+    case FCMD_SLB:
+      emu->locks |= region;
+      break;
+
+    case FCMD_CLB:
+      emu->locks &= ~region;
+      break;
+
+    case FCMD_EA:
+      if (emu->locks)
+        {
+          emu->fsr_errors |= FSR_LOCKE;
+          return;
+        }
+      memset(emu->flash, 0xFF, NXT_EMU_FLASH_SIZE);
+      break;
+
+    default:
+      emu->fsr_errors |= FSR_PROGE;
+      return;
+    }
+
+  emu->flash_busy_until = t + emu->program_us;
+}
+
+
+static nxt_word_t
+emu_read_fsr(nxt_emu_t *emu, long long t)
+{
+  nxt_word_t fsr = emu->fsr_errors | (emu->locks << 16);
+
+  if (t >= emu->flash_busy_until)
+    fsr |= FSR_FRDY;
+
+  // Reading the status clears the error bits
+  emu->fsr_errors = 0;
+  return fsr;
+}
+
+
+/* Accesses of size bytes, as the ARM core would do them at time t. */
+static nxt_word_t
+emu_read(nxt_emu_t *emu, nxt_addr_t addr, int size, long long t)
+{
+  unsigned char *p = emu_sram(emu, addr, size);
+  nxt_word_t w = 0;
+  int i;
+
+  if (p == NULL && addr >= FLASH_BASE &&
+      addr - FLASH_BASE + size <= NXT_EMU_FLASH_SIZE)
+    p = emu->flash + (addr - FLASH_BASE);
+
+  if (p != NULL)
+    {
+      for (i = size - 1; i >= 0; i--)
+        w = (w << 8) | p[i];
+      return w;
+    }
+
+  if (addr == MC_FMR)
+    return emu->fmr;
+  if (addr == MC_FSR)
+    return emu_read_fsr(emu, t);
+
+  // Other peripherals read as zero
+  return 0;
+}
+
+
+static void
+emu_write(nxt_emu_t *emu, nxt_addr_t addr, int size, nxt_word_t w,
+          long long t)
+{
+  unsigned char *p = emu_sram(emu, addr, size);
+  int i;
+
+  // Writes to the flash only load the page latch
+  if (p == NULL && addr >= FLASH_BASE &&
+      addr - FLASH_BASE + size <= NXT_EMU_FLASH_SIZE)
+    p = emu->latch + ((addr - FLASH_BASE) % FLASH_PAGE_SIZE);
+
+  if (p != NULL)
+    {
+      for (i = 0; i < size; i++, w >>= 8)
+        p[i] = w & 0xFF;
+      return;
+    }
+
+  if (addr == MC_FMR)
+    emu->fmr = w;
+  else if (addr == MC_FCR)
+    emu_flash_command(emu, w, t);
+}
+
+
+static void
+emu_reply(nxt_emu_t *emu, const void *buf, int len)
+{
+  if (emu->out_len + len > emu->out_size)
+    {
+      int size = emu->out_len + len + 4096;
+      unsigned char *out = realloc(emu->out, size);
+
+      if (out == NULL)
+        return;
+      emu->out = out;
+      emu->out_size = size;
+    }
+
+  memcpy(emu->out + emu->out_len, buf, len);
+  emu->out_len += len;
+}
+
+
+/* The onboard routines busy-wait on FRDY; the emulated ones skip
+ * ahead to when it is set.
+ */
+static long long
+emu_wait_ready(nxt_emu_t *emu, long long t)
+{
+  return t > emu->flash_busy_until ? t : emu->flash_busy_until;
+}
+
+
+static long long
+emu_run_flash(nxt_emu_t *emu, long long t)
+{
+  nxt_addr_t batch = emu_read(emu, FLASH_BATCH_ADDR, 4, t);
+  nxt_word_t page = emu_read(emu, batch, 4, t);
+  nxt_word_t count = emu_read(emu, batch + 4, 4, t);
+  nxt_addr_t data = batch + 8;
+  int i;
+
+  while (count--)
+    {
+      t = emu_wait_ready(emu, t);
+
+      for (i = 0; i < FLASH_PAGE_SIZE; i += 4)
+        emu_write(emu, FLASH_BASE + page * FLASH_PAGE_SIZE + i, 4,
+                  emu_read(emu, data + i, 4, t), t);
+      emu_flash_command(emu, 0x5A000001 + ((page & 0x3FF) << 8), t);
+
+      page++;
+      data += FLASH_PAGE_SIZE;
+    }
+
+  return t;
+}
+
+
+static long long
+emu_run_crc(nxt_emu_t *emu, long long t)
+{
+  nxt_addr_t addr = emu_read(emu, CRC_PARAMS_ADDR, 4, t);
+  nxt_word_t len = emu_read(emu, CRC_PARAMS_ADDR + 4, 4, t);
+  nxt_word_t n_chunks = emu_read(emu, CRC_PARAMS_ADDR + 8, 4, t);
+  nxt_addr_t out = emu_read(emu, CRC_PARAMS_ADDR + 12, 4, t);
+  char buf[256];
+  nxt_word_t i, j, n, c;
+
+  // The real routine leaves its lookup table behind
+  for (i = 0; i < 256; i++)
+    {
+      c = i;
+      for (j = 0; j < 8; j++)
+        c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      emu_write(emu, CRC_TABLE_ADDR + i * 4, 4, c, t);
+    }
+
+  t = emu_wait_ready(emu, t);
+
+  while (n_chunks--)
+    {
+      c = 0;
+      for (i = 0; i < len; i += n)
+        {
+          n = len - i < sizeof(buf) ? len - i : sizeof(buf);
+          for (j = 0; j < n; j++)
+            buf[j] = emu_read(emu, addr++, 1, t);
+          c = nxt_crc32_update(c, buf, n);
+        }
+
+      emu_write(emu, out, 4, c, t);
+      out += 4;
+    }
+
+  return t;
+}
+
+
+static long long
+emu_run_unlz(nxt_emu_t *emu, nxt_addr_t base, long long t)
+{
+  nxt_addr_t stream = base + ROUTINE_MAILBOX;
+  nxt_addr_t dst = emu_read(emu, stream, 4, t);
+  nxt_word_t clen = emu_read(emu, stream + 4, 4, t);
+  unsigned char *src = emu_sram(emu, stream + 8, clen);
+  unsigned char *out = emu_sram(emu, dst, 1);
+
+  if (src == NULL || out == NULL)
+    return t;
+
+  nxt_lz_decompress((char *)src, clen, (char *)out,
+                    NXT_EMU_SRAM_SIZE - (dst - SRAM_BASE));
+  return t;
+}
+
+
+static long long
+emu_run_seq(nxt_emu_t *emu, nxt_addr_t base, long long t)
+{
+  nxt_addr_t mailbox = base + ROUTINE_MAILBOX;
+  nxt_word_t n_ops = emu_read(emu, mailbox, 4, t);
+  nxt_addr_t op = mailbox + 8;
+  nxt_word_t done, errors, i;
+
+  // Stale errors are read, which clears them, and ignored
+  t = emu_wait_ready(emu, t);
+  emu_read_fsr(emu, t);
+  errors = 0;
+
+  for (done = 0; done < n_ops && !errors; done++, op += 12)
+    {
+      nxt_word_t arg0 = emu_read(emu, op + 4, 4, t);
+      nxt_word_t arg1 = emu_read(emu, op + 8, 4, t);
+
+      switch (emu_read(emu, op, 4, t))
+        {
+        case SEQ_SET_FMR:
+          emu->fmr = arg0;
+          break;
+
+        case SEQ_COMMAND:
+          emu_flash_command(emu, arg0, t);
+          break;
+
+        case SEQ_WRITE_PAGE:
+          for (i = 0; i < FLASH_PAGE_SIZE; i += 4)
+            emu_write(emu, FLASH_BASE + arg0 * FLASH_PAGE_SIZE + i, 4,
+                      emu_read(emu, arg1 + i, 4, t), t);
+          emu_flash_command(emu, 0x5A000001 + ((arg0 & 0x3FF) << 8), t);
+          break;
+        }
+
+      t = emu_wait_ready(emu, t);
+      errors = emu_read_fsr(emu, t) & (FSR_LOCKE | FSR_PROGE);
+    }
+
+  emu_write(emu, mailbox + 4, 4, SEQ_DONE | (done << 8) | errors, t);
+  return t;
+}
+
+
+static long long
+emu_run_csum(nxt_emu_t *emu, nxt_addr_t base, long long t)
+{
+  nxt_addr_t mailbox = base + ROUTINE_MAILBOX;
+  nxt_addr_t addr = emu_read(emu, mailbox, 4, t);
+  nxt_word_t len = emu_read(emu, mailbox + 4, 4, t);
+  nxt_word_t n_chunks = emu_read(emu, mailbox + 8, 4, t);
+  nxt_addr_t out = mailbox + 12;
+  nxt_word_t i, c;
+
+  while (n_chunks--)
+    {
+      c = 0;
+      for (i = 0; i < len; i++)
+        {
+          char b = emu_read(emu, addr++, 1, t);
+          c = nxt_crc32_update(c, &b, 1);
+        }
+
+      emu_write(emu, out, 4, c, t);
+      out += 4;
+    }
+
+  return t;
+}
+
+
+static long long
+emu_run_regs(nxt_emu_t *emu, nxt_addr_t base, long long t)
+{
+  nxt_addr_t mailbox = base + ROUTINE_MAILBOX;
+  nxt_word_t n = emu_read(emu, mailbox, 4, t);
+  nxt_addr_t addrs = mailbox + 4, values = addrs + n * 4;
+  nxt_word_t i, addr;
+
+  for (i = 0; i < n; i++)
+    {
+      addr = emu_read(emu, addrs + i * 4, 4, t);
+      if (addr & 1)
+        emu_write(emu, addr & ~3, 4, emu_read(emu, values + i * 4, 4, t), t);
+      else
+        emu_write(emu, values + i * 4, 4, emu_read(emu, addr, 4, t), t);
+    }
+
+  return t;
+}
+
+
+static int
+emu_holds(nxt_emu_t *emu, nxt_addr_t addr, const char *bin, unsigned long len)
+{
+  unsigned char *p = emu_sram(emu, addr, len);
+
+  return p != NULL && memcmp(p, bin, len) == 0;
+}
+
+
+static void
+emu_jump(nxt_emu_t *emu, nxt_addr_t addr)
+{
+  long long t = emu_now();
+
+  if (emu_holds(emu, addr, flash_bin, flash_len))
+    t = emu_run_flash(emu, t);
+  else if (emu_holds(emu, addr, crc_bin, crc_len))
+    t = emu_run_crc(emu, t);
+  else if (emu_holds(emu, addr, unlz_bin, unlz_len))
+    t = emu_run_unlz(emu, addr, t);
+  else if (emu_holds(emu, addr, seq_bin, seq_len))
+    t = emu_run_seq(emu, addr, t);
+  else if (emu_holds(emu, addr, csum_bin, csum_len))
+    t = emu_run_csum(emu, addr, t);
+  else if (emu_holds(emu, addr, regs_bin, regs_len))
+    t = emu_run_regs(emu, addr, t);
+  else if (emu_holds(emu, addr, agent_bin, agent_len))
+    {
+      // The agent takes over USB until told to exit
+      emu->agent = 1;
+      emu->agent_base = addr;
+      emu->agent_packets = 0;
+      emu->agent_errors = 0;
+      return;
+    }
+  else
+    {
+      // Someone else's code: the brick leaves SAM-BA for good
+      emu->halted = 1;
+      return;
+    }
+
+  emu->cpu_busy_until = t;
+}
+
+
+static void
+emu_command(nxt_emu_t *emu)
+{
+  nxt_addr_t addr = 0;
+  nxt_word_t arg = 0;
+  char reply[4];
+  unsigned char *p;
+  long long t = emu_now();
+  char c = emu->cmd[0];
+  int i;
+
+  emu->cmd[emu->cmd_len] = '\0';
+  sscanf(emu->cmd + 1, "%x,%x", &addr, &arg);
+
+  switch (c)
+    {
+    case 'N':
+      emu_reply(emu, "\n\r", 2);
+      break;
+
+    case 'V':
+      // libnxt only reads the version number itself
+      emu_reply(emu, "v1.4", 4);
+      break;
+
+    case 'O':
+    case 'H':
+    case 'W':
+      emu_write(emu, addr, c == 'O' ? 1 : c == 'H' ? 2 : 4, arg, t);
+      break;
+
+    case 'o':
+    case 'h':
+    case 'w':
+      arg = emu_read(emu, addr, c == 'o' ? 1 : c == 'h' ? 2 : 4, t);
+      nxt_store_word(reply, arg);
+      emu_reply(emu, reply, c == 'o' ? 1 : c == 'h' ? 2 : 4);
+      break;
+
+    case 'S':
+      emu->data_addr = addr;
+      emu->data_left = arg;
+      break;
+
+    case 'R':
+      p = emu_sram(emu, addr, arg);
+      if (p != NULL)
+        emu_reply(emu, p, arg);
+      else
+        for (i = 0; i < arg; i++)
+          {
+            reply[0] = emu_read(emu, addr + i, 1, t);
+            emu_reply(emu, reply, 1);
+          }
+      break;
+
+    case 'G':
+      emu_jump(emu, addr);
+      break;
+    }
+}
+
+
+static void
+emu_input(nxt_emu_t *emu, const char *buf, int len)
+{
+  while (len > 0 && !emu->halted)
+    {
+      // The data of an 'S' command comes raw, right after it
+      if (emu->data_left > 0)
+        {
+          unsigned char *p = emu_sram(emu, emu->data_addr, 1);
+          int n = len < emu->data_left ? len : emu->data_left;
+
+          if (p != NULL && emu_sram(emu, emu->data_addr, n) != NULL)
+            memcpy(p, buf, n);
+
+          emu->data_addr += n;
+          emu->data_left -= n;
+          buf += n;
+          len -= n;
+          continue;
+        }
+
+      if (*buf == '#')
+        {
+          emu_command(emu);
+          emu->cmd_len = 0;
+        }
+      else if (emu->cmd_len < CMD_MAX - 1)
+        emu->cmd[emu->cmd_len++] = *buf;
+
+      buf++;
+      len--;
+    }
+}
+
+
+/* Wait for the flash controller as the agent does, keeping the errors
+ * until they are reported.
+ */
+static long long
+emu_agent_wait_ready(nxt_emu_t *emu, long long t)
+{
+  t = emu_wait_ready(emu, t);
+  emu->agent_errors |= emu_read_fsr(emu, t) & (FSR_LOCKE | FSR_PROGE);
+  return t;
+}
+
+
+static void
+emu_agent_reply(nxt_emu_t *emu, nxt_word_t seq, nxt_word_t status,
+                nxt_word_t value, unsigned char *payload, int len)
+{
+  unsigned char f[AGENT_REPLY_HEADER + AGENT_MAX_PAYLOAD + 4];
+
+  nxt_store_word((char *)f, AGENT_REPLY_MAGIC | (status << 8) | (seq << 16));
+  nxt_store_word((char *)f + 4, value);
+  nxt_store_word((char *)f + 8, len);
+  if (len > 0)
+    memcpy(f + AGENT_REPLY_HEADER, payload, len);
+  nxt_store_word((char *)f + AGENT_REPLY_HEADER + len,
+                 nxt_crc32((char *)f, AGENT_REPLY_HEADER + len));
+
+  if (emu->n_replies == AGENT_QUEUE)
+    return;
+  emu_reply(emu, f, AGENT_REPLY_HEADER + len + 4);
+  emu->reply_ends[emu->n_replies++] = emu->out_len;
+}
+
+
+static int
+emu_agent_reserved(nxt_emu_t *emu, nxt_addr_t addr, nxt_word_t len)
+{
+  return addr < AGENT_SRAM_END && addr + len > emu->agent_base;
+}
+
+
+/* Copy with the widest accesses the alignment allows, as the agent. */
+static void
+emu_agent_copy(nxt_emu_t *emu, nxt_addr_t dst, unsigned char *src,
+               nxt_word_t len, long long t)
+{
+  int size = ((dst | len) & 3) == 0 ? 4 : ((dst | len) & 1) == 0 ? 2 : 1;
+  nxt_word_t i, w;
+  int j;
+
+  for (i = 0; i < len; i += size)
+    {
+      for (w = 0, j = size - 1; j >= 0; j--)
+        w = (w << 8) | src[i + j];
+      emu_write(emu, dst + i, size, w, t);
+    }
+}
+
+
+static long long
+emu_agent_flash(nxt_emu_t *emu, nxt_word_t page, unsigned char *data,
+                nxt_word_t n_pages, long long t)
+{
+  for (; n_pages > 0 && page < 1024; n_pages--, page++)
+    {
+      t = emu_agent_wait_ready(emu, t);
+
+      if (emu->locks & (1 << (page / FLASH_REGION_PAGES)))
+        {
+          emu_flash_command(emu, 0x5A000004 + ((page & 0x3FF) << 8), t);
+          t = emu_agent_wait_ready(emu, t);
+        }
+
+      emu->fmr = 0x00340100;
+      emu_agent_copy(emu, FLASH_BASE + page * FLASH_PAGE_SIZE, data,
+                     FLASH_PAGE_SIZE, t);
+      emu_flash_command(emu, 0x5A000001 + ((page & 0x3FF) << 8), t);
+      data += FLASH_PAGE_SIZE;
+    }
+
+  return t;
+}
+
+
+/* Handle one OUT transfer while the agent runs. The host sends each
+ * frame as a transfer of its own.
+ */
+static void
+emu_agent_input(nxt_emu_t *emu, const char *buf, int len)
+{
+  unsigned char *f = (unsigned char *)buf;
+  unsigned char *payload = f + AGENT_HEADER;
+  unsigned char reply[AGENT_MAX_PAYLOAD];
+  nxt_word_t seq, op, addr, arg, plen, i, j, n, c;
+  nxt_word_t status = AGENT_OK, value = 0, reply_len = 0;
+  long long t = emu_now();
+
+  emu->agent_packets += len == 0 ? 1 : (len + USB_PACKET_SIZE - 1) /
+    USB_PACKET_SIZE;
+
+  // The packet lining SAM-BA's banks back up after exiting
+  if (emu->agent_pad)
+    {
+      emu->agent_pad = 0;
+      emu->agent = 0;
+      if (len > USB_PACKET_SIZE)
+        emu_input(emu, buf + USB_PACKET_SIZE, len - USB_PACKET_SIZE);
+      return;
+    }
+
+  plen = len >= AGENT_HEADER ? nxt_load_word(buf + 12) : 0;
+  if (len < AGENT_HEADER + 4 || f[0] != AGENT_REQUEST_MAGIC ||
+      plen > AGENT_MAX_PAYLOAD || len != AGENT_HEADER + plen + 4)
+    {
+      emu_agent_reply(emu, 0, AGENT_BAD_FRAME, 0, NULL, 0);
+      return;
+    }
+
+  seq = nxt_load_word(buf) >> 16;
+  if (nxt_crc32(buf, len - 4) != nxt_load_word(buf + len - 4))
+    {
+      emu_agent_reply(emu, seq, AGENT_BAD_CRC, 0, NULL, 0);
+      return;
+    }
+
+  op = f[1];
+  addr = nxt_load_word(buf + 4);
+  arg = nxt_load_word(buf + 8);
+
+  switch (op)
+    {
+    case AGENT_PING:
+      value = AGENT_VERSION;
+      break;
+
+    case AGENT_WRITE:
+      if (emu_agent_reserved(emu, addr, plen))
+        status = AGENT_BAD_ADDRESS;
+      else
+        emu_agent_copy(emu, addr, payload, plen, t);
+      break;
+
+    case AGENT_READ:
+      if (arg > AGENT_MAX_PAYLOAD)
+        status = AGENT_BAD_FRAME;
+      else
+        {
+          t = emu_agent_wait_ready(emu, t);
+          for (i = 0; i < arg; i++)
+            reply[i] = emu_read(emu, addr + i, 1, t);
+          reply_len = arg;
+        }
+      break;
+
+    case AGENT_FLASH:
+      if (plen % FLASH_PAGE_SIZE != 0 ||
+          addr + plen / FLASH_PAGE_SIZE > 1024)
+        status = AGENT_BAD_ADDRESS;
+      else
+        {
+          t = emu_agent_flash(emu, addr, payload, plen / FLASH_PAGE_SIZE, t);
+          if (plen == 0)
+            t = emu_agent_wait_ready(emu, t);
+          value = emu->agent_errors;
+          if (emu->agent_errors)
+            status = AGENT_FLASH_ERROR;
+          emu->agent_errors = 0;
+        }
+      break;
+
+    case AGENT_CRC:
+      n = plen == 4 ? nxt_load_word(buf + AGENT_HEADER) : 0;
+      if (n == 0 || n > AGENT_MAX_PAYLOAD / 4)
+        status = AGENT_BAD_FRAME;
+      else
+        {
+          t = emu_agent_wait_ready(emu, t);
+          for (i = 0; i < n; i++, addr += arg)
+            {
+              c = 0;
+              for (j = 0; j < arg; j++)
+                {
+                  char b = emu_read(emu, addr + j, 1, t);
+                  c = nxt_crc32_update(c, &b, 1);
+                }
+              nxt_store_word((char *)reply + i * 4, c);
+            }
+          reply_len = n * 4;
+        }
+      break;
+
+    case AGENT_FILL:
+      c = plen == 4 ? nxt_load_word(buf + AGENT_HEADER) : 0;
+      if (plen != 4 || emu_agent_reserved(emu, addr, arg))
+        status = AGENT_BAD_ADDRESS;
+      else if (((addr | arg) & 3) == 0)
+        for (i = 0; i < arg; i += 4)
+          emu_write(emu, addr + i, 4, c, t);
+      else
+        for (i = 0; i < arg; i++)
+          emu_write(emu, addr + i, 1, c >> (8 * (i & 3)), t);
+      break;
+
+    case AGENT_EXIT:
+      t = emu_agent_wait_ready(emu, t);
+      if (emu->agent_errors)
+        status = AGENT_FLASH_ERROR;
+
+      // SAM-BA takes over again, after the padding packet if any
+      value = emu->agent_packets & 1;
+      emu_agent_reply(emu, seq, status, value, NULL, 0);
+      if (value)
+        emu->agent_pad = 1;
+      else
+        emu->agent = 0;
+      emu->cpu_busy_until = t;
+      return;
+
+    default:
+      status = AGENT_BAD_FRAME;
+      break;
+    }
+
+  emu_agent_reply(emu, seq, status, value, reply, reply_len);
+  emu->cpu_busy_until = t;
+}
+
+
+static nxt_error_t
+emu_open(nxt_t *nxt, int interface)
+{
+  nxt_emu_t *emu = nxt_transport_data(nxt);
+
+  // A new connection starts SAM-BA's parser afresh
+  emu->cmd_len = 0;
+  emu->data_left = 0;
+  emu->out_len = 0;
+  emu->out_pos = 0;
+  emu->n_replies = 0;
+
+  return emu->halted ? NXT_NOT_PRESENT : NXT_OK;
+}
+
+
+static nxt_error_t
+emu_send(nxt_t *nxt, char *buf, int len)
+{
+  nxt_emu_t *emu = nxt_transport_data(nxt);
+
+  emu_delay(emu);
+  if (emu->halted)
+    return NXT_USB_WRITE_ERROR;
+
+  if (emu->agent)
+    emu_agent_input(emu, buf, len);
+  else
+    emu_input(emu, buf, len);
+  return NXT_OK;
+}
+
+
+static nxt_error_t
+emu_recv(nxt_t *nxt, char *buf, int len, int *n_read)
+{
+  nxt_emu_t *emu = nxt_transport_data(nxt);
+  int n = emu->out_len - emu->out_pos;
+
+  *n_read = 0;
+  emu_delay(emu);
+  if (emu->halted)
+    return NXT_USB_READ_ERROR;
+
+  // A read with nothing to answer it would time out on a real brick
+  if (n == 0)
+    return NXT_USB_TIMEOUT;
+
+  // Agent replies each end their transfer
+  if (emu->n_replies > 0 && n > emu->reply_ends[0] - emu->out_pos)
+    n = emu->reply_ends[0] - emu->out_pos;
+
+  if (n > len)
+    n = len;
+  memcpy(buf, emu->out + emu->out_pos, n);
+  emu->out_pos += n;
+  *n_read = n;
+
+  if (emu->n_replies > 0 && emu->out_pos == emu->reply_ends[0])
+    {
+      int i;
+
+      emu->n_replies--;
+      for (i = 0; i < emu->n_replies; i++)
+        emu->reply_ends[i] = emu->reply_ends[i + 1];
+    }
+
+  if (emu->out_pos == emu->out_len)
+    emu->out_pos = emu->out_len = 0;
+
+  return NXT_OK;
+}
+
+
+static void
+emu_close(nxt_t *nxt)
+{
+}
+
+
+/* A brick busy running code NAKs the host, so nothing moves until it
+ * is back in SAM-BA. Replies are there as soon as it is.
+ */
+static int
+emu_can_send(nxt_t *nxt)
+{
+  nxt_emu_t *emu = nxt_transport_data(nxt);
+
+  return emu->halted || emu->cpu_busy_until <= emu_now();
+}
+
+
+static int
+emu_available(nxt_t *nxt, int len)
+{
+  nxt_emu_t *emu = nxt_transport_data(nxt);
+  int n = emu->out_len - emu->out_pos;
+
+  // The transfer fails at once on a halted brick
+  if (emu->halted)
+    return 0;
+  if (!emu_can_send(nxt) || n == 0)
+    return -1;
+
+  if (emu->n_replies > 0 && n > emu->reply_ends[0] - emu->out_pos)
+    n = emu->reply_ends[0] - emu->out_pos;
+  return n;
+}
+
+
+/* There is nothing to poll, only the wait for the brick to be back. */
+static int
+emu_pollfds(nxt_t *nxt, struct pollfd *fds, int max, int *timeout_ms)
+{
+  nxt_emu_t *emu = nxt_transport_data(nxt);
+  long long t = emu_now();
+
+  if (emu->cpu_busy_until > t)
+    {
+      int ms = (emu->cpu_busy_until - t + 999) / 1000;
+
+      if (*timeout_ms < 0 || ms < *timeout_ms)
+        *timeout_ms = ms;
+    }
+
+  return 0;
+}
+
+
+static nxt_error_t
+emu_events(nxt_t *nxt)
+{
+  return NXT_OK;
+}
+
+
+static const nxt_transport_t nxt_emu_transport = {
+  "emulator",
+  emu_open,
+  emu_send,
+  emu_recv,
+  emu_close,
+  NULL,
+  NULL,
+  emu_can_send,
+  emu_available,
+  emu_pollfds,
+  emu_events,
+};
+
+
+nxt_emu_t *
+nxt_emu_new(void)
+{
+  nxt_emu_t *emu = calloc(1, sizeof(*emu));
+
+  if (emu == NULL)
+    return NULL;
+
+  // Erased flash, with every region locked
+  memset(emu->flash, 0xFF, NXT_EMU_FLASH_SIZE);
+  emu->locks = 0xFFFF;
+
+  return emu;
+}
+
+
+void
+nxt_emu_free(nxt_emu_t *emu)
+{
+  free(emu->out);
+  free(emu);
+}
+
+
+void
+nxt_emu_reset(nxt_emu_t *emu)
+{
+  // SAM-BA reinitializes its own variables, at the bottom of SRAM
+  memset(emu->sram, 0, 0x2000);
+  emu->halted = 0;
+  emu->agent = 0;
+  emu->agent_pad = 0;
+  emu->cpu_busy_until = 0;
+}
+
+
+void
+nxt_emu_set_timing(nxt_emu_t *emu, int latency_us, int program_us)
+{
+  emu->latency_us = latency_us;
+  emu->program_us = program_us;
+}
+
+
+char *
+nxt_emu_flash(nxt_emu_t *emu)
+{
+  return (char *)emu->flash;
+}
+
+
+nxt_error_t
+nxt_emu_init(nxt_t **nxt, nxt_emu_t *emu)
+{
+  return nxt_init_transport(nxt, &nxt_emu_transport, emu, SAMBA);
+}
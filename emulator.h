@@ -0,0 +1,63 @@
+/**
+ * NXT bootstrap interface; SAM-BA emulator.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __EMULATOR_H__
+#define __EMULATOR_H__
+
+#include "error.h"
+#include "lowlevel.h"
+
+#define NXT_EMU_SRAM_SIZE  (64*1024)
+#define NXT_EMU_FLASH_SIZE (256*1024)
+
+/* An emulated NXT in reset mode: SAM-BA's command set, the SRAM, the
+ * flash and its controller. Code uploaded with 'S' only runs if it is
+ * one of libnxt's own onboard routines, which are emulated natively,
+ * resident agent included. Jumping anywhere else stops the emulated
+ * brick.
+ *
+ * The brick outlives the handles talking to it, so its state can be
+ * inspected after closing them, or survive a reconnect.
+ */
+typedef struct nxt_emu nxt_emu_t;
+
+nxt_emu_t *nxt_emu_new(void);
+void nxt_emu_free(nxt_emu_t *emu);
+
+/* Press the reset button: the brick goes back to SAM-BA, from code it
+ * jumped to or the agent. Past SAM-BA's own variables, the SRAM keeps
+ * what it held.
+ */
+void nxt_emu_reset(nxt_emu_t *emu);
+
+/* Delay every transfer by latency_us, and keep the flash controller
+ * busy for program_us per page or lock bit programmed. Both default
+ * to 0.
+ */
+void nxt_emu_set_timing(nxt_emu_t *emu, int latency_us, int program_us);
+
+/* The emulated flash contents, NXT_EMU_FLASH_SIZE bytes. */
+char *nxt_emu_flash(nxt_emu_t *emu);
+
+/* Create a handle to the emulated brick, ready for nxt_open(). */
+nxt_error_t nxt_emu_init(nxt_t **nxt, nxt_emu_t *emu);
+
+#endif /* __EMULATOR_H__ */
@@ -32,6 +32,12 @@ static const char const *err_str[] = {
   "NXT handshake failed",
   "File open/handling error",
   "Invalid firmware image",
+  "Flash contents do not match the firmware image",
+  "Flash controller reported a lock or programming error",
+  "USB transfer timed out",
+  "The resident agent rejected a request",
+  "Lost the connection to nxtd",
+  "The LEGO firmware refused a command",
 };
 
 const char const *
@@ -34,6 +34,12 @@ typedef enum
   NXT_HANDSHAKE_FAILED = 7,
   NXT_FILE_ERROR = 8,
   NXT_INVALID_FIRMWARE = 9,
+  NXT_VERIFY_FAILED = 10,
+  NXT_FLASH_ERROR = 11,
+  NXT_USB_TIMEOUT = 12,
+  NXT_AGENT_ERROR = 13,
+  NXT_DAEMON_ERROR = 14,
+  NXT_LEGO_ERROR = 15,
 } nxt_error_t;
 
 const char const *nxt_str_error(nxt_error_t err);
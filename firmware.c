@@ -20,10 +20,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -32,35 +34,300 @@
 #include "samba.h"
 #include "flash.h"
 #include "firmware.h"
+#include "crc32.h"
+#include "lz.h"
+#include "stats.h"
+#include "agent.h"
+#include "request.h"
 #include "flash_routine.h"
+#include "crc_routine.h"
+#include "csum_routine.h"
 
+/* SRAM layout used by the flash routine (see flash_write/flash.c). */
+#define FLASH_ROUTINE_ADDR 0x202000
+#define FLASH_BATCH_ADDR   0x202300
+
+/* SRAM layout used by the CRC routine (see flash_write/crc.c). */
+#define CRC_ROUTINE_ADDR   0x202400
+#define CRC_PARAMS_ADDR    0x202800
+#define CRC_RESULTS_ADDR   0x209000
+
+#define FLASH_BASE_ADDR    0x00100000
+#define FLASH_N_PAGES      NXT_FLASH_N_PAGES
+
+/* The image is uploaded in batches of pages, alternating between two
+ * staging buffers. Each buffer holds an 8 byte batch descriptor
+ * (first page, page count) followed by the page data.
+ */
+#define FLASH_BATCH_PAGES  32
+#define FLASH_BATCH_HEADER 8
+#define FLASH_BATCH_SIZE   (FLASH_BATCH_HEADER + FLASH_BATCH_PAGES * 256)
+
+static const nxt_addr_t flash_staging[2] = { 0x204000, 0x206100 };
+
+/* Batches are uploaded compressed through the decompressor staged
+ * here, and expanded into the staging buffers.
+ */
+#define FLASH_LZ_SCRATCH   0x20A000
+
+/* The last page of flash records the length and CRC32 of the image
+ * libnxt last wrote, so a brick can be checked for an image without
+ * reading it back. Images reaching into that page go without.
+ */
+#define FINGERPRINT_PAGE   (FLASH_N_PAGES - 1)
+#define FINGERPRINT_ADDR   (FLASH_BASE_ADDR + FINGERPRINT_PAGE * 256)
+#define FINGERPRINT_MAGIC  0x5446584E /* "NXFT" */
+#define FINGERPRINT_WORDS  4
+
+/* RAM images can go anywhere past SAM-BA's own variables. Delta
+ * uploads run the checksum routine (see flash_write/csum.c) next to
+ * the image, and leave the top 4k to its stack.
+ */
+#define EXEC_RAM_START     0x202000
+#define EXEC_RAM_LIMIT     0x20F000
+#define EXEC_CHUNK         256
+#define EXEC_N_CHUNKS      (NXT_EXEC_MAX_SIZE / EXEC_CHUNK)
+#define CSUM_MAILBOX       0x400
+#define CSUM_FOOTPRINT     (CSUM_MAILBOX + 12 + EXEC_N_CHUNKS * 4)
+
+
+/* Lock regions holding any of n pages from first on, a bit each. */
+static nxt_word_t
+nxt_page_regions(int first, int n)
+{
+  nxt_word_t regions = 0;
+  int i;
+
+  for (i = first / 64; n > 0 && i <= (first + n - 1) / 64; i++)
+    regions |= 1 << i;
+
+  return regions;
+}
+
+
+/* The regions flashing an image of len bytes needs unlocked, on top
+ * of its own: the fingerprint page's, unless the image goes without.
+ */
+static nxt_word_t
+nxt_fingerprint_regions(int len)
+{
+  if (len > FINGERPRINT_PAGE * 256)
+    return 0;
+
+  return nxt_page_regions(FINGERPRINT_PAGE, 1);
+}
+
+
+/* With the agent running, flashing and checksumming go through it
+ * instead, and none of the routines are needed.
+ */
 static nxt_error_t
-nxt_flash_prepare(nxt_t *nxt)
+nxt_flash_prepare(nxt_t *nxt, nxt_word_t regions)
 {
+  nxt_error_t err;
+
+  if (nxt_agent_running(nxt))
+    return NXT_OK;
+
+  nxt_batch_begin(nxt);
+
   // Put the clock in PLL/2 mode
-  NXT_ERR(nxt_write_word(nxt, 0xFFFFFC30, 0x7));
+  err = nxt_write_word(nxt, 0xFFFFFC30, 0x7);
+  if (err)
+    goto fail;
 
-  // Unlock the flash chip
-  NXT_ERR(nxt_flash_unlock_all_regions(nxt));
+  // Unlock the parts of the flash chip to be written
+  err = nxt_flash_unlock_regions(nxt, regions);
+  if (err)
+    goto fail;
 
   // Send the flash writing routine
-  NXT_ERR(nxt_send_file(nxt, 0x202000, flash_bin, flash_len));
+  err = nxt_write_mem(nxt, FLASH_ROUTINE_ADDR, flash_bin, flash_len);
+  if (err)
+    goto fail;
+
+  // Send the decompressor for batch uploads
+  err = nxt_lz_load_routine(nxt, FLASH_LZ_SCRATCH);
+  if (err)
+    goto fail;
+
+  return nxt_batch_end(nxt);
+
+ fail:
+  return nxt_batch_cancel(nxt, err);
+}
+
+
+static nxt_error_t
+nxt_flash_batch(nxt_t *nxt, int staging, nxt_word_t first_page,
+                char *buf, int n_pages)
+{
+  nxt_addr_t addr = flash_staging[staging];
+  nxt_error_t err;
+
+  // Fill in the batch descriptor
+  nxt_store_word(buf, first_page);
+  nxt_store_word(buf + 4, n_pages);
+
+  /* Send the descriptor and pages to the staging buffer, compressed
+   * unless they don't shrink.
+   */
+  NXT_ERR(nxt_lz_send_file(nxt, FLASH_LZ_SCRATCH, addr, buf,
+                           FLASH_BATCH_HEADER + n_pages * 256));
+
+  // Point the flash routine at it, and jump in, in a single packet
+  nxt_batch_begin(nxt);
+  err = nxt_write_word(nxt, FLASH_BATCH_ADDR, addr);
+  if (err)
+    goto fail;
+  err = nxt_jump(nxt, FLASH_ROUTINE_ADDR);
+  if (err)
+    goto fail;
+
+  /* The pages only count once the jump has gone out: until
+   * nxt_batch_end() sends it, nothing was written, and a failed batch
+   * is cancelled unsent.
+   */
+  NXT_ERR(nxt_batch_end(nxt));
+  NXT_STAT_ADD(nxt, pages_flashed, n_pages);
 
   return NXT_OK;
+
+ fail:
+  return nxt_batch_cancel(nxt, err);
 }
 
 
+/* Copy len bytes of the image starting at offset to buf, reading the
+ * zero padding of the last page past the end of the image.
+ */
+static void
+nxt_image_copy(char *buf, char *image, int image_len, int offset, int len)
+{
+  int avail = image_len - offset;
+
+  if (avail < 0)
+    avail = 0;
+  if (avail > len)
+    avail = len;
+
+  memcpy(buf, image + offset, avail);
+  memset(buf + avail, 0, len - avail);
+}
+
+
+/* CRC32 of len bytes of the zero-padded image starting at offset. */
+static nxt_word_t
+nxt_image_crc(char *image, int image_len, int offset, int len)
+{
+  static const char zero[256];
+  int avail = image_len - offset;
+  nxt_word_t crc;
+
+  if (avail < 0)
+    avail = 0;
+  if (avail > len)
+    avail = len;
+
+  crc = nxt_crc32(image + offset, avail);
+  for (len -= avail; len > 0; len -= 256)
+    crc = nxt_crc32_update(crc, zero, len < 256 ? len : 256);
+
+  return crc;
+}
+
+
+static nxt_error_t
+nxt_crc_prepare(nxt_t *nxt)
+{
+  if (nxt_agent_running(nxt))
+    return NXT_OK;
+
+  return nxt_write_mem(nxt, CRC_ROUTINE_ADDR, crc_bin, crc_len);
+}
+
+
+/* Flash a run of consecutive pages of an image, splitting it into
+ * batches. The staging buffer alternates across calls.
+ *
+ * Pages are copied once, to put the batch descriptor in front of
+ * them. That is far cheaper than the extra USB transfer it would take
+ * to send the descriptor on its own. The agent takes them straight
+ * from the image, and pads the last one itself.
+ */
+static nxt_error_t
+nxt_flash_pages(nxt_t *nxt, char *image, int image_len,
+                int first_page, int n_pages, int *staging)
+{
+  char buf[FLASH_BATCH_SIZE];
+
+  if (nxt_agent_running(nxt))
+    {
+      int len = image_len - first_page * 256;
+
+      if (len > n_pages * 256)
+        len = n_pages * 256;
+      if (len <= 0)
+        return NXT_OK;
+
+      NXT_ERR(nxt_agent_flash(nxt, first_page, image + first_page * 256,
+                              len));
+      NXT_STAT_ADD(nxt, pages_flashed, n_pages);
+      return NXT_OK;
+    }
+
+  while (n_pages > 0)
+    {
+      int n = n_pages;
+
+      if (n > FLASH_BATCH_PAGES)
+        n = FLASH_BATCH_PAGES;
+
+      /* The host can fill the other staging buffer while the brick
+       * is still busy with this one.
+       */
+      nxt_image_copy(buf + FLASH_BATCH_HEADER, image, image_len,
+                     first_page * 256, n * 256);
+      NXT_ERR(nxt_flash_batch(nxt, *staging, first_page, buf, n));
+      *staging ^= 1;
+
+      first_page += n;
+      n_pages -= n;
+    }
+
+  return NXT_OK;
+}
+
+
+/* Compute the CRC32 of n_chunks consecutive chunks of chunk_len bytes
+ * of NXT memory starting at addr, using the CRC routine which must
+ * already be uploaded.
+ */
 static nxt_error_t
-nxt_flash_block(nxt_t *nxt, nxt_word_t block_num, char *buf)
+nxt_remote_crc(nxt_t *nxt, nxt_addr_t addr, nxt_word_t chunk_len,
+               int n_chunks, nxt_word_t *crcs)
 {
-  // Set the target block number
-  NXT_ERR(nxt_write_word(nxt, 0x202300, block_num));
+  char params[16];
+  char buf[FLASH_N_PAGES * 4];
+  int i;
+
+  if (n_chunks > FLASH_N_PAGES)
+    return NXT_SAMBA_PROTOCOL_ERROR;
 
-  // Send the block to flash
-  NXT_ERR(nxt_send_file(nxt, 0x202100, buf, 256));
+  if (nxt_agent_running(nxt))
+    return nxt_agent_crc(nxt, addr, chunk_len, n_chunks, crcs);
 
-  // Jump into the flash writing routine
-  NXT_ERR(nxt_jump(nxt, 0x202000));
+  nxt_store_word(params, addr);
+  nxt_store_word(params + 4, chunk_len);
+  nxt_store_word(params + 8, n_chunks);
+  nxt_store_word(params + 12, CRC_RESULTS_ADDR);
+
+  NXT_ERR(nxt_write_mem(nxt, CRC_PARAMS_ADDR, params, 16));
+  NXT_ERR(nxt_jump(nxt, CRC_ROUTINE_ADDR));
+  NXT_ERR(nxt_read_mem(nxt, CRC_RESULTS_ADDR, buf, n_chunks * 4));
+
+  for (i = 0; i < n_chunks; i++)
+    crcs[i] = nxt_load_word(buf + i * 4);
 
   return NXT_OK;
 }
@@ -69,84 +336,894 @@ nxt_flash_block(nxt_t *nxt, nxt_word_t block_num, char *buf)
 static nxt_error_t
 nxt_flash_finish(nxt_t *nxt)
 {
+  if (nxt_agent_running(nxt))
+    return nxt_agent_flash(nxt, 0, NULL, 0);
+
   return nxt_flash_wait_ready(nxt);
 }
 
 
+/* The fingerprint words of an image: magic, length, CRC32 and the
+ * CRC32 inverted, which an erased or stale page won't match.
+ */
+static void
+nxt_fingerprint(nxt_word_t *words, char *image, int len)
+{
+  nxt_word_t crc = nxt_crc32(image, len);
+
+  words[0] = FINGERPRINT_MAGIC;
+  words[1] = len;
+  words[2] = crc;
+  words[3] = ~crc;
+}
+
+
+/* The contents of the fingerprint page, blank when image is NULL. */
+static void
+nxt_fingerprint_page(char *page, char *image, int len)
+{
+  nxt_word_t words[FINGERPRINT_WORDS];
+  int i;
+
+  memset(page, 0, 256);
+  if (image == NULL)
+    return;
+
+  nxt_fingerprint(words, image, len);
+  for (i = 0; i < FINGERPRINT_WORDS; i++)
+    nxt_store_word(page + i * 4, words[i]);
+}
+
+
+/* Whether the fingerprint page already holds image's fingerprint, or
+ * image goes without one. The CRC routine must already be uploaded.
+ */
 static nxt_error_t
-nxt_firmware_validate_fd(int fd)
+nxt_fingerprint_current(nxt_t *nxt, char *image, int len, int *current)
 {
-  struct stat s;
+  char page[256];
+  nxt_word_t crc;
 
-  if (fstat(fd, &s) < 0)
-    return NXT_FILE_ERROR;
+  *current = 1;
+  if (len > FINGERPRINT_PAGE * 256)
+    return NXT_OK;
+
+  nxt_fingerprint_page(page, image, len);
+  NXT_ERR(nxt_remote_crc(nxt, FINGERPRINT_ADDR, 256, 1, &crc));
+  *current = crc == nxt_crc32(page, 256);
+
+  return NXT_OK;
+}
+
+
+/* Write the fingerprint page, blank when image is NULL. Flashing
+ * blanks it before touching any other page, and only records the new
+ * image once all of it is written, so an interrupted flash never
+ * leaves a fingerprint behind.
+ */
+static nxt_error_t
+nxt_flash_fingerprint(nxt_t *nxt, char *image, int len, int *staging)
+{
+  char buf[FLASH_BATCH_HEADER + 256];
+
+  if (len > FINGERPRINT_PAGE * 256)
+    return NXT_OK;
+
+  nxt_fingerprint_page(buf + FLASH_BATCH_HEADER, image, len);
+
+  if (nxt_agent_running(nxt))
+    {
+      NXT_ERR(nxt_agent_flash(nxt, FINGERPRINT_PAGE,
+                              buf + FLASH_BATCH_HEADER, 256));
+      NXT_STAT_INC(nxt, pages_flashed);
+      return NXT_OK;
+    }
+
+  NXT_ERR(nxt_flash_batch(nxt, *staging, FINGERPRINT_PAGE, buf, 1));
+  *staging ^= 1;
+
+  return NXT_OK;
+}
+
+
+static nxt_error_t
+nxt_flash_plan_raw(nxt_flash_plan_t *plan, char *image, int len)
+{
+  int n_pages = (len + 255) / 256;
 
-  if (s.st_size > 256*1024)
+  if (len < 0 || len > FLASH_N_PAGES * 256)
     return NXT_INVALID_FIRMWARE;
 
+  memset(plan, 0, sizeof(*plan));
+  plan->data = image;
+  plan->len = len;
+  plan->n_used = n_pages;
+  plan->regions = nxt_page_regions(0, n_pages);
+  memset(plan->used, 1, n_pages);
+
   return NXT_OK;
 }
 
 
 nxt_error_t
-nxt_firmware_validate(char *fw_path)
+nxt_flash_plan_image(nxt_flash_plan_t *plan, nxt_image_t *image)
 {
-  nxt_error_t err;
-  int fd;
+  int i, page, last = -1;
 
-  fd = open(fw_path, O_RDONLY);
-  if (fd < 0)
+  if (image->format == NXT_IMAGE_RAW)
+    return nxt_flash_plan_raw(plan, image->map, image->map_len);
+
+  memset(plan, 0, sizeof(*plan));
+  plan->sparse = 1;
+  plan->data = calloc(1, FLASH_N_PAGES * 256);
+  if (plan->data == NULL)
     return NXT_FILE_ERROR;
 
-  err = nxt_firmware_validate_fd(fd);
-  close(fd);
+  for (i = 0; i < image->n_segments; i++)
+    {
+      nxt_image_segment_t *seg = &image->segments[i];
+      nxt_word_t offset = seg->addr - FLASH_BASE_ADDR;
 
-  return err;
+      if (seg->addr < FLASH_BASE_ADDR || offset > FLASH_N_PAGES * 256 ||
+          seg->len > FLASH_N_PAGES * 256 - offset)
+        {
+          free(plan->data);
+          plan->data = NULL;
+          return NXT_INVALID_FIRMWARE;
+        }
+
+      memcpy(plan->data + offset, seg->data, seg->len);
+      for (page = offset / 256; page * 256 < offset + seg->len; page++)
+        plan->used[page] = 1;
+    }
+
+  for (page = 0; page < FLASH_N_PAGES; page++)
+    if (plan->used[page])
+      {
+        plan->n_used++;
+        plan->regions |= nxt_page_regions(page, 1);
+        last = page;
+      }
+  plan->len = (last + 1) * 256;
+
+  return NXT_OK;
 }
 
 
 nxt_error_t
-nxt_firmware_flash(nxt_t *nxt, char *fw_path)
+nxt_flash_plan_load(char *path, nxt_flash_plan_t *plan)
 {
-  int fd, i, err;
+  nxt_image_t *image;
+  nxt_error_t err;
+
+  NXT_ERR(nxt_image_load(path, &image));
+
+  err = nxt_flash_plan_image(plan, image);
+  if (err)
+    {
+      nxt_image_free(image);
+      return err;
+    }
+
+  // Raw plans use the mapped file as is, the others a copy
+  if (plan->sparse)
+    nxt_image_free(image);
+  else
+    plan->image = image;
+
+  return NXT_OK;
+}
 
-  fd = open(fw_path, O_RDONLY);
+
+void
+nxt_flash_plan_free(nxt_flash_plan_t *plan)
+{
+  if (plan->sparse)
+    free(plan->data);
+  if (plan->image != NULL)
+    nxt_image_free(plan->image);
+
+  plan->data = NULL;
+  plan->image = NULL;
+}
+
+
+nxt_error_t
+nxt_firmware_validate(char *fw_path)
+{
+  nxt_flash_plan_t plan;
+
+  NXT_ERR(nxt_flash_plan_load(fw_path, &plan));
+  nxt_flash_plan_free(&plan);
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_map_file(char *path, char **image, int *len)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
   if (fd < 0)
     return NXT_FILE_ERROR;
 
-  err = nxt_firmware_validate_fd(fd);
-  if (err != NXT_OK)
+  if (fstat(fd, &st) < 0)
+    {
+      close(fd);
+      return NXT_FILE_ERROR;
+    }
+
+  // mmap() refuses empty mappings
+  if (st.st_size == 0)
     {
       close(fd);
+      *image = NULL;
+      *len = 0;
+      return NXT_OK;
+    }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NXT_FILE_ERROR;
+
+  *image = map;
+  *len = st.st_size;
+  return NXT_OK;
+}
+
+
+void
+nxt_unmap_file(char *image, int len)
+{
+  if (image != NULL)
+    munmap(image, len);
+}
+
+
+nxt_error_t
+nxt_firmware_load(char *fw_path, char **image, int *len)
+{
+  NXT_ERR(nxt_map_file(fw_path, image, len));
+
+  if (*len > FLASH_N_PAGES * 256)
+    {
+      nxt_unmap_file(*image, *len);
       return NXT_INVALID_FIRMWARE;
     }
 
-  NXT_ERR(nxt_flash_prepare(nxt));
+  return NXT_OK;
+}
+
+
+void
+nxt_firmware_unload(char *image, int len)
+{
+  nxt_unmap_file(image, len);
+}
+
+
+/* The runs of consecutive pages a plan uses, one per call: *first is
+ * where to start looking, and is left on the first page of the run.
+ * Returns the length of the run, or 0 past the last one.
+ */
+static int
+nxt_plan_next_run(nxt_flash_plan_t *plan, int *first)
+{
+  int run;
+
+  while (*first < FLASH_N_PAGES && !plan->used[*first])
+    (*first)++;
+  for (run = *first; run < FLASH_N_PAGES && plan->used[run]; run++);
+
+  return run - *first;
+}
+
+
+nxt_error_t
+nxt_firmware_flash_plan(nxt_t *nxt, nxt_flash_plan_t *plan)
+{
+  int staging = 0;
+  int first, n;
+
+  NXT_ERR(nxt_flash_prepare(nxt, plan->regions |
+                            nxt_fingerprint_regions(plan->len)));
+  NXT_ERR(nxt_flash_fingerprint(nxt, NULL, plan->len, &staging));
+
+  // Gaps between the runs are left as they are
+  for (first = 0; (n = nxt_plan_next_run(plan, &first)) > 0; first += n)
+    NXT_ERR(nxt_flash_pages(nxt, plan->data, plan->len, first, n,
+                            &staging));
+
+  NXT_ERR(nxt_flash_fingerprint(nxt, plan->data, plan->len, &staging));
+  return nxt_flash_finish(nxt);
+}
+
+
+nxt_error_t
+nxt_firmware_flash_buffer(nxt_t *nxt, char *image, int len)
+{
+  nxt_flash_plan_t plan;
+
+  NXT_ERR(nxt_flash_plan_raw(&plan, image, len));
+  return nxt_firmware_flash_plan(nxt, &plan);
+}
+
+
+nxt_error_t
+nxt_firmware_flash(nxt_t *nxt, char *fw_path)
+{
+  nxt_flash_plan_t plan;
+  nxt_error_t err;
+
+  NXT_ERR(nxt_flash_plan_load(fw_path, &plan));
+  err = nxt_firmware_flash_plan(nxt, &plan);
+  nxt_flash_plan_free(&plan);
+
+  return err;
+}
+
+
+enum nxt_flash_request_state
+{
+  FLASH_REQ_PREPARE,
+  FLASH_REQ_UNLOCKING,
+  FLASH_REQ_PAGES,
+  FLASH_REQ_FINISHING,
+};
+
+struct nxt_flash_request
+{
+  nxt_flash_plan_t *plan;
+  enum nxt_flash_request_state state;
+  nxt_flash_seq_t seq;
+  char mailbox[NXT_FLASH_SEQ_MAILBOX_SIZE];
+  char status[4];
+  int polled;
+  int next_page;
+  int staging;
+  int queued_pages; /* Pages of the batches queued by the last step */
+  char batch[FLASH_BATCH_SIZE];
+};
+
+
+/* nxt_flash_batch() as request steps. The batch goes up as it is,
+ * which keeps each step to one upload and one jump.
+ */
+static nxt_error_t
+nxt_flash_queue_batch(nxt_request_t *req, struct nxt_flash_request *st,
+                      nxt_word_t first_page, int n_pages)
+{
+  nxt_addr_t addr = flash_staging[st->staging];
+
+  nxt_store_word(st->batch, first_page);
+  nxt_store_word(st->batch + 4, n_pages);
 
-  for (i = 0; i < 1024; i++) //256*1024; i += 256)
+  NXT_ERR(nxt_op_write_mem(req, addr, st->batch,
+                           FLASH_BATCH_HEADER + n_pages * 256));
+  NXT_ERR(nxt_op_write_word(req, FLASH_BATCH_ADDR, addr));
+  NXT_ERR(nxt_op_jump(req, FLASH_ROUTINE_ADDR));
+  st->queued_pages += n_pages;
+  st->staging ^= 1;
+
+  return NXT_OK;
+}
+
+
+static nxt_error_t
+nxt_flash_queue_fingerprint(nxt_request_t *req, struct nxt_flash_request *st,
+                            char *image)
+{
+  nxt_flash_plan_t *plan = st->plan;
+
+  nxt_fingerprint_page(st->batch + FLASH_BATCH_HEADER, image, plan->len);
+  return nxt_flash_queue_batch(req, st, FINGERPRINT_PAGE, 1);
+}
+
+
+/* The steps of nxt_firmware_flash_plan(), a batch at a time. */
+static nxt_error_t
+nxt_flash_request_step(nxt_request_t *req, void *state)
+{
+  struct nxt_flash_request *st = state;
+  nxt_flash_plan_t *plan = st->plan;
+  int fingerprint = plan->len <= FINGERPRINT_PAGE * 256;
+  nxt_word_t regions;
+  int i, n;
+
+  // Like nxt_flash_batch(), only count the pages once they went out
+  NXT_STAT_ADD(nxt_request_handle(req), pages_flashed, st->queued_pages);
+  st->queued_pages = 0;
+
+  switch (st->state)
     {
-      char buf[256];
-      int ret;
+    case FLASH_REQ_PREPARE:
+      // Put the clock in PLL/2 mode, and unlock what's to be written
+      NXT_ERR(nxt_op_write_word(req, 0xFFFFFC30, 0x7));
+
+      regions = plan->regions | nxt_fingerprint_regions(plan->len);
+      nxt_flash_seq_init(&st->seq);
+      for (i = 0; i < 16; i++)
+        if (regions & (1 << i))
+          NXT_ERR(nxt_flash_seq_unlock(&st->seq, i));
+      if (st->seq.n_ops > 0)
+        NXT_ERR(nxt_flash_seq_queue(req, &st->seq, st->mailbox, st->status));
+
+      nxt_request_set_phase(req, "unlocking");
+      st->state = FLASH_REQ_UNLOCKING;
+      return NXT_OK;
+
+    case FLASH_REQ_UNLOCKING:
+      if (st->seq.n_ops > 0)
+        NXT_ERR(nxt_flash_seq_check(nxt_request_handle(req), &st->seq,
+                                    nxt_load_word(st->status)));
 
-      memset(buf, 0, 256);
-      ret = read(fd, buf, 256);
+      NXT_ERR(nxt_op_write_mem(req, FLASH_ROUTINE_ADDR, flash_bin,
+                               flash_len));
+      if (fingerprint)
+        NXT_ERR(nxt_flash_queue_fingerprint(req, st, NULL));
 
-      if (ret != -1)
-        NXT_ERR(nxt_flash_block(nxt, i, buf));
+      nxt_request_set_phase(req, "writing");
+      st->state = FLASH_REQ_PAGES;
+      return NXT_OK;
 
-      if (ret < 256)
+    case FLASH_REQ_PAGES:
+      n = nxt_plan_next_run(plan, &st->next_page);
+      if (n > 0)
         {
-          close(fd);
-          NXT_ERR(nxt_flash_finish(nxt));
+          if (n > FLASH_BATCH_PAGES)
+            n = FLASH_BATCH_PAGES;
 
-          return ret == -1 ? NXT_FILE_ERROR : NXT_OK;
+          nxt_image_copy(st->batch + FLASH_BATCH_HEADER, plan->data,
+                         plan->len, st->next_page * 256, n * 256);
+          NXT_ERR(nxt_flash_queue_batch(req, st, st->next_page, n));
+          st->next_page += n;
+          return NXT_OK;
         }
 
-      NXT_ERR(nxt_flash_block(nxt, i, buf));
+      nxt_request_set_phase(req, "finishing");
+      st->state = FLASH_REQ_FINISHING;
+      if (fingerprint)
+        return nxt_flash_queue_fingerprint(req, st, plan->data);
+      // Fall through
+
+    case FLASH_REQ_FINISHING:
+      // Poll the FRDY bit of MC_FSR, like nxt_flash_wait_ready()
+      if (st->polled && (nxt_load_word(st->status) & 0x1))
+        return NXT_OK;
+
+      st->polled = 1;
+      NXT_STAT_INC(nxt_request_handle(req), wait_ready_polls);
+      return nxt_op_read_word(req, 0xFFFFFF68, st->status);
     }
 
-  close(fd);
-  NXT_ERR(nxt_flash_finish(nxt));
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_request_flash_plan(nxt_request_t **req, nxt_t *nxt,
+                       nxt_flash_plan_t *plan)
+{
+  struct nxt_flash_request *st;
+
+  NXT_ERR(nxt_request_new(req, nxt, nxt_flash_request_step, sizeof(*st),
+                          (void **)&st));
+
+  st->plan = plan;
+  st->state = FLASH_REQ_PREPARE;
+  nxt_request_set_phase(*req, "preparing");
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_firmware_flash_incremental_plan(nxt_t *nxt, nxt_flash_plan_t *plan,
+                                    int *n_written, int *n_skipped)
+{
+  nxt_word_t crcs[FLASH_N_PAGES];
+  int n_pages = (plan->len + 255) / 256;
+  char *image = plan->data;
+  int len = plan->len;
+  int staging = 0;
+  int written = 0;
+  int fingerprint_current;
+  int i, run;
+
+  if (n_written != NULL)
+    *n_written = 0;
+  if (n_skipped != NULL)
+    *n_skipped = 0;
+
+  NXT_ERR(nxt_flash_prepare(nxt, plan->regions |
+                            nxt_fingerprint_regions(len)));
+  NXT_ERR(nxt_crc_prepare(nxt));
+  NXT_ERR(nxt_remote_crc(nxt, FLASH_BASE_ADDR, 256, n_pages, crcs));
+  NXT_ERR(nxt_fingerprint_current(nxt, image, len, &fingerprint_current));
+
+  for (i = 0; i < n_pages; i = run)
+    {
+      if (!plan->used[i] ||
+          crcs[i] == nxt_image_crc(image, len, i * 256, 256))
+        {
+          run = i + 1;
+          continue;
+        }
+
+      // Gather a run of consecutive pages that differ
+      for (run = i + 1; run < n_pages && plan->used[run]; run++)
+        if (crcs[run] == nxt_image_crc(image, len, run * 256, 256))
+          break;
+
+      // Blank the fingerprint before the first page changes
+      if (written == 0)
+        NXT_ERR(nxt_flash_fingerprint(nxt, NULL, len, &staging));
+
+      NXT_ERR(nxt_flash_pages(nxt, image, len, i, run - i, &staging));
+      written += run - i;
+
+      if (n_written != NULL)
+        *n_written = written;
+    }
+
+  if (n_skipped != NULL)
+    *n_skipped = plan->n_used - written;
+
+  // An image already on the brick is left entirely alone
+  if (written > 0 || !fingerprint_current)
+    NXT_ERR(nxt_flash_fingerprint(nxt, image, len, &staging));
+  return nxt_flash_finish(nxt);
+}
+
+
+nxt_error_t
+nxt_firmware_flash_incremental_buffer(nxt_t *nxt, char *image, int len,
+                                      int *n_written, int *n_skipped)
+{
+  nxt_flash_plan_t plan;
+
+  if (n_written != NULL)
+    *n_written = 0;
+  if (n_skipped != NULL)
+    *n_skipped = 0;
+
+  NXT_ERR(nxt_flash_plan_raw(&plan, image, len));
+  return nxt_firmware_flash_incremental_plan(nxt, &plan, n_written,
+                                             n_skipped);
+}
+
+
+nxt_error_t
+nxt_firmware_flash_incremental(nxt_t *nxt, char *fw_path,
+                               int *n_written, int *n_skipped)
+{
+  nxt_flash_plan_t plan;
+  nxt_error_t err;
+
+  if (n_written != NULL)
+    *n_written = 0;
+  if (n_skipped != NULL)
+    *n_skipped = 0;
+
+  NXT_ERR(nxt_flash_plan_load(fw_path, &plan));
+  err = nxt_firmware_flash_incremental_plan(nxt, &plan, n_written,
+                                            n_skipped);
+  nxt_flash_plan_free(&plan);
+
+  return err;
+}
+
+
+nxt_error_t
+nxt_flash_session_init(nxt_flash_session_t *session, char *image, int len)
+{
+  if (len < 0 || len > FLASH_N_PAGES * 256)
+    return NXT_INVALID_FIRMWARE;
+
+  session->image = image;
+  session->len = len;
+  session->n_pages = (len + 255) / 256;
+  session->next_page = 0;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_flash_session_run(nxt_t *nxt, nxt_flash_session_t *session)
+{
+  nxt_word_t crcs[NXT_FLASH_CHECKPOINT_PAGES];
+  int staging = 0;
+  int first, n, i;
+
+  // The routines may not have survived whatever interrupted us
+  NXT_ERR(nxt_flash_prepare(nxt, nxt_page_regions(0, session->n_pages) |
+                            nxt_fingerprint_regions(session->len)));
+  NXT_ERR(nxt_crc_prepare(nxt));
+  NXT_ERR(nxt_flash_fingerprint(nxt, NULL, session->len, &staging));
+
+  while (session->next_page < session->n_pages)
+    {
+      first = session->next_page;
+      n = session->n_pages - first;
+      if (n > NXT_FLASH_CHECKPOINT_PAGES)
+        n = NXT_FLASH_CHECKPOINT_PAGES;
+
+      NXT_ERR(nxt_flash_pages(nxt, session->image, session->len,
+                              first, n, &staging));
+      NXT_ERR(nxt_flash_finish(nxt));
+      NXT_ERR(nxt_remote_crc(nxt, FLASH_BASE_ADDR + first * 256, 256, n,
+                             crcs));
+
+      // Confirm pages up to the first one that didn't make it
+      for (i = 0; i < n; i++)
+        if (crcs[i] != nxt_image_crc(session->image, session->len,
+                                     (first + i) * 256, 256))
+          break;
+
+      session->next_page = first + i;
+      if (i < n)
+        return NXT_VERIFY_FAILED;
+    }
+
+  NXT_ERR(nxt_flash_fingerprint(nxt, session->image, session->len,
+                                &staging));
+  return nxt_flash_finish(nxt);
+}
+
+
+nxt_error_t
+nxt_firmware_verify_plan(nxt_t *nxt, nxt_flash_plan_t *plan)
+{
+  nxt_word_t crc;
+  int first, n;
+
+  /* Flashed images are zero-padded to whole pages, so checksum each
+   * run of padded pages in one go on both ends.
+   */
+  NXT_ERR(nxt_crc_prepare(nxt));
+  for (first = 0; (n = nxt_plan_next_run(plan, &first)) > 0; first += n)
+    {
+      NXT_ERR(nxt_remote_crc(nxt, FLASH_BASE_ADDR + first * 256, n * 256, 1,
+                             &crc));
+      if (crc != nxt_image_crc(plan->data, plan->len, first * 256, n * 256))
+        return NXT_VERIFY_FAILED;
+    }
 
   return NXT_OK;
 }
+
+
+nxt_error_t
+nxt_firmware_verify_buffer(nxt_t *nxt, char *image, int len)
+{
+  nxt_flash_plan_t plan;
+
+  NXT_ERR(nxt_flash_plan_raw(&plan, image, len));
+  return nxt_firmware_verify_plan(nxt, &plan);
+}
+
+
+nxt_error_t
+nxt_firmware_verify(nxt_t *nxt, char *fw_path)
+{
+  nxt_flash_plan_t plan;
+  nxt_error_t err;
+
+  NXT_ERR(nxt_flash_plan_load(fw_path, &plan));
+  err = nxt_firmware_verify_plan(nxt, &plan);
+  nxt_flash_plan_free(&plan);
+
+  return err;
+}
+
+
+nxt_error_t
+nxt_firmware_is_current_plan(nxt_t *nxt, nxt_flash_plan_t *plan,
+                             int *current)
+{
+  nxt_word_t words[FINGERPRINT_WORDS], w;
+  nxt_error_t err;
+  int i;
+
+  *current = 0;
+  if (plan->len > FINGERPRINT_PAGE * 256)
+    return NXT_OK;
+
+  nxt_fingerprint(words, plan->data, plan->len);
+  for (i = 0; i < FINGERPRINT_WORDS; i++)
+    {
+      NXT_ERR(nxt_read_word(nxt, FINGERPRINT_ADDR + i * 4, &w));
+      if (w != words[i])
+        return NXT_OK;
+    }
+
+  /* Other tools may have written the flash since, leaving it behind.
+   * Only the pages the plan uses were written, so only those count.
+   */
+  err = nxt_firmware_verify_plan(nxt, plan);
+  if (err == NXT_VERIFY_FAILED)
+    return NXT_OK;
+  NXT_ERR(err);
+
+  *current = 1;
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_firmware_is_current_buffer(nxt_t *nxt, char *image, int len,
+                               int *current)
+{
+  nxt_flash_plan_t plan;
+
+  *current = 0;
+  NXT_ERR(nxt_flash_plan_raw(&plan, image, len));
+  return nxt_firmware_is_current_plan(nxt, &plan, current);
+}
+
+
+nxt_error_t
+nxt_firmware_is_current(nxt_t *nxt, char *fw_path, int *current)
+{
+  nxt_flash_plan_t plan;
+  nxt_error_t err;
+
+  *current = 0;
+  NXT_ERR(nxt_flash_plan_load(fw_path, &plan));
+  err = nxt_firmware_is_current_plan(nxt, &plan, current);
+  nxt_flash_plan_free(&plan);
+
+  return err;
+}
+
+
+nxt_error_t
+nxt_exec_buffer(nxt_t *nxt, nxt_addr_t addr, char *image, int len)
+{
+  if (len > NXT_EXEC_MAX_SIZE)
+    return NXT_INVALID_FIRMWARE;
+
+  // Uploaded straight from the caller's memory, compressed if it pays
+  NXT_ERR(nxt_send_file_compressed(nxt, addr, image, len));
+  NXT_ERR(nxt_jump(nxt, addr));
+
+  return NXT_OK;
+}
+
+
+/* Where the checksum routine can run without touching the image, or
+ * 0 if there is no room for it.
+ */
+static nxt_addr_t
+nxt_csum_addr(nxt_addr_t addr, int len)
+{
+  nxt_addr_t after = (addr + len + 255) & ~255;
+
+  if (addr < EXEC_RAM_START || addr + len > EXEC_RAM_LIMIT)
+    return 0;
+  if (after + CSUM_FOOTPRINT <= EXEC_RAM_LIMIT)
+    return after;
+  if (addr >= EXEC_RAM_START + CSUM_FOOTPRINT)
+    return EXEC_RAM_START;
+
+  return 0;
+}
+
+
+/* CRC32 of the first n_chunks chunks of RAM at addr, where an earlier
+ * upload left its image.
+ */
+static nxt_error_t
+nxt_exec_crcs(nxt_t *nxt, nxt_addr_t csum, nxt_addr_t addr, int n_chunks,
+              nxt_word_t *crcs)
+{
+  char mailbox[12];
+  char buf[EXEC_N_CHUNKS * 4];
+  int i;
+
+  nxt_store_word(mailbox, addr);
+  nxt_store_word(mailbox + 4, EXEC_CHUNK);
+  nxt_store_word(mailbox + 8, n_chunks);
+
+  NXT_ERR(nxt_write_mem(nxt, csum, csum_bin, csum_len));
+  NXT_ERR(nxt_write_mem(nxt, csum + CSUM_MAILBOX, mailbox, 12));
+  NXT_ERR(nxt_jump(nxt, csum));
+  NXT_ERR(nxt_read_mem(nxt, csum + CSUM_MAILBOX + 12, buf, n_chunks * 4));
+
+  for (i = 0; i < n_chunks; i++)
+    crcs[i] = nxt_load_word(buf + i * 4);
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_exec_delta_buffer(nxt_t *nxt, nxt_addr_t addr, char *image, int len,
+                      char *prev, int prev_len, int *n_sent, int *n_skipped)
+{
+  nxt_word_t crcs[EXEC_N_CHUNKS];
+  char skip[EXEC_N_CHUNKS + 1];
+  int n_chunks = (len + EXEC_CHUNK - 1) / EXEC_CHUNK;
+  int n_check = 0, skipped = 0;
+  nxt_addr_t csum;
+  int i, run;
+
+  if (n_sent != NULL)
+    *n_sent = 0;
+  if (n_skipped != NULL)
+    *n_skipped = 0;
+
+  if (len < 0 || len > NXT_EXEC_MAX_SIZE)
+    return NXT_INVALID_FIRMWARE;
+
+  // Only whole chunks the two images share are worth checking
+  if (prev != NULL)
+    n_check = (len < prev_len ? len : prev_len) / EXEC_CHUNK;
+
+  memset(skip, 0, sizeof(skip));
+  for (i = 0; i < n_check; i++)
+    if (memcmp(image + i * EXEC_CHUNK, prev + i * EXEC_CHUNK,
+               EXEC_CHUNK) == 0)
+      skip[i] = 1;
+
+  /* The brick may have been power cycled since, or the image have
+   * changed its own data when it ran: ask the brick what it holds.
+   */
+  csum = nxt_csum_addr(addr, len);
+  if (csum != 0 && memchr(skip, 1, n_check) != NULL)
+    {
+      NXT_ERR(nxt_exec_crcs(nxt, csum, addr, n_check, crcs));
+      for (i = 0; i < n_check; i++)
+        if (skip[i] && crcs[i] != nxt_crc32(image + i * EXEC_CHUNK,
+                                            EXEC_CHUNK))
+          skip[i] = 0;
+    }
+  else
+    memset(skip, 0, sizeof(skip));
+
+  // Send the runs of chunks the brick doesn't hold
+  for (i = 0; i < n_chunks; i = run)
+    {
+      if (skip[i])
+        {
+          skipped++;
+          run = i + 1;
+          continue;
+        }
+
+      for (run = i + 1; run < n_chunks && !skip[run]; run++);
+
+      NXT_ERR(nxt_write_mem(nxt, addr + i * EXEC_CHUNK,
+                            image + i * EXEC_CHUNK,
+                            (run * EXEC_CHUNK < len ? run * EXEC_CHUNK : len) -
+                            i * EXEC_CHUNK));
+    }
+
+  if (n_sent != NULL)
+    *n_sent = n_chunks - skipped;
+  if (n_skipped != NULL)
+    *n_skipped = skipped;
+
+  return nxt_jump(nxt, addr);
+}
+
+
+nxt_error_t
+nxt_exec(nxt_t *nxt, nxt_addr_t addr, char *path)
+{
+  nxt_error_t err;
+  char *image;
+  int len;
+
+  NXT_ERR(nxt_map_file(path, &image, &len));
+  err = nxt_exec_buffer(nxt, addr, image, len);
+  nxt_unmap_file(image, len);
+
+  return err;
+}
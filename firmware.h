@@ -19,13 +19,142 @@
  * USA
  */
 
-#ifndef __FLASH_H__
-#define __FLASH_H__
+#ifndef __FIRMWARE_H__
+#define __FIRMWARE_H__
 
 #include "error.h"
 #include "lowlevel.h"
+#include "samba.h"
+#include "image.h"
+#include "request.h"
 
+#define NXT_FLASH_N_PAGES 1024
+
+/* Largest image fwexec-style uploads can put in RAM. */
+#define NXT_EXEC_MAX_SIZE (56*1024)
+
+/* The functions taking a path accept raw binaries, and ELF, Intel HEX
+ * and S-record images (see image.h).
+ *
+ * Flashing an image that leaves the last flash page (page 1023) free
+ * overwrites that page with a fingerprint of the image, for
+ * nxt_firmware_is_current(). Whatever was kept there is lost.
+ */
 nxt_error_t nxt_firmware_flash(nxt_t *nxt, char *fw_path);
+nxt_error_t nxt_firmware_flash_incremental(nxt_t *nxt, char *fw_path,
+                                           int *n_written, int *n_skipped);
 nxt_error_t nxt_firmware_validate(char *fw_path);
+nxt_error_t nxt_firmware_verify(nxt_t *nxt, char *fw_path);
+
+/* Map a file read-only into memory, without reading or copying it.
+ * Released with nxt_unmap_file().
+ */
+nxt_error_t nxt_map_file(char *path, char **image, int *len);
+void nxt_unmap_file(char *image, int len);
+
+/* Load a firmware image once, to flash it to several NXTs. The image
+ * is mapped from the file, and released with nxt_firmware_unload().
+ */
+nxt_error_t nxt_firmware_load(char *fw_path, char **image, int *len);
+void nxt_firmware_unload(char *image, int len);
+
+/* Variants of the above working on an image already in memory. The
+ * image is only read, so one image can be shared between threads.
+ */
+nxt_error_t nxt_firmware_flash_buffer(nxt_t *nxt, char *image, int len);
+nxt_error_t nxt_firmware_flash_incremental_buffer(nxt_t *nxt, char *image,
+                                                  int len, int *n_written,
+                                                  int *n_skipped);
+nxt_error_t nxt_firmware_verify_buffer(nxt_t *nxt, char *image, int len);
+
+/* What flashing an image involves: its contents laid out from the
+ * start of the flash, zero-filled up to the end of the last page used,
+ * and which pages and lock regions it uses. Raw binaries use every
+ * page up to their end. The other formats only use the pages their
+ * data lands in, and the rest of the flash is left alone.
+ */
+typedef struct
+{
+  char *data;
+  int len;
+  int sparse;
+  int n_used;
+  nxt_word_t regions; /* Lock regions of the pages used, a bit each */
+  unsigned char used[NXT_FLASH_N_PAGES];
+  nxt_image_t *image;
+} nxt_flash_plan_t;
+
+nxt_error_t nxt_flash_plan_load(char *path, nxt_flash_plan_t *plan);
+nxt_error_t nxt_flash_plan_image(nxt_flash_plan_t *plan,
+                                 nxt_image_t *image);
+void nxt_flash_plan_free(nxt_flash_plan_t *plan);
+
+/* Unlock the regions and write the pages a plan uses, skipping the
+ * gaps between them.
+ */
+nxt_error_t nxt_firmware_flash_plan(nxt_t *nxt, nxt_flash_plan_t *plan);
+nxt_error_t nxt_firmware_flash_incremental_plan(nxt_t *nxt,
+                                                nxt_flash_plan_t *plan,
+                                                int *n_written,
+                                                int *n_skipped);
+nxt_error_t nxt_firmware_verify_plan(nxt_t *nxt, nxt_flash_plan_t *plan);
+
+/* nxt_firmware_flash_plan() as a request (see request.h). The plan is
+ * only read, so many requests can share one.
+ */
+nxt_error_t nxt_request_flash_plan(nxt_request_t **req, nxt_t *nxt,
+                                   nxt_flash_plan_t *plan);
+
+/* A flashing run that survives a lost connection. Pages are written
+ * in checkpoints, each confirmed by checksumming its pages on the
+ * brick before the session moves past it. After an error, reconnect
+ * and run the session again to resume at the first unconfirmed page.
+ *
+ * The session only lives in memory: a program that dies mid-flash
+ * takes it along, and the next one starts over. Flashing the image
+ * incrementally then gets most of the way back, skipping the pages
+ * already written.
+ */
+#define NXT_FLASH_CHECKPOINT_PAGES 64
+
+typedef struct
+{
+  char *image;
+  int len;
+  int n_pages;
+  int next_page; /* First page not confirmed written yet */
+} nxt_flash_session_t;
+
+nxt_error_t nxt_flash_session_init(nxt_flash_session_t *session,
+                                   char *image, int len);
+nxt_error_t nxt_flash_session_run(nxt_t *nxt, nxt_flash_session_t *session);
+
+/* Check whether an image is what libnxt last flashed to the brick,
+ * from the fingerprint it keeps in the last flash page, then confirm
+ * it with a CRC of the pages the image uses. Images written by other
+ * tools are never reported current, and neither are images using the
+ * last page.
+ */
+nxt_error_t nxt_firmware_is_current(nxt_t *nxt, char *fw_path,
+                                    int *current);
+nxt_error_t nxt_firmware_is_current_buffer(nxt_t *nxt, char *image,
+                                           int len, int *current);
+nxt_error_t nxt_firmware_is_current_plan(nxt_t *nxt, nxt_flash_plan_t *plan,
+                                         int *current);
+
+/* Upload an image to RAM at addr and jump to it. */
+nxt_error_t nxt_exec(nxt_t *nxt, nxt_addr_t addr, char *path);
+nxt_error_t nxt_exec_buffer(nxt_t *nxt, nxt_addr_t addr, char *image,
+                            int len);
+
+/* Upload an image to RAM over the one a previous upload left there,
+ * prev, and jump to it. Only the 256 byte chunks that changed, or
+ * that the brick no longer holds, are sent. The brick is asked by
+ * checksumming its RAM with a small routine run next to the image;
+ * when there is no room for it, or no prev, everything is sent.
+ */
+nxt_error_t nxt_exec_delta_buffer(nxt_t *nxt, nxt_addr_t addr, char *image,
+                                  int len, char *prev, int prev_len,
+                                  int *n_sent, int *n_skipped);
 
-#endif /* __FLASH_H__ */
+#endif /* __FIRMWARE_H__ */
@@ -23,13 +23,16 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <fcntl.h>
 
 #include "error.h"
 #include "lowlevel.h"
 #include "samba.h"
 #include "flash.h"
+#include "stats.h"
+#include "request.h"
+
+#include "seq_routine.h"
 
 enum nxt_flash_commands
 {
@@ -37,39 +40,208 @@ enum nxt_flash_commands
   FLASH_CMD_UNLOCK = 0x4,
 };
 
-nxt_error_t
-nxt_flash_wait_ready(nxt_t *nxt)
+/* SRAM layout used by the sequencer routine (see flash_write/seq.c).
+ * The mailbox holds the operation count, the status word and the
+ * operations.
+ */
+#define FLASH_SEQ_ADDR     0x203400
+#define FLASH_SEQ_MAILBOX  0x203800
+
+enum nxt_flash_seq_ops
 {
-  nxt_word_t flash_status;
+  FLASH_SEQ_SET_FMR = 1,
+  FLASH_SEQ_COMMAND = 2,
+  FLASH_SEQ_WRITE_PAGE = 3,
+};
 
-  do
-    {
-      NXT_ERR(nxt_read_word(nxt, 0xFFFFFF68, &flash_status));
+#define FLASH_SEQ_DONE        0x80000000
+#define FLASH_SEQ_ERRORS      0xC /* MC_FSR LOCKE, PROGE */
+#define FLASH_SEQ_N_DONE(s)   (((s) >> 8) & 0xFF)
 
-      /* Bit 0 is the FRDY field. Set to 1 if the flash controller is
-       * ready to run a new command.
-       */
-    } while (!(flash_status & 0x1));
+/* Flash mode register: FCMN 0x5, FWS 0x1 for lock bit commands, and
+ * FCMN 0x34, FWS 0x1 for page writes.
+ */
+#define FLASH_MODE_LOCK    0x00050100
+#define FLASH_MODE_WRITE   0x00340100
+
+
+void
+nxt_flash_seq_init(nxt_flash_seq_t *seq)
+{
+  seq->n_ops = 0;
+}
+
+
+static nxt_error_t
+nxt_flash_seq_add(nxt_flash_seq_t *seq, enum nxt_flash_seq_ops op,
+                  nxt_word_t arg0, nxt_word_t arg1)
+{
+  if (seq->n_ops == NXT_FLASH_SEQ_MAX_OPS)
+    return NXT_FLASH_ERROR;
+
+  seq->ops[seq->n_ops][0] = op;
+  seq->ops[seq->n_ops][1] = arg0;
+  seq->ops[seq->n_ops][2] = arg1;
+  seq->n_ops++;
 
   return NXT_OK;
 }
 
+
+nxt_error_t
+nxt_flash_seq_set_mode(nxt_flash_seq_t *seq, nxt_word_t mode)
+{
+  return nxt_flash_seq_add(seq, FLASH_SEQ_SET_FMR, mode, 0);
+}
+
+
 static nxt_error_t
-nxt_flash_alter_lock(nxt_t *nxt, int region_num,
-                     enum nxt_flash_commands cmd)
+nxt_flash_seq_alter_lock(nxt_flash_seq_t *seq, int region_num,
+                         enum nxt_flash_commands cmd)
 {
   nxt_word_t w = 0x5A000000 | ((64 * region_num) << 8);
   w += cmd;
 
-  NXT_ERR(nxt_flash_wait_ready(nxt));
+  NXT_ERR(nxt_flash_seq_set_mode(seq, FLASH_MODE_LOCK));
+  NXT_ERR(nxt_flash_seq_add(seq, FLASH_SEQ_COMMAND, w, 0));
+  return nxt_flash_seq_set_mode(seq, FLASH_MODE_WRITE);
+}
+
+
+nxt_error_t
+nxt_flash_seq_lock(nxt_flash_seq_t *seq, int region_num)
+{
+  return nxt_flash_seq_alter_lock(seq, region_num, FLASH_CMD_LOCK);
+}
+
+
+nxt_error_t
+nxt_flash_seq_unlock(nxt_flash_seq_t *seq, int region_num)
+{
+  return nxt_flash_seq_alter_lock(seq, region_num, FLASH_CMD_UNLOCK);
+}
+
+
+nxt_error_t
+nxt_flash_seq_write_page(nxt_flash_seq_t *seq, int page_num,
+                         nxt_addr_t src)
+{
+  return nxt_flash_seq_add(seq, FLASH_SEQ_WRITE_PAGE, page_num, src);
+}
+
+
+/* Fill in the mailbox for seq, returning its length. */
+static int
+nxt_flash_seq_mailbox(nxt_flash_seq_t *seq, char *mailbox)
+{
+  int i, j;
+
+  nxt_store_word(mailbox, seq->n_ops);
+  nxt_store_word(mailbox + 4, 0);
+  for (i = 0; i < seq->n_ops; i++)
+    for (j = 0; j < 3; j++)
+      nxt_store_word(mailbox + 8 + (i * 3 + j) * 4, seq->ops[i][j]);
+
+  return 8 + seq->n_ops * 12;
+}
+
+
+nxt_error_t
+nxt_flash_seq_run(nxt_t *nxt, nxt_flash_seq_t *seq)
+{
+  nxt_flash_state_t *state = nxt_flash_state_of(nxt);
+  char mailbox[NXT_FLASH_SEQ_MAILBOX_SIZE];
+  nxt_word_t status;
+  nxt_error_t err;
+  int len = nxt_flash_seq_mailbox(seq, mailbox);
 
-  /* Flash mode register: FCMN 0x5, FWS 0x1
-   * Flash command register: KEY 0x5A, FCMD = clear-lock-bit (0x4)
-   * Flash mode register: FCMN 0x34, FWS 0x1
+  /* The routine waits on FRDY itself between operations, so the
+   * whole sequence costs one upload, one jump and one status read
+   * instead of a round trip per operation. Later runs skip the upload.
    */
-  NXT_ERR(nxt_write_word(nxt, 0xFFFFFF60, 0x00050100));
-  NXT_ERR(nxt_write_word(nxt, 0xFFFFFF64, w));
-  NXT_ERR(nxt_write_word(nxt, 0xFFFFFF60, 0x00340100));
+  nxt_batch_begin(nxt);
+  if (!state->seq_resident)
+    {
+      err = nxt_write_mem(nxt, FLASH_SEQ_ADDR, seq_bin, seq_len);
+      if (err)
+        goto fail;
+    }
+  err = nxt_write_mem(nxt, FLASH_SEQ_MAILBOX, mailbox, len);
+  if (err)
+    goto fail;
+  err = nxt_jump(nxt, FLASH_SEQ_ADDR);
+  if (err)
+    goto fail;
+  err = nxt_read_word(nxt, FLASH_SEQ_MAILBOX + 4, &status);
+  if (err)
+    goto fail;
+  err = nxt_batch_end(nxt);
+  if (err)
+    {
+      state->seq_resident = 0;
+      return err;
+    }
+
+  // A status word means the routine ran, and is still there
+  state->seq_resident = (status & FLASH_SEQ_DONE) != 0;
+  return nxt_flash_seq_check(nxt, seq, status);
+
+ fail:
+  state->seq_resident = 0;
+  return nxt_batch_cancel(nxt, err);
+}
+
+
+/* Requests always upload the routine: whether it is still there can
+ * only be known once the steps queued before this one have run.
+ */
+nxt_error_t
+nxt_flash_seq_queue(nxt_request_t *req, nxt_flash_seq_t *seq,
+                    char *mailbox, char *status)
+{
+  int len = nxt_flash_seq_mailbox(seq, mailbox);
+
+  NXT_ERR(nxt_op_write_mem(req, FLASH_SEQ_ADDR, seq_bin, seq_len));
+  NXT_ERR(nxt_op_write_mem(req, FLASH_SEQ_MAILBOX, mailbox, len));
+  NXT_ERR(nxt_op_jump(req, FLASH_SEQ_ADDR));
+  return nxt_op_read_word(req, FLASH_SEQ_MAILBOX + 4, status);
+}
+
+
+nxt_error_t
+nxt_flash_seq_check(nxt_t *nxt, nxt_flash_seq_t *seq, nxt_word_t status)
+{
+  int i;
+
+  if (!(status & FLASH_SEQ_DONE))
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  for (i = 0; i < FLASH_SEQ_N_DONE(status) && i < seq->n_ops; i++)
+    if (seq->ops[i][0] == FLASH_SEQ_WRITE_PAGE)
+      NXT_STAT_INC(nxt, pages_flashed);
+
+  if ((status & FLASH_SEQ_ERRORS) ||
+      FLASH_SEQ_N_DONE(status) != seq->n_ops)
+    return NXT_FLASH_ERROR;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_flash_wait_ready(nxt_t *nxt)
+{
+  nxt_word_t flash_status;
+
+  do
+    {
+      NXT_ERR(nxt_read_word(nxt, 0xFFFFFF68, &flash_status));
+      NXT_STAT_INC(nxt, wait_ready_polls);
+
+      /* Bit 0 is the FRDY field. Set to 1 if the flash controller is
+       * ready to run a new command.
+       */
+    } while (!(flash_status & 0x1));
 
   return NXT_OK;
 }
@@ -78,36 +250,77 @@ nxt_flash_alter_lock(nxt_t *nxt, int region_num,
 nxt_error_t
 nxt_flash_lock_region(nxt_t *nxt, int region_num)
 {
-  return nxt_flash_alter_lock(nxt, region_num, FLASH_CMD_LOCK);
+  nxt_flash_seq_t seq;
+
+  nxt_flash_seq_init(&seq);
+  NXT_ERR(nxt_flash_seq_lock(&seq, region_num));
+  return nxt_flash_seq_run(nxt, &seq);
 }
 
 
 nxt_error_t
 nxt_flash_unlock_region(nxt_t *nxt, int region_num)
 {
-  return nxt_flash_alter_lock(nxt, region_num, FLASH_CMD_UNLOCK);
+  nxt_flash_seq_t seq;
+
+  nxt_flash_seq_init(&seq);
+  NXT_ERR(nxt_flash_seq_unlock(&seq, region_num));
+  return nxt_flash_seq_run(nxt, &seq);
 }
 
 
 nxt_error_t
 nxt_flash_lock_all_regions(nxt_t *nxt)
 {
+  nxt_flash_seq_t seq;
   int i;
 
+  nxt_flash_seq_init(&seq);
   for (i = 0; i < 16; i++)
-    NXT_ERR(nxt_flash_lock_region(nxt, i));
+    NXT_ERR(nxt_flash_seq_lock(&seq, i));
 
-  return NXT_OK;
+  return nxt_flash_seq_run(nxt, &seq);
 }
 
 
 nxt_error_t
-nxt_flash_unlock_all_regions(nxt_t *nxt)
+nxt_flash_unlock_regions(nxt_t *nxt, nxt_word_t regions)
 {
+  nxt_flash_seq_t seq;
   int i;
 
+  nxt_flash_seq_init(&seq);
   for (i = 0; i < 16; i++)
-    NXT_ERR(nxt_flash_unlock_region(nxt, i));
+    if (regions & (1 << i))
+      NXT_ERR(nxt_flash_seq_unlock(&seq, i));
 
-  return NXT_OK;
+  if (seq.n_ops == 0)
+    return NXT_OK;
+
+  return nxt_flash_seq_run(nxt, &seq);
+}
+
+
+nxt_error_t
+nxt_flash_unlock_all_regions(nxt_t *nxt)
+{
+  return nxt_flash_unlock_regions(nxt, 0xFFFF);
+}
+
+
+void
+nxt_flash_note_command(nxt_t *nxt, char cmd, nxt_addr_t addr,
+                       nxt_word_t arg)
+{
+  nxt_flash_state_t *state = nxt_flash_state_of(nxt);
+  nxt_word_t len = cmd == 'S' ? arg : cmd == 'W' ? 4 : cmd == 'H' ? 2 :
+                   cmd == 'O' ? 1 : 0;
+
+  // Whatever code runs may write anywhere
+  if (cmd == 'G' && addr != FLASH_SEQ_ADDR)
+    state->seq_resident = 0;
+
+  if (len > 0 && addr < FLASH_SEQ_ADDR + seq_len &&
+      addr + len > FLASH_SEQ_ADDR)
+    state->seq_resident = 0;
 }
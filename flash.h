@@ -24,6 +24,44 @@
 
 #include "error.h"
 #include "lowlevel.h"
+#include "samba.h"
+#include "request.h"
+
+/* A list of flash controller operations, run back to back by the
+ * onboard sequencer routine in a single exchange with the brick.
+ */
+#define NXT_FLASH_SEQ_MAX_OPS 64
+
+typedef struct
+{
+  int n_ops;
+  nxt_word_t ops[NXT_FLASH_SEQ_MAX_OPS][3];
+} nxt_flash_seq_t;
+
+void nxt_flash_seq_init(nxt_flash_seq_t *seq);
+nxt_error_t nxt_flash_seq_set_mode(nxt_flash_seq_t *seq, nxt_word_t mode);
+nxt_error_t nxt_flash_seq_lock(nxt_flash_seq_t *seq, int region_num);
+nxt_error_t nxt_flash_seq_unlock(nxt_flash_seq_t *seq, int region_num);
+nxt_error_t nxt_flash_seq_write_page(nxt_flash_seq_t *seq, int page_num,
+                                     nxt_addr_t src);
+
+/* Run seq on the brick. The sequencer routine stays in SRAM between
+ * runs, and is only uploaded again once something may have overwritten
+ * it (see nxt_flash_note_command()).
+ */
+nxt_error_t nxt_flash_seq_run(nxt_t *nxt, nxt_flash_seq_t *seq);
+
+/* nxt_flash_seq_run() as request steps (see request.h): queue the
+ * upload, jump and status read, then check the status once it has
+ * come in. mailbox holds NXT_FLASH_SEQ_MAILBOX_SIZE bytes and status
+ * 4, and both must stay around until then.
+ */
+#define NXT_FLASH_SEQ_MAILBOX_SIZE (8 + NXT_FLASH_SEQ_MAX_OPS * 12)
+
+nxt_error_t nxt_flash_seq_queue(nxt_request_t *req, nxt_flash_seq_t *seq,
+                                char *mailbox, char *status);
+nxt_error_t nxt_flash_seq_check(nxt_t *nxt, nxt_flash_seq_t *seq,
+                                nxt_word_t status);
 
 nxt_error_t nxt_flash_wait_ready(nxt_t *nxt);
 nxt_error_t nxt_flash_lock_region(nxt_t *nxt, int region_num);
@@ -31,4 +69,25 @@ nxt_error_t nxt_flash_unlock_region(nxt_t *nxt, int region_num);
 nxt_error_t nxt_flash_lock_all_regions(nxt_t *nxt);
 nxt_error_t nxt_flash_unlock_all_regions(nxt_t *nxt);
 
+/* Unlock the regions with their bit set in regions, bit 0 for the
+ * first 64 pages and so on.
+ */
+nxt_error_t nxt_flash_unlock_regions(nxt_t *nxt, nxt_word_t regions);
+
+/* Per-handle flash state, kept in the handle by lowlevel.c, and
+ * forgotten when the connection is opened again.
+ */
+typedef struct {
+  int seq_resident;
+} nxt_flash_state_t;
+
+nxt_flash_state_t *nxt_flash_state_of(nxt_t *nxt);
+
+/* Called for every SAM-BA command sent: a write over the sequencer
+ * routine, or a jump to any other code, means it must be uploaded
+ * again before the next run.
+ */
+void nxt_flash_note_command(nxt_t *nxt, char cmd, nxt_addr_t addr,
+                            nxt_word_t arg);
+
 #endif /* __FLASH_H__ */
@@ -0,0 +1,516 @@
+/**
+ * NXT bootstrap interface; NXT onboard resident agent.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#define VINTPTR(addr) ((volatile unsigned int *)(addr))
+#define VINT(addr) (*(VINTPTR(addr)))
+
+/* Memory used relative to where the agent runs: its code, the CRC32
+ * lookup table and the frame buffer. Everything from the agent up to
+ * the top of SRAM, where crt0 put the stack, is off limits to writes.
+ */
+#define AGENT_TABLE_OFFSET 0xC00
+#define AGENT_FRAME_OFFSET 0x1000
+#define AGENT_FRAME_SIZE   (AGENT_HEADER + AGENT_MAX_PAYLOAD + 4 + 64)
+#define SRAM_END           0x00210000
+
+/* Request frames are a header of four words, magic/opcode/sequence,
+ * address, argument and payload length, then the payload and the
+ * CRC32 of everything before it. Replies are the same, with a three
+ * word header: magic/status/sequence, value and payload length.
+ */
+#define AGENT_HEADER       16
+#define AGENT_REPLY_HEADER 12
+#define AGENT_MAX_PAYLOAD  2048
+#define AGENT_REQUEST_MAGIC 0xA5
+#define AGENT_REPLY_MAGIC   0x5A
+#define AGENT_VERSION       1
+
+#define AGENT_PING   0 /* value: agent version */
+#define AGENT_WRITE  1 /* payload to addr */
+#define AGENT_READ   2 /* arg bytes from addr */
+#define AGENT_FLASH  3 /* payload pages from page addr */
+#define AGENT_CRC    4 /* payload word chunks of arg bytes from addr */
+#define AGENT_FILL   5 /* arg bytes at addr with the payload word */
+#define AGENT_EXIT   6 /* value: whether a padding packet must follow */
+
+#define AGENT_OK          0
+#define AGENT_BAD_CRC     1
+#define AGENT_BAD_FRAME   2
+#define AGENT_BAD_ADDRESS 3
+#define AGENT_FLASH_ERROR 4
+
+#define FLASH_BASE VINTPTR(0x00100000)
+#define FLASH_MODE_REG VINT(0xFFFFFF60)
+#define FLASH_CMD_REG VINT(0xFFFFFF64)
+#define FLASH_STATUS_REG VINT(0xFFFFFF68)
+#define FLASH_STATUS_ERRORS 0xC /* LOCKE, PROGE */
+#define FLASH_STATUS_LOCKS(s) ((s) >> 16)
+#define FLASH_MODE_LOCK  0x00050100
+#define FLASH_MODE_WRITE 0x00340100
+#define FLASH_CMD_WRITE(page) (0x5A000001 + (((page) & 0x000003FF) << 8))
+#define FLASH_CMD_UNLOCK(page) (0x5A000004 + (((page) & 0x000003FF) << 8))
+
+/* USB device port. SAM-BA talks to the host over endpoints 1 (bulk
+ * OUT) and 2 (bulk IN), both with two banks.
+ */
+#define UDP_RSTEP VINT(0xFFFB0028)
+#define UDP_CSR(ep) VINT(0xFFFB0030 + 4 * (ep))
+#define UDP_FDR(ep) VINT(0xFFFB0050 + 4 * (ep))
+#define UDP_TXCOMP      0x01
+#define UDP_RX_DATA_BK0 0x02
+#define UDP_RXSETUP     0x04
+#define UDP_STALLSENT   0x08
+#define UDP_TXPKTRDY    0x10
+#define UDP_FORCESTALL  0x20
+#define UDP_RX_DATA_BK1 0x40
+#define UDP_DIR         0x80
+#define UDP_RXBYTECNT(csr) (((csr) >> 16) & 0x7FF)
+#define UDP_NO_EFFECT (UDP_TXCOMP | UDP_RX_DATA_BK0 | UDP_RXSETUP | \
+                       UDP_STALLSENT | UDP_RX_DATA_BK1)
+
+#define EP_CONTROL 0
+#define EP_OUT     1
+#define EP_IN      2
+#define PACKET_SIZE 64
+
+struct agent {
+  unsigned long base;
+  unsigned int *table;
+  unsigned char *frame;
+  unsigned int bank;         /* OUT bank of the next packet, 0 if unknown */
+  unsigned long n_packets;   /* OUT packets consumed */
+  unsigned int errors;       /* Flash errors not reported yet */
+};
+
+/* Writing 1 to the status bits in UDP_NO_EFFECT leaves them alone, so
+ * the other bits of the register can be changed without racing the
+ * hardware.
+ */
+static void
+csr_clear(int ep, unsigned int bits)
+{
+  unsigned int csr = UDP_CSR(ep);
+
+  csr |= UDP_NO_EFFECT;
+  csr &= ~bits;
+  UDP_CSR(ep) = csr;
+  while (UDP_CSR(ep) & bits);
+}
+
+static void
+csr_set(int ep, unsigned int bits)
+{
+  unsigned int csr = UDP_CSR(ep);
+
+  csr |= UDP_NO_EFFECT | bits;
+  UDP_CSR(ep) = csr;
+}
+
+/* Send len bytes as one transfer. While the hardware sends one bank,
+ * the next packet goes into the other.
+ */
+static void
+usb_write(int ep, const unsigned char *buf, unsigned int len)
+{
+  unsigned int n, i, first = 1;
+
+  do
+    {
+      n = len < PACKET_SIZE ? len : PACKET_SIZE;
+      for (i = 0; i < n; i++)
+        UDP_FDR(ep) = buf[i];
+      buf += n;
+      len -= n;
+
+      if (!first)
+        {
+          while (!(UDP_CSR(ep) & UDP_TXCOMP));
+          csr_clear(ep, UDP_TXCOMP);
+        }
+      csr_set(ep, UDP_TXPKTRDY);
+      first = 0;
+    } while (len > 0);
+
+  while (!(UDP_CSR(ep) & UDP_TXCOMP));
+  csr_clear(ep, UDP_TXCOMP);
+}
+
+/* The host only sends control requests to clear a halted endpoint
+ * after a failed transfer. Acknowledge those, resetting the endpoint,
+ * and stall everything else.
+ */
+static void
+usb_control(struct agent *a)
+{
+  unsigned int csr = UDP_CSR(EP_CONTROL);
+  unsigned char setup[8];
+  int i;
+
+  if (csr & UDP_STALLSENT)
+    csr_clear(EP_CONTROL, UDP_STALLSENT | UDP_FORCESTALL);
+
+  if (!(csr & UDP_RXSETUP))
+    return;
+
+  for (i = 0; i < 8; i++)
+    setup[i] = UDP_FDR(EP_CONTROL);
+  if (setup[0] & 0x80)
+    csr_set(EP_CONTROL, UDP_DIR);
+  csr_clear(EP_CONTROL, UDP_RXSETUP);
+
+  if (setup[0] == 0x02 && setup[1] == 0x01)
+    {
+      int ep = setup[4] & 0xF;
+
+      UDP_RSTEP = 1 << ep;
+      UDP_RSTEP = 0;
+      if (ep == EP_OUT)
+        a->bank = 0;
+      usb_write(EP_CONTROL, setup, 0);
+    }
+  else
+    csr_set(EP_CONTROL, UDP_FORCESTALL);
+}
+
+/* Read one OUT packet into buf, or drop it if buf is 0. Packets
+ * alternate between the banks, but which one comes first depends on
+ * how many SAM-BA read before jumping here.
+ */
+static unsigned int
+usb_read_packet(struct agent *a, unsigned char *buf)
+{
+  unsigned int csr, n, i;
+
+  do
+    {
+      usb_control(a);
+      csr = UDP_CSR(EP_OUT);
+    } while (!(csr & (UDP_RX_DATA_BK0 | UDP_RX_DATA_BK1)));
+
+  if (!(csr & a->bank))
+    a->bank = (csr & UDP_RX_DATA_BK0) ? UDP_RX_DATA_BK0 : UDP_RX_DATA_BK1;
+
+  n = UDP_RXBYTECNT(csr);
+  for (i = 0; i < n; i++)
+    {
+      unsigned char c = UDP_FDR(EP_OUT);
+      if (buf)
+        buf[i] = c;
+    }
+
+  csr_clear(EP_OUT, a->bank);
+  a->bank = a->bank == UDP_RX_DATA_BK0 ? UDP_RX_DATA_BK1 : UDP_RX_DATA_BK0;
+  a->n_packets++;
+
+  return n;
+}
+
+static unsigned int
+crc32(struct agent *a, const volatile unsigned char *p, unsigned long len,
+      unsigned int crc)
+{
+  unsigned int c = ~crc;
+
+  while (len--)
+    c = a->table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+
+  return ~c;
+}
+
+static unsigned int
+load_word(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+static void
+store_word(unsigned char *p, unsigned int w)
+{
+  p[0] = w;
+  p[1] = w >> 8;
+  p[2] = w >> 16;
+  p[3] = w >> 24;
+}
+
+/* Wait for the flash controller, keeping the errors it reports until
+ * they can be sent to the host. Reading the status clears them.
+ */
+static void
+wait_ready(struct agent *a)
+{
+  unsigned int status;
+
+  do
+    {
+      status = FLASH_STATUS_REG;
+      a->errors |= status & FLASH_STATUS_ERRORS;
+    } while (!(status & 0x1));
+}
+
+/* Receive a request frame. Returns the length of the frame, or 0 if
+ * it was malformed, after dropping the rest of its transfer.
+ */
+static unsigned int
+read_frame(struct agent *a)
+{
+  unsigned int got = 0, want = AGENT_HEADER + 4, n;
+  int bad = 0;
+
+  do
+    {
+      n = usb_read_packet(a, got + PACKET_SIZE <= AGENT_FRAME_SIZE ?
+                          a->frame + got : 0);
+      got += n;
+
+      if (got >= AGENT_HEADER && want == AGENT_HEADER + 4)
+        {
+          unsigned int len = load_word(a->frame + 12);
+
+          if ((a->frame[0] != AGENT_REQUEST_MAGIC) ||
+              len > AGENT_MAX_PAYLOAD)
+            bad = 1;
+          else
+            want = AGENT_HEADER + len + 4;
+        }
+    } while (n == PACKET_SIZE && (bad || got < want));
+
+  return bad || got != want ? 0 : got;
+}
+
+static void
+send_reply(struct agent *a, unsigned int seq, unsigned int status,
+           unsigned int value, unsigned int len)
+{
+  unsigned char *f = a->frame;
+
+  store_word(f, AGENT_REPLY_MAGIC | (status << 8) | (seq << 16));
+  store_word(f + 4, value);
+  store_word(f + 8, len);
+  store_word(f + AGENT_REPLY_HEADER + len,
+             crc32(a, f, AGENT_REPLY_HEADER + len, 0));
+
+  usb_write(EP_IN, f, AGENT_REPLY_HEADER + len + 4);
+}
+
+/* Writes may not land on the agent or its stack. */
+static int
+reserved(struct agent *a, unsigned long addr, unsigned long len)
+{
+  return addr < SRAM_END && addr + len > a->base;
+}
+
+/* Copy with the widest accesses the alignment allows, so that
+ * peripheral registers see the access size they expect.
+ */
+static void
+copy(unsigned long dst, unsigned long src, unsigned long len)
+{
+  unsigned long i;
+
+  if (((dst | src | len) & 3) == 0)
+    for (i = 0; i < len; i += 4)
+      *(volatile unsigned int *)(dst + i) =
+        *(volatile unsigned int *)(src + i);
+  else if (((dst | src | len) & 1) == 0)
+    for (i = 0; i < len; i += 2)
+      *(volatile unsigned short *)(dst + i) =
+        *(volatile unsigned short *)(src + i);
+  else
+    for (i = 0; i < len; i++)
+      *(volatile unsigned char *)(dst + i) =
+        *(volatile unsigned char *)(src + i);
+}
+
+/* Program pages straight from the frame, unlocking their regions as
+ * needed. The last page is left programming while the next frame
+ * comes in.
+ */
+static void
+flash_pages(struct agent *a, unsigned int page, unsigned char *data,
+            unsigned int n_pages)
+{
+  volatile unsigned int *src;
+  unsigned int i;
+
+  while (n_pages-- && page < 1024)
+    {
+      wait_ready(a);
+
+      if (FLASH_STATUS_LOCKS(FLASH_STATUS_REG) & (1 << (page / 64)))
+        {
+          FLASH_MODE_REG = FLASH_MODE_LOCK;
+          FLASH_CMD_REG = FLASH_CMD_UNLOCK(page);
+          wait_ready(a);
+        }
+
+      FLASH_MODE_REG = FLASH_MODE_WRITE;
+      src = (volatile unsigned int *)data;
+      for (i = 0; i < 64; i++)
+        FLASH_BASE[(page*64)+i] = src[i];
+      FLASH_CMD_REG = FLASH_CMD_WRITE(page);
+
+      page++;
+      data += 256;
+    }
+}
+
+void do_agent(unsigned long base)
+{
+  struct agent agent;
+  struct agent *a = &agent;
+  unsigned int c, i, j;
+
+  a->base = base;
+  a->table = (unsigned int *)(base + AGENT_TABLE_OFFSET);
+  a->frame = (unsigned char *)(base + AGENT_FRAME_OFFSET);
+  a->bank = 0;
+  a->n_packets = 0;
+  a->errors = 0;
+
+  for (i = 0; i < 256; i++)
+    {
+      c = i;
+      for (j = 0; j < 8; j++)
+        c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      a->table[i] = c;
+    }
+
+  for (;;)
+    {
+      unsigned char *f = a->frame;
+      unsigned char *payload = f + AGENT_HEADER;
+      unsigned int n = read_frame(a);
+      unsigned int seq, op, addr, arg, len, status = AGENT_OK, value = 0;
+      unsigned int reply_len = 0;
+
+      if (n == 0)
+        {
+          send_reply(a, 0, AGENT_BAD_FRAME, 0, 0);
+          continue;
+        }
+
+      seq = load_word(f) >> 16;
+      if (crc32(a, f, n - 4, 0) != load_word(f + n - 4))
+        {
+          send_reply(a, seq, AGENT_BAD_CRC, 0, 0);
+          continue;
+        }
+
+      op = f[1];
+      addr = load_word(f + 4);
+      arg = load_word(f + 8);
+      len = load_word(f + 12);
+
+      /* Replies are built in the frame buffer, over the request:
+       * anything the reply payload needs is read first.
+       */
+      switch (op)
+        {
+        case AGENT_PING:
+          value = AGENT_VERSION;
+          break;
+
+        case AGENT_WRITE:
+          if (reserved(a, addr, len))
+            status = AGENT_BAD_ADDRESS;
+          else
+            copy(addr, (unsigned long)payload, len);
+          break;
+
+        case AGENT_READ:
+          if (arg > AGENT_MAX_PAYLOAD)
+            status = AGENT_BAD_FRAME;
+          else
+            {
+              // Flash reads are garbage while the controller is busy
+              wait_ready(a);
+              copy((unsigned long)f + AGENT_REPLY_HEADER, addr, arg);
+              reply_len = arg;
+            }
+          break;
+
+        case AGENT_FLASH:
+          if (len % 256 != 0 || addr + len / 256 > 1024)
+            status = AGENT_BAD_ADDRESS;
+          else
+            {
+              flash_pages(a, addr, payload, len / 256);
+
+              // An empty batch waits for the last page to be done
+              if (len == 0)
+                wait_ready(a);
+              value = a->errors;
+              if (a->errors)
+                status = AGENT_FLASH_ERROR;
+              a->errors = 0;
+            }
+          break;
+
+        case AGENT_CRC:
+          n = len == 4 ? load_word(payload) : 0;
+          if (n == 0 || n > AGENT_MAX_PAYLOAD / 4)
+            status = AGENT_BAD_FRAME;
+          else
+            {
+              wait_ready(a);
+              for (i = 0; i < n; i++, addr += arg)
+                store_word(f + AGENT_REPLY_HEADER + i * 4,
+                           crc32(a, (const volatile unsigned char *)addr,
+                                 arg, 0));
+              reply_len = n * 4;
+            }
+          break;
+
+        case AGENT_FILL:
+          c = len == 4 ? load_word(payload) : 0;
+          if (len != 4 || reserved(a, addr, arg))
+            status = AGENT_BAD_ADDRESS;
+          else if (((addr | arg) & 3) == 0)
+            for (i = 0; i < arg; i += 4)
+              VINT(addr + i) = c;
+          else
+            for (i = 0; i < arg; i++)
+              *(volatile unsigned char *)(addr + i) = c >> (8 * (i & 3));
+          break;
+
+        case AGENT_EXIT:
+          wait_ready(a);
+          if (a->errors)
+            status = AGENT_FLASH_ERROR;
+
+          /* SAM-BA expects the next packet in the bank after the one
+           * that held the jump. After an odd number of packets, the
+           * host sends one more to line the banks up again.
+           */
+          value = a->n_packets & 1;
+          send_reply(a, seq, status, value, 0);
+          if (value)
+            usb_read_packet(a, 0);
+          return;
+
+        default:
+          status = AGENT_BAD_FRAME;
+          break;
+        }
+
+      send_reply(a, seq, status, value, reply_len);
+    }
+}
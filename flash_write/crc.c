@@ -0,0 +1,65 @@
+/**
+ * NXT bootstrap interface; NXT onboard CRC32 checksum kernel.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#define VINTPTR(addr) ((volatile unsigned int *)(addr))
+#define VINT(addr) (*(VINTPTR(addr)))
+
+/* Kernel parameters: start address, chunk length in bytes, number of
+ * chunks and address of the result table. One CRC32 is written to the
+ * result table for each chunk.
+ */
+#define CRC_PARAMS VINTPTR(0x00202800)
+
+/* Scratch space for the byte-wise lookup table. */
+#define CRC_TABLE ((unsigned int *)0x00203000)
+
+#define FLASH_STATUS_REG VINT(0xFFFFFF68)
+
+void do_crc_table(void)
+{
+  volatile unsigned int *params = CRC_PARAMS;
+  const volatile unsigned char *p = (const volatile unsigned char *)params[0];
+  unsigned long len = params[1];
+  unsigned long n_chunks = params[2];
+  volatile unsigned int *out = VINTPTR(params[3]);
+  unsigned int *table = CRC_TABLE;
+  unsigned int c;
+  unsigned long i, j;
+
+  for (i = 0; i < 256; i++)
+    {
+      c = i;
+      for (j = 0; j < 8; j++)
+        c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      table[i] = c;
+    }
+
+  /* Flash reads are garbage while the controller is programming. */
+  while (!(FLASH_STATUS_REG & 0x1));
+
+  while (n_chunks--)
+    {
+      c = 0xFFFFFFFF;
+      for (i = 0; i < len; i++)
+        c = table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+      *out++ = ~c;
+    }
+}
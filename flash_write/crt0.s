@@ -30,8 +30,9 @@ _start:
 	/* Preserve old link register */
 	stmfd sp!, {lr}
 
-	/* Call main */
-	bl do_flash_write
+	/* Call main, passing the address we were loaded at */
+	adr r0, _start
+	bl routine_main
 
 	/* Return */
 	ldmfd sp!, {pc}
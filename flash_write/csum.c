@@ -0,0 +1,67 @@
+/**
+ * NXT bootstrap interface; NXT onboard per-chunk checksum routine.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+
+#define VINTPTR(addr) ((volatile unsigned int *)(addr))
+#define VINT(addr) (*(VINTPTR(addr)))
+
+/* Unlike crc.c, this routine has no fixed addresses: it runs wherever
+ * there is room next to the RAM image it checks. The mailbox sits 1k
+ * after its start, and holds the start address, chunk length and
+ * number of chunks, followed by one CRC32 per chunk on return.
+ */
+#define CSUM_MAILBOX_OFFSET 0x400
+
+void do_chunk_crcs(unsigned long base)
+{
+  volatile unsigned int *mailbox = VINTPTR(base + CSUM_MAILBOX_OFFSET);
+  const volatile unsigned char *p =
+    (const volatile unsigned char *)mailbox[0];
+  unsigned long len = mailbox[1];
+  unsigned long n_chunks = mailbox[2];
+  volatile unsigned int *out = mailbox + 3;
+  unsigned int table[16];
+  unsigned int c;
+  unsigned long i, j;
+
+  /* A table per nibble keeps the routine's footprint, stack included,
+   * small enough to squeeze in after most images.
+   */
+  for (i = 0; i < 16; i++)
+    {
+      c = i;
+      for (j = 0; j < 4; j++)
+        c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      table[i] = c;
+    }
+
+  while (n_chunks--)
+    {
+      c = 0xFFFFFFFF;
+      for (i = 0; i < len; i++)
+        {
+          c ^= *p++;
+          c = table[c & 0xF] ^ (c >> 4);
+          c = table[c & 0xF] ^ (c >> 4);
+        }
+      *out++ = ~c;
+    }
+}
@@ -22,25 +22,40 @@
 #define VINTPTR(addr) ((volatile unsigned int *)(addr))
 #define VINT(addr) (*(VINTPTR(addr)))
 
-#define USER_PAGE VINTPTR(0x00202100)
-#define USER_PAGE_NUM VINT(0x00202300)
+/* Address of the batch descriptor to program. The descriptor is a
+ * word holding the first page number, a word holding the number of
+ * pages, followed by the page data itself.
+ */
+#define USER_BATCH VINT(0x00202300)
 
 #define FLASH_BASE VINTPTR(0x00100000)
 #define FLASH_CMD_REG VINT(0xFFFFFF64)
 #define FLASH_STATUS_REG VINT(0xFFFFFF68)
-#define OFFSET_PAGE_NUM ((USER_PAGE_NUM & 0x000003FF) << 8)
-#define FLASH_CMD_WRITE (0x5A000001 + OFFSET_PAGE_NUM)
+#define FLASH_CMD_WRITE(page) (0x5A000001 + (((page) & 0x000003FF) << 8))
 
 void do_flash_write(void)
 {
+  volatile unsigned int *batch = VINTPTR(USER_BATCH);
+  volatile unsigned int *data = batch + 2;
+  unsigned long page = batch[0];
+  unsigned long count = batch[1];
   unsigned long i;
 
-  while (!(FLASH_STATUS_REG & 0x1));
+  while (count--)
+    {
+      while (!(FLASH_STATUS_REG & 0x1));
+
+      for (i = 0; i < 64; i++)
+        FLASH_BASE[(page*64)+i] = data[i];
 
-  for (i = 0; i < 64; i++)
-    FLASH_BASE[(USER_PAGE_NUM*64)+i] = USER_PAGE[i];
+      FLASH_CMD_REG = FLASH_CMD_WRITE(page);
 
-  FLASH_CMD_REG = FLASH_CMD_WRITE;
+      page++;
+      data += 64;
+    }
 
-  while (!(FLASH_STATUS_REG & 0x1));
+  /* Don't wait for the last page to be programmed. The flash
+   * controller finishes it on its own while SAM-BA, which runs from
+   * ROM, receives the next batch from the host.
+   */
 }
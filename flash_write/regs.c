@@ -0,0 +1,51 @@
+/**
+ * NXT bootstrap interface; NXT onboard register access routine.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+
+#define VINTPTR(addr) ((volatile unsigned int *)(addr))
+#define VINT(addr) (*(VINTPTR(addr)))
+
+/* Runs a list of word accesses, mostly to peripheral registers. Like
+ * csum.c, it runs wherever it is loaded, with its mailbox 1k after
+ * its start. The mailbox holds the access count, then the addresses,
+ * then a value per access. Addresses with their low bit set are
+ * written with their value, the others are read into it.
+ */
+#define REGS_MAILBOX_OFFSET 0x400
+#define REGS_WRITE 1
+
+void do_regs(unsigned long base)
+{
+  volatile unsigned int *mailbox = VINTPTR(base + REGS_MAILBOX_OFFSET);
+  unsigned long n = mailbox[0];
+  volatile unsigned int *addrs = mailbox + 1;
+  volatile unsigned int *values = addrs + n;
+  unsigned long i, addr;
+
+  for (i = 0; i < n; i++)
+    {
+      addr = addrs[i];
+      if (addr & REGS_WRITE)
+        VINT(addr & ~3) = values[i];
+      else
+        values[i] = VINT(addr);
+    }
+}
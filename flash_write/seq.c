@@ -0,0 +1,109 @@
+/**
+ * NXT bootstrap interface; NXT onboard flash controller sequencer.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#define VINTPTR(addr) ((volatile unsigned int *)(addr))
+#define VINT(addr) (*(VINTPTR(addr)))
+
+/* The mailbox sits 1k after the start of the routine. It holds the
+ * number of operations, the status word, and the operations
+ * themselves, three words each: opcode and two arguments.
+ */
+#define SEQ_MAILBOX_OFFSET 0x400
+
+#define SEQ_SET_FMR    1 /* arg0: flash mode register value */
+#define SEQ_COMMAND    2 /* arg0: flash command register value */
+#define SEQ_WRITE_PAGE 3 /* arg0: page number, arg1: page data address */
+
+/* The status word: set when the sequence ends, the number of
+ * operations completed, and the error bits of the flash status
+ * register. The sequence stops at the first error.
+ */
+#define SEQ_DONE 0x80000000
+#define SEQ_N_DONE_SHIFT 8
+
+#define FLASH_BASE VINTPTR(0x00100000)
+#define FLASH_MODE_REG VINT(0xFFFFFF60)
+#define FLASH_CMD_REG VINT(0xFFFFFF64)
+#define FLASH_STATUS_REG VINT(0xFFFFFF68)
+#define FLASH_STATUS_ERRORS 0xC /* LOCKE, PROGE */
+#define FLASH_CMD_WRITE(page) (0x5A000001 + (((page) & 0x000003FF) << 8))
+
+static unsigned int
+wait_ready(void)
+{
+  unsigned int status;
+
+  /* Reading the status register clears the error bits, so keep the
+   * ones seen while waiting.
+   */
+  unsigned int errors = 0;
+  do
+    {
+      status = FLASH_STATUS_REG;
+      errors |= status & FLASH_STATUS_ERRORS;
+    } while (!(status & 0x1));
+
+  return errors;
+}
+
+void do_flash_seq(unsigned long base)
+{
+  volatile unsigned int *mailbox = VINTPTR(base + SEQ_MAILBOX_OFFSET);
+  volatile unsigned int *op = mailbox + 2;
+  unsigned long n_ops = mailbox[0];
+  unsigned long done, i;
+  unsigned int errors;
+
+  /* Errors left over from before the sequence aren't its own, and
+   * would stop it before the first operation. Reading them clears
+   * them.
+   */
+  wait_ready();
+  errors = 0;
+
+  for (done = 0; done < n_ops && !errors; done++, op += 3)
+    {
+      switch (op[0])
+        {
+        case SEQ_SET_FMR:
+          FLASH_MODE_REG = op[1];
+          break;
+
+        case SEQ_COMMAND:
+          FLASH_CMD_REG = op[1];
+          break;
+
+        case SEQ_WRITE_PAGE:
+          {
+            volatile unsigned int *src = VINTPTR(op[2]);
+
+            for (i = 0; i < 64; i++)
+              FLASH_BASE[(op[1]*64)+i] = src[i];
+            FLASH_CMD_REG = FLASH_CMD_WRITE(op[1]);
+          }
+          break;
+        }
+
+      errors = wait_ready();
+    }
+
+  mailbox[1] = SEQ_DONE | (done << SEQ_N_DONE_SHIFT) | errors;
+}
@@ -0,0 +1,79 @@
+/**
+ * NXT bootstrap interface; NXT onboard decompressor.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/* The compressed stream lives 1k after the start of the routine. It
+ * starts with the destination address and the length of the
+ * compressed data, followed by the data itself.
+ *
+ * The data is a series of sequences. Each sequence starts with a
+ * token byte, whose high nibble is the number of literal bytes and
+ * whose low nibble is the match length minus 4. A nibble of 15 is
+ * extended by the following bytes, up to and including the first one
+ * that is not 255. The literals follow, then a little-endian 16 bit
+ * offset back into the output for the match. The last sequence has
+ * literals only.
+ */
+#define UNLZ_STREAM_OFFSET 0x400
+
+static unsigned long
+read_length(const unsigned char **src, unsigned long len)
+{
+  unsigned char b;
+
+  if (len == 15)
+    do
+      {
+        b = *(*src)++;
+        len += b;
+      } while (b == 255);
+
+  return len;
+}
+
+void do_unlz(unsigned long base)
+{
+  const unsigned int *desc = (const unsigned int *)(base + UNLZ_STREAM_OFFSET);
+  unsigned char *dst = (unsigned char *)desc[0];
+  const unsigned char *src = (const unsigned char *)(desc + 2);
+  const unsigned char *end = src + desc[1];
+
+  while (src < end)
+    {
+      unsigned char token = *src++;
+      unsigned long len, offset;
+      const unsigned char *match;
+
+      len = read_length(&src, token >> 4);
+      while (len--)
+        *dst++ = *src++;
+
+      if (src >= end)
+        break;
+
+      offset = src[0] | (src[1] << 8);
+      src += 2;
+
+      len = read_length(&src, token & 0xF) + 4;
+      match = dst - offset;
+      while (len--)
+        *dst++ = *match++;
+    }
+}
@@ -0,0 +1,403 @@
+/**
+ * NXT bootstrap interface; firmware image file formats.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "samba.h"
+#include "firmware.h"
+#include "image.h"
+
+#define IMAGE_RAW_BASE 0x00100000
+
+/* The parts of ELF32 libnxt cares about: the program headers saying
+ * what to load where.
+ */
+#define ELF_HEADER_SIZE 52
+#define ELF_PHOFF       0x1C
+#define ELF_PHENTSIZE   0x2A
+#define ELF_PHNUM       0x2C
+#define ELF_MACHINE     0x12
+#define ELF_MACHINE_ARM 40
+#define ELF_PT_LOAD     1
+#define ELF_PHDR_SIZE   32
+
+/* Longest HEX or S-record line, data included. */
+#define RECORD_MAX 600
+
+
+static const char *format_names[] = {
+  "raw binary", "ELF", "Intel HEX", "S-record",
+};
+
+
+const char *
+nxt_image_format_name(nxt_image_format_t format)
+{
+  return format_names[format];
+}
+
+
+static nxt_image_segment_t *
+nxt_image_add_segment(nxt_image_t *image, nxt_addr_t addr, int len,
+                      char *data)
+{
+  nxt_image_segment_t *seg;
+
+  seg = realloc(image->segments,
+                (image->n_segments + 1) * sizeof(*image->segments));
+  if (seg == NULL)
+    return NULL;
+
+  image->segments = seg;
+  seg += image->n_segments++;
+  seg->addr = addr;
+  seg->len = len;
+  seg->data = data;
+  return seg;
+}
+
+
+/* Records of the text formats mostly follow on from each other, so
+ * they are gathered into as few segments as possible.
+ */
+static nxt_error_t
+nxt_image_add_record(nxt_image_t *image, nxt_addr_t addr,
+                     unsigned char *data, int len)
+{
+  nxt_image_segment_t *seg = NULL;
+  char *buf;
+
+  if (len == 0)
+    return NXT_OK;
+
+  if (image->n_segments > 0)
+    seg = image->segments + image->n_segments - 1;
+  if (seg == NULL || seg->addr + seg->len != addr)
+    {
+      seg = nxt_image_add_segment(image, addr, 0, NULL);
+      if (seg == NULL)
+        return NXT_FILE_ERROR;
+    }
+
+  buf = realloc(seg->data, seg->len + len);
+  if (buf == NULL)
+    return NXT_FILE_ERROR;
+
+  memcpy(buf + seg->len, data, len);
+  seg->data = buf;
+  seg->len += len;
+  return NXT_OK;
+}
+
+
+static int
+load_half(const char *buf)
+{
+  return (unsigned char)buf[0] | ((unsigned char)buf[1] << 8);
+}
+
+
+static nxt_error_t
+nxt_image_parse_elf(nxt_image_t *image)
+{
+  char *elf = image->map;
+  int phoff, phentsize, phnum, i;
+
+  if (image->map_len < ELF_HEADER_SIZE || elf[4] != 1 || elf[5] != 1 ||
+      load_half(elf + ELF_MACHINE) != ELF_MACHINE_ARM)
+    return NXT_INVALID_FIRMWARE;
+
+  phoff = nxt_load_word(elf + ELF_PHOFF);
+  phentsize = load_half(elf + ELF_PHENTSIZE);
+  phnum = load_half(elf + ELF_PHNUM);
+
+  if (phentsize < ELF_PHDR_SIZE || phoff < 0 ||
+      phoff > image->map_len || phnum > (image->map_len - phoff) / phentsize)
+    return NXT_INVALID_FIRMWARE;
+
+  for (i = 0; i < phnum; i++)
+    {
+      char *ph = elf + phoff + i * phentsize;
+      nxt_word_t offset = nxt_load_word(ph + 4);
+      nxt_word_t paddr = nxt_load_word(ph + 12);
+      nxt_word_t filesz = nxt_load_word(ph + 16);
+
+      /* What is loaded goes to the physical address: initialized data
+       * is stored in flash, and copied to RAM by the startup code.
+       */
+      if (nxt_load_word(ph) != ELF_PT_LOAD || filesz == 0)
+        continue;
+
+      if (offset > image->map_len || filesz > image->map_len - offset)
+        return NXT_INVALID_FIRMWARE;
+      if (nxt_image_add_segment(image, paddr, filesz, elf + offset) == NULL)
+        return NXT_FILE_ERROR;
+    }
+
+  return NXT_OK;
+}
+
+
+static int
+hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+
+/* Decode the hex digits of a record, from p up to the end of its
+ * line. Returns the number of bytes, or -1 if the line isn't hex.
+ * *next is set to the start of the next line.
+ */
+static int
+hex_decode(char *p, char *end, unsigned char *buf, char **next)
+{
+  int n = 0;
+
+  while (p < end && *p != '\r' && *p != '\n')
+    {
+      int hi, lo;
+
+      if (end - p < 2 || n == RECORD_MAX)
+        return -1;
+      hi = hex_digit(p[0]);
+      lo = hex_digit(p[1]);
+      if (hi < 0 || lo < 0)
+        return -1;
+
+      buf[n++] = (hi << 4) | lo;
+      p += 2;
+    }
+
+  while (p < end && (*p == '\r' || *p == '\n'))
+    p++;
+  *next = p;
+  return n;
+}
+
+
+static nxt_error_t
+nxt_image_parse_ihex(nxt_image_t *image)
+{
+  char *p = image->map, *end = image->map + image->map_len;
+  unsigned char rec[RECORD_MAX];
+  nxt_addr_t base = 0;
+  int n, len, sum, i;
+
+  while (p < end)
+    {
+      if (*p++ != ':')
+        return NXT_INVALID_FIRMWARE;
+
+      // Count, address, type, data, checksum
+      n = hex_decode(p, end, rec, &p);
+      if (n < 5 || rec[0] != n - 5)
+        return NXT_INVALID_FIRMWARE;
+      for (sum = 0, i = 0; i < n; i++)
+        sum += rec[i];
+      if (sum & 0xFF)
+        return NXT_INVALID_FIRMWARE;
+
+      len = rec[0];
+      switch (rec[3])
+        {
+        case 0x00:
+          NXT_ERR(nxt_image_add_record(image, base + (rec[1] << 8 | rec[2]),
+                                       rec + 4, len));
+          break;
+
+        case 0x01:
+          return NXT_OK;
+
+        case 0x02:
+          if (len != 2)
+            return NXT_INVALID_FIRMWARE;
+          base = (rec[4] << 8 | rec[5]) << 4;
+          break;
+
+        case 0x04:
+          if (len != 2)
+            return NXT_INVALID_FIRMWARE;
+          base = (rec[4] << 8 | rec[5]) << 16;
+          break;
+
+        case 0x03:
+        case 0x05:
+          // Start addresses mean nothing to the flash
+          break;
+
+        default:
+          return NXT_INVALID_FIRMWARE;
+        }
+    }
+
+  // The end of file record is mandatory
+  return NXT_INVALID_FIRMWARE;
+}
+
+
+static nxt_error_t
+nxt_image_parse_srec(nxt_image_t *image)
+{
+  char *p = image->map, *end = image->map + image->map_len;
+  unsigned char rec[RECORD_MAX];
+  nxt_addr_t addr;
+  int n, type, addr_len, sum, i;
+
+  while (p < end)
+    {
+      if (end - p < 2 || p[0] != 'S' || hex_digit(p[1]) < 0 ||
+          hex_digit(p[1]) > 9)
+        return NXT_INVALID_FIRMWARE;
+      type = p[1] - '0';
+
+      // Count, address, data, checksum
+      n = hex_decode(p + 2, end, rec, &p);
+      if (n < 1 || rec[0] != n - 1)
+        return NXT_INVALID_FIRMWARE;
+      for (sum = 0, i = 0; i < n; i++)
+        sum += rec[i];
+      if ((sum & 0xFF) != 0xFF)
+        return NXT_INVALID_FIRMWARE;
+
+      switch (type)
+        {
+        case 1: case 2: case 3:
+          addr_len = type + 1;
+          if (n < addr_len + 2)
+            return NXT_INVALID_FIRMWARE;
+          for (addr = 0, i = 0; i < addr_len; i++)
+            addr = addr << 8 | rec[1 + i];
+          NXT_ERR(nxt_image_add_record(image, addr, rec + 1 + addr_len,
+                                       n - addr_len - 2));
+          break;
+
+        case 7: case 8: case 9:
+          return NXT_OK;
+
+        case 0: case 5: case 6:
+          // Header and record counts
+          break;
+
+        default:
+          return NXT_INVALID_FIRMWARE;
+        }
+    }
+
+  // Files may just stop without a termination record
+  return NXT_OK;
+}
+
+
+/* Text formats are told apart from raw binaries by a first line made
+ * only of hex digits after the record mark.
+ */
+static int
+nxt_image_is_text(char *map, int len, char mark)
+{
+  int i;
+
+  if (len < 2 || map[0] != mark)
+    return 0;
+
+  for (i = 1; i < len && map[i] != '\r' && map[i] != '\n'; i++)
+    if (hex_digit(map[i]) < 0)
+      return 0;
+
+  return i >= 10;
+}
+
+
+nxt_error_t
+nxt_image_load(char *path, nxt_image_t **image)
+{
+  nxt_image_t *img;
+  nxt_error_t err;
+
+  img = calloc(1, sizeof(*img));
+  if (img == NULL)
+    return NXT_FILE_ERROR;
+
+  err = nxt_map_file(path, &img->map, &img->map_len);
+  if (err)
+    {
+      free(img);
+      return err;
+    }
+
+  if (img->map_len >= 4 && memcmp(img->map, "\177ELF", 4) == 0)
+    {
+      img->format = NXT_IMAGE_ELF;
+      err = nxt_image_parse_elf(img);
+    }
+  else if (nxt_image_is_text(img->map, img->map_len, ':'))
+    {
+      img->format = NXT_IMAGE_IHEX;
+      err = nxt_image_parse_ihex(img);
+    }
+  else if (nxt_image_is_text(img->map, img->map_len, 'S'))
+    {
+      img->format = NXT_IMAGE_SREC;
+      err = nxt_image_parse_srec(img);
+    }
+  else
+    {
+      img->format = NXT_IMAGE_RAW;
+      if (img->map_len > 0 &&
+          nxt_image_add_segment(img, IMAGE_RAW_BASE, img->map_len,
+                                img->map) == NULL)
+        err = NXT_FILE_ERROR;
+    }
+
+  if (err)
+    {
+      nxt_image_free(img);
+      return err;
+    }
+
+  *image = img;
+  return NXT_OK;
+}
+
+
+void
+nxt_image_free(nxt_image_t *image)
+{
+  int i;
+
+  // The text formats' segments are decoded copies
+  if (image->format == NXT_IMAGE_IHEX || image->format == NXT_IMAGE_SREC)
+    for (i = 0; i < image->n_segments; i++)
+      free(image->segments[i].data);
+
+  free(image->segments);
+  nxt_unmap_file(image->map, image->map_len);
+  free(image);
+}
@@ -0,0 +1,68 @@
+/**
+ * NXT bootstrap interface; firmware image file formats.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include "error.h"
+#include "samba.h"
+
+typedef enum
+{
+  NXT_IMAGE_RAW,   /* A flat binary, starting at the beginning of flash */
+  NXT_IMAGE_ELF,
+  NXT_IMAGE_IHEX,
+  NXT_IMAGE_SREC,
+} nxt_image_format_t;
+
+/* A run of bytes to put at addr. */
+typedef struct
+{
+  nxt_addr_t addr;
+  int len;
+  char *data;
+} nxt_image_segment_t;
+
+/* An image file, as the pieces of data it places in the NXT's memory.
+ * Raw and ELF images point into the mapped file; HEX and S-record
+ * ones are decoded into memory. Segments are in file order, and may
+ * overlap.
+ */
+typedef struct
+{
+  nxt_image_format_t format;
+  int n_segments;
+  nxt_image_segment_t *segments;
+
+  char *map;
+  int map_len;
+} nxt_image_t;
+
+/* Load an image file, telling the format from its contents. Returns
+ * NXT_INVALID_FIRMWARE for files that look like one of the formats
+ * but don't parse.
+ */
+nxt_error_t nxt_image_load(char *path, nxt_image_t **image);
+void nxt_image_free(nxt_image_t *image);
+
+const char *nxt_image_format_name(nxt_image_format_t format);
+
+#endif /* __IMAGE_H__ */
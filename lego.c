@@ -0,0 +1,536 @@
+/**
+ * NXT bootstrap interface; LEGO firmware system commands.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+#include "lego.h"
+
+/* Commands start with their type and opcode, and replies with the
+ * reply type, the opcode they answer and a status byte.
+ */
+enum nxt_lego_types
+{
+  LEGO_SYSTEM = 0x01,
+  LEGO_REPLY = 0x02,
+  LEGO_SYSTEM_NO_REPLY = 0x81,
+};
+
+enum nxt_lego_opcodes
+{
+  LEGO_OPEN_READ = 0x80,
+  LEGO_OPEN_WRITE = 0x81,
+  LEGO_READ = 0x82,
+  LEGO_WRITE = 0x83,
+  LEGO_CLOSE = 0x84,
+  LEGO_DELETE = 0x85,
+  LEGO_FIND_FIRST = 0x86,
+  LEGO_FIND_NEXT = 0x87,
+  LEGO_OPEN_WRITE_LINEAR = 0x89,
+  LEGO_OPEN_WRITE_DATA = 0x8B,
+  LEGO_DELETE_USER_FLASH = 0xA0,
+};
+
+/* Data carried by a read reply, and by a write command. */
+#define LEGO_READ_MAX  (NXT_PACKET_SIZE - 6)
+#define LEGO_WRITE_MAX (NXT_PACKET_SIZE - 3)
+
+/* Replies the brick can hold until the host reads them. */
+#define LEGO_READ_WINDOW 2
+
+/* Erasing the user flash takes the brick several seconds. */
+#define LEGO_ERASE_TIMEOUT 30000
+
+
+int
+nxt_lego_status(nxt_t *nxt)
+{
+  return nxt_lego_state_of(nxt)->status;
+}
+
+
+const char *
+nxt_lego_str_status(int status)
+{
+  switch (status)
+    {
+    case 0x00: return "Success";
+    case 0x81: return "No more handles";
+    case 0x82: return "No space";
+    case 0x83: return "No more files";
+    case 0x84: return "End of file expected";
+    case 0x85: return "End of file";
+    case 0x86: return "Not a linear file";
+    case 0x87: return "File not found";
+    case 0x88: return "Handle already closed";
+    case 0x89: return "No linear space";
+    case 0x8A: return "Undefined error";
+    case 0x8B: return "File is busy";
+    case 0x8C: return "No write buffers";
+    case 0x8D: return "Append not possible";
+    case 0x8E: return "File is full";
+    case 0x8F: return "File exists";
+    case 0x90: return "Module not found";
+    case 0x91: return "Out of boundary";
+    case 0x92: return "Illegal file name";
+    case 0x93: return "Illegal handle";
+    case NXT_LEGO_BAD_REPLY: return "Malformed reply";
+    default: return "Unknown status";
+    }
+}
+
+
+static nxt_error_t
+nxt_lego_fail(nxt_t *nxt, int status)
+{
+  nxt_lego_state_of(nxt)->status = status;
+  return NXT_LEGO_ERROR;
+}
+
+
+/* Close a file after err, keeping the status that explains it. */
+static void
+nxt_lego_abandon(nxt_t *nxt, int handle, const char *name)
+{
+  int status = nxt_lego_status(nxt);
+
+  nxt_lego_close(nxt, handle);
+  if (name != NULL)
+    nxt_lego_delete(nxt, name);
+  nxt_lego_state_of(nxt)->status = status;
+}
+
+
+/* Wait for the reply to a command, which must be at least len bytes
+ * long. The whole packet lands in reply.
+ */
+static nxt_error_t
+nxt_lego_reply(nxt_t *nxt, int opcode, char *reply, int len)
+{
+  int n_read;
+
+  NXT_ERR(nxt_recv_buf_partial(nxt, reply, NXT_PACKET_SIZE, &n_read));
+
+  if (n_read < 3 || reply[0] != LEGO_REPLY ||
+      (unsigned char)reply[1] != opcode)
+    return nxt_lego_fail(nxt, NXT_LEGO_BAD_REPLY);
+  if (reply[2] != 0)
+    return nxt_lego_fail(nxt, (unsigned char)reply[2]);
+  if (n_read < len)
+    return nxt_lego_fail(nxt, NXT_LEGO_BAD_REPLY);
+
+  nxt_lego_state_of(nxt)->status = 0;
+  return NXT_OK;
+}
+
+
+/* Send a command of len bytes from cmd, and wait for its reply. */
+static nxt_error_t
+nxt_lego_command(nxt_t *nxt, char *cmd, int len, char *reply, int reply_len)
+{
+  NXT_ERR(nxt_send_buf(nxt, cmd, len));
+  return nxt_lego_reply(nxt, (unsigned char)cmd[1], reply, reply_len);
+}
+
+
+/* Start a command taking a file name, zero padded. */
+static nxt_error_t
+nxt_lego_name_command(nxt_t *nxt, char *cmd, int opcode, const char *name)
+{
+  if (strlen(name) >= NXT_LEGO_NAME_LEN)
+    return nxt_lego_fail(nxt, NXT_LEGO_ILLEGAL_FILENAME);
+
+  memset(cmd, 0, NXT_PACKET_SIZE);
+  cmd[0] = LEGO_SYSTEM;
+  cmd[1] = opcode;
+  strcpy(cmd + 2, name);
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_lego_open_read(nxt_t *nxt, const char *name, int *handle,
+                   nxt_word_t *size)
+{
+  char buf[NXT_PACKET_SIZE];
+
+  NXT_ERR(nxt_lego_name_command(nxt, buf, LEGO_OPEN_READ, name));
+  NXT_ERR(nxt_lego_command(nxt, buf, 2 + NXT_LEGO_NAME_LEN, buf, 8));
+
+  *handle = (unsigned char)buf[3];
+  *size = nxt_load_word(buf + 4);
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_lego_open_write(nxt_t *nxt, const char *name, nxt_word_t size,
+                    nxt_lego_write_mode mode, int *handle)
+{
+  static const int opcodes[] = {
+    LEGO_OPEN_WRITE, LEGO_OPEN_WRITE_LINEAR, LEGO_OPEN_WRITE_DATA
+  };
+  char buf[NXT_PACKET_SIZE];
+
+  NXT_ERR(nxt_lego_name_command(nxt, buf, opcodes[mode], name));
+  nxt_store_word(buf + 2 + NXT_LEGO_NAME_LEN, size);
+  NXT_ERR(nxt_lego_command(nxt, buf, 6 + NXT_LEGO_NAME_LEN, buf, 4));
+
+  *handle = (unsigned char)buf[3];
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_lego_close(nxt_t *nxt, int handle)
+{
+  char buf[NXT_PACKET_SIZE] = { LEGO_SYSTEM, LEGO_CLOSE, handle };
+
+  return nxt_lego_command(nxt, buf, 3, buf, 4);
+}
+
+
+nxt_error_t
+nxt_lego_delete(nxt_t *nxt, const char *name)
+{
+  char buf[NXT_PACKET_SIZE];
+
+  NXT_ERR(nxt_lego_name_command(nxt, buf, LEGO_DELETE, name));
+  return nxt_lego_command(nxt, buf, 2 + NXT_LEGO_NAME_LEN, buf, 3);
+}
+
+
+static void
+nxt_lego_read_command(char *buf, int handle, int n)
+{
+  buf[0] = LEGO_SYSTEM;
+  buf[1] = LEGO_READ;
+  buf[2] = handle;
+  buf[3] = n & 0xFF;
+  buf[4] = n >> 8;
+}
+
+
+nxt_error_t
+nxt_lego_read(nxt_t *nxt, int handle, char *buf, size_t len)
+{
+  char pkt[NXT_PACKET_SIZE];
+  size_t asked = 0, got = 0;
+  int in_flight = 0;
+  nxt_error_t err = NXT_OK;
+
+  while (got < len)
+    {
+      int n = len - got < LEGO_READ_MAX ? len - got : LEGO_READ_MAX;
+
+      // Keep the next read waiting behind this one
+      while (in_flight < LEGO_READ_WINDOW && asked < len)
+        {
+          int k = len - asked < LEGO_READ_MAX ? len - asked : LEGO_READ_MAX;
+
+          nxt_lego_read_command(pkt, handle, k);
+          NXT_ERR(nxt_send_buf(nxt, pkt, 5));
+          asked += k;
+          in_flight++;
+        }
+
+      err = nxt_lego_reply(nxt, LEGO_READ, pkt, 6 + n);
+      in_flight--;
+      if (err == NXT_OK && (pkt[4] & 0xFF) + ((pkt[5] & 0xFF) << 8) != n)
+        err = nxt_lego_fail(nxt, NXT_LEGO_BAD_REPLY);
+      if (err != NXT_OK)
+        break;
+
+      memcpy(buf + got, pkt + 6, n);
+      got += n;
+    }
+
+  // Take in the replies still coming, to leave the link usable
+  while (err != NXT_OK && in_flight-- > 0)
+    nxt_recv_buf(nxt, pkt, NXT_PACKET_SIZE);
+
+  return err;
+}
+
+
+nxt_error_t
+nxt_lego_write(nxt_t *nxt, int handle, const char *buf, size_t len)
+{
+  char pkt[NXT_PACKET_SIZE];
+  size_t done = 0;
+  int unacked = 0;
+
+  while (done < len)
+    {
+      int n = len - done < LEGO_WRITE_MAX ? len - done : LEGO_WRITE_MAX;
+      int ack = done + n == len || ++unacked == NXT_LEGO_WRITE_ACK;
+
+      pkt[0] = ack ? LEGO_SYSTEM : LEGO_SYSTEM_NO_REPLY;
+      pkt[1] = LEGO_WRITE;
+      pkt[2] = handle;
+      memcpy(pkt + 3, buf + done, n);
+      NXT_ERR(nxt_send_buf(nxt, pkt, 3 + n));
+      done += n;
+
+      /* The packets before it went unanswered, so a failure among
+       * them shows up here, as the file won't take any more.
+       */
+      if (ack)
+        {
+          NXT_ERR(nxt_lego_reply(nxt, LEGO_WRITE, pkt, 6));
+          if ((pkt[4] & 0xFF) + ((pkt[5] & 0xFF) << 8) != n)
+            return nxt_lego_fail(nxt, NXT_LEGO_BAD_REPLY);
+          unacked = 0;
+        }
+    }
+
+  return NXT_OK;
+}
+
+
+/* Files the firmware uses in place must be linear, and the files
+ * programs log to must stay data files so they can be appended to.
+ */
+static nxt_lego_write_mode
+nxt_lego_mode_for(const char *name)
+{
+  static const char *linear[] = { ".rxe", ".rpg", ".rtm", ".ric", ".rso" };
+  static const char *data[] = { ".rdt", ".log" };
+  const char *ext = strrchr(name, '.');
+  int i;
+
+  for (i = 0; ext != NULL && i < sizeof(linear) / sizeof(*linear); i++)
+    if (strcasecmp(ext, linear[i]) == 0)
+      return NXT_LEGO_WRITE_LINEAR;
+
+  for (i = 0; ext != NULL && i < sizeof(data) / sizeof(*data); i++)
+    if (strcasecmp(ext, data[i]) == 0)
+      return NXT_LEGO_WRITE_DATA;
+
+  return NXT_LEGO_WRITE;
+}
+
+
+nxt_error_t
+nxt_lego_upload(nxt_t *nxt, const char *name, const char *buf, size_t len)
+{
+  nxt_error_t err;
+  int handle;
+
+  if (len > 0xFFFFFFFF)
+    return nxt_lego_fail(nxt, NXT_LEGO_NO_SPACE);
+
+  err = nxt_lego_delete(nxt, name);
+  if (err != NXT_OK && nxt_lego_status(nxt) != NXT_LEGO_FILE_NOT_FOUND)
+    return err;
+
+  NXT_ERR(nxt_lego_open_write(nxt, name, len, nxt_lego_mode_for(name),
+                              &handle));
+
+  err = nxt_lego_write(nxt, handle, buf, len);
+  if (err != NXT_OK)
+    {
+      // Don't leave half a file behind
+      nxt_lego_abandon(nxt, handle, name);
+      return err;
+    }
+
+  return nxt_lego_close(nxt, handle);
+}
+
+
+nxt_error_t
+nxt_lego_download(nxt_t *nxt, const char *name, char **buf, size_t *len)
+{
+  nxt_word_t size;
+  nxt_error_t err;
+  int handle;
+
+  NXT_ERR(nxt_lego_open_read(nxt, name, &handle, &size));
+
+  *buf = malloc(size ? size : 1);
+  if (*buf == NULL)
+    {
+      nxt_lego_abandon(nxt, handle, NULL);
+      return NXT_FILE_ERROR;
+    }
+
+  err = nxt_lego_read(nxt, handle, *buf, size);
+  if (err == NXT_OK)
+    err = nxt_lego_close(nxt, handle);
+  else
+    nxt_lego_abandon(nxt, handle, NULL);
+
+  if (err != NXT_OK)
+    {
+      free(*buf);
+      *buf = NULL;
+      return err;
+    }
+
+  *len = size;
+  return NXT_OK;
+}
+
+
+/* Take in a file found by a search, from a reply. */
+static nxt_error_t
+nxt_lego_add_file(nxt_lego_file_t **files, int *n_files, char *reply)
+{
+  nxt_lego_file_t *grown = realloc(*files, (*n_files + 1) * sizeof(**files));
+
+  if (grown == NULL)
+    return NXT_FILE_ERROR;
+  *files = grown;
+
+  memcpy(grown[*n_files].name, reply + 4, NXT_LEGO_NAME_LEN);
+  grown[*n_files].name[NXT_LEGO_NAME_LEN - 1] = '\0';
+  grown[*n_files].size = nxt_load_word(reply + 4 + NXT_LEGO_NAME_LEN);
+  (*n_files)++;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_lego_list(nxt_t *nxt, const char *pattern, nxt_lego_file_t **files,
+              int *n_files)
+{
+  char buf[NXT_PACKET_SIZE];
+  nxt_error_t err;
+  int handle;
+
+  *files = NULL;
+  *n_files = 0;
+
+  NXT_ERR(nxt_lego_name_command(nxt, buf, LEGO_FIND_FIRST, pattern));
+  err = nxt_lego_command(nxt, buf, 2 + NXT_LEGO_NAME_LEN, buf,
+                         8 + NXT_LEGO_NAME_LEN);
+
+  /* The search ends with a failed find, which also releases its
+   * handle.
+   */
+  while (err == NXT_OK)
+    {
+      handle = (unsigned char)buf[3];
+      err = nxt_lego_add_file(files, n_files, buf);
+      if (err != NXT_OK)
+        {
+          nxt_lego_abandon(nxt, handle, NULL);
+          break;
+        }
+
+      buf[0] = LEGO_SYSTEM;
+      buf[1] = LEGO_FIND_NEXT;
+      buf[2] = handle;
+      err = nxt_lego_command(nxt, buf, 3, buf, 8 + NXT_LEGO_NAME_LEN);
+    }
+
+  if (err == NXT_LEGO_ERROR &&
+      (nxt_lego_status(nxt) == NXT_LEGO_FILE_NOT_FOUND ||
+       nxt_lego_status(nxt) == NXT_LEGO_NO_MORE_FILES))
+    return NXT_OK;
+
+  free(*files);
+  *files = NULL;
+  *n_files = 0;
+  return err;
+}
+
+
+/* Copy a file to the host, so a defrag cut short can be recovered. */
+static nxt_error_t
+nxt_lego_backup(const char *dir, const char *name, const char *buf,
+                size_t len)
+{
+  char path[PATH_MAX];
+  FILE *f;
+  int ok;
+
+  if (strchr(name, '/') != NULL ||
+      snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path))
+    return NXT_FILE_ERROR;
+
+  f = fopen(path, "wb");
+  if (f == NULL)
+    return NXT_FILE_ERROR;
+
+  ok = fwrite(buf, 1, len, f) == len;
+  if (fclose(f) != 0 || !ok)
+    return NXT_FILE_ERROR;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_lego_defrag(nxt_t *nxt, const char *backup_dir)
+{
+  char erase[2] = { LEGO_SYSTEM, LEGO_DELETE_USER_FLASH };
+  char reply[NXT_PACKET_SIZE];
+  nxt_lego_file_t *files;
+  char **data;
+  size_t *lens;
+  int timeout_ms = nxt_get_timeout(nxt);
+  nxt_error_t err;
+  int i, n_files;
+
+  NXT_ERR(nxt_lego_list(nxt, "*.*", &files, &n_files));
+
+  data = calloc(n_files + 1, sizeof(*data));
+  lens = calloc(n_files + 1, sizeof(*lens));
+  err = data && lens ? NXT_OK : NXT_FILE_ERROR;
+
+  // Nothing is erased unless every file made it into memory, and
+  // onto the host when asked
+  for (i = 0; i < n_files && err == NXT_OK; i++)
+    {
+      err = nxt_lego_download(nxt, files[i].name, &data[i], &lens[i]);
+      if (err == NXT_OK && backup_dir != NULL)
+        err = nxt_lego_backup(backup_dir, files[i].name, data[i], lens[i]);
+    }
+
+  if (err == NXT_OK)
+    {
+      if (timeout_ms != 0 && timeout_ms < LEGO_ERASE_TIMEOUT)
+        nxt_set_timeout(nxt, LEGO_ERASE_TIMEOUT);
+      err = nxt_lego_command(nxt, erase, 2, reply, 3);
+      nxt_set_timeout(nxt, timeout_ms);
+    }
+
+  for (i = 0; i < n_files && err == NXT_OK; i++)
+    err = nxt_lego_upload(nxt, files[i].name, data[i], lens[i]);
+
+  for (i = 0; data != NULL && i < n_files; i++)
+    free(data[i]);
+  free(data);
+  free(lens);
+  free(files);
+
+  return err;
+}
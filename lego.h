@@ -0,0 +1,122 @@
+/**
+ * NXT bootstrap interface; LEGO firmware system commands.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __LEGO_H__
+#define __LEGO_H__
+
+#include <stddef.h>
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+
+/* The file commands of the official LEGO firmware, for handles found
+ * running LEGO and opened on NXT_LEGO_INTERFACE. Commands and replies
+ * are a packet each.
+ *
+ * When the brick refuses a command, calls fail with NXT_LEGO_ERROR,
+ * and nxt_lego_status() gives the status byte it answered with.
+ */
+#define NXT_LEGO_INTERFACE 0
+
+/* File names are at most 19 characters, in 15.3 form. */
+#define NXT_LEGO_NAME_LEN 20
+
+/* Status bytes of the replies. */
+#define NXT_LEGO_NO_MORE_HANDLES  0x81
+#define NXT_LEGO_NO_SPACE         0x82
+#define NXT_LEGO_NO_MORE_FILES    0x83
+#define NXT_LEGO_END_OF_FILE      0x85
+#define NXT_LEGO_FILE_NOT_FOUND   0x87
+#define NXT_LEGO_NO_LINEAR_SPACE  0x89
+#define NXT_LEGO_FILE_EXISTS      0x8F
+#define NXT_LEGO_ILLEGAL_FILENAME 0x92
+#define NXT_LEGO_BAD_REPLY        -1 /* A reply that made no sense */
+
+int nxt_lego_status(nxt_t *nxt);
+const char *nxt_lego_str_status(int status);
+
+/* How files are written. Programs, pictures and sounds are used in
+ * place, and must be linear: in consecutive flash sectors. Data files
+ * can be appended to later.
+ */
+typedef enum {
+  NXT_LEGO_WRITE,
+  NXT_LEGO_WRITE_LINEAR,
+  NXT_LEGO_WRITE_DATA,
+} nxt_lego_write_mode;
+
+nxt_error_t nxt_lego_open_read(nxt_t *nxt, const char *name, int *handle,
+                               nxt_word_t *size);
+nxt_error_t nxt_lego_open_write(nxt_t *nxt, const char *name,
+                                nxt_word_t size, nxt_lego_write_mode mode,
+                                int *handle);
+nxt_error_t nxt_lego_close(nxt_t *nxt, int handle);
+nxt_error_t nxt_lego_delete(nxt_t *nxt, const char *name);
+
+/* Read or write len bytes of an open file. The transfer is pipelined:
+ * writes go out without waiting for replies, but for one in every
+ * NXT_LEGO_WRITE_ACK packets and the last, which pace the stream and
+ * report errors. Reads keep a second read in flight, as the brick can
+ * hold two replies for the host.
+ */
+#define NXT_LEGO_WRITE_ACK 16
+
+nxt_error_t nxt_lego_read(nxt_t *nxt, int handle, char *buf, size_t len);
+nxt_error_t nxt_lego_write(nxt_t *nxt, int handle, const char *buf,
+                           size_t len);
+
+/* Whole files. Uploads replace any file of the same name, write
+ * programs, pictures and sounds linear, and .rdt and .log files as data
+ * files. Downloads return a malloc()ed buffer.
+ */
+nxt_error_t nxt_lego_upload(nxt_t *nxt, const char *name, const char *buf,
+                            size_t len);
+nxt_error_t nxt_lego_download(nxt_t *nxt, const char *name, char **buf,
+                              size_t *len);
+
+typedef struct {
+  char name[NXT_LEGO_NAME_LEN];
+  nxt_word_t size;
+} nxt_lego_file_t;
+
+/* List the files matching a pattern such as "*.rxe", or "*.*" for all
+ * of them. Returns a malloc()ed array, NULL when there are none.
+ */
+nxt_error_t nxt_lego_list(nxt_t *nxt, const char *pattern,
+                          nxt_lego_file_t **files, int *n_files);
+
+/* Gather the free space. The LEGO firmware can't move files, so all of
+ * them are read into memory, the user flash is erased, and they are
+ * uploaded again. Unless backup_dir is NULL, every file is first copied
+ * into that existing host directory, and nothing is erased if one
+ * can't be: it holds the only copy of the files still to be written
+ * back if the defrag fails half way.
+ */
+nxt_error_t nxt_lego_defrag(nxt_t *nxt, const char *backup_dir);
+
+/* Per-handle state, kept in the handle by lowlevel.c. */
+typedef struct {
+  int status;
+} nxt_lego_state_t;
+
+nxt_lego_state_t *nxt_lego_state_of(nxt_t *nxt);
+
+#endif /* __LEGO_H__ */
@@ -26,9 +26,47 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 #include <usb.h>
+#ifdef NXT_HAVE_LIBUSB1
+#include <libusb-1.0/libusb.h>
+#endif
 
 #include "lowlevel.h"
+#include "transport.h"
+#include "trace.h"
+#include "stats.h"
+#include "agent.h"
+#include "daemon.h"
+#include "request.h"
+#include "lego.h"
+#include "flash.h"
+
+#ifdef NXT_HAVE_LIBUSB1
+/* Asynchronous transport: OUT transfers are queued without waiting for
+ * completion, and an IN transfer is posted for each read, sized to it
+ * in whole packets. A longer one would go on waiting after a reply
+ * that fills its last packet, and collect the start of the next reply
+ * along with it.
+ */
+#define NXT_ASYNC_N_OUT 4
+#define NXT_ASYNC_PACKET 64
+
+struct nxt_async_in {
+  struct libusb_transfer *xfer;
+  int size;
+  int posted;
+  int done;
+  int want;
+  int pos;
+};
+#endif
+
+
+static const nxt_transport_t nxt_usb_transport;
+#ifdef NXT_HAVE_LIBUSB1
+static const nxt_transport_t nxt_async_transport;
+#endif
 
 
 const struct {
@@ -42,9 +80,37 @@ const struct {
 
 struct nxt_t {
   struct usb_device *dev;
+  int bus_num;
+  int dev_num;
   struct usb_dev_handle *hdl;
   nxt_firmware firmware;
   int interface;
+  char queue[NXT_PACKET_SIZE];
+  int queue_len;
+  int batch_depth;
+  int timeout_ms;
+  int retries;
+  int write_repeatable;      /* The write in progress can safely be retried */
+  const nxt_transport_t *transport;
+  void *transport_data;
+  nxt_trace_writer_t *trace;
+  nxt_agent_state_t agent;
+  nxt_request_queue_t requests;
+  nxt_lego_state_t lego;
+  nxt_flash_state_t flash;
+#ifndef NXT_NO_STATS
+  nxt_stats_t stats;
+#endif
+#ifdef NXT_HAVE_LIBUSB1
+  libusb_context *ctx;
+  libusb_device_handle *ahdl;
+  struct libusb_transfer *out[NXT_ASYNC_N_OUT];
+  int out_busy[NXT_ASYNC_N_OUT];
+  int out_size[NXT_ASYNC_N_OUT];
+  int out_next;
+  struct nxt_async_in in;
+  nxt_error_t async_err;
+#endif
 };
 
 
@@ -52,17 +118,111 @@ nxt_error_t nxt_init(nxt_t **nxt)
 {
   usb_init();
   *nxt = calloc(1, sizeof(**nxt));
+  if (*nxt != NULL)
+    {
+      (*nxt)->timeout_ms = NXT_DEFAULT_TIMEOUT;
+      (*nxt)->retries = NXT_DEFAULT_RETRIES;
+      (*nxt)->transport = &nxt_usb_transport;
+    }
 
   return NXT_OK;
 }
 
 
-nxt_error_t nxt_find(nxt_t *nxt)
+nxt_error_t
+nxt_init_transport(nxt_t **nxt, const nxt_transport_t *transport,
+                   void *data, nxt_firmware fw)
 {
-  struct usb_bus *busses, *bus;
+  NXT_ERR(nxt_init(nxt));
+  if (*nxt == NULL)
+    return NXT_CONFIGURATION_ERROR;
+
+  nxt_set_transport(*nxt, transport, data, fw);
+  return NXT_OK;
+}
+
+
+void
+nxt_set_transport(nxt_t *nxt, const nxt_transport_t *transport,
+                  void *data, nxt_firmware fw)
+{
+  nxt->transport = transport;
+  nxt->transport_data = data;
+  nxt->firmware = fw;
+}
+
+
+void *
+nxt_transport_data(nxt_t *nxt)
+{
+  return nxt->transport_data;
+}
+
+
+static int
+nxt_is_usb(nxt_t *nxt)
+{
+#ifdef NXT_HAVE_LIBUSB1
+  if (nxt->transport == &nxt_async_transport)
+    return 1;
+#endif
+  return nxt->transport == &nxt_usb_transport;
+}
+
+
+static int
+nxt_match_ids(int vendor_id, int product_id)
+{
+  int i;
+
+  for (i=0; i<N_FIRMWARES; i++)
+    if (vendor_id == nxt_usb_ids[i].vendor_id &&
+        product_id == nxt_usb_ids[i].product_id)
+      return i;
+
+  return -1;
+}
 
+
+static int
+nxt_match_firmware(struct usb_device *dev)
+{
+  return nxt_match_ids(dev->descriptor.idVendor, dev->descriptor.idProduct);
+}
+
+
+static void
+nxt_set_device(nxt_t *nxt, struct usb_device *dev, int fw)
+{
+  nxt->dev = dev;
+  // The bus directory name is only a number on Linux
+  nxt->bus_num = dev->bus->location;
+  nxt->dev_num = dev->devnum;
+  nxt->firmware = fw;
+}
+
+
+/* Refresh libusb's bus list. The scans may come before any nxt_init(),
+ * as when flashing every brick found, so libusb is set up here too.
+ */
+static void
+nxt_usb_scan(void)
+{
+  usb_init();
   usb_find_busses();
   usb_find_devices();
+}
+
+
+nxt_error_t nxt_find(nxt_t *nxt)
+{
+  struct usb_bus *busses, *bus;
+
+  // Bricks nxtd holds can only be reached through it
+  if (nxt_daemon_available())
+    return nxt_daemon_find(nxt, NULL, -1);
+
+  nxt_usb_scan();
 
   busses = usb_get_busses();
 
@@ -72,16 +232,13 @@ nxt_error_t nxt_find(nxt_t *nxt)
 
       for (dev = bus->devices; dev != NULL; dev = dev->next)
         {
-          int i;
-
-          for (i=0; i<N_FIRMWARES; i++)
-            if (dev->descriptor.idVendor == nxt_usb_ids[i].vendor_id &&
-                dev->descriptor.idProduct == nxt_usb_ids[i].product_id)
-              {
-                nxt->dev = dev;
-                nxt->firmware = i;
-                return NXT_OK;
-              }
+          int fw = nxt_match_firmware(dev);
+
+          if (fw >= 0)
+            {
+              nxt_set_device(nxt, dev, fw);
+              return NXT_OK;
+            }
         }
     }
 
@@ -90,74 +247,1392 @@ nxt_error_t nxt_find(nxt_t *nxt)
 
 
 nxt_error_t
-nxt_open(nxt_t *nxt, int interface)
+nxt_find_all(nxt_t ***nxts, int *n_nxts)
 {
-  int ret;
+  struct usb_bus *bus;
+  nxt_t **list = NULL;
+  int n = 0;
 
-  nxt->hdl = usb_open(nxt->dev);
+  if (nxt_daemon_available())
+    return nxt_daemon_find_all(nxts, n_nxts);
 
-  ret = usb_set_configuration(nxt->hdl, 1);
-  if (ret < 0)
+  nxt_usb_scan();
+
+  for (bus = usb_get_busses(); bus != NULL; bus = bus->next)
     {
-      usb_close(nxt->hdl);
-      return NXT_CONFIGURATION_ERROR;
+      struct usb_device *dev;
+
+      for (dev = bus->devices; dev != NULL; dev = dev->next)
+        {
+          int fw = nxt_match_firmware(dev);
+          nxt_t **grown;
+
+          if (fw < 0)
+            continue;
+
+          grown = realloc(list, (n + 1) * sizeof(*list));
+          if (grown == NULL)
+            break;
+          list = grown;
+
+          nxt_init(&list[n]);
+          if (list[n] == NULL)
+            break;
+          nxt_set_device(list[n], dev, fw);
+          n++;
+        }
     }
 
-  ret = usb_claim_interface(nxt->hdl, interface);
-  if (ret < 0)
+  if (n == 0)
     {
-      usb_close(nxt->hdl);
-      return NXT_IN_USE;
+      free(list);
+      return NXT_NOT_PRESENT;
     }
 
-  nxt->interface = interface;
-
+  *nxts = list;
+  *n_nxts = n;
   return NXT_OK;
 }
 
 
+void
+nxt_get_location(nxt_t *nxt, char *buf, int len)
+{
+#ifdef NXT_HAVE_LIBUSB1
+  libusb_context *ctx;
+  libusb_device **list;
+  int bus = nxt->bus_num;
+  ssize_t i, n;
+#endif
+
+  if (!nxt_is_usb(nxt))
+    {
+      if (nxt->transport->location != NULL)
+        nxt->transport->location(nxt, buf, len);
+      else
+        snprintf(buf, len, "%s", nxt->transport->name);
+      return;
+    }
+
+#ifdef NXT_HAVE_LIBUSB1
+  // Give the physical port path when libusb-1.0 can tell it
+  if (libusb_init(&ctx) == 0)
+    {
+      n = libusb_get_device_list(ctx, &list);
+      for (i = 0; i < n; i++)
+        if (libusb_get_bus_number(list[i]) == bus &&
+            libusb_get_device_address(list[i]) == nxt->dev_num)
+          {
+            uint8_t ports[7];
+            int j, pos, n_ports;
+
+            n_ports = libusb_get_port_numbers(list[i], ports, 7);
+            if (n_ports <= 0)
+              break;
+
+            pos = snprintf(buf, len, "%d-", bus);
+            for (j = 0; j < n_ports && pos < len; j++)
+              pos += snprintf(buf + pos, len - pos, j ? ".%d" : "%d",
+                              ports[j]);
+
+            libusb_free_device_list(list, 1);
+            libusb_exit(ctx);
+            return;
+          }
+      if (n >= 0)
+        libusb_free_device_list(list, 1);
+      libusb_exit(ctx);
+    }
+#endif
+
+  snprintf(buf, len, "%03d:%03d", nxt->bus_num, nxt->dev_num);
+}
+
+
+/* Locate the libusb 0.1 device at the bus address of the handle, for
+ * handles found without a bus scan.
+ */
+static nxt_error_t
+nxt_resolve_device(nxt_t *nxt)
+{
+  struct usb_bus *bus;
+
+  nxt_usb_scan();
+
+  for (bus = usb_get_busses(); bus != NULL; bus = bus->next)
+    {
+      struct usb_device *dev;
+
+      if (bus->location != nxt->bus_num)
+        continue;
+
+      for (dev = bus->devices; dev != NULL; dev = dev->next)
+        if (dev->devnum == nxt->dev_num)
+          {
+            nxt->dev = dev;
+            return NXT_OK;
+          }
+    }
+
+  return NXT_NOT_PRESENT;
+}
+
+
+static int
+nxt_read_sysfs_int(char *dir, char *attr, int base, int *value)
+{
+  char path[512], buf[32];
+  FILE *f;
+  int ok, n;
+
+  n = snprintf(path, sizeof(path), "%s/%s", dir, attr);
+  if (n < 0 || n >= (int)sizeof(path))
+    return -1;
+  f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+
+  ok = fgets(buf, sizeof(buf), f) != NULL;
+  fclose(f);
+  if (!ok)
+    return -1;
+
+  *value = strtol(buf, NULL, base);
+  return 0;
+}
+
+
 nxt_error_t
-nxt_close(nxt_t *nxt)
+nxt_find_path(nxt_t *nxt, char *path)
 {
-  usb_release_interface(nxt->hdl, nxt->interface);
-  usb_close(nxt->hdl);
-  free(nxt);
+  char dir[512];
+  int vendor_id, product_id, fw, n;
+
+  if (nxt_daemon_available())
+    return nxt_daemon_find(nxt, path, -1);
+
+  // "bus:device" addresses can only be matched with a bus scan
+  if (sscanf(path, "%d:%d", &nxt->bus_num, &nxt->dev_num) == 2)
+    {
+      NXT_ERR(nxt_resolve_device(nxt));
+      fw = nxt_match_firmware(nxt->dev);
+      if (fw < 0)
+        return NXT_NOT_PRESENT;
+      nxt->firmware = fw;
+      return NXT_OK;
+    }
+
+  /* Everything else is a sysfs device directory, either in full or as
+   * a port path like 1-2.3, which is its name under /sys/bus/usb.
+   */
+  if (path[0] == '/')
+    n = snprintf(dir, sizeof(dir), "%s", path);
+  else
+    n = snprintf(dir, sizeof(dir), "/sys/bus/usb/devices/%s", path);
+  if (n < 0 || n >= (int)sizeof(dir))
+    return NXT_NOT_PRESENT;
+
+  if (nxt_read_sysfs_int(dir, "busnum", 10, &nxt->bus_num) < 0 ||
+      nxt_read_sysfs_int(dir, "devnum", 10, &nxt->dev_num) < 0 ||
+      nxt_read_sysfs_int(dir, "idVendor", 16, &vendor_id) < 0 ||
+      nxt_read_sysfs_int(dir, "idProduct", 16, &product_id) < 0)
+    return NXT_NOT_PRESENT;
+
+  fw = nxt_match_ids(vendor_id, product_id);
+  if (fw < 0)
+    return NXT_NOT_PRESENT;
 
+  nxt->dev = NULL;
+  nxt->firmware = fw;
   return NXT_OK;
 }
 
 
-int
-nxt_is_firmware(nxt_t *nxt, nxt_firmware fw)
+#ifdef NXT_HAVE_LIBUSB1
+struct nxt_hotplug {
+  int found;
+  int bus_num;
+  int dev_num;
+};
+
+
+static int
+nxt_hotplug_cb(libusb_context *ctx, libusb_device *dev,
+               libusb_hotplug_event event, void *user_data)
 {
-  return (nxt->firmware == fw);
+  struct nxt_hotplug *hp = user_data;
+
+  hp->bus_num = libusb_get_bus_number(dev);
+  hp->dev_num = libusb_get_device_address(dev);
+  hp->found = 1;
+
+  // Deregister, we only need the first one
+  return 1;
 }
 
 
-nxt_error_t
-nxt_send_buf(nxt_t *nxt, char *buf, int len)
+static nxt_error_t
+nxt_wait_hotplug(nxt_t *nxt, nxt_firmware fw, int timeout_ms)
 {
-  int ret = usb_bulk_write(nxt->hdl, 0x1, buf, len, 0);
-  if (ret < 0)
-    return NXT_USB_WRITE_ERROR;
+  libusb_context *ctx;
+  libusb_hotplug_callback_handle cb;
+  struct nxt_hotplug hp = { 0, 0, 0 };
+  struct timespec start, t;
+  int elapsed_ms = 0;
+
+  if (libusb_init(&ctx) < 0)
+    return NXT_CONFIGURATION_ERROR;
+
+  /* ENUMERATE reports devices that are already plugged in right away,
+   * so there is no race with a brick appearing before we register.
+   */
+  if (libusb_hotplug_register_callback(ctx,
+                                       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                       LIBUSB_HOTPLUG_ENUMERATE,
+                                       nxt_usb_ids[fw].vendor_id,
+                                       nxt_usb_ids[fw].product_id,
+                                       LIBUSB_HOTPLUG_MATCH_ANY,
+                                       nxt_hotplug_cb, &hp, &cb) < 0)
+    {
+      libusb_exit(ctx);
+      return NXT_CONFIGURATION_ERROR;
+    }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (!hp.found && (timeout_ms < 0 || elapsed_ms < timeout_ms))
+    {
+      struct timeval tv = { 0, 100000 };
+
+      if (timeout_ms >= 0 && timeout_ms - elapsed_ms < 100)
+        tv.tv_usec = (timeout_ms - elapsed_ms) * 1000;
+
+      libusb_handle_events_timeout_completed(ctx, &tv, &hp.found);
+
+      clock_gettime(CLOCK_MONOTONIC, &t);
+      elapsed_ms = (t.tv_sec - start.tv_sec) * 1000 +
+        (t.tv_nsec - start.tv_nsec) / 1000000;
+    }
+
+  if (!hp.found)
+    libusb_hotplug_deregister_callback(ctx, cb);
+  libusb_exit(ctx);
 
+  if (!hp.found)
+    return NXT_NOT_PRESENT;
+
+  nxt->dev = NULL;
+  nxt->bus_num = hp.bus_num;
+  nxt->dev_num = hp.dev_num;
+  nxt->firmware = fw;
   return NXT_OK;
 }
+#endif
 
 
-nxt_error_t
-nxt_send_str(nxt_t *nxt, char *str)
+static nxt_error_t
+nxt_find_firmware(nxt_t *nxt, nxt_firmware fw)
 {
-  return nxt_send_buf(nxt, str, strlen(str));
+  struct usb_bus *bus;
+
+  if (nxt_daemon_available())
+    return nxt_daemon_find(nxt, NULL, fw);
+
+  nxt_usb_scan();
+
+  for (bus = usb_get_busses(); bus != NULL; bus = bus->next)
+    {
+      struct usb_device *dev;
+
+      for (dev = bus->devices; dev != NULL; dev = dev->next)
+        if (nxt_match_firmware(dev) == fw)
+          {
+            nxt_set_device(nxt, dev, fw);
+            return NXT_OK;
+          }
+    }
+
+  return NXT_NOT_PRESENT;
 }
 
 
 nxt_error_t
-nxt_recv_buf(nxt_t *nxt, char *buf, int len)
+nxt_wait_for(nxt_t *nxt, nxt_firmware fw, int timeout_ms)
 {
-  int ret = usb_bulk_read(nxt->hdl, 0x82, buf, len, 0);
-  if (ret < 0)
+  int waited_ms = 0;
+
+#ifdef NXT_HAVE_LIBUSB1
+  // nxtd does the scanning when it runs
+  if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+      !nxt_daemon_available())
+    return nxt_wait_hotplug(nxt, fw, timeout_ms);
+#endif
+
+  // Without hotplug notifications, fall back to scanning periodically
+  for (;;)
+    {
+      if (nxt_find_firmware(nxt, fw) == NXT_OK)
+        return NXT_OK;
+
+      if (timeout_ms >= 0 && waited_ms >= timeout_ms)
+        return NXT_NOT_PRESENT;
+
+      usleep(250000);
+      waited_ms += 250;
+    }
+}
+
+
+#ifdef NXT_HAVE_LIBUSB1
+static void
+nxt_async_out_cb(struct libusb_transfer *xfer)
+{
+  nxt_t *nxt = xfer->user_data;
+  int i;
+
+  for (i = 0; i < NXT_ASYNC_N_OUT; i++)
+    if (nxt->out[i] == xfer)
+      nxt->out_busy[i] = 0;
+
+  if (xfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+    nxt->async_err = NXT_USB_TIMEOUT;
+  else if (xfer->status != LIBUSB_TRANSFER_COMPLETED)
+    nxt->async_err = NXT_USB_WRITE_ERROR;
+}
+
+
+static void
+nxt_async_in_cb(struct libusb_transfer *xfer)
+{
+  struct nxt_async_in *in = xfer->user_data;
+
+  in->done = 1;
+}
+
+
+/* Post the read for the next len bytes. The device never sends more
+ * than was asked for, but whatever would fill out the last packet is
+ * dropped rather than kept for the next read.
+ */
+static nxt_error_t
+nxt_async_post_in(nxt_t *nxt, int len)
+{
+  struct nxt_async_in *in = &nxt->in;
+  int size = (len + NXT_ASYNC_PACKET - 1) & ~(NXT_ASYNC_PACKET - 1);
+
+  if (size == 0)
+    size = NXT_ASYNC_PACKET;
+
+  if (in->size < size)
+    {
+      unsigned char *b = realloc(in->xfer->buffer, size);
+      if (b == NULL)
+        return NXT_USB_READ_ERROR;
+      in->xfer->buffer = b;
+      in->size = size;
+    }
+
+  libusb_fill_bulk_transfer(in->xfer, nxt->ahdl, 0x82, in->xfer->buffer,
+                            size, nxt_async_in_cb, in, 0);
+  in->done = 0;
+  in->want = len;
+  in->pos = 0;
+  if (libusb_submit_transfer(in->xfer) < 0)
     return NXT_USB_READ_ERROR;
 
+  in->posted = 1;
+  return NXT_OK;
+}
+
+
+/* How many of the bytes wanted from a completed read came in. */
+static int
+nxt_async_in_length(struct nxt_async_in *in)
+{
+  if (in->xfer->status != LIBUSB_TRANSFER_COMPLETED)
+    return 0;
+
+  return in->xfer->actual_length < in->want ?
+    in->xfer->actual_length : in->want;
+}
+
+
+/* Find the libusb-1.0 device at the bus address of the handle. */
+static libusb_device_handle *
+nxt_async_open_device(nxt_t *nxt)
+{
+  libusb_device **list;
+  libusb_device_handle *hdl = NULL;
+  ssize_t i, n;
+
+  n = libusb_get_device_list(nxt->ctx, &list);
+  if (n < 0)
+    return NULL;
+
+  for (i = 0; i < n; i++)
+    if (libusb_get_bus_number(list[i]) == nxt->bus_num &&
+        libusb_get_device_address(list[i]) == nxt->dev_num)
+      {
+        if (libusb_open(list[i], &hdl) < 0)
+          hdl = NULL;
+        break;
+      }
+
+  libusb_free_device_list(list, 1);
+  return hdl;
+}
+
+
+static void
+nxt_async_close(nxt_t *nxt)
+{
+  int i;
+
+  /* Let queued writes reach the brick, then cancel the reads that are
+   * still waiting for data.
+   */
+  for (i = 0; i < NXT_ASYNC_N_OUT; i++)
+    while (nxt->out_busy[i])
+      if (libusb_handle_events(nxt->ctx) < 0)
+        break;
+
+  if (nxt->in.posted && !nxt->in.done)
+    {
+      libusb_cancel_transfer(nxt->in.xfer);
+      while (!nxt->in.done)
+        if (libusb_handle_events_completed(nxt->ctx, &nxt->in.done) < 0)
+          break;
+    }
+
+  for (i = 0; i < NXT_ASYNC_N_OUT; i++)
+    if (nxt->out[i])
+      {
+        free(nxt->out[i]->buffer);
+        libusb_free_transfer(nxt->out[i]);
+      }
+
+  if (nxt->in.xfer)
+    {
+      free(nxt->in.xfer->buffer);
+      libusb_free_transfer(nxt->in.xfer);
+    }
+
+  libusb_release_interface(nxt->ahdl, nxt->interface);
+  libusb_close(nxt->ahdl);
+  libusb_exit(nxt->ctx);
+  nxt->ahdl = NULL;
+  nxt->ctx = NULL;
+
+  // Reopening picks the transport afresh
+  nxt->transport = &nxt_usb_transport;
+}
+
+
+static nxt_error_t
+nxt_async_open(nxt_t *nxt, int interface)
+{
+  int i;
+
+  if (libusb_init(&nxt->ctx) < 0)
+    return NXT_CONFIGURATION_ERROR;
+
+  nxt->ahdl = nxt_async_open_device(nxt);
+  if (nxt->ahdl == NULL)
+    {
+      libusb_exit(nxt->ctx);
+      nxt->ctx = NULL;
+      return NXT_CONFIGURATION_ERROR;
+    }
+
+  if (libusb_set_configuration(nxt->ahdl, 1) < 0)
+    {
+      libusb_close(nxt->ahdl);
+      libusb_exit(nxt->ctx);
+      nxt->ahdl = NULL;
+      nxt->ctx = NULL;
+      return NXT_CONFIGURATION_ERROR;
+    }
+
+  if (libusb_claim_interface(nxt->ahdl, interface) < 0)
+    {
+      libusb_close(nxt->ahdl);
+      libusb_exit(nxt->ctx);
+      nxt->ahdl = NULL;
+      nxt->ctx = NULL;
+      return NXT_IN_USE;
+    }
+
+  nxt->interface = interface;
+  nxt->async_err = NXT_OK;
+  nxt->out_next = 0;
+  nxt->in.xfer = NULL;
+  nxt->in.size = 0;
+  nxt->in.posted = 0;
+
+  for (i = 0; i < NXT_ASYNC_N_OUT; i++)
+    {
+      nxt->out[i] = libusb_alloc_transfer(0);
+      nxt->out_busy[i] = 0;
+      nxt->out_size[i] = 0;
+      if (nxt->out[i] == NULL)
+        goto fail;
+      nxt->out[i]->buffer = NULL;
+    }
+
+  nxt->in.xfer = libusb_alloc_transfer(0);
+  if (nxt->in.xfer == NULL)
+    goto fail;
+  nxt->in.xfer->buffer = NULL;
+
+  return NXT_OK;
+
+ fail:
+  nxt_async_close(nxt);
+  return NXT_CONFIGURATION_ERROR;
+}
+
+
+static nxt_error_t
+nxt_async_send_buf(nxt_t *nxt, char *buf, int len)
+{
+  int slot = nxt->out_next;
+  struct libusb_transfer *xfer = nxt->out[slot];
+
+  // Wait for the oldest write to free up its slot
+  while (nxt->out_busy[slot])
+    if (libusb_handle_events(nxt->ctx) < 0)
+      return NXT_USB_WRITE_ERROR;
+
+  /* Errors of earlier writes can only be reported now, since nothing
+   * waited for them. They can't be retried either: the writes queued
+   * behind them may already have reached the brick.
+   */
+  if (nxt->async_err != NXT_OK)
+    {
+      libusb_clear_halt(nxt->ahdl, 0x1);
+      return nxt->async_err;
+    }
+
+  if (nxt->out_size[slot] < len)
+    {
+      unsigned char *b = realloc(xfer->buffer, len);
+      if (b == NULL)
+        return NXT_USB_WRITE_ERROR;
+      xfer->buffer = b;
+      nxt->out_size[slot] = len;
+    }
+  memcpy(xfer->buffer, buf, len);
+
+  libusb_fill_bulk_transfer(xfer, nxt->ahdl, 0x1, xfer->buffer, len,
+                            nxt_async_out_cb, nxt, nxt->timeout_ms);
+  if (libusb_submit_transfer(xfer) < 0)
+    return NXT_USB_WRITE_ERROR;
+
+  nxt->out_busy[slot] = 1;
+  nxt->out_next = (slot + 1) % NXT_ASYNC_N_OUT;
+
   return NXT_OK;
 }
+
+
+/* Wait for a posted read to complete. The read stays posted, so on
+ * timeout a retry simply waits for it again. A read that never
+ * completes leaves the handle unusable, as the response may still
+ * show up later and be mistaken for the next one.
+ */
+static nxt_error_t
+nxt_async_wait_in(nxt_t *nxt, struct nxt_async_in *in)
+{
+  int attempt;
+
+  if (nxt->timeout_ms == 0)
+    {
+      while (!in->done)
+        if (libusb_handle_events_completed(nxt->ctx, &in->done) < 0)
+          return NXT_USB_READ_ERROR;
+      return NXT_OK;
+    }
+
+  for (attempt = 0; attempt <= nxt->retries; attempt++)
+    {
+      struct timespec start, t;
+      int elapsed_ms = 0;
+
+      if (attempt > 0)
+        NXT_STAT_INC(nxt, retries);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      while (!in->done && elapsed_ms < nxt->timeout_ms)
+        {
+          struct timeval tv;
+
+          tv.tv_sec = (nxt->timeout_ms - elapsed_ms) / 1000;
+          tv.tv_usec = (nxt->timeout_ms - elapsed_ms) % 1000 * 1000;
+          if (libusb_handle_events_timeout_completed(nxt->ctx, &tv,
+                                                     &in->done) < 0)
+            return NXT_USB_READ_ERROR;
+
+          clock_gettime(CLOCK_MONOTONIC, &t);
+          elapsed_ms = (t.tv_sec - start.tv_sec) * 1000 +
+            (t.tv_nsec - start.tv_nsec) / 1000000;
+        }
+
+      if (in->done)
+        return NXT_OK;
+    }
+
+  nxt->async_err = NXT_USB_TIMEOUT;
+  return NXT_USB_TIMEOUT;
+}
+
+
+/* Reads complete like a blocking bulk read would: once len bytes have
+ * arrived, or at the end of a short packet. A read posted by
+ * available() for more than len keeps the rest for the next call.
+ */
+static nxt_error_t
+nxt_async_recv_buf(nxt_t *nxt, char *buf, int len, int *n_read)
+{
+  struct nxt_async_in *in = &nxt->in;
+  int got = 0;
+
+  *n_read = 0;
+
+  while (got < len)
+    {
+      int avail, n;
+
+      if (!in->posted)
+        NXT_ERR(nxt_async_post_in(nxt, len - got));
+      NXT_ERR(nxt_async_wait_in(nxt, in));
+
+      if (in->xfer->status != LIBUSB_TRANSFER_COMPLETED)
+        {
+          in->posted = 0;
+          return NXT_USB_READ_ERROR;
+        }
+
+      avail = nxt_async_in_length(in) - in->pos;
+      n = avail < len - got ? avail : len - got;
+      memcpy(buf + got, in->xfer->buffer + in->pos, n);
+      in->pos += n;
+      got += n;
+      *n_read = got;
+
+      if (in->pos < nxt_async_in_length(in))
+        break;
+
+      // This read is drained, the next one gets posted afresh
+      in->posted = 0;
+      if (in->xfer->actual_length < in->want)
+        break;
+    }
+
+  return nxt->async_err;
+}
+
+
+static int
+nxt_async_can_send(nxt_t *nxt)
+{
+  // Errors are reported by the send itself
+  return !nxt->out_busy[nxt->out_next] || nxt->async_err != NXT_OK;
+}
+
+
+static int
+nxt_async_available(nxt_t *nxt, int len)
+{
+  struct nxt_async_in *in = &nxt->in;
+
+  // A read that failed has nothing, and recv() reports the failure
+  if (!in->posted && nxt_async_post_in(nxt, len) != NXT_OK)
+    return 0;
+  if (!in->done)
+    return -1;
+
+  return nxt_async_in_length(in) - in->pos;
+}
+
+
+/* Each handle has its own libusb context, with its own descriptors. */
+static int
+nxt_async_pollfds(nxt_t *nxt, struct pollfd *fds, int max, int *timeout_ms)
+{
+  const struct libusb_pollfd **list = libusb_get_pollfds(nxt->ctx);
+  struct timeval tv;
+  int n;
+
+  if (list == NULL)
+    return 0;
+
+  for (n = 0; list[n] != NULL; n++)
+    if (n < max)
+      {
+        fds[n].fd = list[n]->fd;
+        fds[n].events = list[n]->events;
+        fds[n].revents = 0;
+      }
+  libusb_free_pollfds(list);
+
+  // Transfer timeouts, when libusb can't wait on them with a descriptor
+  if (libusb_get_next_timeout(nxt->ctx, &tv) == 1)
+    {
+      int ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+
+      if (*timeout_ms < 0 || ms < *timeout_ms)
+        *timeout_ms = ms;
+    }
+
+  return n;
+}
+
+
+static nxt_error_t
+nxt_async_events(nxt_t *nxt)
+{
+  struct timeval tv = { 0, 0 };
+
+  if (libusb_handle_events_timeout_completed(nxt->ctx, &tv, NULL) < 0)
+    return NXT_USB_READ_ERROR;
+
+  return NXT_OK;
+}
+#endif /* NXT_HAVE_LIBUSB1 */
+
+
+static nxt_error_t
+nxt_usb_open(nxt_t *nxt, int interface)
+{
+  int ret;
+
+#ifdef NXT_HAVE_LIBUSB1
+  // Prefer the asynchronous transport, if the device can be opened
+  if (nxt_async_open(nxt, interface) == NXT_OK)
+    {
+      nxt->transport = &nxt_async_transport;
+      return NXT_OK;
+    }
+#endif
+
+  if (nxt->dev == NULL)
+    NXT_ERR(nxt_resolve_device(nxt));
+
+  nxt->hdl = usb_open(nxt->dev);
+
+  ret = usb_set_configuration(nxt->hdl, 1);
+  if (ret < 0)
+    {
+      usb_close(nxt->hdl);
+      nxt->hdl = NULL;
+      return NXT_CONFIGURATION_ERROR;
+    }
+
+  ret = usb_claim_interface(nxt->hdl, interface);
+  if (ret < 0)
+    {
+      usb_close(nxt->hdl);
+      nxt->hdl = NULL;
+      return NXT_IN_USE;
+    }
+
+  nxt->interface = interface;
+
+  return NXT_OK;
+}
+
+
+static void
+nxt_usb_close(nxt_t *nxt)
+{
+  // Handles from nxt_find_all() may never have been opened
+  if (nxt->hdl != NULL)
+    {
+      usb_release_interface(nxt->hdl, nxt->interface);
+      usb_close(nxt->hdl);
+      nxt->hdl = NULL;
+    }
+}
+
+
+nxt_error_t
+nxt_open(nxt_t *nxt, int interface)
+{
+  nxt->interface = interface;
+  nxt->flash.seq_resident = 0;
+  return nxt->transport->open(nxt, interface);
+}
+
+
+nxt_error_t
+nxt_close(nxt_t *nxt)
+{
+  // Don't lose commands still waiting in a batch
+  if (nxt->queue_len > 0)
+    nxt_flush(nxt);
+
+  // Leave the brick to SAM-BA, where the next user expects it
+  if (nxt->agent.running)
+    nxt_agent_stop(nxt);
+
+  if (nxt->trace != NULL)
+    nxt_capture_stop(nxt);
+
+  nxt->transport->close(nxt);
+  free(nxt);
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_capture_start(nxt_t *nxt, char *path)
+{
+  if (nxt->trace != NULL)
+    NXT_ERR(nxt_capture_stop(nxt));
+
+  return nxt_trace_writer_open(&nxt->trace, path, nxt->firmware);
+}
+
+
+nxt_error_t
+nxt_capture_stop(nxt_t *nxt)
+{
+  nxt_trace_writer_t *trace = nxt->trace;
+
+  if (trace == NULL)
+    return NXT_OK;
+
+  // Everything sent so far belongs in the trace
+  nxt_flush(nxt);
+  nxt->trace = NULL;
+  return nxt_trace_writer_close(trace);
+}
+
+
+int
+nxt_is_firmware(nxt_t *nxt, nxt_firmware fw)
+{
+  return (nxt->firmware == fw);
+}
+
+
+int
+nxt_same_device(nxt_t *a, nxt_t *b)
+{
+  return (nxt_is_usb(a) && nxt_is_usb(b) && a->bus_num == b->bus_num &&
+          a->dev_num == b->dev_num && a->firmware == b->firmware);
+}
+
+
+void
+nxt_set_timeout(nxt_t *nxt, int timeout_ms)
+{
+  nxt->timeout_ms = timeout_ms;
+}
+
+
+void
+nxt_set_retries(nxt_t *nxt, int retries)
+{
+  nxt->retries = retries;
+}
+
+
+int
+nxt_get_timeout(nxt_t *nxt)
+{
+  return nxt->timeout_ms;
+}
+
+
+int
+nxt_get_retries(nxt_t *nxt)
+{
+  return nxt->retries;
+}
+
+
+nxt_agent_state_t *
+nxt_agent_state_of(nxt_t *nxt)
+{
+  return &nxt->agent;
+}
+
+
+nxt_flash_state_t *
+nxt_flash_state_of(nxt_t *nxt)
+{
+  return &nxt->flash;
+}
+
+
+nxt_request_queue_t *
+nxt_request_queue_of(nxt_t *nxt)
+{
+  return &nxt->requests;
+}
+
+
+nxt_lego_state_t *
+nxt_lego_state_of(nxt_t *nxt)
+{
+  return &nxt->lego;
+}
+
+
+#ifndef NXT_NO_STATS
+nxt_stats_t *
+nxt_stats_of(nxt_t *nxt)
+{
+  return &nxt->stats;
+}
+#endif
+
+
+nxt_error_t
+nxt_get_stats(nxt_t *nxt, nxt_stats_t *stats)
+{
+#ifdef NXT_NO_STATS
+  memset(stats, 0, sizeof(*stats));
+  return NXT_CONFIGURATION_ERROR;
+#else
+  *stats = nxt->stats;
+  return NXT_OK;
+#endif
+}
+
+
+void
+nxt_reset_stats(nxt_t *nxt)
+{
+#ifndef NXT_NO_STATS
+  memset(&nxt->stats, 0, sizeof(nxt->stats));
+#endif
+}
+
+
+/* Look for the NXT again after a reset. Bus addresses change when the
+ * device re-enumerates, so without a port path to go by, settle for
+ * any NXT running the same firmware.
+ */
+static nxt_error_t
+nxt_locate_again(nxt_t *nxt, char *location, nxt_firmware fw)
+{
+  if (nxt_find_path(nxt, location) == NXT_OK && nxt->firmware == fw)
+    return NXT_OK;
+
+  if (strchr(location, ':') != NULL)
+    return nxt_find_firmware(nxt, fw);
+
+  return NXT_NOT_PRESENT;
+}
+
+
+/* Reset the USB port, then wait for the NXT to come back. */
+static nxt_error_t
+nxt_usb_reconnect(nxt_t *nxt, int timeout_ms)
+{
+  nxt_firmware fw = nxt->firmware;
+  int interface = nxt->interface;
+  char location[64];
+  int waited_ms = 0;
+
+  nxt_get_location(nxt, location, sizeof(location));
+
+#ifdef NXT_HAVE_LIBUSB1
+  if (nxt->ahdl != NULL)
+    {
+      libusb_reset_device(nxt->ahdl);
+      nxt_async_close(nxt);
+    }
+#endif
+
+  if (nxt->hdl != NULL)
+    {
+      usb_reset(nxt->hdl);
+      usb_close(nxt->hdl);
+      nxt->hdl = NULL;
+    }
+
+  /* The old device may linger for a moment while the new one
+   * enumerates, so keep trying until it can actually be opened.
+   */
+  for (;;)
+    {
+      if (nxt_locate_again(nxt, location, fw) == NXT_OK &&
+          nxt_open(nxt, interface) == NXT_OK)
+        return NXT_OK;
+
+      if (timeout_ms >= 0 && waited_ms >= timeout_ms)
+        return NXT_NOT_PRESENT;
+
+      usleep(250000);
+      waited_ms += 250;
+    }
+}
+
+
+nxt_error_t
+nxt_reconnect(nxt_t *nxt, int timeout_ms)
+{
+  // Whatever was still queued is lost with the connection
+  nxt->queue_len = 0;
+  nxt->batch_depth = 0;
+  nxt->flash.seq_resident = 0;
+
+  if (nxt->transport->reconnect != NULL)
+    return nxt->transport->reconnect(nxt, timeout_ms);
+
+  nxt->transport->close(nxt);
+  return nxt->transport->open(nxt, nxt->interface);
+}
+
+
+/* A failed transfer abandons the current batch, since callers bail
+ * out on errors without ending it.
+ */
+static nxt_error_t
+nxt_abort_batch(nxt_t *nxt, nxt_error_t err)
+{
+  nxt->batch_depth = 0;
+  nxt->queue_len = 0;
+  return err;
+}
+
+
+static nxt_error_t
+nxt_bulk_error(int ret, nxt_error_t err)
+{
+  return ret == -ETIMEDOUT ? NXT_USB_TIMEOUT : err;
+}
+
+
+static nxt_error_t
+nxt_bulk_write(nxt_t *nxt, char *buf, int len)
+{
+  int attempt, ret;
+
+  for (attempt = 0; ; attempt++)
+    {
+      ret = usb_bulk_write(nxt->hdl, 0x1, buf, len, nxt->timeout_ms);
+      if (ret >= 0)
+        return NXT_OK;
+
+      if (attempt >= nxt->retries || !nxt->write_repeatable)
+        return nxt_bulk_error(ret, NXT_USB_WRITE_ERROR);
+
+      usb_clear_halt(nxt->hdl, 0x1);
+      NXT_STAT_INC(nxt, retries);
+    }
+}
+
+
+static nxt_error_t
+nxt_bulk_read(nxt_t *nxt, char *buf, int len, int *n_read)
+{
+  int attempt, ret;
+
+  *n_read = 0;
+  for (attempt = 0; ; attempt++)
+    {
+      ret = usb_bulk_read(nxt->hdl, 0x82, buf, len, nxt->timeout_ms);
+      if (ret >= 0)
+        {
+          *n_read = ret;
+          return NXT_OK;
+        }
+
+      if (attempt >= nxt->retries)
+        return nxt_bulk_error(ret, NXT_USB_READ_ERROR);
+
+      usb_clear_halt(nxt->hdl, 0x82);
+      NXT_STAT_INC(nxt, retries);
+    }
+}
+
+
+static const nxt_transport_t nxt_usb_transport = {
+  "usb",
+  nxt_usb_open,
+  nxt_bulk_write,
+  nxt_bulk_read,
+  nxt_usb_close,
+  nxt_usb_reconnect,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+};
+
+#ifdef NXT_HAVE_LIBUSB1
+static const nxt_transport_t nxt_async_transport = {
+  "usb",
+  nxt_usb_open,
+  nxt_async_send_buf,
+  nxt_async_recv_buf,
+  nxt_async_close,
+  nxt_usb_reconnect,
+  NULL,
+  nxt_async_can_send,
+  nxt_async_available,
+  nxt_async_pollfds,
+  nxt_async_events,
+};
+#endif
+
+
+/* Transfers are only timed when something needs the time. */
+static long long
+nxt_transfer_start(nxt_t *nxt)
+{
+#ifdef NXT_NO_STATS
+  return nxt->trace ? nxt_trace_now() : 0;
+#else
+  return nxt_trace_now();
+#endif
+}
+
+
+static void
+nxt_transfer_done(nxt_t *nxt, int direction, nxt_error_t err,
+                  char *buf, int len, long long start)
+{
+#ifndef NXT_NO_STATS
+  long long us = (nxt_trace_now() - start) / 1000;
+  int bucket = us > 0 ? 64 - __builtin_clzll(us) : 0;
+
+  if (bucket >= NXT_STATS_BUCKETS)
+    bucket = NXT_STATS_BUCKETS - 1;
+
+  if (direction == NXT_TRACE_OUT)
+    {
+      nxt->stats.transfers_out++;
+      nxt->stats.bytes_out += err ? 0 : len;
+      nxt->stats.write_latency[bucket]++;
+    }
+  else
+    {
+      nxt->stats.transfers_in++;
+      nxt->stats.bytes_in += len;
+      nxt->stats.read_latency[bucket]++;
+    }
+#endif
+
+  if (nxt->trace != NULL)
+    nxt_trace_write(nxt->trace, direction,
+                    direction == NXT_TRACE_OUT ? 0x01 : 0x82,
+                    err, buf, len, start);
+}
+
+
+/* Whether buf holds only SAM-BA commands that do no harm when they
+ * run twice, as they do when a write that timed out had in fact got
+ * through. Those are writes, but not to the flash command register.
+ * Repeating a jump, an 'S' header or anything sending a reply back
+ * would put SAM-BA and the host out of step.
+ */
+static int
+nxt_repeatable(const char *buf, int len)
+{
+  char addr[9];
+
+  if (len == 0 || len > NXT_PACKET_SIZE)
+    return 0;
+
+  // Commands are all "X%08X,%08X#" here, 19 characters long
+  for (; len > 0; buf += 19, len -= 19)
+    {
+      if (len < 19 || (buf[0] != 'W' && buf[0] != 'H' && buf[0] != 'O'))
+        return 0;
+
+      memcpy(addr, buf + 1, 8);
+      addr[8] = '\0';
+      if (strtoul(addr, NULL, 16) == 0xFFFFFF64)
+        return 0;
+    }
+
+  return 1;
+}
+
+
+static nxt_error_t
+nxt_write_raw(nxt_t *nxt, char *buf, int len, int commands)
+{
+  long long start = nxt_transfer_start(nxt);
+  nxt_error_t err;
+
+  nxt->write_repeatable = commands && nxt_repeatable(buf, len);
+  err = nxt->transport->send(nxt, buf, len);
+
+  nxt_transfer_done(nxt, NXT_TRACE_OUT, err, buf, len, start);
+
+  if (err != NXT_OK)
+    return nxt_abort_batch(nxt, err);
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_flush(nxt_t *nxt)
+{
+  int len = nxt->queue_len;
+
+  if (len == 0)
+    return NXT_OK;
+
+  nxt->queue_len = 0;
+  return nxt_write_raw(nxt, nxt->queue, len, 1);
+}
+
+
+nxt_error_t
+nxt_send_buf(nxt_t *nxt, char *buf, int len)
+{
+  NXT_ERR(nxt_flush(nxt));
+  return nxt_write_raw(nxt, buf, len, 0);
+}
+
+
+nxt_error_t
+nxt_send_str(nxt_t *nxt, char *str)
+{
+  return nxt_send_buf(nxt, str, strlen(str));
+}
+
+
+nxt_error_t
+nxt_queue_buf(nxt_t *nxt, char *buf, int len)
+{
+  if (nxt->batch_depth == 0 || len > NXT_PACKET_SIZE)
+    return nxt_send_buf(nxt, buf, len);
+
+  /* Commands never straddle a packet boundary: when this one doesn't
+   * fit, the queued ones go out as one full-speed packet first.
+   */
+  if (nxt->queue_len + len > NXT_PACKET_SIZE)
+    NXT_ERR(nxt_flush(nxt));
+
+  memcpy(nxt->queue + nxt->queue_len, buf, len);
+  nxt->queue_len += len;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_queue_str(nxt_t *nxt, char *str)
+{
+  return nxt_queue_buf(nxt, str, strlen(str));
+}
+
+
+void
+nxt_batch_begin(nxt_t *nxt)
+{
+  nxt->batch_depth++;
+}
+
+
+nxt_error_t
+nxt_batch_end(nxt_t *nxt)
+{
+  if (nxt->batch_depth > 0)
+    nxt->batch_depth--;
+
+  if (nxt->batch_depth == 0)
+    return nxt_flush(nxt);
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_batch_cancel(nxt_t *nxt, nxt_error_t err)
+{
+  if (nxt->batch_depth > 0)
+    nxt->batch_depth--;
+
+  // What was queued after the failure must not go out on its own
+  if (nxt->batch_depth == 0)
+    nxt->queue_len = 0;
+
+  return err;
+}
+
+
+nxt_error_t
+nxt_recv_buf_partial(nxt_t *nxt, char *buf, int len, int *n_read)
+{
+  long long start;
+  nxt_error_t err;
+
+  // The command we want the answer to may still be queued
+  NXT_ERR(nxt_flush(nxt));
+
+  start = nxt_transfer_start(nxt);
+  err = nxt->transport->recv(nxt, buf, len, n_read);
+  nxt_transfer_done(nxt, NXT_TRACE_IN, err, buf, *n_read, start);
+
+  return err ? nxt_abort_batch(nxt, err) : NXT_OK;
+}
+
+
+nxt_error_t
+nxt_recv_buf(nxt_t *nxt, char *buf, int len)
+{
+  int n_read;
+
+  return nxt_recv_buf_partial(nxt, buf, len, &n_read);
+}
+
+
+int
+nxt_transport_pollable(nxt_t *nxt)
+{
+  return nxt->transport->events != NULL;
+}
+
+
+int
+nxt_can_send(nxt_t *nxt)
+{
+  if (nxt->transport->can_send == NULL)
+    return 1;
+
+  return nxt->transport->can_send(nxt);
+}
+
+
+int
+nxt_recv_available(nxt_t *nxt, int len)
+{
+  int n;
+
+  if (nxt->transport->available == NULL)
+    return len;
+
+  n = nxt->transport->available(nxt, len);
+  return n < len ? n : len;
+}
+
+
+int
+nxt_transport_pollfds(nxt_t *nxt, struct pollfd *fds, int max,
+                      int *timeout_ms)
+{
+  if (nxt->transport->pollfds == NULL)
+    return 0;
+
+  return nxt->transport->pollfds(nxt, fds, max, timeout_ms);
+}
+
+
+nxt_error_t
+nxt_transport_events(nxt_t *nxt)
+{
+  if (nxt->transport->events == NULL)
+    return NXT_OK;
+
+  return nxt->transport->events(nxt);
+}
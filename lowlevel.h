@@ -28,6 +28,13 @@
 struct nxt_t;
 typedef struct nxt_t nxt_t;
 
+/* Maximum packet size of the NXT's bulk endpoints. */
+#define NXT_PACKET_SIZE 64
+
+/* Transfer timeout and retry count given to new handles. */
+#define NXT_DEFAULT_TIMEOUT 5000
+#define NXT_DEFAULT_RETRIES 2
+
 typedef enum {
   SAMBA = 0,   /* SAM7 Boot Assistant    */
   LEGO, /* Official LEGO firmware */
@@ -37,11 +44,82 @@ typedef enum {
 
 nxt_error_t nxt_init(nxt_t **nxt);
 nxt_error_t nxt_find(nxt_t *nxt);
+
+/* Locate every connected NXT. Returns a malloc()ed array of handles,
+ * each ready for nxt_open(). Each handle is released with nxt_close(),
+ * and the array with free().
+ */
+nxt_error_t nxt_find_all(nxt_t ***nxts, int *n_nxts);
+
+/* Describe where the NXT sits in the USB tree, as "bus-port.port..."
+ * when the port path is known, or "bus:device" otherwise.
+ */
+void nxt_get_location(nxt_t *nxt, char *buf, int len);
+
+/* Wait up to timeout_ms (forever if negative) for an NXT running the
+ * given firmware to be plugged in or reset. Uses hotplug notification
+ * when libusb-1.0 provides it, and periodic bus scans otherwise.
+ */
+nxt_error_t nxt_wait_for(nxt_t *nxt, nxt_firmware fw, int timeout_ms);
+
+/* Target a specific NXT, given a sysfs device directory, a port path
+ * such as "1-2.3", or a "bus:device" address. Sysfs and port paths
+ * don't need a bus scan.
+ */
+nxt_error_t nxt_find_path(nxt_t *nxt, char *path);
+
 nxt_error_t nxt_open(nxt_t *nxt, int interface);
 nxt_error_t nxt_close(nxt_t *nxt);
+
+/* Bound every bulk transfer to timeout_ms (0 waits forever). Failed
+ * transfers are retried up to retries times, after clearing the halt
+ * on their endpoint. Reads are always retried. Writes are retried only
+ * when they hold nothing but queued SAM-BA register and memory writes,
+ * which do no harm if the first attempt got through after all.
+ */
+void nxt_set_timeout(nxt_t *nxt, int timeout_ms);
+void nxt_set_retries(nxt_t *nxt, int retries);
+int nxt_get_timeout(nxt_t *nxt);
+int nxt_get_retries(nxt_t *nxt);
+
+/* Recover from a failed transfer: reset the NXT's USB port, wait up
+ * to timeout_ms for it to come back at the same place, and reopen
+ * it. The brick keeps its RAM and flash contents.
+ */
+nxt_error_t nxt_reconnect(nxt_t *nxt, int timeout_ms);
+
 int nxt_is_firmware(nxt_t *nxt, nxt_firmware fw);
+
+/* Whether two handles from bus scans point at the same USB device. A
+ * brick that re-enumerated, after a reset or a jump, is a new device.
+ */
+int nxt_same_device(nxt_t *a, nxt_t *b);
+
 nxt_error_t nxt_send_buf(nxt_t *nxt, char *buf, int len);
 nxt_error_t nxt_send_str(nxt_t *nxt, char *str);
 nxt_error_t nxt_recv_buf(nxt_t *nxt, char *buf, int len);
 
+/* Like nxt_recv_buf(), but also reports how many bytes came in, which
+ * is fewer than len when the device had nothing more to send.
+ */
+nxt_error_t nxt_recv_buf_partial(nxt_t *nxt, char *buf, int len,
+                                 int *n_read);
+
+/* Command batching. Between nxt_batch_begin() and nxt_batch_end(),
+ * buffers passed to nxt_queue_buf() are coalesced into as few bulk
+ * transfers as possible, each at most one packet long. Any other
+ * send or receive flushes the queue first, so replies are never
+ * waited on with their command still queued. Batches can nest.
+ *
+ * A batch cut short by an error is closed with nxt_batch_cancel(),
+ * which returns the error and drops the commands still queued rather
+ * than sending them.
+ */
+void nxt_batch_begin(nxt_t *nxt);
+nxt_error_t nxt_batch_end(nxt_t *nxt);
+nxt_error_t nxt_batch_cancel(nxt_t *nxt, nxt_error_t err);
+nxt_error_t nxt_flush(nxt_t *nxt);
+nxt_error_t nxt_queue_buf(nxt_t *nxt, char *buf, int len);
+nxt_error_t nxt_queue_str(nxt_t *nxt, char *str);
+
 #endif /* __LOWLEVEL_H__ */
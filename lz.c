@@ -0,0 +1,300 @@
+/**
+ * NXT bootstrap interface; compressed upload code.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+#include "lz.h"
+#include "unlz_routine.h"
+
+/* Layout of the decompressor scratch area (see flash_write/unlz.c):
+ * the routine itself, then the stream descriptor and data 1k in.
+ */
+#define LZ_STREAM_OFFSET 0x400
+#define LZ_STREAM_HEADER 8
+
+/* Keep clear of the stack at the top of SRAM. */
+#define LZ_RAM_LIMIT 0x20F000
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+
+static int
+lz_put_length(unsigned char **op, unsigned char *oend, int len)
+{
+  for (len -= 15; len >= 255; len -= 255)
+    {
+      if (*op >= oend)
+        return -1;
+      *(*op)++ = 255;
+    }
+
+  if (*op >= oend)
+    return -1;
+  *(*op)++ = len;
+
+  return 0;
+}
+
+
+static int
+lz_put_sequence(unsigned char **op, unsigned char *oend,
+                const unsigned char *lit, int lit_len,
+                int offset, int match_len)
+{
+  unsigned char *token = *op;
+  int ml = match_len - LZ_MIN_MATCH;
+
+  if (*op >= oend)
+    return -1;
+  (*op)++;
+
+  *token = (lit_len < 15 ? lit_len : 15) << 4;
+  if (lit_len >= 15 && lz_put_length(op, oend, lit_len) < 0)
+    return -1;
+
+  if (oend - *op < lit_len)
+    return -1;
+  memcpy(*op, lit, lit_len);
+  *op += lit_len;
+
+  // The last sequence has no match
+  if (match_len == 0)
+    return 0;
+
+  if (oend - *op < 2)
+    return -1;
+  *(*op)++ = offset & 0xFF;
+  *(*op)++ = offset >> 8;
+
+  *token |= ml < 15 ? ml : 15;
+  if (ml >= 15 && lz_put_length(op, oend, ml) < 0)
+    return -1;
+
+  return 0;
+}
+
+
+int
+nxt_lz_compress(const char *src, int len, char *dst, int dst_len)
+{
+  const unsigned char *in = (const unsigned char *)src;
+  unsigned char *op = (unsigned char *)dst;
+  unsigned char *oend = op + dst_len;
+  int table[1 << LZ_HASH_BITS];
+  int ip = 0, anchor = 0;
+
+  memset(table, 0xFF, sizeof(table));
+
+  while (ip + LZ_MIN_MATCH <= len)
+    {
+      uint32_t seq = in[ip] | (in[ip+1] << 8) | (in[ip+2] << 16) |
+        ((uint32_t)in[ip+3] << 24);
+      int h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+      int ref = table[h];
+      int match_len;
+
+      table[h] = ip;
+      if (ref < 0 || ip - ref > LZ_MAX_OFFSET ||
+          memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0)
+        {
+          ip++;
+          continue;
+        }
+
+      match_len = LZ_MIN_MATCH;
+      while (ip + match_len < len && in[ref + match_len] == in[ip + match_len])
+        match_len++;
+
+      if (lz_put_sequence(&op, oend, in + anchor, ip - anchor,
+                          ip - ref, match_len) < 0)
+        return -1;
+
+      ip += match_len;
+      anchor = ip;
+    }
+
+  if (lz_put_sequence(&op, oend, in + anchor, len - anchor, 0, 0) < 0)
+    return -1;
+
+  return op - (unsigned char *)dst;
+}
+
+
+static int
+lz_get_length(const unsigned char **ip, const unsigned char *iend, int len)
+{
+  unsigned char b;
+
+  if (len == 15)
+    do
+      {
+        if (*ip >= iend)
+          return -1;
+        b = *(*ip)++;
+        len += b;
+      } while (b == 255);
+
+  return len;
+}
+
+
+int
+nxt_lz_decompress(const char *src, int len, char *dst, int dst_len)
+{
+  const unsigned char *ip = (const unsigned char *)src;
+  const unsigned char *iend = ip + len;
+  unsigned char *op = (unsigned char *)dst;
+  unsigned char *oend = op + dst_len;
+
+  while (ip < iend)
+    {
+      unsigned char token = *ip++;
+      int n, offset;
+
+      n = lz_get_length(&ip, iend, token >> 4);
+      if (n < 0 || iend - ip < n || oend - op < n)
+        return -1;
+      memcpy(op, ip, n);
+      ip += n;
+      op += n;
+
+      if (ip >= iend)
+        break;
+
+      if (iend - ip < 2)
+        return -1;
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+
+      n = lz_get_length(&ip, iend, token & 0xF);
+      if (n < 0 || offset == 0 || offset > op - (unsigned char *)dst)
+        return -1;
+      n += LZ_MIN_MATCH;
+      if (oend - op < n)
+        return -1;
+
+      // Matches may overlap their own output, so copy bytewise
+      for (; n > 0; n--, op++)
+        *op = *(op - offset);
+    }
+
+  return op - (unsigned char *)dst;
+}
+
+
+nxt_error_t
+nxt_lz_load_routine(nxt_t *nxt, nxt_addr_t scratch)
+{
+  return nxt_write_mem(nxt, scratch, unlz_bin, unlz_len);
+}
+
+
+/* Compress buf into a stream for the onboard decompressor, if the
+ * stream plus overhead bytes on the wire is smaller than the raw
+ * data. Returns the stream length, or -1 with *stream unset.
+ */
+static int
+lz_make_stream(nxt_addr_t addr, char *buf, int len, int overhead,
+               char **stream)
+{
+  int clen;
+
+  *stream = malloc(LZ_STREAM_HEADER + len);
+  if (*stream == NULL)
+    return -1;
+
+  clen = nxt_lz_compress(buf, len, *stream + LZ_STREAM_HEADER,
+                         len - LZ_STREAM_HEADER - overhead);
+  if (clen < 0)
+    {
+      free(*stream);
+      return -1;
+    }
+
+  nxt_store_word(*stream, addr);
+  nxt_store_word(*stream + 4, clen);
+
+  return LZ_STREAM_HEADER + clen;
+}
+
+
+static nxt_error_t
+lz_send_stream(nxt_t *nxt, nxt_addr_t scratch, char *stream, int len)
+{
+  NXT_ERR(nxt_write_mem(nxt, scratch + LZ_STREAM_OFFSET, stream, len));
+  NXT_ERR(nxt_jump(nxt, scratch));
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_lz_send_file(nxt_t *nxt, nxt_addr_t scratch, nxt_addr_t addr,
+                 char *buf, int len)
+{
+  nxt_error_t err;
+  char *stream;
+  int slen;
+
+  slen = lz_make_stream(addr, buf, len, NXT_LZ_JUMP_COST, &stream);
+  if (slen < 0)
+    return nxt_write_mem(nxt, addr, buf, len);
+
+  err = lz_send_stream(nxt, scratch, stream, slen);
+  free(stream);
+
+  return err;
+}
+
+
+nxt_error_t
+nxt_send_file_compressed(nxt_t *nxt, nxt_addr_t addr, char *buf, int len)
+{
+  nxt_addr_t scratch = (addr + len + 255) & ~255;
+  nxt_error_t err;
+  char *stream;
+  int slen;
+
+  // Fall back to a raw upload if the scratch area doesn't fit
+  if (scratch + LZ_STREAM_OFFSET + LZ_STREAM_HEADER + len > LZ_RAM_LIMIT)
+    return nxt_write_mem(nxt, addr, buf, len);
+
+  /* Here the decompressor itself has to be uploaded too, so count it
+   * against the savings.
+   */
+  slen = lz_make_stream(addr, buf, len, NXT_LZ_JUMP_COST + unlz_len,
+                        &stream);
+  if (slen < 0)
+    return nxt_write_mem(nxt, addr, buf, len);
+
+  err = nxt_lz_load_routine(nxt, scratch);
+  if (err == NXT_OK)
+    err = lz_send_stream(nxt, scratch, stream, slen);
+
+  free(stream);
+  return err;
+}
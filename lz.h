@@ -0,0 +1,61 @@
+/**
+ * NXT bootstrap interface; compressed upload code.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+
+/* Bytes on the wire for the jump into the onboard decompressor. */
+#define NXT_LZ_JUMP_COST 10
+
+/* Compress len bytes of src into dst. Returns the compressed length,
+ * or -1 if it doesn't fit in dst_len bytes.
+ */
+int nxt_lz_compress(const char *src, int len, char *dst, int dst_len);
+
+/* Expand a compressed stream. Returns the expanded length, or -1 if
+ * the stream is corrupt or doesn't fit in dst_len bytes.
+ */
+int nxt_lz_decompress(const char *src, int len, char *dst, int dst_len);
+
+/* Upload the decompressor to a scratch area of NXT RAM. The scratch
+ * area needs 1k plus room for the compressed stream, and must not
+ * overlap the destination of uploads.
+ */
+nxt_error_t nxt_lz_load_routine(nxt_t *nxt, nxt_addr_t scratch);
+
+/* Upload len bytes to addr compressed, through a decompressor already
+ * loaded at scratch. Falls back to a raw upload when the data doesn't
+ * compress.
+ */
+nxt_error_t nxt_lz_send_file(nxt_t *nxt, nxt_addr_t scratch,
+                             nxt_addr_t addr, char *buf, int len);
+
+/* Upload len bytes to addr compressed, staging the decompressor just
+ * past the end of the destination.
+ */
+nxt_error_t nxt_send_file_compressed(nxt_t *nxt, nxt_addr_t addr,
+                                     char *buf, int len);
+
+#endif /* __LZ_H__ */
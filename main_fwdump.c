@@ -0,0 +1,228 @@
+/**
+ * Main program code for the fwdump utility.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+
+#define NXT_HANDLE_ERR(expr, nxt, msg)     \
+  do {                                     \
+    nxt_error_t nxt__err_temp = (expr);    \
+    if (nxt__err_temp)                     \
+      return handle_error(nxt, msg, nxt__err_temp);  \
+  } while(0)
+
+/* The dump may be going to stdout, so all the chatter goes to stderr. */
+static int handle_error(nxt_t *nxt, char *msg, nxt_error_t err)
+{
+  fprintf(stderr, "%s: %s\n", msg, nxt_str_error(err));
+  if (nxt != NULL)
+    nxt_close(nxt);
+  exit(err);
+}
+
+#define FLASH_ADDR 0x00100000
+#define FLASH_SIZE (256 * 1024)
+#define SRAM_ADDR 0x00200000
+#define SRAM_SIZE (64 * 1024)
+
+struct dump {
+  FILE *out;
+  size_t len;
+  size_t done;
+  double start;
+  int quiet;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void progress(struct dump *d)
+{
+  double t = now() - d->start;
+
+  fprintf(stderr, "\r%zu/%zu bytes (%d%%), %.1f KB/s", d->done, d->len,
+          (int)(d->done * 100 / d->len), t > 0 ? d->done / t / 1024 : 0.0);
+}
+
+/* Chunks go to disk as they come in, while the next one is read. */
+static int dump_chunk(void *data, nxt_addr_t addr, const char *buf,
+                      size_t len)
+{
+  struct dump *d = data;
+
+  if (fwrite(buf, 1, len, d->out) != len)
+    return 1;
+
+  d->done += len;
+  if (!d->quiet)
+    progress(d);
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_t *nxt;
+  nxt_error_t err;
+  struct dump d = { NULL, FLASH_SIZE, 0, 0, 0 };
+  unsigned long addr = FLASH_ADDR;
+  char *device = NULL;
+  char *out_file;
+  int wait_secs = -1;
+  int timeout_ms = NXT_DEFAULT_TIMEOUT;
+  double t;
+  int i;
+
+  for (i = 1; i < argc - 1; i++)
+    {
+      if (strcmp(argv[i], "--flash") == 0)
+        {
+          addr = FLASH_ADDR;
+          d.len = FLASH_SIZE;
+        }
+      else if (strcmp(argv[i], "--sram") == 0)
+        {
+          addr = SRAM_ADDR;
+          d.len = SRAM_SIZE;
+        }
+      else if (strcmp(argv[i], "--addr") == 0 && i + 2 < argc)
+        addr = strtoul(argv[++i], NULL, 0);
+      else if (strcmp(argv[i], "--len") == 0 && i + 2 < argc)
+        d.len = strtoul(argv[++i], NULL, 0);
+      else if (strcmp(argv[i], "--wait") == 0 && i + 2 < argc)
+        wait_secs = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--device") == 0 && i + 2 < argc)
+        device = argv[++i];
+      else if (strcmp(argv[i], "--timeout") == 0 && i + 2 < argc)
+        timeout_ms = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--quiet") == 0)
+        d.quiet = 1;
+      else
+        break;
+    }
+
+  if (argc < 2 || i != argc - 1 || d.len == 0 ||
+      addr > 0xFFFFFFFF || d.len - 1 > 0xFFFFFFFF - addr)
+    {
+      fprintf(stderr,
+              "Syntax: %s [options] <output file, or - for stdout>\n"
+              "\n"
+              "  --flash        Dump the 256k of flash (the default).\n"
+              "  --sram         Dump the 64k of SRAM.\n"
+              "  --addr ADDR    Dump from ADDR instead.\n"
+              "  --len LEN      Dump LEN bytes instead.\n"
+              "  --wait SECS    Wait up to SECS for an NXT in reset mode.\n"
+              "  --device PATH  Dump the NXT at a sysfs or port path\n"
+              "                 (e.g. 1-2.3), or a bus:device address.\n"
+              "  --timeout MS   Give up on USB transfers after MS\n"
+              "                 milliseconds (0 waits forever).\n"
+              "  --quiet        Don't report progress.\n"
+              "\n"
+              "Memory is read a byte at a time, so peripheral registers\n"
+              "needing word accesses, or cleared by reading, may not dump\n"
+              "faithfully.\n"
+              "\n"
+              "Example: %s nxtos-backup.bin\n"
+              "         %s --addr 0x202000 --len 0x1000 -\n",
+              argv[0], argv[0], argv[0]);
+      exit(1);
+    }
+
+  out_file = argv[argc - 1];
+
+  NXT_HANDLE_ERR(nxt_init(&nxt), NULL,
+                 "Error during library initialization");
+
+  if (device != NULL)
+    err = nxt_find_path(nxt, device);
+  else if (wait_secs >= 0)
+    {
+      fprintf(stderr, "Waiting for an NXT in reset mode...\n");
+      err = nxt_wait_for(nxt, SAMBA, wait_secs * 1000);
+    }
+  else
+    err = nxt_find(nxt);
+  if (err)
+    {
+      if (err == NXT_NOT_PRESENT)
+        fprintf(stderr,
+                "NXT not found. Is it properly plugged in via USB?\n");
+      else
+        NXT_HANDLE_ERR(0, NULL, "Error while scanning for NXT");
+      exit(1);
+    }
+
+  if (!nxt_is_firmware(nxt, SAMBA))
+    {
+      fprintf(stderr, "NXT found, but not running in reset mode.\n");
+      fprintf(stderr,
+              "Please reset your NXT manually and restart this program.\n");
+      exit(2);
+    }
+
+  nxt_set_timeout(nxt, timeout_ms);
+
+  NXT_HANDLE_ERR(nxt_open(nxt, NXT_SAMBA_INTERFACE), NULL,
+                 "Error while connecting to NXT");
+  NXT_HANDLE_ERR(nxt_handshake(nxt), NULL, "Error during initial handshake");
+
+  if (strcmp(out_file, "-") == 0)
+    d.out = stdout;
+  else
+    d.out = fopen(out_file, "wb");
+  if (d.out == NULL)
+    NXT_HANDLE_ERR(NXT_FILE_ERROR, nxt, "Error opening output file");
+
+  if (!d.quiet)
+    fprintf(stderr, "Dumping %zu bytes from 0x%08lX...\n", d.len, addr);
+
+  d.start = now();
+  err = nxt_read_mem_stream(nxt, addr, d.len, dump_chunk, &d);
+  t = now() - d.start;
+  if (!d.quiet)
+    fprintf(stderr, "\n");
+
+  if (d.out != stdout && fclose(d.out) != 0 && err == NXT_OK)
+    err = NXT_FILE_ERROR;
+  else if (d.out == stdout && fflush(stdout) != 0 && err == NXT_OK)
+    err = NXT_FILE_ERROR;
+  NXT_HANDLE_ERR(err, nxt, "Error dumping memory");
+
+  if (!d.quiet)
+    fprintf(stderr, "Dumped %zu bytes in %.2f s (%.1f KB/s).\n",
+            d.len, t, t > 0 ? d.len / t / 1024 : 0.0);
+
+  NXT_HANDLE_ERR(nxt_close(nxt), NULL,
+                 "Error while closing connection to NXT");
+
+  return 0;
+}
@@ -22,6 +22,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "error.h"
 #include "lowlevel.h"
@@ -43,30 +46,68 @@ static int handle_error(nxt_t *nxt, char *msg, nxt_error_t err)
   exit(err);
 }
 
-void get_firmware(char **firmware, int *len, char *filename)
+/* The last image uploaded to each brick is kept in the cache
+ * directory, to only send what changed the next time. Each file holds
+ * the load address, then the image.
+ */
+static void cache_path(char *path, int size, char *location)
 {
-  FILE *f;
+  char *dir = getenv("NXT_CACHE_DIR");
+  char *home = getenv("HOME");
+
+  if (dir != NULL)
+    snprintf(path, size, "%s/fwexec-%s", dir, location);
+  else
+    snprintf(path, size, "%s/.cache/libnxt/fwexec-%s",
+             home ? home : ".", location);
+}
 
-  f = fopen(filename, "rb");
-  if (f == NULL) NXT_HANDLE_ERR(NXT_FILE_ERROR, NULL, "Error opening file");
+static void cache_load(char *path, long load_addr, char **image, int *len,
+                       char **map, int *map_len)
+{
+  *image = *map = NULL;
+  *len = *map_len = 0;
 
-  fseek(f, 0, SEEK_END);
-  *len = ftell(f);
-  rewind(f);
+  if (nxt_map_file(path, map, map_len) != NXT_OK)
+    return;
 
-  if (*len > 56*1024)
-    NXT_HANDLE_ERR(NXT_INVALID_FIRMWARE, NULL,
-                   "Firmware image is too big to fit in RAM.");
+  // Images loaded elsewhere are no use
+  if (*map_len < 4 || nxt_load_word(*map) != load_addr)
+    return;
 
-  *firmware = malloc(*len);
-  if (*firmware == NULL) NXT_HANDLE_ERR(NXT_FILE_ERROR, NULL,
-                                        "Error allocating memory");
+  *image = *map + 4;
+  *len = *map_len - 4;
+}
 
-  if (fread(*firmware, 1, *len, f) != *len)
-    NXT_HANDLE_ERR(NXT_FILE_ERROR, NULL, "Error reading file");
+static void cache_store(char *path, long load_addr, char *image, int len)
+{
+  char *slash, header[4];
+  FILE *f;
+
+  // Create the directory the cache goes in, and its parents
+  for (slash = strchr(path + 1, '/'); slash != NULL;
+       slash = strchr(slash + 1, '/'))
+    {
+      *slash = '\0';
+      if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        {
+          *slash = '/';
+          return;
+        }
+      *slash = '/';
+    }
 
-  printf("Firmware size is %d bytes\n", *len);
+  f = fopen(path, "wb");
+  if (f == NULL)
+    return;
 
+  nxt_store_word(header, load_addr);
+  if (fwrite(header, 4, 1, f) != 1 || fwrite(image, 1, len, f) != len)
+    {
+      fclose(f);
+      remove(path);
+      return;
+    }
   fclose(f);
 }
 
@@ -77,10 +118,24 @@ int main(int argc, char *argv[])
   char *firmware;
   int firmware_len;
   long load_addr;
+  int delta = 0;
+  char location[32], path[512];
+  char *prev, *cache;
+  int prev_len, cache_len, n_sent, n_skipped;
+
+  if (argc > 1 && strcmp(argv[1], "--delta") == 0)
+    {
+      delta = 1;
+      argc--;
+      argv++;
+    }
 
   if (argc < 2 || argc > 3)
     {
-      printf("Syntax: %s <Firmware image to write> [load address]\n"
+      printf("Syntax: %s [--delta] <Firmware image to write> [load address]\n"
+             "\n"
+             "  --delta  Only send the parts of the image that changed\n"
+             "           since the last upload to this NXT.\n"
              "\n"
              "Example: %s beep.bin\n"
              "         %s beep.bin 0x1234", argv[0], argv[0], argv[0]);
@@ -92,7 +147,12 @@ int main(int argc, char *argv[])
     load_addr = 0x202000;
   }
 
-  get_firmware(&firmware, &firmware_len, argv[1]);
+  NXT_HANDLE_ERR(nxt_map_file(argv[1], &firmware, &firmware_len), NULL,
+                 "Error opening file");
+  if (firmware_len > NXT_EXEC_MAX_SIZE)
+    NXT_HANDLE_ERR(NXT_INVALID_FIRMWARE, NULL,
+                   "Firmware image is too big to fit in RAM.");
+  printf("Firmware size is %d bytes\n", firmware_len);
 
   NXT_HANDLE_ERR(nxt_init(&nxt), NULL,
                  "Error during library initialization");
@@ -120,13 +180,29 @@ int main(int argc, char *argv[])
   printf("NXT device in reset mode located and opened.\n"
          "Uploading firmware...\n");
 
-  // Send the C program
-  NXT_HANDLE_ERR(nxt_send_file(nxt, load_addr, firmware, firmware_len), nxt,
-                 "Error Sending file");
-
-  printf("Firmware uploaded, executing...\n");
-  NXT_HANDLE_ERR(nxt_jump(nxt, load_addr), nxt,
-                 "Error jumping to C program");
+  if (delta)
+    {
+      nxt_get_location(nxt, location, sizeof(location));
+      cache_path(path, sizeof(path), location);
+      cache_load(path, load_addr, &prev, &prev_len, &cache, &cache_len);
+
+      // Send what changed and run it
+      NXT_HANDLE_ERR(nxt_exec_delta_buffer(nxt, load_addr, firmware,
+                                           firmware_len, prev, prev_len,
+                                           &n_sent, &n_skipped),
+                     nxt, "Error uploading and starting C program");
+      printf("%d chunks sent, %d already on the NXT\n", n_sent, n_skipped);
+
+      nxt_unmap_file(cache, cache_len);
+      cache_store(path, load_addr, firmware, firmware_len);
+    }
+  else
+    {
+      // Send the C program and run it
+      NXT_HANDLE_ERR(nxt_exec_buffer(nxt, load_addr, firmware, firmware_len),
+                     nxt, "Error uploading and starting C program");
+    }
+  nxt_unmap_file(firmware, firmware_len);
 
   NXT_HANDLE_ERR(nxt_close(nxt), NULL,
                  "Error while closing connection to NXT");
@@ -21,11 +21,17 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "error.h"
 #include "lowlevel.h"
 #include "samba.h"
 #include "firmware.h"
+#include "trace.h"
+#include "stats.h"
+#include "agent.h"
 
 #define NXT_HANDLE_ERR(expr, nxt, msg)     \
   do {                                     \
@@ -42,31 +48,434 @@ static int handle_error(nxt_t *nxt, char *msg, nxt_error_t err)
   exit(err);
 }
 
+/* Settings shared by all the flashing workers. */
+static int incremental = 0;
+static int force = 0;
+static int verify = 1;
+static int timeout_ms = NXT_DEFAULT_TIMEOUT;
+static int retries = NXT_DEFAULT_RETRIES;
+static char *trace_file = NULL;
+static int show_stats = 0;
+static int use_agent = 0;
+
+/* The image to flash, loaded once and shared. */
+static nxt_flash_plan_t plan;
+
+/* How long a brick gets to come back after a USB reset. */
+#define RECONNECT_TIMEOUT 10000
+
+struct flash_job {
+  nxt_t *nxt;
+  char location[32];
+  nxt_error_t err;
+  char *failed_step;
+  double seconds;
+};
+
+struct flash_pool {
+  struct flash_job *jobs;
+  int n_jobs;
+  int next;
+  pthread_mutex_t lock;
+};
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Flash the image through a checkpointed session, reconnecting and
+ * resuming where it left off after errors. *nxt is cleared when a
+ * failed handshake closed the handle. Sessions write every page, so
+ * sparse images are flashed in one go instead.
+ */
+static nxt_error_t flash_resumable(nxt_t **nxt, char *location)
+{
+  nxt_flash_session_t session;
+  nxt_error_t err;
+  int attempt;
+
+  if (plan.sparse)
+    return nxt_firmware_flash_plan(*nxt, &plan);
+
+  NXT_ERR(nxt_flash_session_init(&session, plan.data, plan.len));
+
+  for (attempt = 0; ; attempt++)
+    {
+      err = nxt_flash_session_run(*nxt, &session);
+      if (err == NXT_OK || attempt >= retries)
+        return err;
+
+      printf("[%s] %s, resuming at page %d...\n", location,
+             nxt_str_error(err), session.next_page);
+
+      NXT_ERR(nxt_reconnect(*nxt, RECONNECT_TIMEOUT));
+      err = nxt_handshake(*nxt);
+      if (err)
+        {
+          *nxt = NULL;
+          return err;
+        }
+    }
+}
+
+static void print_latency(char *name, unsigned long *buckets)
+{
+  int i, first = 1;
+
+  printf("  %s latency:", name);
+  for (i = 0; i < NXT_STATS_BUCKETS; i++)
+    {
+      if (buckets[i] == 0)
+        continue;
+
+      if (i == NXT_STATS_BUCKETS - 1)
+        printf("%s >=%luus: %lu", first ? "" : ",", 1UL << (i - 1),
+               buckets[i]);
+      else
+        printf("%s <%luus: %lu", first ? "" : ",", 1UL << i, buckets[i]);
+      first = 0;
+    }
+  printf("%s\n", first ? " none" : "");
+}
+
+/* Where the time went: the USB traffic, the flash controller's busy
+ * waits, and how transfer latencies were spread.
+ */
+static void print_stats(char *location, nxt_t *nxt)
+{
+  nxt_stats_t stats;
+  int i;
+
+  if (nxt_get_stats(nxt, &stats) != NXT_OK)
+    {
+      printf("[%s] libnxt was built without statistics.\n", location);
+      return;
+    }
+
+  printf("[%s] statistics:\n", location);
+  printf("  out: %lu transfers, %llu bytes\n"
+         "  in: %lu transfers, %llu bytes\n"
+         "  retries: %lu\n"
+         "  pages flashed: %lu, FRDY polls: %lu\n",
+         stats.transfers_out, stats.bytes_out,
+         stats.transfers_in, stats.bytes_in, stats.retries,
+         stats.pages_flashed, stats.wait_ready_polls);
+
+  printf("  commands:");
+  for (i = 0; i < NXT_STATS_OPCODES; i++)
+    if (stats.commands[i] != 0)
+      printf(" %c=%lu", i, stats.commands[i]);
+  printf("\n");
+
+  print_latency("write", stats.write_latency);
+  print_latency("read", stats.read_latency);
+}
+
+#define JOB_STEP(job, expr, step)               \
+  do {                                          \
+    (job)->err = (expr);                        \
+    if ((job)->err)                             \
+      {                                         \
+        (job)->failed_step = (step);            \
+        return;                                 \
+      }                                         \
+  } while(0)
+
+static void flash_one(struct flash_job *job)
+{
+  int n_written, n_skipped, current = 0;
+
+  JOB_STEP(job, nxt_open(job->nxt, NXT_SAMBA_INTERFACE),
+           "Error while connecting to NXT");
+
+  job->err = nxt_handshake(job->nxt);
+  if (job->err)
+    {
+      // A failed handshake already closed the handle
+      job->nxt = NULL;
+      job->failed_step = "Error during initial handshake";
+      return;
+    }
+
+  if (use_agent)
+    JOB_STEP(job, nxt_agent_start(job->nxt), "Error starting the agent");
+
+  if (!force)
+    JOB_STEP(job, nxt_firmware_is_current_plan(job->nxt, &plan, &current),
+             "Error reading the firmware fingerprint");
+
+  if (current)
+    printf("[%s] firmware already up to date.\n", job->location);
+  else if (incremental)
+    {
+      printf("[%s] flashing...\n", job->location);
+      JOB_STEP(job, nxt_firmware_flash_incremental_plan(job->nxt, &plan,
+                                                        &n_written,
+                                                        &n_skipped),
+               "Error flashing firmware");
+      printf("[%s] %d pages written, %d unchanged pages skipped\n",
+             job->location, n_written, n_skipped);
+    }
+  else
+    {
+      printf("[%s] flashing...\n", job->location);
+      JOB_STEP(job, flash_resumable(&job->nxt, job->location),
+               "Error flashing firmware");
+    }
+
+  if (verify && !current)
+    JOB_STEP(job, nxt_firmware_verify_plan(job->nxt, &plan),
+             "Error verifying firmware");
+
+  JOB_STEP(job, nxt_jump(job->nxt, 0x00100000),
+           "Error booting new firmware");
+}
+
+static void *flash_worker(void *arg)
+{
+  struct flash_pool *pool = arg;
+
+  for (;;)
+    {
+      struct flash_job *job;
+      double start;
+
+      pthread_mutex_lock(&pool->lock);
+      job = pool->next < pool->n_jobs ? &pool->jobs[pool->next++] : NULL;
+      pthread_mutex_unlock(&pool->lock);
+
+      if (job == NULL)
+        return NULL;
+
+      start = now();
+      flash_one(job);
+      job->seconds = now() - start;
+
+      if (job->nxt != NULL)
+        {
+          if (show_stats)
+            print_stats(job->location, job->nxt);
+          nxt_close(job->nxt);
+        }
+
+      if (job->err)
+        printf("[%s] %s: %s\n", job->location, job->failed_step,
+               nxt_str_error(job->err));
+      else
+        printf("[%s] done in %.1fs, new firmware started.\n",
+               job->location, job->seconds);
+    }
+}
+
+static int flash_all(int n_workers)
+{
+  struct flash_pool pool;
+  pthread_t *threads;
+  nxt_t **nxts;
+  int n_nxts, n_ok = 0;
+  double start;
+  int i;
+
+  if (nxt_find_all(&nxts, &n_nxts) != NXT_OK)
+    {
+      printf("No NXT found. Are they properly plugged in via USB?\n");
+      exit(1);
+    }
+
+  pool.jobs = calloc(n_nxts, sizeof(*pool.jobs));
+  pool.n_jobs = 0;
+  pool.next = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+
+  for (i = 0; i < n_nxts; i++)
+    {
+      struct flash_job *job = &pool.jobs[pool.n_jobs];
+
+      nxt_get_location(nxts[i], job->location, sizeof(job->location));
+      if (!nxt_is_firmware(nxts[i], SAMBA))
+        {
+          printf("[%s] not running in reset mode, skipping.\n",
+                 job->location);
+          nxt_close(nxts[i]);
+          continue;
+        }
+
+      nxt_set_timeout(nxts[i], timeout_ms);
+      nxt_set_retries(nxts[i], retries);
+      if (trace_file != NULL)
+        {
+          // One trace per brick, named after where it is plugged in
+          char path[256];
+
+          snprintf(path, sizeof(path), "%s.%s", trace_file, job->location);
+          if (nxt_capture_start(nxts[i], path) != NXT_OK)
+            printf("[%s] can't write %s, not tracing.\n", job->location,
+                   path);
+        }
+      job->nxt = nxts[i];
+      pool.n_jobs++;
+    }
+  free(nxts);
+
+  if (pool.n_jobs == 0)
+    {
+      printf("No NXT in reset mode found.\n"
+             "Please reset your NXTs manually and restart this program.\n");
+      exit(2);
+    }
+
+  if (n_workers <= 0 || n_workers > pool.n_jobs)
+    n_workers = pool.n_jobs;
+
+  printf("Flashing %d NXTs with %d workers...\n", pool.n_jobs, n_workers);
+
+  start = now();
+  threads = calloc(n_workers, sizeof(*threads));
+  for (i = 0; i < n_workers; i++)
+    pthread_create(&threads[i], NULL, flash_worker, &pool);
+  for (i = 0; i < n_workers; i++)
+    pthread_join(threads[i], NULL);
+
+  for (i = 0; i < pool.n_jobs; i++)
+    if (pool.jobs[i].err == NXT_OK)
+      n_ok++;
+
+  printf("%d of %d NXTs flashed successfully in %.1fs.\n",
+         n_ok, pool.n_jobs, now() - start);
+
+  free(threads);
+  free(pool.jobs);
+  nxt_flash_plan_free(&plan);
+
+  return n_ok == pool.n_jobs ? 0 : 1;
+}
+
 int main(int argc, char *argv[])
 {
   nxt_t *nxt;
   nxt_error_t err;
   char *fw_file;
+  char location[32];
+  int n_written, n_skipped, current = 0;
+  int all = 0, n_workers = 0, n_regions;
+  int wait_secs = -1;
+  char *device = NULL;
+  char *replay_file = NULL;
+  double replay_speed = 1.0;
+  nxt_trace_t *trace = NULL;
+  int i;
 
-  if (argc != 2)
+  for (i = 1; i < argc - 1; i++)
     {
-      printf("Syntax: %s <firmware image to write>\n"
+      if (strcmp(argv[i], "--incremental") == 0)
+        incremental = 1;
+      else if (strcmp(argv[i], "--all") == 0)
+        all = 1;
+      else if (strcmp(argv[i], "--jobs") == 0 && i + 2 < argc)
+        n_workers = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--wait") == 0 && i + 2 < argc)
+        wait_secs = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--device") == 0 && i + 2 < argc)
+        device = argv[++i];
+      else if (strcmp(argv[i], "--no-verify") == 0)
+        verify = 0;
+      else if (strcmp(argv[i], "--force") == 0)
+        force = 1;
+      else if (strcmp(argv[i], "--timeout") == 0 && i + 2 < argc)
+        timeout_ms = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--retries") == 0 && i + 2 < argc)
+        retries = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--trace") == 0 && i + 2 < argc)
+        trace_file = argv[++i];
+      else if (strcmp(argv[i], "--replay") == 0 && i + 2 < argc)
+        replay_file = argv[++i];
+      else if (strcmp(argv[i], "--replay-speed") == 0 && i + 2 < argc)
+        replay_speed = atof(argv[++i]);
+      else if (strcmp(argv[i], "--stats") == 0)
+        show_stats = 1;
+      else if (strcmp(argv[i], "--agent") == 0)
+        use_agent = 1;
+      else
+        break;
+    }
+
+  if (argc < 2 || i != argc - 1 || (all && replay_file != NULL))
+    {
+      printf("Syntax: %s [options] <firmware image to write>\n"
+             "\n"
+             "  --incremental  Only rewrite the pages that changed.\n"
+             "  --no-verify    Don't checksum the flash after writing.\n"
+             "  --force        Flash even when the NXT already has this\n"
+             "                 firmware.\n"
+             "  --all          Flash every NXT in reset mode at once.\n"
+             "  --jobs N       With --all, flash at most N NXTs at a time.\n"
+             "  --wait SECS    Wait up to SECS for an NXT in reset mode.\n"
+             "  --device PATH  Flash the NXT at a sysfs or port path\n"
+             "                 (e.g. 1-2.3), or a bus:device address.\n"
+             "  --timeout MS   Give up on USB transfers after MS\n"
+             "                 milliseconds (0 waits forever).\n"
+             "  --retries N    Retry failed transfers, and reconnect to\n"
+             "                 resume a failed flash, up to N times.\n"
+             "  --trace FILE   Record all USB traffic to FILE (with --all,\n"
+             "                 to FILE.<location> for each NXT).\n"
+             "  --replay FILE  Play a recorded trace back instead of\n"
+             "                 talking to an NXT. The options must match\n"
+             "                 the ones used when recording.\n"
+             "  --replay-speed X  Scale the recorded timings by X\n"
+             "                 (0 replays as fast as possible).\n"
+             "  --stats        Print transfer counters and latencies\n"
+             "                 at the end.\n"
+             "  --agent        Run a small agent on the NXT and flash\n"
+             "                 through it instead of through SAM-BA.\n"
+             "\n"
+             "The image may be a raw binary, or an ELF, Intel HEX or\n"
+             "S-record file. Only the pages those use are written.\n"
              "\n"
              "Example: %s nxtos.bin\n", argv[0], argv[0]);
       exit(1);
     }
 
-  fw_file = argv[1];
+  fw_file = argv[argc - 1];
 
   printf("Checking firmware... ");
-  NXT_HANDLE_ERR(nxt_firmware_validate(fw_file), NULL,
+  NXT_HANDLE_ERR(nxt_flash_plan_load(fw_file, &plan), NULL,
                  "Error");
-  printf("OK.\n");
+  for (n_regions = 0, i = 0; i < 16; i++)
+    if (plan.regions & (1 << i))
+      n_regions++;
+  printf("OK (%d pages in %d lock regions).\n", plan.n_used, n_regions);
 
-  NXT_HANDLE_ERR(nxt_init(&nxt), NULL,
-                 "Error during library initialization");
+  if (all)
+    return flash_all(n_workers);
+
+  if (replay_file != NULL)
+    {
+      // The recorded brick stands in for discovery
+      NXT_HANDLE_ERR(nxt_trace_load(replay_file, &trace), NULL,
+                     "Error loading trace");
+      NXT_HANDLE_ERR(nxt_replay_init(&nxt, trace, replay_speed), NULL,
+                     "Error during library initialization");
+      err = NXT_OK;
+    }
+  else
+    {
+      NXT_HANDLE_ERR(nxt_init(&nxt), NULL,
+                     "Error during library initialization");
 
-  err = nxt_find(nxt);
+      if (device != NULL)
+        err = nxt_find_path(nxt, device);
+      else if (wait_secs >= 0)
+        {
+          printf("Waiting for an NXT in reset mode...\n");
+          err = nxt_wait_for(nxt, SAMBA, wait_secs * 1000);
+        }
+      else
+        err = nxt_find(nxt);
+    }
   if (err)
     {
       if (err == NXT_NOT_PRESENT)
@@ -83,20 +492,63 @@ int main(int argc, char *argv[])
       exit(2);
     }
 
+  nxt_set_timeout(nxt, timeout_ms);
+  nxt_set_retries(nxt, retries);
+  nxt_get_location(nxt, location, sizeof(location));
+  if (trace_file != NULL)
+    NXT_HANDLE_ERR(nxt_capture_start(nxt, trace_file), nxt,
+                   "Error starting the trace");
+
   NXT_HANDLE_ERR(nxt_open(nxt, NXT_SAMBA_INTERFACE), NULL, "Error while connecting to NXT");
   NXT_HANDLE_ERR(nxt_handshake(nxt), NULL, "Error during initial handshake");
 
-  printf("NXT device in reset mode located and opened.\n"
-         "Starting firmware flash procedure now...\n");
+  printf("NXT device in reset mode located and opened.\n");
+
+  if (use_agent)
+    NXT_HANDLE_ERR(nxt_agent_start(nxt), nxt, "Error starting the agent");
+
+  if (!force)
+    NXT_HANDLE_ERR(nxt_firmware_is_current_plan(nxt, &plan, &current), nxt,
+                   "Error reading the firmware fingerprint");
+
+  if (current)
+    printf("Firmware already up to date, not flashing.\n");
+  else if (incremental)
+    {
+      printf("Starting firmware flash procedure now...\n");
+      NXT_HANDLE_ERR(nxt_firmware_flash_incremental_plan(nxt, &plan,
+                                                         &n_written,
+                                                         &n_skipped),
+                     nxt, "Error flashing firmware");
+      printf("Firmware flash complete (%d pages written, "
+             "%d unchanged pages skipped).\n", n_written, n_skipped);
+    }
+  else
+    {
+      printf("Starting firmware flash procedure now...\n");
+      NXT_HANDLE_ERR(flash_resumable(&nxt, location), nxt,
+                     "Error flashing firmware");
+      printf("Firmware flash complete.\n");
+    }
+
+  if (verify && !current)
+    {
+      printf("Verifying flash contents... ");
+      NXT_HANDLE_ERR(nxt_firmware_verify_plan(nxt, &plan), nxt, "Error");
+      printf("OK.\n");
+    }
 
-  NXT_HANDLE_ERR(nxt_firmware_flash(nxt, fw_file), nxt,
-                 "Error flashing firmware");
-  printf("Firmware flash complete.\n");
   NXT_HANDLE_ERR(nxt_jump(nxt, 0x00100000), nxt,
                  "Error booting new firmware");
   printf("New firmware started!\n");
 
+  if (show_stats)
+    print_stats(location, nxt);
+
   NXT_HANDLE_ERR(nxt_close(nxt), NULL,
                  "Error while closing connection to NXT");
+  if (trace != NULL)
+    nxt_trace_free(trace);
+  nxt_flash_plan_free(&plan);
   return 0;
 }
@@ -0,0 +1,145 @@
+/**
+ * Main program code for the lzbench utility.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lz.h"
+
+/* Mirror the batched flash upload in firmware.c, and SAM-BA's command
+ * framing: 'S' and 'W' commands are 19 bytes, 'G' is 10.
+ */
+#define BATCH_SIZE (8 + 32 * 256)
+#define CMD_S 19
+#define CMD_W 19
+#define CMD_G 10
+
+/* Nominal full speed bulk throughput, for the time estimates. */
+#define WIRE_BYTES_PER_SEC 1000000.0
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_file(char *filename)
+{
+  FILE *f;
+  char *image, *stream, *check;
+  long len, raw_bytes = 0, lz_bytes = 0;
+  int raw_xfers = 0, lz_xfers = 0;
+  double t_comp = 0, t_decomp = 0, t;
+  long off;
+
+  f = fopen(filename, "rb");
+  if (f == NULL)
+    {
+      printf("%s: cannot open file\n", filename);
+      return 1;
+    }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  rewind(f);
+
+  image = calloc(1, len + BATCH_SIZE);
+  stream = malloc(BATCH_SIZE);
+  check = malloc(BATCH_SIZE);
+  if (image == NULL || stream == NULL || check == NULL ||
+      fread(image, 1, len, f) != len)
+    {
+      printf("%s: cannot read file\n", filename);
+      fclose(f);
+      return 1;
+    }
+  fclose(f);
+
+  for (off = 0; off < len; off += BATCH_SIZE - 8)
+    {
+      int chunk = len - off < BATCH_SIZE - 8 ? len - off : BATCH_SIZE - 8;
+      int size = 8 + ((chunk + 255) & ~255);
+      int clen;
+
+      raw_bytes += CMD_S + size + CMD_W + CMD_G;
+      raw_xfers += 4;
+
+      t = now();
+      clen = nxt_lz_compress(image + off, size, stream,
+                             size - 8 - NXT_LZ_JUMP_COST);
+      t_comp += now() - t;
+
+      if (clen < 0)
+        {
+          lz_bytes += CMD_S + size + CMD_W + CMD_G;
+          lz_xfers += 4;
+          continue;
+        }
+
+      t = now();
+      if (nxt_lz_decompress(stream, clen, check, size) != size ||
+          memcmp(check, image + off, size) != 0)
+        {
+          printf("%s: round trip mismatch at offset %ld\n", filename, off);
+          return 1;
+        }
+      t_decomp += now() - t;
+
+      lz_bytes += CMD_S + 8 + clen + CMD_G + CMD_W + CMD_G;
+      lz_xfers += 5;
+    }
+
+  printf("%s: %ld bytes\n", filename, len);
+  printf("  raw:        %8ld bytes on the wire, %5d transfers, "
+         "~%.3fs\n", raw_bytes, raw_xfers, raw_bytes / WIRE_BYTES_PER_SEC);
+  printf("  compressed: %8ld bytes on the wire, %5d transfers, "
+         "~%.3fs (%.1f%%)\n", lz_bytes, lz_xfers,
+         lz_bytes / WIRE_BYTES_PER_SEC, 100.0 * lz_bytes / raw_bytes);
+  printf("  host compression %.2fms, decompression check %.2fms\n",
+         t_comp * 1000, t_decomp * 1000);
+
+  free(image);
+  free(stream);
+  free(check);
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int i, ret = 0;
+
+  if (argc < 2)
+    {
+      printf("Syntax: %s <firmware image> [...]\n"
+             "\n"
+             "Compares the bytes sent to flash each image with raw and\n"
+             "compressed batch uploads.\n", argv[0]);
+      exit(1);
+    }
+
+  for (i = 1; i < argc; i++)
+    ret |= bench_file(argv[i]);
+
+  return ret;
+}
@@ -0,0 +1,331 @@
+/**
+ * Main program code for the nxtbench utility.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+#include "firmware.h"
+#include "agent.h"
+#include "emulator.h"
+
+/* Scratch SRAM for the benchmarks, clear of SAM-BA's own variables. */
+#define BENCH_ADDR 0x204000
+#define BENCH_FILE_LEN (16 * 1024)
+
+static const int chunk_sizes[] = { 64, 256, 1024, 4096, 16384 };
+#define N_CHUNK_SIZES (sizeof(chunk_sizes) / sizeof(chunk_sizes[0]))
+
+/* A device to benchmark against. connect() returns an open handle,
+ * past the SAM-BA handshake.
+ */
+struct bench_backend {
+  char *name;
+  char *help;
+  nxt_error_t (*connect)(nxt_t **nxt, char *device);
+};
+
+static nxt_error_t usb_connect(nxt_t **nxt, char *device)
+{
+  NXT_ERR(nxt_init(nxt));
+  if (device != NULL)
+    NXT_ERR(nxt_find_path(*nxt, device));
+  else
+    NXT_ERR(nxt_find(*nxt));
+
+  if (!nxt_is_firmware(*nxt, SAMBA))
+    return NXT_NOT_PRESENT;
+
+  NXT_ERR(nxt_open(*nxt, NXT_SAMBA_INTERFACE));
+  return nxt_handshake(*nxt);
+}
+
+/* The emulated brick takes its timings as the device argument. */
+static nxt_error_t emu_connect(nxt_t **nxt, char *device)
+{
+  nxt_emu_t *emu = nxt_emu_new();
+  int latency_us = 0, program_us = 0;
+
+  if (emu == NULL)
+    return NXT_CONFIGURATION_ERROR;
+
+  if (device != NULL)
+    sscanf(device, "%d,%d", &latency_us, &program_us);
+  nxt_emu_set_timing(emu, latency_us, program_us);
+
+  NXT_ERR(nxt_emu_init(nxt, emu));
+  NXT_ERR(nxt_open(*nxt, NXT_SAMBA_INTERFACE));
+  return nxt_handshake(*nxt);
+}
+
+static const struct bench_backend backends[] = {
+  { "usb", "an NXT in reset mode, over USB", usb_connect },
+  { "emu", "an emulated NXT; --device LATENCY_US[,PROGRAM_US]\n"
+    "           sets its per-transfer latency and page program time",
+    emu_connect },
+};
+#define N_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Round trips through the raw send/receive layer, reading one word,
+ * or pinging the agent when it runs.
+ */
+static nxt_error_t bench_roundtrip(nxt_t *nxt, int n)
+{
+  double *samples = malloc(n * sizeof(*samples));
+  double total = 0;
+  char cmd[20], buf[4];
+  int i;
+
+  if (samples == NULL)
+    return NXT_FILE_ERROR;
+
+  sprintf(cmd, "w%08X,4#", BENCH_ADDR);
+  for (i = 0; i < n; i++)
+    {
+      double t = now();
+      nxt_error_t err;
+
+      if (nxt_agent_running(nxt))
+        err = nxt_agent_ping(nxt);
+      else
+        {
+          err = nxt_send_str(nxt, cmd);
+          if (err == NXT_OK)
+            err = nxt_recv_buf(nxt, buf, 4);
+        }
+      if (err)
+        {
+          free(samples);
+          return err;
+        }
+
+      samples[i] = (now() - t) * 1e6;
+      total += samples[i];
+    }
+
+  qsort(samples, n, sizeof(*samples), compare_doubles);
+  printf("  \"roundtrip_us\": {\"n\": %d, \"min\": %.1f, \"mean\": %.1f, "
+         "\"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f},\n",
+         n, samples[0], total / n, samples[n / 2],
+         samples[(int)(n * 0.99)], samples[n - 1]);
+
+  free(samples);
+  return NXT_OK;
+}
+
+static nxt_error_t bench_words(nxt_t *nxt, int n)
+{
+  nxt_word_t w;
+  double t;
+  int i;
+
+  t = now();
+  for (i = 0; i < n; i++)
+    NXT_ERR(nxt_read_word(nxt, BENCH_ADDR, &w));
+  printf("  \"read_word_ops_per_sec\": %.1f,\n", n / (now() - t));
+
+  t = now();
+  for (i = 0; i < n; i++)
+    NXT_ERR(nxt_write_word(nxt, BENCH_ADDR, i));
+
+  /* Writes don't wait for anything, so read back once to make sure
+   * they all reached the brick before stopping the clock.
+   */
+  NXT_ERR(nxt_read_word(nxt, BENCH_ADDR, &w));
+  printf("  \"write_word_ops_per_sec\": %.1f,\n", n / (now() - t));
+
+  return NXT_OK;
+}
+
+static nxt_error_t bench_send_file(nxt_t *nxt)
+{
+  char *buf = malloc(BENCH_FILE_LEN);
+  nxt_error_t err = NXT_OK;
+  nxt_word_t w;
+  unsigned i;
+  int off;
+
+  if (buf == NULL)
+    return NXT_FILE_ERROR;
+  for (off = 0; off < BENCH_FILE_LEN; off++)
+    buf[off] = rand();
+
+  printf("  \"send_file\": [");
+  for (i = 0; i < N_CHUNK_SIZES && err == NXT_OK; i++)
+    {
+      int chunk = chunk_sizes[i];
+      double t = now();
+
+      for (off = 0; off < BENCH_FILE_LEN && err == NXT_OK; off += chunk)
+        err = nxt_send_file(nxt, BENCH_ADDR + off, buf + off, chunk);
+      if (err == NXT_OK)
+        err = nxt_read_word(nxt, BENCH_ADDR, &w);
+
+      if (err == NXT_OK)
+        printf("%s\n    {\"chunk\": %d, \"mb_per_sec\": %.3f}",
+               i ? "," : "", chunk, BENCH_FILE_LEN / (now() - t) / 1e6);
+    }
+
+  // Keep the output well-formed even when a run failed
+  printf("\n  ],\n");
+
+  free(buf);
+  return err;
+}
+
+static nxt_error_t bench_flash(nxt_t *nxt, char *image_path)
+{
+  char *image;
+  int len, n_pages;
+  nxt_error_t err;
+  double t;
+
+  if (image_path == NULL)
+    {
+      printf("  \"flash\": null\n");
+      return NXT_OK;
+    }
+
+  NXT_ERR(nxt_firmware_load(image_path, &image, &len));
+  n_pages = (len + 255) / 256;
+
+  t = now();
+  err = nxt_firmware_flash_buffer(nxt, image, len);
+  t = now() - t;
+  nxt_firmware_unload(image, len);
+  NXT_ERR(err);
+
+  printf("  \"flash\": {\"pages\": %d, \"seconds\": %.3f, "
+         "\"pages_per_sec\": %.1f}\n", n_pages, t, n_pages / t);
+  return NXT_OK;
+}
+
+static void usage(char *prog)
+{
+  unsigned i;
+
+  printf("Syntax: %s [options]\n"
+         "\n"
+         "Measures each layer of the SAM-BA stack and prints the\n"
+         "results as JSON.\n"
+         "\n"
+         "  --backend NAME  Device to benchmark against (default usb).\n"
+         "  --device ARG    Which device, or how, for the backend.\n"
+         "  --iterations N  Operations per latency benchmark (1000).\n"
+         "  --flash IMAGE   Also time flashing IMAGE. This overwrites\n"
+         "                  the firmware on the brick.\n"
+         "  --agent         Go through the resident agent instead of\n"
+         "                  SAM-BA.\n"
+         "\n"
+         "Backends:\n", prog);
+  for (i = 0; i < N_BACKENDS; i++)
+    printf("  %-8s %s\n", backends[i].name, backends[i].help);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  const struct bench_backend *backend = &backends[0];
+  char *device = NULL, *flash_image = NULL;
+  int iterations = 1000, agent = 0;
+  nxt_error_t err;
+  nxt_t *nxt;
+  int i;
+  unsigned j;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
+        {
+          i++;
+          for (j = 0; j < N_BACKENDS; j++)
+            if (strcmp(argv[i], backends[j].name) == 0)
+              break;
+          if (j == N_BACKENDS)
+            usage(argv[0]);
+          backend = &backends[j];
+        }
+      else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+        device = argv[++i];
+      else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+        iterations = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--flash") == 0 && i + 1 < argc)
+        flash_image = argv[++i];
+      else if (strcmp(argv[i], "--agent") == 0)
+        agent = 1;
+      else
+        usage(argv[0]);
+    }
+
+  if (iterations <= 0)
+    usage(argv[0]);
+
+  err = backend->connect(&nxt, device);
+  if (err == NXT_OK && agent)
+    err = nxt_agent_start(nxt);
+  if (err)
+    {
+      fprintf(stderr, "Error connecting to the %s backend: %s\n",
+              backend->name, nxt_str_error(err));
+      exit(err);
+    }
+
+  printf("{\n  \"backend\": \"%s\",\n  \"agent\": %s,\n", backend->name,
+         agent ? "true" : "false");
+
+  err = bench_roundtrip(nxt, iterations);
+  if (err == NXT_OK)
+    err = bench_words(nxt, iterations);
+  if (err == NXT_OK)
+    err = bench_send_file(nxt);
+  if (err == NXT_OK)
+    err = bench_flash(nxt, flash_image);
+
+  if (err)
+    {
+      printf("  \"error\": \"%s\"\n}\n", nxt_str_error(err));
+      nxt_close(nxt);
+      return err;
+    }
+
+  printf("}\n");
+  nxt_close(nxt);
+  return 0;
+}
@@ -0,0 +1,596 @@
+/**
+ * Main program code for the nxtd daemon.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+#include "agent.h"
+#include "daemon.h"
+
+/* How often the bus is scanned for bricks coming and going. */
+#define SCAN_INTERVAL_MS 1000
+
+/* Tickets of clients that stopped waiting, a brick's worth. */
+#define MAX_GAVE_UP 64
+
+/* A brick, and the handle the daemon keeps open to it. Clients get it
+ * in the order they asked, by ticket.
+ */
+struct brick {
+  char location[64];
+  nxt_t *nxt;
+  int fw;
+  int interface;       /* open on this interface, or -1 */
+  int broken;          /* a transfer failed, reopen before reuse */
+  int users;           /* clients holding or waiting for it */
+  unsigned long next_ticket;
+  unsigned long serving;
+  unsigned long gave_up[MAX_GAVE_UP];
+  int n_gave_up;
+  pthread_cond_t turn;
+  int seen;
+  struct brick *next;
+};
+
+static struct brick *bricks = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static char socket_path[108];
+
+static const char *fw_names[N_FIRMWARES] = { "SAM-BA", "LEGO", "NXTOS" };
+
+static struct brick *lookup(const char *location)
+{
+  struct brick *b;
+
+  for (b = bricks; b != NULL; b = b->next)
+    if (strcmp(b->location, location) == 0)
+      return b;
+
+  return NULL;
+}
+
+static void brick_close(struct brick *b)
+{
+  if (b->nxt != NULL)
+    nxt_close(b->nxt);
+  b->nxt = NULL;
+  b->interface = -1;
+  b->broken = 0;
+}
+
+/* Bricks in reset mode are opened right away, the others when a
+ * client first asks, since only it knows the interface it wants.
+ */
+static void brick_adopt(struct brick *b, nxt_t *nxt)
+{
+  int fw;
+
+  for (fw = 0; fw < N_FIRMWARES && !nxt_is_firmware(nxt, fw); fw++)
+    ;
+  b->nxt = nxt;
+  b->fw = fw;
+  if (fw == SAMBA && nxt_open(nxt, NXT_SAMBA_INTERFACE) == NXT_OK)
+    b->interface = NXT_SAMBA_INTERFACE;
+}
+
+/* Catch up with the bus: adopt new bricks, replace the handles of
+ * idle bricks that re-enumerated, and drop idle bricks that left.
+ * Bricks in use are left alone until their clients are done.
+ */
+static void rescan(void)
+{
+  nxt_t **found;
+  struct brick *b, **pb;
+  char location[64];
+  int i, n_found;
+
+  pthread_mutex_lock(&scan_lock);
+  if (nxt_find_all(&found, &n_found) != NXT_OK)
+    n_found = 0;
+
+  pthread_mutex_lock(&lock);
+  for (b = bricks; b != NULL; b = b->next)
+    b->seen = 0;
+
+  for (i = 0; i < n_found; i++)
+    {
+      nxt_get_location(found[i], location, sizeof(location));
+      b = lookup(location);
+      if (b != NULL)
+        {
+          b->seen = 1;
+          if (b->users > 0 ||
+              (b->nxt != NULL && nxt_same_device(b->nxt, found[i])))
+            {
+              nxt_close(found[i]);
+              continue;
+            }
+          brick_close(b);
+        }
+      else
+        {
+          b = calloc(1, sizeof(*b));
+          if (b == NULL)
+            {
+              nxt_close(found[i]);
+              continue;
+            }
+          snprintf(b->location, sizeof(b->location), "%s", location);
+          b->interface = -1;
+          b->seen = 1;
+          pthread_cond_init(&b->turn, NULL);
+          b->next = bricks;
+          bricks = b;
+        }
+
+      brick_adopt(b, found[i]);
+      printf("%s: %s brick attached\n", b->location,
+             b->fw < N_FIRMWARES ? fw_names[b->fw] : "unknown");
+    }
+  if (n_found > 0)
+    free(found);
+
+  for (pb = &bricks; *pb != NULL; )
+    {
+      b = *pb;
+      if (b->seen || b->users > 0)
+        {
+          pb = &b->next;
+          continue;
+        }
+      printf("%s: brick gone\n", b->location);
+      *pb = b->next;
+      brick_close(b);
+      pthread_cond_destroy(&b->turn);
+      free(b);
+    }
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&scan_lock);
+  fflush(stdout);
+}
+
+static void *scanner(void *arg)
+{
+  for (;;)
+    {
+      usleep(SCAN_INTERVAL_MS * 1000);
+      rescan();
+    }
+
+  return NULL;
+}
+
+/* Move on to the next ticket whose client is still waiting. */
+static void next_turn(struct brick *b)
+{
+  int i;
+
+  b->serving++;
+  for (;;)
+    {
+      for (i = 0; i < b->n_gave_up && b->gave_up[i] != b->serving; i++)
+        ;
+      if (i == b->n_gave_up)
+        break;
+      b->gave_up[i] = b->gave_up[--b->n_gave_up];
+      b->serving++;
+    }
+  pthread_cond_broadcast(&b->turn);
+}
+
+/* Wait for our turn with the brick at location, for up to
+ * NXTD_OPEN_WAIT_MS.
+ */
+static nxt_error_t acquire(const char *location, struct brick **owned)
+{
+  struct brick *b;
+  struct timespec deadline;
+  unsigned long ticket;
+
+  pthread_mutex_lock(&lock);
+  b = lookup(location);
+  if (b == NULL)
+    {
+      // It may have just been plugged in
+      pthread_mutex_unlock(&lock);
+      rescan();
+      pthread_mutex_lock(&lock);
+      b = lookup(location);
+    }
+  if (b == NULL)
+    {
+      pthread_mutex_unlock(&lock);
+      return NXT_NOT_PRESENT;
+    }
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += NXTD_OPEN_WAIT_MS / 1000;
+  deadline.tv_nsec += NXTD_OPEN_WAIT_MS % 1000 * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+  b->users++;
+  ticket = b->next_ticket++;
+  while (b->serving != ticket)
+    {
+      /* Giving up needs room to note the turn to skip, so without it
+       * wait for a turn to go by, rather than time out over and over.
+       */
+      if (b->n_gave_up == MAX_GAVE_UP)
+        {
+          pthread_cond_wait(&b->turn, &lock);
+          continue;
+        }
+
+      if (pthread_cond_timedwait(&b->turn, &lock, &deadline) == ETIMEDOUT &&
+          b->serving != ticket && b->n_gave_up < MAX_GAVE_UP)
+        {
+          // Our turn gets skipped when it comes
+          b->gave_up[b->n_gave_up++] = ticket;
+          b->users--;
+          pthread_mutex_unlock(&lock);
+          return NXT_IN_USE;
+        }
+    }
+  pthread_mutex_unlock(&lock);
+
+  *owned = b;
+  return NXT_OK;
+}
+
+static void release(struct brick *b)
+{
+  if (b == NULL)
+    return;
+
+  /* A client gone with the agent running would leave the brick deaf
+   * to SAM-BA commands, so bring it back for the next one.
+   */
+  if (b->nxt != NULL && !b->broken && nxt_agent_running(b->nxt))
+    nxt_agent_stop(b->nxt);
+
+  pthread_mutex_lock(&lock);
+  b->users--;
+  next_turn(b);
+  pthread_mutex_unlock(&lock);
+}
+
+/* Get the brick's handle open on interface, reopening it after a
+ * failure or for another interface.
+ */
+static nxt_error_t prepare(struct brick *b, int interface)
+{
+  nxt_error_t err;
+
+  if (b->nxt != NULL && b->interface == interface && !b->broken)
+    return NXT_OK;
+
+  if (b->nxt != NULL && b->interface < 0)
+    {
+      err = nxt_open(b->nxt, interface);
+      if (err == NXT_OK)
+        b->interface = interface;
+      return err;
+    }
+
+  brick_close(b);
+  NXT_ERR(nxt_init(&b->nxt));
+  if (b->nxt == NULL)
+    return NXT_CONFIGURATION_ERROR;
+
+  // The find rescans libusb's bus list, which the scanner also updates
+  pthread_mutex_lock(&scan_lock);
+  err = nxt_find_path(b->nxt, b->location);
+  if (err == NXT_OK)
+    err = nxt_open(b->nxt, interface);
+  pthread_mutex_unlock(&scan_lock);
+  if (err != NXT_OK)
+    {
+      nxt_close(b->nxt);
+      b->nxt = NULL;
+      return err;
+    }
+
+  b->interface = interface;
+  return NXT_OK;
+}
+
+static nxt_error_t list_bricks(char *buf, int max, int *len)
+{
+  struct brick *b;
+  int n;
+
+  pthread_mutex_lock(&lock);
+  if (bricks == NULL)
+    {
+      pthread_mutex_unlock(&lock);
+      rescan();
+      pthread_mutex_lock(&lock);
+    }
+
+  *len = 0;
+  for (b = bricks; b != NULL; b = b->next)
+    {
+      n = strlen(b->location) + 2;
+      if (*len + n > max)
+        break;
+      buf[*len] = b->fw;
+      memcpy(buf + *len + 1, b->location, n - 1);
+      *len += n;
+    }
+  pthread_mutex_unlock(&lock);
+
+  return NXT_OK;
+}
+
+/* Serve one client, until it hangs up. It owns at most one brick at
+ * a time, from NXTD_OPEN to NXTD_CLOSE.
+ */
+static void *serve(void *arg)
+{
+  int fd = (intptr_t)arg;
+  char *buf = malloc(NXTD_MAX_PAYLOAD);
+  struct brick *owned = NULL;
+  nxt_error_t err;
+  int type, len, n;
+
+  while (buf != NULL &&
+         nxt_daemon_recv_msg(fd, &type, buf, NXTD_MAX_PAYLOAD,
+                             &len) == NXT_OK)
+    {
+      int reply_len = 0;
+
+      if (type != NXTD_LIST && type != NXTD_OPEN && type != NXTD_CLOSE &&
+          owned == NULL)
+        err = NXT_CONFIGURATION_ERROR;
+      else switch (type)
+        {
+        case NXTD_LIST:
+          err = list_bricks(buf, NXTD_MAX_PAYLOAD, &reply_len);
+          break;
+
+        case NXTD_OPEN:
+          release(owned);
+          owned = NULL;
+          if (len < 13 || buf[len - 1] != '\0')
+            {
+              err = NXT_DAEMON_ERROR;
+              break;
+            }
+          err = acquire(buf + 12, &owned);
+          if (err != NXT_OK)
+            break;
+          err = prepare(owned, nxt_load_word(buf));
+          if (err == NXT_OK)
+            {
+              nxt_set_timeout(owned->nxt, nxt_load_word(buf + 4));
+              nxt_set_retries(owned->nxt, nxt_load_word(buf + 8));
+            }
+          else
+            {
+              release(owned);
+              owned = NULL;
+            }
+          break;
+
+        case NXTD_SEND:
+          err = nxt_send_buf(owned->nxt, buf, len);
+          if (err == NXT_OK)
+            nxt_agent_note_send(owned->nxt, buf, len);
+          break;
+
+        case NXTD_RECV:
+          n = len == 4 ? nxt_load_word(buf) : -1;
+          if (n < 0 || n > NXTD_MAX_PAYLOAD)
+            err = NXT_DAEMON_ERROR;
+          else
+            err = nxt_recv_buf_partial(owned->nxt, buf, n, &reply_len);
+          break;
+
+        case NXTD_CLOSE:
+          release(owned);
+          owned = NULL;
+          err = NXT_OK;
+          break;
+
+        case NXTD_RECONNECT:
+          err = len == 4 ? nxt_reconnect(owned->nxt, nxt_load_word(buf))
+                         : NXT_DAEMON_ERROR;
+          break;
+
+        default:
+          err = NXT_DAEMON_ERROR;
+          break;
+        }
+
+      // Timeouts are how SAM-BA says it has nothing to send
+      if (owned != NULL && type == NXTD_RECONNECT)
+        owned->broken = err != NXT_OK;
+      else if (owned != NULL && (err == NXT_USB_WRITE_ERROR ||
+                                 err == NXT_USB_READ_ERROR))
+        owned->broken = 1;
+      if (err != NXT_OK)
+        reply_len = 0;
+      if (nxt_daemon_send_msg(fd, err, buf, reply_len) != NXT_OK)
+        break;
+    }
+
+  release(owned);
+  close(fd);
+  free(buf);
+  return NULL;
+}
+
+/* Make sure nobody else can replace the socket at path: its directory
+ * must be ours or root's, and writable by nobody else unless sticky.
+ * The directory is created private to us when missing.
+ */
+static int socket_dir_safe(const char *path)
+{
+  char dir[108];
+  char *slash;
+  struct stat st;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  slash = strrchr(dir, '/');
+  if (slash == NULL)
+    snprintf(dir, sizeof(dir), ".");
+  else if (slash == dir)
+    dir[1] = '\0';
+  else
+    *slash = '\0';
+
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    return 0;
+
+  if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+    return 0;
+  if (st.st_uid != geteuid() && st.st_uid != 0)
+    return 0;
+
+  return (st.st_mode & S_ISVTX) || !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+static void quit(int sig)
+{
+  unlink(socket_path);
+  _exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+  struct sockaddr_un sa;
+  pthread_t thread;
+  pthread_attr_t attr;
+  int fd, client;
+
+  if (argc == 3 && strcmp(argv[1], "--socket") == 0)
+    setenv("NXTD_SOCKET", argv[2], 1);
+  else if (argc != 1)
+    {
+      printf("Syntax: %s [--socket PATH]\n"
+             "\n"
+             "Keeps every attached NXT open, and lets libnxt programs\n"
+             "share them through a Unix domain socket, by default\n"
+             "nxtd in $XDG_RUNTIME_DIR, or /tmp/nxtd-<uid>/socket.\n"
+             "Programs use the daemon whenever it runs, unless\n"
+             "NXT_NO_DAEMON is set in their environment. Only programs\n"
+             "run by the same user get in.\n"
+             "  --socket PATH  Listen on PATH instead. Clients find it\n"
+             "                 through $NXTD_SOCKET.\n", argv[0]);
+      exit(1);
+    }
+
+  if (nxt_daemon_available())
+    {
+      printf("nxtd is already running.\n");
+      exit(1);
+    }
+
+  // The daemon talks to the bricks itself
+  nxt_daemon_disable();
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  nxt_daemon_socket_path(sa.sun_path, sizeof(sa.sun_path));
+  snprintf(socket_path, sizeof(socket_path), "%s", sa.sun_path);
+
+  if (!socket_dir_safe(socket_path))
+    {
+      fprintf(stderr, "%s: directory not private to this user\n",
+              socket_path);
+      exit(1);
+    }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      perror("socket");
+      exit(1);
+    }
+
+  // Nobody answered, so any socket there was left by a dead daemon
+  unlink(socket_path);
+
+  umask(0077);
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+      listen(fd, 16) < 0)
+    {
+      perror(socket_path);
+      exit(1);
+    }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, quit);
+  signal(SIGTERM, quit);
+
+  rescan();
+  printf("nxtd listening on %s\n", socket_path);
+  fflush(stdout);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, scanner, NULL) != 0)
+    {
+      perror("pthread_create");
+      exit(1);
+    }
+
+  for (;;)
+    {
+      client = accept(fd, NULL, NULL);
+      if (client < 0)
+        {
+          if (errno != EINTR)
+            perror("accept");
+          continue;
+        }
+
+      if (!nxt_daemon_peer_trusted(client))
+        {
+          close(client);
+          continue;
+        }
+
+      if (pthread_create(&thread, &attr, serve,
+                         (void *)(intptr_t)client) != 0)
+        close(client);
+    }
+
+  return 0;
+}
@@ -0,0 +1,409 @@
+/**
+ * Main program code for the nxtfile utility.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "lego.h"
+
+static int timeout_ms = NXT_DEFAULT_TIMEOUT;
+static int assume_yes = 0;
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Report a failure, with the brick's own reason when it gave one. */
+static void report(nxt_t *nxt, const char *what, const char *name,
+                   nxt_error_t err)
+{
+  if (err == NXT_LEGO_ERROR)
+    fprintf(stderr, "%s %s: %s\n", what, name,
+            nxt_lego_str_status(nxt_lego_status(nxt)));
+  else
+    fprintf(stderr, "%s %s: %s\n", what, name, nxt_str_error(err));
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+  FILE *f = fopen(path, "rb");
+  char *buf = NULL;
+  long size;
+
+  if (f == NULL)
+    return NULL;
+
+  if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 &&
+      fseek(f, 0, SEEK_SET) == 0)
+    {
+      buf = malloc(size ? size : 1);
+      if (buf != NULL && fread(buf, 1, size, f) != size)
+        {
+          free(buf);
+          buf = NULL;
+        }
+      *len = size;
+    }
+
+  fclose(f);
+  return buf;
+}
+
+static int write_file(const char *path, const char *buf, size_t len)
+{
+  FILE *f = fopen(path, "wb");
+  int ok;
+
+  if (f == NULL)
+    return 0;
+
+  ok = fwrite(buf, 1, len, f) == len;
+  return fclose(f) == 0 && ok;
+}
+
+static int do_list(nxt_t *nxt, const char *pattern)
+{
+  nxt_lego_file_t *files;
+  nxt_error_t err;
+  int i, n_files;
+
+  err = nxt_lego_list(nxt, pattern, &files, &n_files);
+  if (err)
+    {
+      report(nxt, "Error listing", pattern, err);
+      return 1;
+    }
+
+  for (i = 0; i < n_files; i++)
+    printf("%8lu  %s\n", (unsigned long)files[i].size, files[i].name);
+
+  free(files);
+  return 0;
+}
+
+static int do_upload(nxt_t *nxt, const char *path)
+{
+  const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  nxt_error_t err;
+  size_t len;
+  char *buf;
+  double t;
+
+  buf = read_file(path, &len);
+  if (buf == NULL)
+    {
+      report(nxt, "Error reading", path, NXT_FILE_ERROR);
+      return 1;
+    }
+
+  t = now();
+  err = nxt_lego_upload(nxt, name, buf, len);
+  t = now() - t;
+  free(buf);
+
+  if (err)
+    {
+      report(nxt, "Error uploading", name, err);
+      return 1;
+    }
+
+  printf("Uploaded %s, %zu bytes in %.2f s (%.1f KB/s).\n", name, len, t,
+         t > 0 ? len / t / 1024 : 0.0);
+  return 0;
+}
+
+static int do_download(nxt_t *nxt, const char *name)
+{
+  nxt_error_t err;
+  size_t len;
+  char *buf;
+  double t;
+
+  t = now();
+  err = nxt_lego_download(nxt, name, &buf, &len);
+  t = now() - t;
+  if (err)
+    {
+      report(nxt, "Error downloading", name, err);
+      return 1;
+    }
+
+  if (!write_file(name, buf, len))
+    {
+      report(nxt, "Error writing", name, NXT_FILE_ERROR);
+      free(buf);
+      return 1;
+    }
+
+  printf("Downloaded %s, %zu bytes in %.2f s (%.1f KB/s).\n", name, len, t,
+         t > 0 ? len / t / 1024 : 0.0);
+  free(buf);
+  return 0;
+}
+
+static int do_delete(nxt_t *nxt, const char *name)
+{
+  nxt_error_t err = nxt_lego_delete(nxt, name);
+
+  if (err)
+    {
+      report(nxt, "Error deleting", name, err);
+      return 1;
+    }
+
+  return 0;
+}
+
+static int confirm(const char *question)
+{
+  char answer[16];
+
+  if (assume_yes)
+    return 1;
+
+  printf("%s [y/N] ", question);
+  fflush(stdout);
+  if (fgets(answer, sizeof(answer), stdin) == NULL)
+    return 0;
+
+  return answer[0] == 'y' || answer[0] == 'Y';
+}
+
+static int do_defrag(nxt_t *nxt)
+{
+  char backup[] = "nxt-defrag-XXXXXX";
+  nxt_error_t err;
+
+  if (!confirm("Defragmenting erases the user flash and rewrites every "
+               "file. Continue?"))
+    {
+      printf("Not defragmenting.\n");
+      return 1;
+    }
+
+  if (mkdtemp(backup) == NULL)
+    {
+      report(nxt, "Error creating", "a backup directory", NXT_FILE_ERROR);
+      return 1;
+    }
+
+  printf("Defragmenting, backing the files up to %s...\n", backup);
+  err = nxt_lego_defrag(nxt, backup);
+  if (err)
+    {
+      report(nxt, "Error while", "defragmenting", err);
+      fprintf(stderr, "The files read so far are in %s, upload any that "
+              "are missing from the NXT.\n", backup);
+      return 1;
+    }
+
+  printf("Done. The backup in %s can be removed.\n", backup);
+  return 0;
+}
+
+/* Run the command on an open brick, returning how many parts failed. */
+static int run(nxt_t *nxt, char *cmd, int argc, char *argv[])
+{
+  int failed = 0;
+  int i;
+
+  nxt_set_timeout(nxt, timeout_ms);
+
+  if (strcmp(cmd, "list") == 0)
+    return do_list(nxt, argc > 0 ? argv[0] : "*.*");
+  if (strcmp(cmd, "defrag") == 0)
+    return do_defrag(nxt);
+
+  for (i = 0; i < argc; i++)
+    {
+      if (strcmp(cmd, "upload") == 0)
+        failed += do_upload(nxt, argv[i]);
+      else if (strcmp(cmd, "download") == 0)
+        failed += do_download(nxt, argv[i]);
+      else
+        failed += do_delete(nxt, argv[i]);
+    }
+
+  return failed;
+}
+
+static int run_all(char *cmd, int argc, char *argv[])
+{
+  nxt_t **nxts;
+  char location[64];
+  int failed = 0, n_lego = 0;
+  int i, n_nxts;
+
+  if (nxt_find_all(&nxts, &n_nxts) != NXT_OK)
+    {
+      fprintf(stderr, "No NXT found. Are they properly plugged in via USB?\n");
+      exit(1);
+    }
+
+  // One brick at a time, as downloads land in the same files
+  for (i = 0; i < n_nxts; i++)
+    {
+      nxt_get_location(nxts[i], location, sizeof(location));
+      if (!nxt_is_firmware(nxts[i], LEGO))
+        printf("[%s] not running the LEGO firmware, skipping.\n", location);
+      else if (nxt_open(nxts[i], NXT_LEGO_INTERFACE) != NXT_OK)
+        {
+          printf("[%s] can't connect, skipping.\n", location);
+          failed++;
+        }
+      else
+        {
+          printf("[%s]\n", location);
+          failed += run(nxts[i], cmd, argc, argv);
+          n_lego++;
+        }
+      nxt_close(nxts[i]);
+    }
+  free(nxts);
+
+  if (n_lego == 0)
+    {
+      fprintf(stderr, "None of the NXTs found run the LEGO firmware.\n");
+      exit(2);
+    }
+
+  return failed;
+}
+
+static void usage(char *prog)
+{
+  fprintf(stderr,
+          "Syntax: %s [options] <command> [arguments]\n"
+          "\n"
+          "  list [PATTERN]     List the files, or those matching PATTERN\n"
+          "                     (e.g. *.rxe).\n"
+          "  upload FILE...     Copy files to the NXT, replacing any\n"
+          "                     already there.\n"
+          "  download NAME...   Copy files from the NXT to the current\n"
+          "                     directory.\n"
+          "  delete NAME...     Delete files from the NXT.\n"
+          "  defrag             Gather the free space, by reading every\n"
+          "                     file, erasing the user flash and writing\n"
+          "                     them back. The files are backed up first\n"
+          "                     to a new nxt-defrag-* directory.\n"
+          "\n"
+          "  --device PATH  Use the NXT at a sysfs or port path\n"
+          "                 (e.g. 1-2.3), or a bus:device address.\n"
+          "  --all          Run the command on every NXT found, in turn.\n"
+          "  --timeout MS   Give up on USB transfers after MS\n"
+          "                 milliseconds (0 waits forever).\n"
+          "  --yes          Don't ask before defragmenting.\n"
+          "\n"
+          "The NXT must be running the LEGO firmware. The files a defrag\n"
+          "cut short didn't write back are in its backup directory.\n"
+          "\n"
+          "Example: %s upload program.rxe sound.rso\n",
+          prog, prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_t *nxt;
+  nxt_error_t err;
+  char *device = NULL;
+  char *cmd;
+  int all = 0;
+  int failed;
+  int i;
+
+  for (i = 1; i < argc; i++)
+    {
+      if (strcmp(argv[i], "--device") == 0 && i + 1 < argc)
+        device = argv[++i];
+      else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+        timeout_ms = atoi(argv[++i]);
+      else if (strcmp(argv[i], "--all") == 0)
+        all = 1;
+      else if (strcmp(argv[i], "--yes") == 0)
+        assume_yes = 1;
+      else
+        break;
+    }
+
+  if (i == argc || (all && device != NULL))
+    usage(argv[0]);
+
+  cmd = argv[i++];
+  if (!(strcmp(cmd, "list") == 0 && argc - i <= 1) &&
+      !(strcmp(cmd, "defrag") == 0 && argc == i) &&
+      !((strcmp(cmd, "upload") == 0 || strcmp(cmd, "download") == 0 ||
+         strcmp(cmd, "delete") == 0) && argc > i))
+    usage(argv[0]);
+
+  if (all)
+    return run_all(cmd, argc - i, argv + i) ? 3 : 0;
+
+  err = nxt_init(&nxt);
+  if (err)
+    {
+      fprintf(stderr, "Error during library initialization: %s\n",
+              nxt_str_error(err));
+      exit(err);
+    }
+
+  if (device != NULL)
+    err = nxt_find_path(nxt, device);
+  else
+    err = nxt_find(nxt);
+  if (err)
+    {
+      if (err == NXT_NOT_PRESENT)
+        fprintf(stderr,
+                "NXT not found. Is it properly plugged in via USB?\n");
+      else
+        fprintf(stderr, "Error while scanning for NXT: %s\n",
+                nxt_str_error(err));
+      exit(1);
+    }
+
+  if (!nxt_is_firmware(nxt, LEGO))
+    {
+      fprintf(stderr, "NXT found, but not running the LEGO firmware.\n");
+      exit(2);
+    }
+
+  err = nxt_open(nxt, NXT_LEGO_INTERFACE);
+  if (err)
+    {
+      fprintf(stderr, "Error while connecting to NXT: %s\n",
+              nxt_str_error(err));
+      exit(err);
+    }
+
+  failed = run(nxt, cmd, argc - i, argv + i);
+
+  nxt_close(nxt);
+  return failed ? 3 : 0;
+}
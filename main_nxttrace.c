@@ -0,0 +1,226 @@
+/**
+ * Main program code for the nxttrace utility.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "trace.h"
+
+static const struct {
+  char cmd;
+  char *name;
+} samba_commands[] = {
+  { 'N', "handshake" },
+  { 'V', "version" },
+  { 'O', "write byte" },
+  { 'H', "write hword" },
+  { 'W', "write word" },
+  { 'o', "read byte" },
+  { 'h', "read hword" },
+  { 'w', "read word" },
+  { 'S', "send file" },
+  { 'R', "receive file" },
+  { 'G', "jump" },
+  { '?', "unknown" },
+};
+#define N_COMMANDS (sizeof(samba_commands) / sizeof(samba_commands[0]))
+
+struct command_stats {
+  long count;
+  long bytes_out;
+  long bytes_in;
+  double seconds;
+};
+
+static int command_index(char cmd)
+{
+  unsigned i;
+
+  for (i = 0; i < N_COMMANDS - 1; i++)
+    if (samba_commands[i].cmd == cmd)
+      return i;
+
+  return N_COMMANDS - 1;
+}
+
+/* Split an OUT transfer into the commands it carries. Its time is
+ * shared out by bytes, since coalesced commands travel together.
+ * *data_left tracks the payload of an 'S' command spanning transfers,
+ * and *reply the command the next IN transfer answers.
+ */
+static void account_out(struct command_stats *stats, nxt_trace_record_t *r,
+                        long *data_left, int *reply)
+{
+  int pos = 0;
+
+  while (pos < r->len)
+    {
+      int start = pos, idx, n;
+
+      if (*data_left > 0)
+        {
+          n = r->len - pos < *data_left ? r->len - pos : *data_left;
+          idx = command_index('S');
+          *data_left -= n;
+        }
+      else
+        {
+          char *end = memchr(r->data + pos, '#', r->len - pos);
+          char cmd = r->data[pos];
+          unsigned addr, arg;
+
+          n = end ? end - (r->data + pos) + 1 : r->len - pos;
+          idx = command_index(cmd);
+          stats[idx].count++;
+
+          if (cmd == 'S' && sscanf(r->data + pos + 1, "%x,%x",
+                                   &addr, &arg) == 2)
+            *data_left = arg;
+          if (strchr("NVohwR", cmd) != NULL)
+            *reply = idx;
+        }
+
+      pos += n;
+      stats[idx].bytes_out += n;
+      stats[idx].seconds += r->duration_us / 1e6 * (pos - start) / r->len;
+    }
+}
+
+static int summary(nxt_trace_t *trace)
+{
+  struct command_stats stats[N_COMMANDS];
+  double total, host = 0, busy = 0;
+  long data_left = 0;
+  int reply = N_COMMANDS - 1;
+  unsigned i;
+  int n;
+
+  memset(stats, 0, sizeof(stats));
+
+  for (n = 0; n < trace->n_records; n++)
+    {
+      nxt_trace_record_t *r = &trace->records[n];
+
+      // Time between transfers is spent on the host
+      if (n > 0)
+        {
+          nxt_trace_record_t *prev = &trace->records[n - 1];
+          double gap = (r->start_ns - prev->start_ns) / 1e9 -
+            prev->duration_us / 1e6;
+
+          if (gap > 0)
+            host += gap;
+        }
+
+      busy += r->duration_us / 1e6;
+      if (r->direction == NXT_TRACE_OUT)
+        account_out(stats, r, &data_left, &reply);
+      else
+        {
+          stats[reply].bytes_in += r->len;
+          stats[reply].seconds += r->duration_us / 1e6;
+        }
+    }
+
+  total = busy + host;
+  printf("%d transfers", trace->n_records);
+  if (trace->n_dropped)
+    printf(" (%lu dropped during capture)", trace->n_dropped);
+  printf(", %.3fs\n\n", total);
+
+  printf("%-14s %8s %10s %10s %10s %6s\n",
+         "command", "count", "bytes out", "bytes in", "time (ms)", "%");
+  for (i = 0; i < N_COMMANDS; i++)
+    {
+      struct command_stats *s = &stats[i];
+
+      if (s->count == 0 && s->bytes_out == 0 && s->bytes_in == 0)
+        continue;
+
+      printf("%c %-12s %8ld %10ld %10ld %10.1f %5.1f%%\n",
+             samba_commands[i].cmd, samba_commands[i].name, s->count,
+             s->bytes_out, s->bytes_in, s->seconds * 1000,
+             total > 0 ? 100 * s->seconds / total : 0);
+    }
+  printf("  %-12s %8s %10s %10s %10.1f %5.1f%%\n", "host", "", "", "",
+         host * 1000, total > 0 ? 100 * host / total : 0);
+
+  return 0;
+}
+
+static int dump(nxt_trace_t *trace)
+{
+  int n, i;
+
+  for (n = 0; n < trace->n_records; n++)
+    {
+      nxt_trace_record_t *r = &trace->records[n];
+
+      printf("%12.6f %8uus %s 0x%02X %5d %-6s ", r->start_ns / 1e9,
+             r->duration_us, r->direction == NXT_TRACE_OUT ? "OUT" : "IN ",
+             r->endpoint, r->len, r->status ? "ERR" : "ok");
+
+      // Commands are readable, data isn't
+      for (i = 0; i < r->len && i < 32; i++)
+        putchar(isprint((unsigned char)r->data[i]) ? r->data[i] : '.');
+      printf("%s\n", r->len > 32 ? "..." : "");
+    }
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_trace_t *trace;
+  nxt_error_t err;
+  int ret;
+
+  if (argc != 3 ||
+      (strcmp(argv[1], "summary") != 0 && strcmp(argv[1], "dump") != 0))
+    {
+      printf("Syntax: %s summary|dump <trace file>\n"
+             "\n"
+             "  summary  Break the time down by SAM-BA command.\n"
+             "  dump     List every transfer.\n"
+             "\n"
+             "Traces are recorded with fwflash --trace.\n", argv[0]);
+      exit(1);
+    }
+
+  err = nxt_trace_load(argv[2], &trace);
+  if (err)
+    {
+      printf("%s: %s\n", argv[2], nxt_str_error(err));
+      exit(err);
+    }
+
+  if (strcmp(argv[1], "summary") == 0)
+    ret = summary(trace);
+  else
+    ret = dump(trace);
+
+  nxt_trace_free(trace);
+  return ret;
+}
@@ -2,7 +2,8 @@
 #
 # Take the flash_routine.bin file, and embed it as an array of bytes
 # in a flash_routine.h, ready for packaging with the C firmware
-# flasher.
+# flasher. The other onboard routines in flash_write are embedded the
+# same way, each into its own header.
 #
 # If a file name is provided on the commandline, load that file as the
 # firmware flashing routine instead.
@@ -11,74 +12,61 @@
 import sys
 import os
 import os.path
-import urllib2
-import sha
 
 FLASH_DIR = 'flash_write'
 FLASH_BIN = 'flash.bin'
 FLASH_PATH = os.path.join(FLASH_DIR, FLASH_BIN)
 
-DOWNLOAD_FLASH_CHECKSUM = '589501072d76be483f873a787080adcab20841f4'
-DOWNLOAD_FLASH_URL = 'http://libnxt.googlecode.com/files/flash.bin'
+# The flash driver runs at 0x202000 and reads its batch descriptor
+# address from 0x202300, so it must end before that.
+FLASH_MAX_SIZE = 0x300
+
+# Other onboard routines: (binary, template prefix, maximum size). The
+# size is what the routine has before its own data: the crc tables at
+# 0x202800, the mailboxes 1k after the start of the others, and the
+# agent's CRC table 3k after its start.
+ROUTINES = [
+    ('crc.bin', 'crc', 0x400),
+    ('unlz.bin', 'unlz', 0x400),
+    ('seq.bin', 'seq', 0x400),
+    ('agent.bin', 'agent', 0xC00),
+    ('csum.bin', 'csum', 0x400),
+    ('regs.bin', 'regs', 0x400),
+    ]
 
 def check_flash_size():
     statinfo = os.stat(FLASH_PATH)
-    if statinfo.st_size > 1024:
+    if statinfo.st_size > FLASH_MAX_SIZE:
         print "The flash driver looks too big, refusing to embed."
         return False
     return True
 
 def ensure_flash_bin():
-    # If the flash binary does exist, just check its size and return.
-    if os.path.isfile(FLASH_PATH):
-        return check_flash_size()
-
-    # If the binary doesn't exist, offer to download a binary build
-    # from Google Code.
-    print """
-Embedded flash driver not found. This is required to build LibNXT.
-
-If you have an ARM7 cross-compiler toolchain available, you can build
-the flash driver by interrupting (ctrl-C) this build and running
-'make' in the 'flash_write' subdirectory. Then rerun this build again,
-and everything should work great.
-
-If you do not have a cross-compiler, do not despair! I can also
-download a copy of the compiled driver (built by the libnxt developer)
-from the project website and use that.
-"""
-    reply = raw_input("Is that okay? (y/n) ")
-    if reply not in ('y', 'Y', 'yes'):
-        print ("Okay, you're the boss. But that does mean I can't build "
-               "LibNXT. Sorry.")
+    # The onboard routines ship prebuilt, as few people have an ARM7
+    # cross-compiler at hand. Rebuilding them with 'make' in the
+    # 'flash_write' subdirectory overwrites the shipped copies.
+    if not os.path.isfile(FLASH_PATH):
+        print "Embedded flash driver %s not found. Please restore it" % FLASH_PATH
+        print "from the source tree, or run 'make' in the '%s'" % FLASH_DIR
+        print "subdirectory with an ARM7 cross-compiler."
         return False
-    f = urllib2.urlopen(DOWNLOAD_FLASH_URL)
-    data = f.read()
-    f.close()
-
-    # Verify the SHA-1 checksum
-    checksum = sha.new(data).hexdigest()
-    if checksum != DOWNLOAD_FLASH_CHECKSUM:
-        print "Oops, the flash binary I downloaded has the wrong checksum!"
-        print "Aborting :("
-        return False
-
-    f = open(FLASH_PATH, 'w')
-    f.write(data)
-    f.close()
+    return check_flash_size()
 
-    if os.path.isfile(FLASH_PATH):
-        return check_flash_size()
 
-    # Dude, you're really not lucky, are you.
-    return False
+def ensure_routine_bin(path, max_size):
+    if not os.path.isfile(path):
+        print "Onboard routine %s not found. Please restore it from" % path
+        print "the source tree, or run 'make' in the '%s'" % FLASH_DIR
+        print "subdirectory with an ARM7 cross-compiler."
+        return False
+    if os.stat(path).st_size > max_size:
+        print "%s looks too big, refusing to embed." % path
+        return False
+    return True
 
 
-def main():
-    if not ensure_flash_bin():
-        sys.exit(1)
-
-    f = file(FLASH_PATH)
+def embed(bin_path, prefix, header):
+    f = file(bin_path)
     fwbin = f.read()
     f.close()
 
@@ -91,19 +79,33 @@ def main():
     len_data = "%d" % len(data)
 
     # Read in the template
-    tplfile = file('flash_routine.h.base')
+    tplfile = file(header + '.base')
     template = tplfile.read()
     tplfile.close()
 
     # Replace the values in the template
-    template = template.replace('___FLASH_BIN___', data_str + '\n')
-    template = template.replace('___FLASH_LEN___', len_data)
+    tag = prefix.upper()
+    template = template.replace('___%s_BIN___' % tag, data_str + '\n')
+    template = template.replace('___%s_LEN___' % tag, len_data)
 
     # Output the done header
-    out = file('flash_routine.h', 'w')
+    out = file(header, 'w')
     out.write(template)
     out.close()
 
+
+def main():
+    if not ensure_flash_bin():
+        sys.exit(1)
+
+    embed(FLASH_PATH, 'flash', 'flash_routine.h')
+
+    for bin_name, prefix, max_size in ROUTINES:
+        path = os.path.join(FLASH_DIR, bin_name)
+        if not ensure_routine_bin(path, max_size):
+            sys.exit(1)
+        embed(path, prefix, '%s_routine.h' % prefix)
+
 if __name__ == '__main__':
     main()
 
@@ -0,0 +1,231 @@
+/**
+ * NXT bootstrap interface; batched register access.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+#include "agent.h"
+#include "regs.h"
+#include "request.h"
+#include "regs_routine.h"
+
+/* Mailbox layout (see flash_write/regs.c): the access count, the
+ * addresses, then the values. Writes are flagged in the address.
+ */
+#define REGS_MAILBOX (NXT_REGS_ADDR + 0x400)
+#define REGS_WRITE   1
+
+
+#define REGS_MAILBOX_SIZE (4 + NXT_REGS_MAX_OPS * 8)
+
+
+/* Fill in the mailbox for a batch, returning the length to upload. */
+static int
+nxt_regs_mailbox(char *mailbox, const nxt_addr_t *addrs,
+                 const nxt_word_t *values, int n, int write)
+{
+  int i;
+
+  nxt_store_word(mailbox, n);
+  for (i = 0; i < n; i++)
+    {
+      nxt_store_word(mailbox + 4 + i * 4, addrs[i] | write);
+      nxt_store_word(mailbox + 4 + (n + i) * 4, write ? values[i] : 0);
+    }
+
+  return 4 + n * (write ? 8 : 4);
+}
+
+
+static nxt_error_t
+nxt_regs_run(nxt_t *nxt, const nxt_addr_t *addrs, nxt_word_t *values,
+             int n, int write)
+{
+  char mailbox[REGS_MAILBOX_SIZE];
+  int len = nxt_regs_mailbox(mailbox, addrs, values, n, write);
+  nxt_error_t err;
+  int i;
+
+  /* The commands all go out together, so a batch of reads costs a
+   * single round trip for the values.
+   */
+  nxt_batch_begin(nxt);
+  err = nxt_write_mem(nxt, NXT_REGS_ADDR, regs_bin, regs_len);
+  if (err)
+    goto fail;
+  err = nxt_write_mem(nxt, REGS_MAILBOX, mailbox, len);
+  if (err)
+    goto fail;
+  err = nxt_jump(nxt, NXT_REGS_ADDR);
+  if (err)
+    goto fail;
+  if (!write)
+    {
+      err = nxt_read_mem(nxt, REGS_MAILBOX + 4 + n * 4, mailbox, n * 4);
+      if (err)
+        goto fail;
+      for (i = 0; i < n; i++)
+        values[i] = nxt_load_word(mailbox + i * 4);
+    }
+
+  return nxt_batch_end(nxt);
+
+ fail:
+  return nxt_batch_cancel(nxt, err);
+}
+
+
+static nxt_error_t
+nxt_regs_check(const nxt_addr_t *addrs, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (addrs[i] & 3)
+      return NXT_SAMBA_PROTOCOL_ERROR;
+
+  return NXT_OK;
+}
+
+
+static nxt_error_t
+nxt_regs_access(nxt_t *nxt, const nxt_addr_t *addrs, nxt_word_t *values,
+                int n, int write)
+{
+  int i, k;
+
+  NXT_ERR(nxt_regs_check(addrs, n));
+
+  if (nxt_agent_running(nxt))
+    {
+      for (i = 0; i < n; i++)
+        if (write)
+          NXT_ERR(nxt_write_word(nxt, addrs[i], values[i]));
+        else
+          NXT_ERR(nxt_read_word(nxt, addrs[i], &values[i]));
+      return NXT_OK;
+    }
+
+  for (i = 0; i < n; i += k)
+    {
+      k = n - i < NXT_REGS_MAX_OPS ? n - i : NXT_REGS_MAX_OPS;
+      NXT_ERR(nxt_regs_run(nxt, addrs + i, values + i, k, write));
+    }
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_read_words(nxt_t *nxt, const nxt_addr_t *addrs, nxt_word_t *out, int n)
+{
+  return nxt_regs_access(nxt, addrs, out, n, 0);
+}
+
+
+nxt_error_t
+nxt_write_words(nxt_t *nxt, const nxt_addr_t *addrs,
+                const nxt_word_t *values, int n)
+{
+  return nxt_regs_access(nxt, addrs, (nxt_word_t *)values, n, REGS_WRITE);
+}
+
+
+struct nxt_regs_state
+{
+  const nxt_addr_t *addrs;
+  nxt_word_t *values;
+  int n;
+  int write;
+  int done;
+  int k; /* Accesses in the batch under way */
+  char mailbox[REGS_MAILBOX_SIZE];
+};
+
+
+/* A batch per step, as nxt_regs_run() does it. */
+static nxt_error_t
+nxt_regs_step(nxt_request_t *req, void *state)
+{
+  struct nxt_regs_state *st = state;
+  int i, len;
+
+  // The values of the batch just run are back in the mailbox
+  if (!st->write)
+    for (i = 0; i < st->k; i++)
+      st->values[st->done + i] = nxt_load_word(st->mailbox + i * 4);
+  st->done += st->k;
+
+  st->k = st->n - st->done;
+  if (st->k > NXT_REGS_MAX_OPS)
+    st->k = NXT_REGS_MAX_OPS;
+  if (st->k == 0)
+    return NXT_OK;
+
+  len = nxt_regs_mailbox(st->mailbox, st->addrs + st->done,
+                         st->values + st->done, st->k, st->write);
+  NXT_ERR(nxt_op_write_mem(req, NXT_REGS_ADDR, regs_bin, regs_len));
+  NXT_ERR(nxt_op_write_mem(req, REGS_MAILBOX, st->mailbox, len));
+  NXT_ERR(nxt_op_jump(req, NXT_REGS_ADDR));
+  if (!st->write)
+    NXT_ERR(nxt_op_read_mem(req, REGS_MAILBOX + 4 + st->k * 4, st->mailbox,
+                            st->k * 4));
+
+  return NXT_OK;
+}
+
+
+static nxt_error_t
+nxt_request_regs(nxt_request_t **req, nxt_t *nxt, const nxt_addr_t *addrs,
+                 nxt_word_t *values, int n, int write)
+{
+  struct nxt_regs_state *st;
+
+  NXT_ERR(nxt_regs_check(addrs, n));
+  NXT_ERR(nxt_request_new(req, nxt, nxt_regs_step, sizeof(*st),
+                          (void **)&st));
+
+  st->addrs = addrs;
+  st->values = values;
+  st->n = n;
+  st->write = write;
+  nxt_request_set_phase(*req, write ? "writing" : "reading");
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_request_read_words(nxt_request_t **req, nxt_t *nxt,
+                       const nxt_addr_t *addrs, nxt_word_t *out, int n)
+{
+  return nxt_request_regs(req, nxt, addrs, out, n, 0);
+}
+
+
+nxt_error_t
+nxt_request_write_words(nxt_request_t **req, nxt_t *nxt,
+                        const nxt_addr_t *addrs, const nxt_word_t *values,
+                        int n)
+{
+  return nxt_request_regs(req, nxt, addrs, (nxt_word_t *)values, n,
+                          REGS_WRITE);
+}
@@ -0,0 +1,55 @@
+/**
+ * NXT bootstrap interface; batched register access.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __REGS_H__
+#define __REGS_H__
+
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+#include "request.h"
+
+/* Word reads and writes at arbitrary addresses, run by a small
+ * onboard routine (see flash_write/regs.c) from a list uploaded along
+ * with it. Each batch of up to NXT_REGS_MAX_OPS accesses costs an
+ * upload, a jump and, for reads, one bulk read of all the values.
+ * Addresses must be word aligned. The routine runs from
+ * NXT_REGS_ADDR, and clobbers the 4k of SRAM there.
+ *
+ * While the agent runs, the accesses go through it one at a time.
+ */
+#define NXT_REGS_ADDR 0x20A000
+#define NXT_REGS_MAX_OPS 256
+
+nxt_error_t nxt_read_words(nxt_t *nxt, const nxt_addr_t *addrs,
+                           nxt_word_t *out, int n);
+nxt_error_t nxt_write_words(nxt_t *nxt, const nxt_addr_t *addrs,
+                            const nxt_word_t *values, int n);
+
+/* The same, as requests (see request.h). */
+nxt_error_t nxt_request_read_words(nxt_request_t **req, nxt_t *nxt,
+                                   const nxt_addr_t *addrs,
+                                   nxt_word_t *out, int n);
+nxt_error_t nxt_request_write_words(nxt_request_t **req, nxt_t *nxt,
+                                    const nxt_addr_t *addrs,
+                                    const nxt_word_t *values, int n);
+
+#endif /* __REGS_H__ */
@@ -0,0 +1,692 @@
+/**
+ * NXT bootstrap interface; non-blocking requests.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "transport.h"
+#include "samba.h"
+#include "trace.h"
+#include "stats.h"
+#include "agent.h"
+#include "flash.h"
+#include "request.h"
+
+enum nxt_op_type
+{
+  NXT_OP_COMMAND,
+  NXT_OP_SEND,
+  NXT_OP_RECV,
+};
+
+struct nxt_op
+{
+  enum nxt_op_type type;
+  char *buf;
+  int len;
+  int pos;
+  char cmd[20];
+};
+
+struct nxt_request
+{
+  nxt_t *nxt;
+  nxt_request_status_t status;
+  nxt_error_t err;
+  const char *phase;
+
+  nxt_request_step_t step;
+  void *state;
+
+  // The transfers queued by the last step, from first_op on to go
+  struct nxt_op ops[NXT_REQUEST_MAX_OPS];
+  int first_op;
+  int n_ops;
+
+  // When the read under way started waiting, in ms, or 0
+  long long waiting_since;
+
+  nxt_request_cb_t cb;
+  void *cb_data;
+
+  nxt_request_t *next;
+};
+
+/* The queues of the handles with requests. */
+static nxt_request_queue_t *nxt_busy;
+
+
+static long long
+nxt_now_ms(void)
+{
+  return nxt_trace_now() / 1000000;
+}
+
+
+/* How long a read may wait, like a blocking one with its retries, or
+ * -1 for ever.
+ */
+static long long
+nxt_request_deadline(nxt_request_t *req)
+{
+  int timeout_ms = nxt_get_timeout(req->nxt);
+
+  if (timeout_ms == 0 || req->waiting_since == 0)
+    return -1;
+
+  return req->waiting_since +
+    (long long)timeout_ms * (nxt_get_retries(req->nxt) + 1);
+}
+
+
+nxt_error_t
+nxt_request_new(nxt_request_t **req, nxt_t *nxt, nxt_request_step_t step,
+                size_t state_size, void **state)
+{
+  nxt_request_queue_t *q = nxt_request_queue_of(nxt);
+  nxt_request_t *r;
+
+  if (nxt_agent_running(nxt))
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  r = calloc(1, sizeof(*r));
+  if (r == NULL)
+    return NXT_CONFIGURATION_ERROR;
+  r->state = calloc(1, state_size ? state_size : 1);
+  if (r->state == NULL)
+    {
+      free(r);
+      return NXT_CONFIGURATION_ERROR;
+    }
+
+  r->nxt = nxt;
+  r->step = step;
+  r->phase = "";
+
+  if (q->first == NULL)
+    {
+      q->nxt = nxt;
+      q->first = r;
+      q->next_busy = nxt_busy;
+      nxt_busy = q;
+      r->status = NXT_REQUEST_RUNNING;
+    }
+  else
+    {
+      q->last->next = r;
+      r->status = NXT_REQUEST_QUEUED;
+    }
+  q->last = r;
+
+  *req = r;
+  if (state != NULL)
+    *state = r->state;
+  return NXT_OK;
+}
+
+
+/* Take a request off its handle's queue, and the queue off the busy
+ * list once it is empty.
+ */
+static void
+nxt_request_dequeue(nxt_request_t *req)
+{
+  nxt_request_queue_t *q = nxt_request_queue_of(req->nxt);
+  nxt_request_queue_t **qp;
+  nxt_request_t **rp;
+
+  for (rp = &q->first; *rp != NULL; rp = &(*rp)->next)
+    if (*rp == req)
+      {
+        *rp = req->next;
+        break;
+      }
+  req->next = NULL;
+
+  if (q->first == NULL)
+    {
+      q->last = NULL;
+      for (qp = &nxt_busy; *qp != NULL; qp = &(*qp)->next_busy)
+        if (*qp == q)
+          {
+            *qp = q->next_busy;
+            break;
+          }
+      q->next_busy = NULL;
+      return;
+    }
+
+  for (q->last = q->first; q->last->next != NULL; q->last = q->last->next);
+  if (q->first->status == NXT_REQUEST_QUEUED)
+    q->first->status = NXT_REQUEST_RUNNING;
+}
+
+
+nxt_request_status_t
+nxt_request_status(nxt_request_t *req)
+{
+  return req->status;
+}
+
+
+nxt_error_t
+nxt_request_error(nxt_request_t *req)
+{
+  return req->err;
+}
+
+
+nxt_t *
+nxt_request_handle(nxt_request_t *req)
+{
+  return req->nxt;
+}
+
+
+const char *
+nxt_request_phase(nxt_request_t *req)
+{
+  return req->phase;
+}
+
+
+void
+nxt_request_set_phase(nxt_request_t *req, const char *phase)
+{
+  req->phase = phase;
+}
+
+
+void
+nxt_request_set_callback(nxt_request_t *req, nxt_request_cb_t cb,
+                         void *data)
+{
+  req->cb = cb;
+  req->cb_data = data;
+}
+
+
+void
+nxt_request_free(nxt_request_t *req)
+{
+  if (req->status == NXT_REQUEST_QUEUED ||
+      req->status == NXT_REQUEST_RUNNING)
+    nxt_request_dequeue(req);
+
+  free(req->state);
+  free(req);
+}
+
+
+static struct nxt_op *
+nxt_op_add(nxt_request_t *req, enum nxt_op_type type, char *buf, int len)
+{
+  struct nxt_op *op;
+
+  if (req->n_ops == NXT_REQUEST_MAX_OPS)
+    return NULL;
+
+  op = &req->ops[req->n_ops++];
+  op->type = type;
+  op->buf = buf;
+  op->len = len;
+  op->pos = 0;
+  return op;
+}
+
+
+nxt_error_t
+nxt_op_command(nxt_request_t *req, char cmd, nxt_addr_t addr, nxt_word_t arg)
+{
+  struct nxt_op *op = nxt_op_add(req, NXT_OP_COMMAND, NULL, 0);
+
+  if (op == NULL)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  // Like samba.c, jumps take no argument
+  if (cmd == 'G')
+    op->len = snprintf(op->cmd, sizeof(op->cmd), "%c%08X#", cmd, addr);
+  else
+    op->len = snprintf(op->cmd, sizeof(op->cmd), "%c%08X,%08X#",
+                       cmd, addr, arg);
+  op->buf = op->cmd;
+  NXT_STAT_INC(req->nxt, commands[(int)cmd]);
+  nxt_flash_note_command(req->nxt, cmd, addr, arg);
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_op_send(nxt_request_t *req, const char *buf, int len)
+{
+  if (nxt_op_add(req, NXT_OP_SEND, (char *)buf, len) == NULL)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_op_recv(nxt_request_t *req, char *buf, int len)
+{
+  if (nxt_op_add(req, NXT_OP_RECV, buf, len) == NULL)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_op_write_word(nxt_request_t *req, nxt_addr_t addr, nxt_word_t w)
+{
+  return nxt_op_command(req, 'W', addr, w);
+}
+
+
+nxt_error_t
+nxt_op_read_word(nxt_request_t *req, nxt_addr_t addr, char *buf)
+{
+  NXT_ERR(nxt_op_command(req, 'w', addr, 4));
+  return nxt_op_recv(req, buf, 4);
+}
+
+
+nxt_error_t
+nxt_op_write_mem(nxt_request_t *req, nxt_addr_t addr, const char *buf,
+                 int len)
+{
+  if (len <= 0 || len > NXT_MEM_CHUNK)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  NXT_ERR(nxt_op_command(req, 'S', addr, len));
+  return nxt_op_send(req, buf, len);
+}
+
+
+nxt_error_t
+nxt_op_read_mem(nxt_request_t *req, nxt_addr_t addr, char *buf, int len)
+{
+  if (len <= 0 || len > NXT_MEM_CHUNK)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  NXT_ERR(nxt_op_command(req, 'R', addr, len));
+  return nxt_op_recv(req, buf, len);
+}
+
+
+nxt_error_t
+nxt_op_jump(nxt_request_t *req, nxt_addr_t addr)
+{
+  return nxt_op_command(req, 'G', addr, 0);
+}
+
+
+/* Send the next transfer, if it won't wait: a buffer, or the commands
+ * queued back to back, in one packet. Like nxt_jump(), nothing shares
+ * a packet with what comes after a jump, since SAM-BA stops reading
+ * commands while the code it jumped to runs.
+ */
+static int
+nxt_request_send(nxt_request_t *req, nxt_error_t *err)
+{
+  struct nxt_op *op = &req->ops[req->first_op];
+  char packet[NXT_PACKET_SIZE];
+  int len = 0;
+
+  if (!nxt_can_send(req->nxt))
+    return 0;
+
+  if (op->type == NXT_OP_SEND)
+    {
+      req->first_op++;
+      *err = nxt_send_buf(req->nxt, op->buf, op->len);
+      return 1;
+    }
+
+  while (req->first_op < req->n_ops && op->type == NXT_OP_COMMAND &&
+         len + op->len <= NXT_PACKET_SIZE)
+    {
+      memcpy(packet + len, op->cmd, op->len);
+      len += op->len;
+      req->first_op++;
+      if (op->cmd[0] == 'G')
+        break;
+      op++;
+    }
+
+  *err = nxt_send_buf(req->nxt, packet, len);
+  return 1;
+}
+
+
+/* Take in what the read under way can have without waiting. */
+static int
+nxt_request_recv(nxt_request_t *req, nxt_error_t *err)
+{
+  struct nxt_op *op = &req->ops[req->first_op];
+  int n = nxt_recv_available(req->nxt, op->len - op->pos);
+  long long deadline;
+  int n_read;
+
+  if (n < 0)
+    {
+      if (req->waiting_since == 0)
+        req->waiting_since = nxt_now_ms();
+
+      deadline = nxt_request_deadline(req);
+      if (deadline >= 0 && nxt_now_ms() >= deadline)
+        {
+          *err = NXT_USB_TIMEOUT;
+          return 1;
+        }
+      return 0;
+    }
+
+  // An empty transfer is taken in like any other
+  *err = nxt_recv_buf_partial(req->nxt, op->buf + op->pos,
+                              n > 0 ? n : op->len - op->pos, &n_read);
+  op->pos += n_read;
+  if (op->pos == op->len)
+    {
+      req->first_op++;
+      req->waiting_since = 0;
+    }
+
+  return 1;
+}
+
+
+static void
+nxt_request_finish(nxt_request_t *req, nxt_error_t err,
+                   nxt_request_t **finished)
+{
+  nxt_request_dequeue(req);
+  req->err = err;
+  req->status = err ? NXT_REQUEST_FAILED : NXT_REQUEST_DONE;
+
+  // Called back once all handles have been seen to
+  req->next = *finished;
+  *finished = req;
+}
+
+
+/* After a failure, the handle is in no state to run what's behind. */
+static void
+nxt_queue_fail(nxt_request_queue_t *q, nxt_error_t err,
+               nxt_request_t **finished)
+{
+  while (q->first != NULL)
+    nxt_request_finish(q->first, err, finished);
+}
+
+
+/* Move the requests of a handle along until one has to wait. Handles
+ * whose transport can't tell only get one transfer.
+ */
+static void
+nxt_queue_run(nxt_request_queue_t *q, nxt_request_t **finished)
+{
+  int pollable = nxt_transport_pollable(q->nxt);
+  int n_transfers = 0;
+
+  while (q->first != NULL)
+    {
+      nxt_request_t *req = q->first;
+      nxt_error_t err = NXT_OK;
+      int moved;
+
+      if (req->first_op == req->n_ops)
+        {
+          req->first_op = req->n_ops = 0;
+          err = req->step(req, req->state);
+          if (err != NXT_OK)
+            nxt_queue_fail(q, err, finished);
+          else if (req->n_ops == 0)
+            nxt_request_finish(req, NXT_OK, finished);
+          continue;
+        }
+
+      if (!pollable && n_transfers > 0)
+        return;
+
+      if (req->ops[req->first_op].type == NXT_OP_RECV)
+        moved = nxt_request_recv(req, &err);
+      else
+        moved = nxt_request_send(req, &err);
+
+      if (err != NXT_OK)
+        nxt_queue_fail(q, err, finished);
+      else if (!moved)
+        return;
+
+      n_transfers++;
+    }
+}
+
+
+int
+nxt_get_pollfds(struct pollfd *fds, int max, int *timeout_ms)
+{
+  nxt_request_queue_t *q;
+  int n = 0;
+
+  *timeout_ms = -1;
+
+  for (q = nxt_busy; q != NULL; q = q->next_busy)
+    {
+      nxt_request_t *req = q->first;
+      long long deadline = nxt_request_deadline(req);
+
+      // Fresh steps, and blocking transports, can go at once
+      if (!nxt_transport_pollable(q->nxt) || req->first_op == req->n_ops)
+        *timeout_ms = 0;
+
+      if (deadline >= 0)
+        {
+          long long left = deadline - nxt_now_ms();
+
+          if (left < 0)
+            left = 0;
+          if (*timeout_ms < 0 || left < *timeout_ms)
+            *timeout_ms = left;
+        }
+
+      n += nxt_transport_pollfds(q->nxt, n < max ? fds + n : fds,
+                                 n < max ? max - n : 0, timeout_ms);
+    }
+
+  return n;
+}
+
+
+int
+nxt_process_events(void)
+{
+  nxt_request_queue_t *q, *next;
+  nxt_request_t *finished = NULL;
+  nxt_request_t *req;
+  int n = 0;
+
+  for (q = nxt_busy; q != NULL; q = next)
+    {
+      nxt_error_t err = nxt_transport_events(q->nxt);
+
+      next = q->next_busy;
+      if (err != NXT_OK)
+        nxt_queue_fail(q, err, &finished);
+      else
+        nxt_queue_run(q, &finished);
+    }
+
+  // Callbacks may free their request, and start new ones
+  while (finished != NULL)
+    {
+      req = finished;
+      finished = req->next;
+      req->next = NULL;
+      if (req->cb != NULL)
+        req->cb(req, req->cb_data);
+    }
+
+  for (q = nxt_busy; q != NULL; q = q->next_busy)
+    for (req = q->first; req != NULL; req = req->next)
+      n++;
+
+  return n;
+}
+
+
+struct nxt_mem_state
+{
+  nxt_addr_t addr;
+  char *buf;
+  size_t left;
+  int started;
+};
+
+
+static nxt_error_t
+nxt_check_range(nxt_addr_t addr, size_t len)
+{
+  if (len > 0 && len - 1 > 0xFFFFFFFF - addr)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  return NXT_OK;
+}
+
+
+/* One chunk per step, the command and its data. */
+static nxt_error_t
+nxt_write_mem_step(nxt_request_t *req, void *state)
+{
+  struct nxt_mem_state *st = state;
+  int n = st->left < NXT_MEM_CHUNK ? st->left : NXT_MEM_CHUNK;
+
+  if (n == 0)
+    return NXT_OK;
+
+  NXT_ERR(nxt_op_write_mem(req, st->addr, st->buf, n));
+  st->addr += n;
+  st->buf += n;
+  st->left -= n;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_request_write_mem(nxt_request_t **req, nxt_t *nxt, nxt_addr_t addr,
+                      const void *buf, size_t len)
+{
+  struct nxt_mem_state *st;
+
+  NXT_ERR(nxt_check_range(addr, len));
+  NXT_ERR(nxt_request_new(req, nxt, nxt_write_mem_step, sizeof(*st),
+                          (void **)&st));
+
+  st->addr = addr;
+  st->buf = (char *)buf;
+  st->left = len;
+  nxt_request_set_phase(*req, "writing");
+
+  return NXT_OK;
+}
+
+
+/* Like nxt_read_mem(), the command for the next chunk goes out before
+ * the current one is read back.
+ */
+static nxt_error_t
+nxt_read_mem_step(nxt_request_t *req, void *state)
+{
+  struct nxt_mem_state *st = state;
+  int n = st->left < NXT_MEM_CHUNK ? st->left : NXT_MEM_CHUNK;
+  int next = st->left - n < NXT_MEM_CHUNK ? st->left - n : NXT_MEM_CHUNK;
+
+  if (n == 0)
+    return NXT_OK;
+
+  if (!st->started)
+    {
+      NXT_ERR(nxt_op_command(req, 'R', st->addr, n));
+      st->started = 1;
+    }
+  if (next > 0)
+    NXT_ERR(nxt_op_command(req, 'R', st->addr + n, next));
+  NXT_ERR(nxt_op_recv(req, st->buf, n));
+
+  st->addr += n;
+  st->buf += n;
+  st->left -= n;
+
+  return NXT_OK;
+}
+
+
+nxt_error_t
+nxt_request_read_mem(nxt_request_t **req, nxt_t *nxt, nxt_addr_t addr,
+                     void *buf, size_t len)
+{
+  struct nxt_mem_state *st;
+
+  NXT_ERR(nxt_check_range(addr, len));
+  NXT_ERR(nxt_request_new(req, nxt, nxt_read_mem_step, sizeof(*st),
+                          (void **)&st));
+
+  st->addr = addr;
+  st->buf = buf;
+  st->left = len;
+  nxt_request_set_phase(*req, "reading");
+
+  return NXT_OK;
+}
+
+
+static nxt_error_t
+nxt_jump_step(nxt_request_t *req, void *state)
+{
+  struct nxt_mem_state *st = state;
+
+  if (st->started)
+    return NXT_OK;
+
+  st->started = 1;
+  return nxt_op_jump(req, st->addr);
+}
+
+
+nxt_error_t
+nxt_request_jump(nxt_request_t **req, nxt_t *nxt, nxt_addr_t addr)
+{
+  struct nxt_mem_state *st;
+
+  NXT_ERR(nxt_request_new(req, nxt, nxt_jump_step, sizeof(*st),
+                          (void **)&st));
+
+  st->addr = addr;
+  nxt_request_set_phase(*req, "jumping");
+
+  return NXT_OK;
+}
@@ -0,0 +1,159 @@
+/**
+ * NXT bootstrap interface; non-blocking requests.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#include <poll.h>
+#include "error.h"
+#include "lowlevel.h"
+#include "samba.h"
+
+/* Operations that never wait, to drive many bricks from one thread.
+ *
+ * An operation is started as a request, which does nothing by itself:
+ * nxt_process_events() moves every request along for as long as its
+ * transfers complete at once, and returns. In between, wait on the
+ * descriptors from nxt_get_pollfds(), with poll(), epoll or any event
+ * loop. The requests on a handle run one after the other, in the
+ * order they were started, and those on different handles side by
+ * side.
+ *
+ * Buffers given to a request are used in place, and must stay around
+ * until it finishes. Requests speak SAM-BA, and can't be started with
+ * the agent running. No blocking calls may be made on a handle with
+ * requests in flight, and a handle must not be closed until they are
+ * finished or freed. A failed request fails those queued behind it
+ * too, and may leave transfers behind: reconnect its handle before
+ * going on. Requests ending in a write are done once the write is on
+ * its way.
+ *
+ * The libusb-1.0 transport and the emulator know when a transfer
+ * would wait. Others don't, so nxt_process_events() makes a single,
+ * blocking, transfer for each of their handles, and nxt_get_pollfds()
+ * asks to be called again at once.
+ */
+typedef struct nxt_request nxt_request_t;
+
+typedef enum {
+  NXT_REQUEST_QUEUED,  /* Behind other requests on its handle */
+  NXT_REQUEST_RUNNING,
+  NXT_REQUEST_DONE,
+  NXT_REQUEST_FAILED,
+} nxt_request_status_t;
+
+nxt_error_t nxt_request_write_mem(nxt_request_t **req, nxt_t *nxt,
+                                  nxt_addr_t addr, const void *buf,
+                                  size_t len);
+nxt_error_t nxt_request_read_mem(nxt_request_t **req, nxt_t *nxt,
+                                 nxt_addr_t addr, void *buf, size_t len);
+nxt_error_t nxt_request_jump(nxt_request_t **req, nxt_t *nxt,
+                             nxt_addr_t addr);
+
+/* regs.h and firmware.h start word accesses and flashing. */
+
+nxt_request_status_t nxt_request_status(nxt_request_t *req);
+nxt_error_t nxt_request_error(nxt_request_t *req);
+nxt_t *nxt_request_handle(nxt_request_t *req);
+
+/* What a running request is busy with, such as "unlocking", for
+ * display.
+ */
+const char *nxt_request_phase(nxt_request_t *req);
+
+/* Have cb called once the request is done or has failed. It may free
+ * the request, and start others.
+ */
+typedef void (*nxt_request_cb_t)(nxt_request_t *req, void *data);
+
+void nxt_request_set_callback(nxt_request_t *req, nxt_request_cb_t cb,
+                              void *data);
+
+/* Release a request. One still running is abandoned, and leaves its
+ * handle in need of a reconnect.
+ */
+void nxt_request_free(nxt_request_t *req);
+
+/* Fill in up to max descriptors to wait on, for the handles with
+ * requests, and how long to wait at most in *timeout_ms, -1 for no
+ * limit. Returns how many descriptors there are, which may be more
+ * than max.
+ */
+int nxt_get_pollfds(struct pollfd *fds, int max, int *timeout_ms);
+
+/* Move all requests along as far as they go without waiting, calling
+ * back those that finish. Returns how many are left unfinished.
+ */
+int nxt_process_events(void);
+
+/* Building requests, for the modules providing them.
+ *
+ * A request is a step function and its state. The step is called
+ * whenever the transfers it queued have all completed, and queues the
+ * next ones, with the nxt_op_*() calls below. A step queuing nothing
+ * finishes the request, and one returning an error fails it. Steps
+ * queue at most NXT_REQUEST_MAX_OPS transfers, with buffers that must
+ * stay around until they complete.
+ */
+#define NXT_REQUEST_MAX_OPS 16
+
+typedef nxt_error_t (*nxt_request_step_t)(nxt_request_t *req, void *state);
+
+/* Start a request with a zeroed state of state_size bytes, returned in
+ * *state, and freed along with it.
+ */
+nxt_error_t nxt_request_new(nxt_request_t **req, nxt_t *nxt,
+                            nxt_request_step_t step, size_t state_size,
+                            void **state);
+void nxt_request_set_phase(nxt_request_t *req, const char *phase);
+
+/* Commands sent back to back share a packet, up to a jump. Reads and
+ * data always get a transfer of their own.
+ */
+nxt_error_t nxt_op_command(nxt_request_t *req, char cmd, nxt_addr_t addr,
+                           nxt_word_t arg);
+nxt_error_t nxt_op_send(nxt_request_t *req, const char *buf, int len);
+nxt_error_t nxt_op_recv(nxt_request_t *req, char *buf, int len);
+
+/* The usual SAM-BA exchanges. len is at most NXT_MEM_CHUNK, and words
+ * land in buf in NXT byte order.
+ */
+nxt_error_t nxt_op_write_word(nxt_request_t *req, nxt_addr_t addr,
+                              nxt_word_t w);
+nxt_error_t nxt_op_read_word(nxt_request_t *req, nxt_addr_t addr,
+                             char *buf);
+nxt_error_t nxt_op_write_mem(nxt_request_t *req, nxt_addr_t addr,
+                             const char *buf, int len);
+nxt_error_t nxt_op_read_mem(nxt_request_t *req, nxt_addr_t addr,
+                            char *buf, int len);
+nxt_error_t nxt_op_jump(nxt_request_t *req, nxt_addr_t addr);
+
+/* Per-handle request queue, kept in the handle by lowlevel.c. */
+typedef struct nxt_request_queue {
+  nxt_t *nxt;
+  nxt_request_t *first;
+  nxt_request_t *last;
+  struct nxt_request_queue *next_busy;
+} nxt_request_queue_t;
+
+nxt_request_queue_t *nxt_request_queue_of(nxt_t *nxt);
+
+#endif /* __REQUEST_H__ */
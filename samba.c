@@ -20,24 +20,56 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "error.h"
 #include "lowlevel.h"
 #include "samba.h"
+#include "stats.h"
+#include "agent.h"
+#include "flash.h"
 
+void
+nxt_store_word(char *buf, nxt_word_t w)
+{
+  /* The NXT is little-endian, regardless of the host. */
+  buf[0] = w & 0xFF;
+  buf[1] = (w >> 8) & 0xFF;
+  buf[2] = (w >> 16) & 0xFF;
+  buf[3] = (w >> 24) & 0xFF;
+}
+
+
+nxt_word_t
+nxt_load_word(const char *buf)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((nxt_word_t)p[3] << 24);
+}
+
+
+/* Every command but the handshake and version query is formatted
+ * here, which makes this the place to count them, and to note what
+ * they may overwrite.
+ */
 static nxt_error_t
-nxt_format_command2(char *buf, char cmd,
+nxt_format_command2(nxt_t *nxt, char *buf, char cmd,
                     nxt_addr_t addr, nxt_word_t word)
 {
   snprintf(buf, 20, "%c%08X,%08X#", cmd, addr, word);
+  NXT_STAT_INC(nxt, commands[(int)cmd]);
+  nxt_flash_note_command(nxt, cmd, addr, word);
 
   return NXT_OK;
 }
 
 static nxt_error_t
-nxt_format_command(char *buf, char cmd, nxt_addr_t addr)
+nxt_format_command(nxt_t *nxt, char *buf, char cmd, nxt_addr_t addr)
 {
   snprintf(buf, 20, "%c%08X#", cmd, addr);
+  NXT_STAT_INC(nxt, commands[(int)cmd]);
+  nxt_flash_note_command(nxt, cmd, addr, 0);
 
   return NXT_OK;
 }
@@ -48,8 +80,15 @@ nxt_write_common(nxt_t *nxt, char type, nxt_addr_t addr, nxt_word_t w)
 {
   char buf[21] = {0};
 
-  NXT_ERR(nxt_format_command2(buf, type, addr, w));
-  NXT_ERR(nxt_send_str(nxt, buf));
+  if (nxt_agent_running(nxt))
+    {
+      nxt_store_word(buf, w);
+      return nxt_agent_write(nxt, addr, buf,
+                             type == 'O' ? 1 : type == 'H' ? 2 : 4);
+    }
+
+  NXT_ERR(nxt_format_command2(nxt, buf, type, addr, w));
+  NXT_ERR(nxt_queue_str(nxt, buf));
 
   return NXT_OK;
 }
@@ -60,9 +99,21 @@ nxt_handshake(nxt_t *nxt)
 {
   char buf[2];
 
-  nxt_send_str(nxt, "N#");
-  nxt_recv_buf(nxt, buf, 2);
-  if (memcmp(buf, "\n\r", 2) != 0)
+  // The agent answers pings instead
+  if (nxt_agent_running(nxt))
+    {
+      if (nxt_agent_ping(nxt) != NXT_OK)
+        {
+          nxt_close(nxt);
+          return NXT_HANDSHAKE_FAILED;
+        }
+      return NXT_OK;
+    }
+
+  NXT_STAT_INC(nxt, commands['N']);
+  if (nxt_send_str(nxt, "N#") != NXT_OK ||
+      nxt_recv_buf(nxt, buf, 2) != NXT_OK ||
+      memcmp(buf, "\n\r", 2) != 0)
     {
       nxt_close(nxt);
       return NXT_HANDSHAKE_FAILED;
@@ -100,9 +151,14 @@ nxt_read_common(nxt_t *nxt, char cmd, int len,
   char buf[20] = {0};
   nxt_word_t w;
 
-  NXT_ERR(nxt_format_command2(buf, cmd, addr, len));
-  NXT_ERR(nxt_send_str(nxt, buf));
-  NXT_ERR(nxt_recv_buf(nxt, buf, len));
+  if (nxt_agent_running(nxt))
+    NXT_ERR(nxt_agent_read(nxt, addr, buf, len));
+  else
+    {
+      NXT_ERR(nxt_format_command2(nxt, buf, cmd, addr, len));
+      NXT_ERR(nxt_queue_str(nxt, buf));
+      NXT_ERR(nxt_recv_buf(nxt, buf, len));
+    }
 
   w = *((nxt_word_t*)buf);
 
@@ -150,28 +206,278 @@ nxt_read_word(nxt_t *nxt, nxt_addr_t addr, nxt_word_t *w)
 }
 
 
+/* A position in an iovec array. */
+struct nxt_iov_cursor {
+  const struct iovec *iov;
+  int iovcnt;
+  size_t off;
+};
+
+
+static void
+nxt_iov_skip(struct nxt_iov_cursor *c, size_t n)
+{
+  while (c->iovcnt > 0 && c->off + n >= c->iov->iov_len)
+    {
+      n -= c->iov->iov_len - c->off;
+      c->iov++;
+      c->iovcnt--;
+      c->off = 0;
+    }
+  c->off += n;
+}
+
+
+/* The next n bytes at the cursor, if they sit in a single buffer. */
+static char *
+nxt_iov_contig(struct nxt_iov_cursor *c, size_t n)
+{
+  nxt_iov_skip(c, 0);
+  if (c->iovcnt == 0 || c->iov->iov_len - c->off < n)
+    return NULL;
+
+  return (char *)c->iov->iov_base + c->off;
+}
+
+
+/* Gather the next n bytes into buf, or scatter them from it. */
+static void
+nxt_iov_copy(struct nxt_iov_cursor *c, char *buf, size_t n, int scatter)
+{
+  while (n > 0)
+    {
+      char *p = (char *)c->iov->iov_base + c->off;
+      size_t k = c->iov->iov_len - c->off;
+
+      if (k > n)
+        k = n;
+      if (scatter)
+        memcpy(p, buf, k);
+      else
+        memcpy(buf, p, k);
+      nxt_iov_skip(c, k);
+      buf += k;
+      n -= k;
+    }
+}
+
+
+static size_t
+nxt_iov_len(const struct iovec *iov, int iovcnt)
+{
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+
+  return len;
+}
+
+
+/* Where the chunk at the cursor goes: straight in its buffer when it
+ * has one to itself, in the bounce buffer when it straddles several.
+ */
+static char *
+nxt_mem_chunk(struct nxt_iov_cursor *c, size_t n, char **bounce)
+{
+  char *p = nxt_iov_contig(c, n);
+
+  if (p != NULL)
+    return p;
+
+  if (*bounce == NULL)
+    *bounce = malloc(NXT_MEM_CHUNK);
+
+  return *bounce;
+}
+
+
 nxt_error_t
-nxt_send_file(nxt_t *nxt, nxt_addr_t addr, char *file, unsigned short len)
+nxt_write_memv(nxt_t *nxt, nxt_addr_t addr,
+               const struct iovec *iov, int iovcnt)
 {
+  struct nxt_iov_cursor c = { iov, iovcnt, 0 };
+  size_t left = nxt_iov_len(iov, iovcnt);
+  nxt_error_t err = NXT_OK;
+  char *bounce = NULL;
   char buf[20];
 
-  NXT_ERR(nxt_format_command2(buf, 'S', addr, len));
-  NXT_ERR(nxt_send_str(nxt, buf));
-  NXT_ERR(nxt_send_buf(nxt, file, len));
+  if (left > 0 && left - 1 > 0xFFFFFFFF - addr)
+    return NXT_SAMBA_PROTOCOL_ERROR;
 
-  return NXT_OK;
+  while (left > 0 && err == NXT_OK)
+    {
+      size_t n = left < NXT_MEM_CHUNK ? left : NXT_MEM_CHUNK;
+      char *p = nxt_mem_chunk(&c, n, &bounce);
+
+      if (p == NULL)
+        {
+          err = NXT_FILE_ERROR;
+          break;
+        }
+      if (p == bounce)
+        nxt_iov_copy(&c, bounce, n, 0);
+      else
+        nxt_iov_skip(&c, n);
+
+      if (nxt_agent_running(nxt))
+        err = nxt_agent_write(nxt, addr, p, n);
+      else
+        {
+          /* SAM-BA reads the data with a fresh USB read, so it can't
+           * share a packet with the command. The command still goes
+           * out along with anything queued before it.
+           */
+          nxt_format_command2(nxt, buf, 'S', addr, n);
+          err = nxt_queue_str(nxt, buf);
+          if (err == NXT_OK)
+            err = nxt_send_buf(nxt, p, n);
+        }
+
+      addr += n;
+      left -= n;
+    }
+
+  free(bounce);
+  return err;
 }
 
 
-nxt_error_t
-nxt_recv_file(nxt_t *nxt, nxt_addr_t addr, char *file, unsigned short len)
+/* Read left bytes at addr, scattering them at the cursor, or else
+ * handing them to the sink one chunk at a time.
+ */
+static nxt_error_t
+nxt_read_chunks(nxt_t *nxt, nxt_addr_t addr, struct nxt_iov_cursor *c,
+                size_t left, nxt_mem_sink_t sink, void *data)
 {
+  int agent = nxt_agent_running(nxt);
+  nxt_error_t err = NXT_OK;
+  char *bounce = NULL;
   char buf[20];
 
-  NXT_ERR(nxt_format_command2(buf, 'R', addr, len));
-  NXT_ERR(nxt_send_str(nxt, buf));
-  NXT_ERR(nxt_recv_buf(nxt, file, len+1));
-  return NXT_OK;
+  if (left > 0 && left - 1 > 0xFFFFFFFF - addr)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  /* The command for the next chunk is sent before the current one is
+   * read back, so SAM-BA finds it waiting when it's done sending.
+   */
+  nxt_batch_begin(nxt);
+  if (!agent && left > 0)
+    {
+      nxt_format_command2(nxt, buf, 'R', addr,
+                          left < NXT_MEM_CHUNK ? left : NXT_MEM_CHUNK);
+      err = nxt_queue_str(nxt, buf);
+    }
+
+  while (left > 0 && err == NXT_OK)
+    {
+      size_t n = left < NXT_MEM_CHUNK ? left : NXT_MEM_CHUNK;
+      size_t next = left - n < NXT_MEM_CHUNK ? left - n : NXT_MEM_CHUNK;
+      char *p;
+
+      if (c != NULL)
+        p = nxt_mem_chunk(c, n, &bounce);
+      else
+        p = bounce = bounce ? bounce : malloc(NXT_MEM_CHUNK);
+      if (p == NULL)
+        {
+          err = NXT_FILE_ERROR;
+          break;
+        }
+
+      if (agent)
+        err = nxt_agent_read(nxt, addr, p, n);
+      else
+        {
+          if (next > 0)
+            {
+              nxt_format_command2(nxt, buf, 'R', addr + n, next);
+              err = nxt_queue_str(nxt, buf);
+            }
+          if (err == NXT_OK)
+            err = nxt_recv_buf(nxt, p, n);
+        }
+      if (err != NXT_OK)
+        break;
+
+      if (c == NULL)
+        {
+          // Take in the chunk already asked for before giving up
+          if (sink(data, addr, p, n) != 0)
+            {
+              if (!agent && next > 0)
+                nxt_recv_buf(nxt, p, next);
+              err = NXT_FILE_ERROR;
+            }
+        }
+      else if (p == bounce)
+        nxt_iov_copy(c, bounce, n, 1);
+      else
+        nxt_iov_skip(c, n);
+
+      addr += n;
+      left -= n;
+    }
+
+  if (err == NXT_OK)
+    err = nxt_batch_end(nxt);
+  else
+    nxt_batch_cancel(nxt, err);
+
+  free(bounce);
+  return err;
+}
+
+
+nxt_error_t
+nxt_read_memv(nxt_t *nxt, nxt_addr_t addr,
+              const struct iovec *iov, int iovcnt)
+{
+  struct nxt_iov_cursor c = { iov, iovcnt, 0 };
+
+  return nxt_read_chunks(nxt, addr, &c, nxt_iov_len(iov, iovcnt),
+                         NULL, NULL);
+}
+
+
+nxt_error_t
+nxt_read_mem_stream(nxt_t *nxt, nxt_addr_t addr, size_t len,
+                    nxt_mem_sink_t sink, void *data)
+{
+  return nxt_read_chunks(nxt, addr, NULL, len, sink, data);
+}
+
+
+nxt_error_t
+nxt_write_mem(nxt_t *nxt, nxt_addr_t addr, const void *buf, size_t len)
+{
+  struct iovec iov = { (void *)buf, len };
+
+  return nxt_write_memv(nxt, addr, &iov, 1);
+}
+
+
+nxt_error_t
+nxt_read_mem(nxt_t *nxt, nxt_addr_t addr, void *buf, size_t len)
+{
+  struct iovec iov = { buf, len };
+
+  return nxt_read_memv(nxt, addr, &iov, 1);
+}
+
+
+nxt_error_t
+nxt_send_file(nxt_t *nxt, nxt_addr_t addr, char *file, unsigned short len)
+{
+  return nxt_write_mem(nxt, addr, file, len);
+}
+
+
+nxt_error_t
+nxt_recv_file(nxt_t *nxt, nxt_addr_t addr, char *file, unsigned short len)
+{
+  return nxt_read_mem(nxt, addr, file, len);
 }
 
 
@@ -180,9 +486,16 @@ nxt_jump(nxt_t *nxt, nxt_addr_t addr)
 {
   char buf[20];
 
-  NXT_ERR(nxt_format_command(buf, 'G', addr));
+  // Only SAM-BA can jump
+  NXT_ERR(nxt_agent_stop(nxt));
 
-  NXT_ERR(nxt_send_str(nxt, buf));
+  NXT_ERR(nxt_format_command(nxt, buf, 'G', addr));
+
+  /* SAM-BA stops reading commands while the code we jump to runs, so
+   * don't make anything else wait behind the jump.
+   */
+  NXT_ERR(nxt_queue_str(nxt, buf));
+  NXT_ERR(nxt_flush(nxt));
   return NXT_OK;
 }
 
@@ -191,7 +504,9 @@ nxt_error_t
 nxt_samba_version(nxt_t *nxt, char *version)
 {
   char buf[3];
+  NXT_ERR(nxt_agent_stop(nxt));
   strcpy(buf, "V#");
+  NXT_STAT_INC(nxt, commands['V']);
   NXT_ERR(nxt_send_str(nxt, buf));
   NXT_ERR(nxt_recv_buf(nxt, version, 4));
   version[4] = 0;
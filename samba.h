@@ -22,7 +22,9 @@
 #ifndef __SAMBA_H__
 #define __SAMBA_H__
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include "error.h"
 #include "lowlevel.h"
 
@@ -33,6 +35,10 @@ typedef uint32_t nxt_word_t;
 typedef uint16_t nxt_hword_t;
 typedef unsigned char nxt_byte_t;
 
+/* Store and load words in NXT (little-endian) byte order. */
+void nxt_store_word(char *buf, nxt_word_t w);
+nxt_word_t nxt_load_word(const char *buf);
+
 nxt_error_t nxt_handshake(nxt_t *nxt);
 
 nxt_error_t nxt_write_byte(nxt_t *nxt, nxt_addr_t addr, nxt_byte_t b);
@@ -43,6 +49,34 @@ nxt_error_t nxt_read_byte(nxt_t *nxt, nxt_addr_t addr, nxt_byte_t *b);
 nxt_error_t nxt_read_hword(nxt_t *nxt, nxt_addr_t addr, nxt_hword_t *hw);
 nxt_error_t nxt_read_word(nxt_t *nxt, nxt_addr_t addr, nxt_word_t *w);
 
+/* Copy len bytes to or from the brick's memory at addr. Any length
+ * goes, split into NXT_MEM_CHUNK sized transfers; reads keep the next
+ * chunk's command in flight while a chunk's data comes back. The
+ * iovec forms gather from or scatter to several buffers, which are
+ * consecutive in the brick's memory.
+ */
+#define NXT_MEM_CHUNK 0x8000
+
+nxt_error_t nxt_write_mem(nxt_t *nxt, nxt_addr_t addr,
+                          const void *buf, size_t len);
+nxt_error_t nxt_read_mem(nxt_t *nxt, nxt_addr_t addr, void *buf, size_t len);
+nxt_error_t nxt_write_memv(nxt_t *nxt, nxt_addr_t addr,
+                           const struct iovec *iov, int iovcnt);
+nxt_error_t nxt_read_memv(nxt_t *nxt, nxt_addr_t addr,
+                          const struct iovec *iov, int iovcnt);
+
+/* Read len bytes at addr, handing each chunk to sink as it arrives,
+ * along with its address. The next chunk is already on its way while
+ * the sink runs. A sink returning nonzero stops the read, which then
+ * fails with NXT_FILE_ERROR.
+ */
+typedef int (*nxt_mem_sink_t)(void *data, nxt_addr_t addr,
+                              const char *buf, size_t len);
+
+nxt_error_t nxt_read_mem_stream(nxt_t *nxt, nxt_addr_t addr, size_t len,
+                                nxt_mem_sink_t sink, void *data);
+
+/* The original single transfer forms, limited to 64k. */
 nxt_error_t nxt_send_file(nxt_t *nxt, nxt_addr_t addr,
                           char *file, unsigned short len);
 nxt_error_t nxt_recv_file(nxt_t *nxt, nxt_addr_t addr,
@@ -0,0 +1,68 @@
+/**
+ * NXT bootstrap interface; per-handle performance counters.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "error.h"
+#include "lowlevel.h"
+
+/* Latency histograms have one bucket per power of two microseconds:
+ * bucket 0 counts transfers under 1us, bucket i those taking
+ * [2^(i-1), 2^i) us, and the last one everything slower.
+ */
+#define NXT_STATS_BUCKETS 24
+
+/* SAM-BA opcodes are ASCII characters, counted by their value. */
+#define NXT_STATS_OPCODES 128
+
+typedef struct {
+  unsigned long long bytes_out;
+  unsigned long long bytes_in;
+  unsigned long transfers_out;
+  unsigned long transfers_in;
+  unsigned long commands[NXT_STATS_OPCODES];
+  unsigned long wait_ready_polls;
+  unsigned long pages_flashed;
+  unsigned long retries;
+  unsigned long write_latency[NXT_STATS_BUCKETS];
+  unsigned long read_latency[NXT_STATS_BUCKETS];
+} nxt_stats_t;
+
+/* Copy the counters of a handle, which start at zero when it is
+ * created. Returns NXT_CONFIGURATION_ERROR, with all counters zero,
+ * when libnxt was built without them.
+ */
+nxt_error_t nxt_get_stats(nxt_t *nxt, nxt_stats_t *stats);
+void nxt_reset_stats(nxt_t *nxt);
+
+/* The counting side, used throughout the library. Building with
+ * NXT_NO_STATS compiles all of it away.
+ */
+#ifdef NXT_NO_STATS
+#define NXT_STAT_ADD(nxt, field, n) do { } while (0)
+#else
+nxt_stats_t *nxt_stats_of(nxt_t *nxt);
+#define NXT_STAT_ADD(nxt, field, n) (nxt_stats_of(nxt)->field += (n))
+#endif
+#define NXT_STAT_INC(nxt, field) NXT_STAT_ADD(nxt, field, 1)
+
+#endif /* __STATS_H__ */
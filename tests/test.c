@@ -0,0 +1,101 @@
+/**
+ * libnxt tests; shared helpers.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "samba.h"
+#include "test.h"
+
+#define MAX_TEMP_FILES 64
+
+static char *temp_files[MAX_TEMP_FILES];
+static int n_temp_files;
+
+nxt_t *test_open(nxt_emu_t *emu)
+{
+  nxt_t *nxt;
+
+  CHECK_OK(nxt_emu_init(&nxt, emu));
+  CHECK_OK(nxt_open(nxt, 1));
+  CHECK_OK(nxt_handshake(nxt));
+
+  return nxt;
+}
+
+void test_pattern(char *buf, int len, int seed)
+{
+  unsigned int x = 2463534242U + seed;
+  int i;
+
+  for (i = 0; i < len; i++)
+    {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      buf[i] = x;
+    }
+}
+
+static void remove_temp_files(void)
+{
+  int i;
+
+  for (i = 0; i < n_temp_files; i++)
+    {
+      unlink(temp_files[i]);
+      free(temp_files[i]);
+    }
+}
+
+char *test_temp_file(const char *data, int len)
+{
+  char *path = strdup("/tmp/libnxt-test-XXXXXX");
+  int fd;
+
+  CHECK(path != NULL && n_temp_files < MAX_TEMP_FILES);
+  fd = mkstemp(path);
+  CHECK(fd >= 0);
+  CHECK(write(fd, data, len) == len);
+  close(fd);
+
+  if (n_temp_files == 0)
+    atexit(remove_temp_files);
+  temp_files[n_temp_files++] = path;
+
+  return path;
+}
+
+void test_ihex_record(char *buf, int type, int addr,
+                      const unsigned char *data, int len)
+{
+  int sum = len + (addr >> 8) + addr + type;
+  int i;
+
+  buf += strlen(buf);
+  buf += sprintf(buf, ":%02X%04X%02X", len, addr & 0xFFFF, type);
+  for (i = 0; i < len; i++)
+    {
+      buf += sprintf(buf, "%02X", data[i]);
+      sum += data[i];
+    }
+  sprintf(buf, "%02X\n", -sum & 0xFF);
+}
@@ -0,0 +1,74 @@
+/**
+ * libnxt tests; shared helpers.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "emulator.h"
+
+/* Stop the test with a failure, naming the check, unless expr holds. */
+#define CHECK(expr)                                                     \
+  do                                                                    \
+    {                                                                   \
+      if (!(expr))                                                      \
+        {                                                               \
+          fprintf(stderr, "%s:%d: check failed: %s\n",                  \
+                  __FILE__, __LINE__, #expr);                           \
+          exit(1);                                                      \
+        }                                                               \
+    } while (0)
+
+/* Stop the test with a failure unless expr returns err. */
+#define CHECK_ERR(expr, err)                                            \
+  do                                                                    \
+    {                                                                   \
+      nxt_error_t check_err_ = (expr);                                  \
+      if (check_err_ != (err))                                          \
+        {                                                               \
+          fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__,        \
+                  #expr, nxt_str_error(check_err_));                    \
+          exit(1);                                                      \
+        }                                                               \
+    } while (0)
+
+#define CHECK_OK(expr) CHECK_ERR(expr, NXT_OK)
+
+/* A handle on the emulated brick, opened and past the handshake. */
+nxt_t *test_open(nxt_emu_t *emu);
+
+/* Fill len bytes of buf with a pattern that depends on seed. */
+void test_pattern(char *buf, int len, int seed);
+
+/* Write len bytes to a new temporary file, returning its malloc()ed
+ * path. The file is removed when the test exits.
+ */
+char *test_temp_file(const char *data, int len);
+
+/* Append an Intel HEX record to the text in buf. */
+void test_ihex_record(char *buf, int type, int addr,
+                      const unsigned char *data, int len);
+
+#endif /* __TEST_H__ */
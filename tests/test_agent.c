@@ -0,0 +1,98 @@
+/**
+ * libnxt tests; the RAM agent and its commands.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <string.h>
+
+#include "agent.h"
+#include "crc32.h"
+#include "samba.h"
+#include "test.h"
+
+#define SCRATCH 0x204000
+#define PAGE_SIZE 256
+
+static void test_agent(nxt_emu_t *emu)
+{
+  nxt_t *nxt = test_open(emu);
+  char *buf = malloc(5000), *back = malloc(5000);
+  nxt_word_t crcs[4], w;
+  int i;
+
+  CHECK_OK(nxt_agent_start(nxt));
+  CHECK(nxt_agent_running(nxt));
+  CHECK_OK(nxt_agent_ping(nxt));
+  CHECK_OK(nxt_handshake(nxt));
+
+  // The SAM-BA calls go through the agent while it runs
+  test_pattern(buf, 5000, 7);
+  CHECK_OK(nxt_write_mem(nxt, SCRATCH + 1, buf, 4999));
+  CHECK_OK(nxt_read_mem(nxt, SCRATCH + 1, back, 4999));
+  CHECK(memcmp(buf, back, 4999) == 0);
+  CHECK_OK(nxt_write_word(nxt, SCRATCH, 0xDEADBEEF));
+  CHECK_OK(nxt_read_word(nxt, SCRATCH, &w));
+  CHECK(w == 0xDEADBEEF);
+
+  CHECK_OK(nxt_agent_fill(nxt, SCRATCH, 0x11223344, 8));
+  CHECK_OK(nxt_read_word(nxt, SCRATCH + 4, &w));
+  CHECK(w == 0x11223344);
+
+  // Its own code and frame are off limits
+  CHECK_ERR(nxt_agent_write(nxt, NXT_AGENT_ADDR + 0x100, buf, 4),
+            NXT_AGENT_ERROR);
+  CHECK_OK(nxt_agent_ping(nxt));
+
+  // CRCs come back as the host computes them
+  CHECK_OK(nxt_write_mem(nxt, SCRATCH, buf, 4 * 1000));
+  CHECK_OK(nxt_agent_crc(nxt, SCRATCH, 1000, 4, crcs));
+  for (i = 0; i < 4; i++)
+    CHECK(crcs[i] == nxt_crc32(buf + i * 1000, 1000));
+
+  // Flashing pads the last page with zeroes
+  CHECK_OK(nxt_agent_flash(nxt, 100, buf, 3 * PAGE_SIZE + 10));
+  CHECK_OK(nxt_agent_flash(nxt, 0, NULL, 0));
+  CHECK(memcmp(nxt_emu_flash(emu) + 100 * PAGE_SIZE, buf,
+               3 * PAGE_SIZE + 10) == 0);
+  CHECK(nxt_emu_flash(emu)[103 * PAGE_SIZE + 10] == 0);
+
+  // Stopping hands the brick back to SAM-BA, with the SRAM intact
+  CHECK_OK(nxt_agent_stop(nxt));
+  CHECK(!nxt_agent_running(nxt));
+  CHECK_OK(nxt_handshake(nxt));
+  CHECK_OK(nxt_read_word(nxt, SCRATCH, &w));
+  CHECK(w == ((nxt_word_t)(unsigned char)buf[0] |
+              (nxt_word_t)(unsigned char)buf[1] << 8 |
+              (nxt_word_t)(unsigned char)buf[2] << 16 |
+              (nxt_word_t)(unsigned char)buf[3] << 24));
+
+  free(buf);
+  free(back);
+  nxt_close(nxt);
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_emu_t *emu = nxt_emu_new();
+
+  test_agent(emu);
+
+  nxt_emu_free(emu);
+  return 0;
+}
@@ -0,0 +1,122 @@
+/**
+ * libnxt tests; uploading code to RAM and running it.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <string.h>
+
+#include "firmware.h"
+#include "samba.h"
+#include "test.h"
+
+#define EXEC_ADDR 0x202000
+#define CHUNK 256
+#define IMAGE_LEN (40 * CHUNK + 100)
+#define N_CHUNKS 41
+
+/* Upload image over prev and run it, then bring the brick back from
+ * the code it jumped to. Returns how many chunks were sent.
+ */
+static int exec_delta(nxt_emu_t *emu, nxt_t **nxt, nxt_addr_t addr,
+                      char *image, int len, char *prev, int prev_len)
+{
+  int sent, skipped;
+
+  CHECK_OK(nxt_exec_delta_buffer(*nxt, addr, image, len, prev, prev_len,
+                                 &sent, &skipped));
+  CHECK(sent + skipped == (len + CHUNK - 1) / CHUNK);
+
+  nxt_close(*nxt);
+  nxt_emu_reset(emu);
+  *nxt = test_open(emu);
+
+  return sent;
+}
+
+/* Whether the brick's RAM at addr holds image. */
+static int ram_holds(nxt_t *nxt, nxt_addr_t addr, char *image, int len)
+{
+  char *back = malloc(len);
+  int same;
+
+  CHECK_OK(nxt_read_mem(nxt, addr, back, len));
+  same = memcmp(back, image, len) == 0;
+  free(back);
+
+  return same;
+}
+
+static void test_delta(nxt_emu_t *emu)
+{
+  nxt_t *nxt = test_open(emu);
+  char *a = malloc(IMAGE_LEN), *b = malloc(IMAGE_LEN);
+  int big = 0xCF00;
+  char *c = malloc(big);
+
+  test_pattern(a, IMAGE_LEN, 11);
+  memcpy(b, a, IMAGE_LEN);
+  b[5 * CHUNK + 7] ^= 1;
+  b[IMAGE_LEN - 1] ^= 1;
+
+  // Without a previous image, everything goes up
+  CHECK(exec_delta(emu, &nxt, EXEC_ADDR, a, IMAGE_LEN, NULL, 0) == N_CHUNKS);
+  CHECK(ram_holds(nxt, EXEC_ADDR, a, IMAGE_LEN));
+
+  // Then the chunks that changed, and the short last one, which
+  // always goes up
+  CHECK(exec_delta(emu, &nxt, EXEC_ADDR, b, IMAGE_LEN, a, IMAGE_LEN) == 2);
+  CHECK(ram_holds(nxt, EXEC_ADDR, b, IMAGE_LEN));
+
+  // Chunks the brick no longer holds go up again, with the last one
+  CHECK_OK(nxt_write_word(nxt, EXEC_ADDR + 10 * CHUNK, 0));
+  CHECK(exec_delta(emu, &nxt, EXEC_ADDR, b, IMAGE_LEN, b, IMAGE_LEN) == 2);
+  CHECK(ram_holds(nxt, EXEC_ADDR, b, IMAGE_LEN));
+
+  // A grown image only sends what it adds
+  CHECK(exec_delta(emu, &nxt, EXEC_ADDR, b, IMAGE_LEN, b,
+                   IMAGE_LEN - 100 - 2 * CHUNK) == 3);
+  CHECK(ram_holds(nxt, EXEC_ADDR, b, IMAGE_LEN));
+
+  // With no room for the checksum routine, everything goes up
+  test_pattern(c, big, 12);
+  CHECK(exec_delta(emu, &nxt, EXEC_ADDR + 0x100, c, big, NULL, 0) ==
+        big / CHUNK);
+  CHECK(exec_delta(emu, &nxt, EXEC_ADDR + 0x100, c, big, c, big) ==
+        big / CHUNK);
+  CHECK(ram_holds(nxt, EXEC_ADDR + 0x100, c, big));
+
+  CHECK_ERR(nxt_exec_delta_buffer(nxt, EXEC_ADDR, c, NXT_EXEC_MAX_SIZE + 1,
+                                  NULL, 0, NULL, NULL),
+            NXT_INVALID_FIRMWARE);
+
+  free(a);
+  free(b);
+  free(c);
+  nxt_close(nxt);
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_emu_t *emu = nxt_emu_new();
+
+  test_delta(emu);
+
+  nxt_emu_free(emu);
+  return 0;
+}
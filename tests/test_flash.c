@@ -0,0 +1,191 @@
+/**
+ * libnxt tests; flashing, verifying and the flash sequencer.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <string.h>
+
+#include "firmware.h"
+#include "flash.h"
+#include "samba.h"
+#include "stats.h"
+#include "test.h"
+
+#define IMAGE_LEN 70000
+#define PAGE_SIZE 256
+#define REGION_PAGES 64
+
+/* Where flash.c keeps the sequencer routine. */
+#define SEQ_ADDR 0x203400
+
+/* How many of cmd the handle has sent, or -1 without statistics. */
+static long commands_sent(nxt_t *nxt, char cmd)
+{
+  nxt_stats_t stats;
+
+  if (nxt_get_stats(nxt, &stats) != NXT_OK)
+    return -1;
+  return stats.commands[(unsigned char)cmd];
+}
+
+/* How many pages the handle has flashed, or -1 without statistics. */
+static long pages_flashed(nxt_t *nxt)
+{
+  nxt_stats_t stats;
+
+  if (nxt_get_stats(nxt, &stats) != NXT_OK)
+    return -1;
+  return stats.pages_flashed;
+}
+
+static void test_firmware(nxt_emu_t *emu)
+{
+  nxt_t *nxt = test_open(emu);
+  char *image = malloc(IMAGE_LEN), *other = malloc(IMAGE_LEN);
+  int current, written, skipped;
+  long before;
+
+  test_pattern(image, IMAGE_LEN, 1);
+  memcpy(other, image, IMAGE_LEN);
+  other[PAGE_SIZE * 10 + 3] ^= 1;
+  other[IMAGE_LEN - 1] ^= 1;
+
+  CHECK_OK(nxt_firmware_flash_buffer(nxt, image, IMAGE_LEN));
+  CHECK(memcmp(nxt_emu_flash(emu), image, IMAGE_LEN) == 0);
+  CHECK_OK(nxt_firmware_verify_buffer(nxt, image, IMAGE_LEN));
+  CHECK_ERR(nxt_firmware_verify_buffer(nxt, other, IMAGE_LEN),
+            NXT_VERIFY_FAILED);
+
+  CHECK_OK(nxt_firmware_is_current_buffer(nxt, image, IMAGE_LEN, &current));
+  CHECK(current);
+  CHECK_OK(nxt_firmware_is_current_buffer(nxt, other, IMAGE_LEN, &current));
+  CHECK(!current);
+
+  // Only the two pages that differ get written
+  CHECK_OK(nxt_firmware_flash_incremental_buffer(nxt, other, IMAGE_LEN,
+                                                 &written, &skipped));
+  CHECK(written == 2);
+  CHECK(written + skipped == (IMAGE_LEN + PAGE_SIZE - 1) / PAGE_SIZE);
+  CHECK(memcmp(nxt_emu_flash(emu), other, IMAGE_LEN) == 0);
+  CHECK_OK(nxt_firmware_is_current_buffer(nxt, other, IMAGE_LEN, &current));
+  CHECK(current);
+
+  // Flashing the same image again writes nothing, fingerprint included
+  before = pages_flashed(nxt);
+  CHECK_OK(nxt_firmware_flash_incremental_buffer(nxt, other, IMAGE_LEN,
+                                                 &written, &skipped));
+  CHECK(written == 0);
+  CHECK(pages_flashed(nxt) == before);
+
+  // Flash changed behind libnxt's back no longer counts as current
+  nxt_emu_flash(emu)[PAGE_SIZE * 20] ^= 1;
+  CHECK_OK(nxt_firmware_is_current_buffer(nxt, other, IMAGE_LEN, &current));
+  CHECK(!current);
+
+  free(image);
+  free(other);
+  nxt_close(nxt);
+}
+
+static void test_sparse(nxt_emu_t *emu)
+{
+  nxt_t *nxt = test_open(emu);
+  unsigned char data[32], upper[2] = { 0x00, 0x10 };
+  char hex[1024] = "", gap[3 * PAGE_SIZE];
+  nxt_flash_plan_t plan;
+  char *path;
+  int current;
+
+  // Pages 0 and 4 of the flash, with the pages between left alone
+  test_pattern((char *)data, sizeof(data), 3);
+  test_ihex_record(hex, 4, 0, upper, 2);
+  test_ihex_record(hex, 0, 0x0000, data, sizeof(data));
+  test_ihex_record(hex, 0, 0x0400, data, sizeof(data));
+  test_ihex_record(hex, 1, 0, NULL, 0);
+  path = test_temp_file(hex, strlen(hex));
+
+  test_pattern(gap, sizeof(gap), 4);
+  memcpy(nxt_emu_flash(emu) + PAGE_SIZE, gap, sizeof(gap));
+
+  CHECK_OK(nxt_flash_plan_load(path, &plan));
+  CHECK(plan.sparse && plan.n_used == 2);
+  CHECK_OK(nxt_firmware_flash_plan(nxt, &plan));
+  CHECK_OK(nxt_firmware_verify_plan(nxt, &plan));
+  CHECK(memcmp(nxt_emu_flash(emu) + PAGE_SIZE, gap, sizeof(gap)) == 0);
+  CHECK(memcmp(nxt_emu_flash(emu) + 4 * PAGE_SIZE, data, sizeof(data)) == 0);
+
+  // Only the pages the image uses decide whether it is current
+  CHECK_OK(nxt_firmware_is_current_plan(nxt, &plan, &current));
+  CHECK(current);
+  CHECK_OK(nxt_firmware_is_current(nxt, path, &current));
+  CHECK(current);
+
+  nxt_emu_flash(emu)[4 * PAGE_SIZE + 1] ^= 1;
+  CHECK_OK(nxt_firmware_is_current_plan(nxt, &plan, &current));
+  CHECK(!current);
+
+  nxt_flash_plan_free(&plan);
+  nxt_close(nxt);
+}
+
+static void test_sequencer(nxt_emu_t *emu)
+{
+  nxt_t *nxt = test_open(emu);
+  nxt_flash_seq_t seq;
+  long before;
+
+  CHECK_OK(nxt_write_word(nxt, 0x204000, 0x5A5A5A5A));
+
+  // Writing a locked page fails, and the failure doesn't linger
+  CHECK_OK(nxt_flash_lock_region(nxt, 3));
+  nxt_flash_seq_init(&seq);
+  CHECK_OK(nxt_flash_seq_write_page(&seq, 3 * REGION_PAGES, 0x204000));
+  CHECK_ERR(nxt_flash_seq_run(nxt, &seq), NXT_FLASH_ERROR);
+  CHECK_OK(nxt_flash_unlock_region(nxt, 3));
+  CHECK_OK(nxt_flash_seq_run(nxt, &seq));
+  CHECK(nxt_emu_flash(emu)[3 * REGION_PAGES * PAGE_SIZE] == 0x5A);
+
+  // A stray bad flash command leaves PROGE behind for the next run
+  CHECK_OK(nxt_write_word(nxt, 0xFFFFFF64, 0x12345601));
+  CHECK_OK(nxt_flash_lock_region(nxt, 3));
+
+  // The routine stays resident, until something writes over it
+  before = commands_sent(nxt, 'S');
+  CHECK_OK(nxt_flash_unlock_region(nxt, 3));
+  CHECK(commands_sent(nxt, 'S') == before + (before >= 0));
+  CHECK_OK(nxt_write_word(nxt, SEQ_ADDR + 0x10, 0));
+  before = commands_sent(nxt, 'S');
+  CHECK_OK(nxt_flash_lock_region(nxt, 3));
+  CHECK(commands_sent(nxt, 'S') == before + 2 * (before >= 0));
+  CHECK_OK(nxt_flash_unlock_region(nxt, 3));
+
+  nxt_close(nxt);
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_emu_t *emu = nxt_emu_new();
+
+  test_firmware(emu);
+  test_sparse(emu);
+  test_sequencer(emu);
+
+  nxt_emu_free(emu);
+  return 0;
+}
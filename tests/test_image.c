@@ -0,0 +1,293 @@
+/**
+ * libnxt tests; loading ELF, Intel HEX and S-record images.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <string.h>
+
+#include "firmware.h"
+#include "image.h"
+#include "samba.h"
+#include "test.h"
+
+#define FLASH_BASE 0x100000
+#define PAGE_SIZE 256
+#define REGION_PAGES 64
+#define RECORD_LEN 16
+
+/* The image every format carries: two runs of data, in the first lock
+ * region and the third.
+ */
+#define A_ADDR FLASH_BASE
+#define A_LEN 300
+#define B_ADDR (FLASH_BASE + 128 * PAGE_SIZE + 0x10)
+#define B_LEN 100
+
+static unsigned char a[A_LEN], b[B_LEN];
+
+static void store_half(char *buf, int value)
+{
+  buf[0] = value;
+  buf[1] = value >> 8;
+}
+
+static void ihex_data(char *hex, nxt_addr_t addr, unsigned char *data,
+                      int len)
+{
+  unsigned char upper[2] = { addr >> 24, addr >> 16 };
+  int i, n;
+
+  test_ihex_record(hex, 4, 0, upper, 2);
+  for (i = 0; i < len; i += n)
+    {
+      n = len - i < RECORD_LEN ? len - i : RECORD_LEN;
+      test_ihex_record(hex, 0, addr + i, data + i, n);
+    }
+}
+
+static void srec_record(char *buf, int type, nxt_addr_t addr,
+                        const unsigned char *data, int len)
+{
+  int addr_len = type == 0 ? 2 : type + 1;
+  int sum = len + addr_len + 1;
+  int i;
+
+  buf += strlen(buf);
+  buf += sprintf(buf, "S%d%02X", type, len + addr_len + 1);
+  for (i = addr_len - 1; i >= 0; i--)
+    {
+      buf += sprintf(buf, "%02X", (addr >> (i * 8)) & 0xFF);
+      sum += addr >> (i * 8);
+    }
+  for (i = 0; i < len; i++)
+    {
+      buf += sprintf(buf, "%02X", data[i]);
+      sum += data[i];
+    }
+  sprintf(buf, "%02X\n", ~sum & 0xFF);
+}
+
+static void srec_data(char *srec, nxt_addr_t addr, unsigned char *data,
+                      int len)
+{
+  int i, n;
+
+  for (i = 0; i < len; i += n)
+    {
+      n = len - i < RECORD_LEN ? len - i : RECORD_LEN;
+      srec_record(srec, 3, addr + i, data + i, n);
+    }
+}
+
+/* An ARM ELF file loading a and b, along with a segment of zeroes
+ * and a note, which load nothing.
+ */
+static int make_elf(char *elf)
+{
+  int phoff = 52, n_ph = 4, data = phoff + n_ph * 32;
+  char *ph = elf + phoff;
+
+  memset(elf, 0, data + A_LEN + B_LEN);
+  memcpy(elf, "\177ELF\1\1\1", 7);
+  store_half(elf + 0x10, 2);
+  store_half(elf + 0x12, 40);
+  nxt_store_word(elf + 0x1C, phoff);
+  store_half(elf + 0x2A, 32);
+  store_half(elf + 0x2C, n_ph);
+
+  // Loaded where the physical address says, not the virtual one
+  nxt_store_word(ph, 1);
+  nxt_store_word(ph + 4, data);
+  nxt_store_word(ph + 8, 0x200000);
+  nxt_store_word(ph + 12, A_ADDR);
+  nxt_store_word(ph + 16, A_LEN);
+  memcpy(elf + data, a, A_LEN);
+
+  ph += 32;
+  nxt_store_word(ph, 1);
+  nxt_store_word(ph + 4, data + A_LEN);
+  nxt_store_word(ph + 8, B_ADDR);
+  nxt_store_word(ph + 12, B_ADDR);
+  nxt_store_word(ph + 16, B_LEN);
+  memcpy(elf + data + A_LEN, b, B_LEN);
+
+  ph += 32;
+  nxt_store_word(ph, 1);
+  nxt_store_word(ph + 12, 0x201000);
+  nxt_store_word(ph + 20, 0x400);
+
+  ph += 32;
+  nxt_store_word(ph, 4);
+  nxt_store_word(ph + 4, data);
+  nxt_store_word(ph + 16, 8);
+
+  return data + A_LEN + B_LEN;
+}
+
+/* Check an image holding a and b loads, plans and flashes as it
+ * should.
+ */
+static void check_image(nxt_emu_t *emu, char *path,
+                        nxt_image_format_t format)
+{
+  char *flash = nxt_emu_flash(emu), gap[2 * PAGE_SIZE];
+  nxt_flash_plan_t plan;
+  nxt_image_t *image;
+  nxt_t *nxt;
+  int current;
+
+  CHECK_OK(nxt_image_load(path, &image));
+  CHECK(image->format == format);
+  CHECK(image->n_segments == 2);
+  CHECK(image->segments[0].addr == A_ADDR &&
+        image->segments[0].len == A_LEN &&
+        memcmp(image->segments[0].data, a, A_LEN) == 0);
+  CHECK(image->segments[1].addr == B_ADDR &&
+        image->segments[1].len == B_LEN &&
+        memcmp(image->segments[1].data, b, B_LEN) == 0);
+  nxt_image_free(image);
+
+  CHECK_OK(nxt_flash_plan_load(path, &plan));
+  CHECK(plan.sparse);
+  CHECK(plan.n_used == 3 && plan.used[0] && plan.used[1] && plan.used[128]);
+  CHECK(plan.regions == (1 << 0 | 1 << 2));
+  CHECK(plan.len == 129 * PAGE_SIZE);
+  nxt_flash_plan_free(&plan);
+
+  // Only the pages the image uses get written
+  test_pattern(gap, sizeof(gap), format);
+  memcpy(flash + 10 * PAGE_SIZE, gap, sizeof(gap));
+
+  nxt = test_open(emu);
+  CHECK_OK(nxt_firmware_flash(nxt, path));
+  CHECK_OK(nxt_firmware_verify(nxt, path));
+  CHECK_OK(nxt_firmware_is_current(nxt, path, &current));
+  CHECK(current);
+  nxt_close(nxt);
+
+  CHECK(memcmp(flash, a, A_LEN) == 0);
+  CHECK(memcmp(flash + (B_ADDR - FLASH_BASE), b, B_LEN) == 0);
+  CHECK(memcmp(flash + 10 * PAGE_SIZE, gap, sizeof(gap)) == 0);
+}
+
+static void test_formats(nxt_emu_t *emu)
+{
+  char *text = calloc(1, 16384), *elf = malloc(4096), *raw = malloc(1000);
+  nxt_flash_plan_t plan;
+  nxt_image_t *image;
+  char *path;
+  int len;
+
+  ihex_data(text, A_ADDR, a, A_LEN);
+  ihex_data(text, B_ADDR, b, B_LEN);
+  test_ihex_record(text, 1, 0, NULL, 0);
+  check_image(emu, test_temp_file(text, strlen(text)), NXT_IMAGE_IHEX);
+
+  text[0] = 0;
+  srec_record(text, 0, 0, (unsigned char *)"libnxt", 6);
+  srec_data(text, A_ADDR, a, A_LEN);
+  srec_data(text, B_ADDR, b, B_LEN);
+  srec_record(text, 7, A_ADDR, NULL, 0);
+  check_image(emu, test_temp_file(text, strlen(text)), NXT_IMAGE_SREC);
+
+  len = make_elf(elf);
+  check_image(emu, test_temp_file(elf, len), NXT_IMAGE_ELF);
+
+  // Anything else is a raw binary, for the start of the flash
+  test_pattern(raw, 1000, 21);
+  path = test_temp_file(raw, 1000);
+  CHECK_OK(nxt_image_load(path, &image));
+  CHECK(image->format == NXT_IMAGE_RAW && image->n_segments == 1);
+  CHECK(image->segments[0].addr == FLASH_BASE &&
+        image->segments[0].len == 1000);
+  nxt_image_free(image);
+  CHECK_OK(nxt_flash_plan_load(path, &plan));
+  CHECK(!plan.sparse && plan.n_used == 4 && plan.len == 1000);
+  nxt_flash_plan_free(&plan);
+
+  free(text);
+  free(elf);
+  free(raw);
+}
+
+/* Load what's in buf, expecting err. */
+static void check_load(const char *buf, int len, nxt_error_t err)
+{
+  nxt_image_t *image;
+
+  CHECK_ERR(nxt_image_load(test_temp_file(buf, len), &image), err);
+  if (err == NXT_OK)
+    nxt_image_free(image);
+}
+
+static void test_malformed(void)
+{
+  char text[1024] = "", *elf = malloc(4096);
+  nxt_flash_plan_t plan;
+  int len;
+
+  // Bad checksums, and HEX files missing their end record
+  test_ihex_record(text, 0, 0, a, RECORD_LEN);
+  check_load(text, strlen(text), NXT_INVALID_FIRMWARE);
+  test_ihex_record(text, 1, 0, NULL, 0);
+  check_load(text, strlen(text), NXT_OK);
+  text[12] ^= 1;
+  check_load(text, strlen(text), NXT_INVALID_FIRMWARE);
+
+  text[0] = 0;
+  srec_record(text, 1, 0x1000, a, RECORD_LEN);
+  check_load(text, strlen(text), NXT_OK);
+  text[10] ^= 1;
+  check_load(text, strlen(text), NXT_INVALID_FIRMWARE);
+
+  // Files for other machines, and headers pointing outside the file
+  len = make_elf(elf);
+  check_load(elf, len, NXT_OK);
+  elf[0x12] = 3;
+  check_load(elf, len, NXT_INVALID_FIRMWARE);
+  make_elf(elf);
+  store_half(elf + 0x2C, 1000);
+  check_load(elf, len, NXT_INVALID_FIRMWARE);
+  make_elf(elf);
+  nxt_store_word(elf + 52 + 16, len);
+  check_load(elf, len, NXT_INVALID_FIRMWARE);
+
+  // Data outside the flash parses, but can't be flashed
+  text[0] = 0;
+  ihex_data(text, 0x200000, a, RECORD_LEN);
+  test_ihex_record(text, 1, 0, NULL, 0);
+  CHECK_ERR(nxt_flash_plan_load(test_temp_file(text, strlen(text)), &plan),
+            NXT_INVALID_FIRMWARE);
+
+  free(elf);
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_emu_t *emu = nxt_emu_new();
+
+  test_pattern((char *)a, A_LEN, 1);
+  test_pattern((char *)b, B_LEN, 2);
+
+  test_formats(emu);
+  test_malformed();
+
+  nxt_emu_free(emu);
+  return 0;
+}
@@ -0,0 +1,499 @@
+/**
+ * libnxt tests; the LEGO firmware file commands, against a fake brick.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lego.h"
+#include "samba.h"
+#include "transport.h"
+#include "test.h"
+
+#define MAX_FILES 32
+#define MAX_HANDLES 8
+#define MAX_REPLIES 2 /* What the brick holds for the host */
+#define BIG_LEN 100000
+
+enum { MODE_READ, MODE_WRITE, MODE_FIND };
+
+/* A brick running the LEGO firmware, as far as its file commands go:
+ * the emulator only speaks SAM-BA.
+ */
+struct lego_file {
+  int used;
+  char name[NXT_LEGO_NAME_LEN];
+  int size, pos;
+  int opcode; /* The open command that made it */
+  char *data;
+};
+
+struct lego_handle {
+  int used;
+  int mode;
+  int file;
+  char pattern[NXT_LEGO_NAME_LEN];
+};
+
+struct lego_brick {
+  struct lego_file files[MAX_FILES];
+  struct lego_handle handles[MAX_HANDLES];
+  char replies[MAX_REPLIES][NXT_PACKET_SIZE];
+  int reply_len[MAX_REPLIES];
+  int n_replies;
+  int capacity;
+  int fail_writes_after; /* Writes the brick takes, or -1 for all */
+  int n_writes;
+  int n_erases;
+  int n_acks;
+};
+
+static struct lego_brick brick;
+
+static int find_file(const char *name)
+{
+  int i;
+
+  for (i = 0; i < MAX_FILES; i++)
+    if (brick.files[i].used && strcmp(brick.files[i].name, name) == 0)
+      return i;
+  return -1;
+}
+
+static int new_handle(int mode, int file)
+{
+  int i;
+
+  for (i = 0; i < MAX_HANDLES && brick.handles[i].used; i++)
+    ;
+  CHECK(i < MAX_HANDLES);
+  memset(&brick.handles[i], 0, sizeof(brick.handles[i]));
+  brick.handles[i].used = 1;
+  brick.handles[i].mode = mode;
+  brick.handles[i].file = file;
+  return i;
+}
+
+static void delete_file(int f)
+{
+  brick.files[f].used = 0;
+  free(brick.files[f].data);
+}
+
+static int space_used(void)
+{
+  int i, used = 0;
+
+  for (i = 0; i < MAX_FILES; i++)
+    if (brick.files[i].used)
+      used += brick.files[i].size;
+  return used;
+}
+
+/* Fill in the reply for the next file a search matches, from where it
+ * left off.
+ */
+static int find_next(int h, char *reply)
+{
+  struct lego_handle *handle = &brick.handles[h];
+
+  for (; handle->file < MAX_FILES; handle->file++)
+    {
+      struct lego_file *file = &brick.files[handle->file];
+
+      if (file->used && fnmatch(handle->pattern, file->name, 0) == 0)
+        {
+          reply[3] = h;
+          strcpy(reply + 4, file->name);
+          nxt_store_word(reply + 4 + NXT_LEGO_NAME_LEN, file->size);
+          handle->file++;
+          return 0;
+        }
+    }
+
+  handle->used = 0;
+  return NXT_LEGO_FILE_NOT_FOUND;
+}
+
+static int open_write(unsigned char *cmd, char *reply)
+{
+  int size = nxt_load_word((char *)cmd + 2 + NXT_LEGO_NAME_LEN);
+  int f;
+
+  if (find_file((char *)cmd + 2) >= 0)
+    return NXT_LEGO_FILE_EXISTS;
+  if (space_used() + size > brick.capacity)
+    return NXT_LEGO_NO_SPACE;
+
+  for (f = 0; f < MAX_FILES && brick.files[f].used; f++)
+    ;
+  CHECK(f < MAX_FILES);
+  memset(&brick.files[f], 0, sizeof(brick.files[f]));
+  brick.files[f].used = 1;
+  strcpy(brick.files[f].name, (char *)cmd + 2);
+  brick.files[f].size = size;
+  brick.files[f].opcode = cmd[1];
+  brick.files[f].data = malloc(size + 1);
+
+  reply[3] = new_handle(MODE_WRITE, f);
+  return 0;
+}
+
+static int lego_command(unsigned char *cmd, int len, char *reply,
+                        int *reply_len)
+{
+  struct lego_handle *handle = &brick.handles[cmd[2] % MAX_HANDLES];
+  struct lego_file *file = &brick.files[handle->file];
+  int f, n;
+
+  reply[3] = cmd[2];
+  switch (cmd[1])
+    {
+    case 0x80:
+      *reply_len = 8;
+      f = find_file((char *)cmd + 2);
+      if (f < 0)
+        return NXT_LEGO_FILE_NOT_FOUND;
+      brick.files[f].pos = 0;
+      reply[3] = new_handle(MODE_READ, f);
+      nxt_store_word(reply + 4, brick.files[f].size);
+      return 0;
+
+    case 0x81:
+    case 0x89:
+    case 0x8B:
+      *reply_len = 4;
+      return open_write(cmd, reply);
+
+    case 0x82:
+      n = cmd[3] | cmd[4] << 8;
+      CHECK(handle->used && handle->mode == MODE_READ);
+      if (n > file->size - file->pos)
+        n = file->size - file->pos;
+      memcpy(reply + 6, file->data + file->pos, n);
+      file->pos += n;
+      reply[4] = n;
+      reply[5] = n >> 8;
+      *reply_len = 6 + n;
+      return 0;
+
+    case 0x83:
+      *reply_len = 6;
+      n = len - 3;
+      CHECK(handle->used && handle->mode == MODE_WRITE);
+      if (brick.fail_writes_after >= 0 &&
+          brick.n_writes++ >= brick.fail_writes_after)
+        return 0x8E;
+      if (n > file->size - file->pos)
+        return 0x8E;
+      memcpy(file->data + file->pos, cmd + 3, n);
+      file->pos += n;
+      reply[4] = n;
+      reply[5] = n >> 8;
+      return 0;
+
+    case 0x84:
+      *reply_len = 4;
+      if (!handle->used)
+        return 0x88;
+      handle->used = 0;
+      return 0;
+
+    case 0x85:
+      *reply_len = 3 + NXT_LEGO_NAME_LEN;
+      f = find_file((char *)cmd + 2);
+      if (f < 0)
+        return NXT_LEGO_FILE_NOT_FOUND;
+      delete_file(f);
+      return 0;
+
+    case 0x86:
+      *reply_len = 8 + NXT_LEGO_NAME_LEN;
+      f = new_handle(MODE_FIND, 0);
+      strcpy(brick.handles[f].pattern, (char *)cmd + 2);
+      return find_next(f, reply);
+
+    case 0x87:
+      *reply_len = 8 + NXT_LEGO_NAME_LEN;
+      CHECK(handle->used && handle->mode == MODE_FIND);
+      return find_next(cmd[2], reply);
+
+    case 0xA0:
+      *reply_len = 3;
+      brick.n_erases++;
+      for (f = 0; f < MAX_FILES; f++)
+        if (brick.files[f].used)
+          delete_file(f);
+      return 0;
+    }
+
+  CHECK(!"unknown LEGO command");
+  return 0;
+}
+
+static nxt_error_t lego_open(nxt_t *nxt, int interface)
+{
+  CHECK(interface == NXT_LEGO_INTERFACE);
+  return NXT_OK;
+}
+
+static nxt_error_t lego_send(nxt_t *nxt, char *buf, int len)
+{
+  unsigned char *cmd = (unsigned char *)buf;
+  char reply[NXT_PACKET_SIZE];
+  int reply_len = 3;
+
+  CHECK(len >= 2 && len <= NXT_PACKET_SIZE);
+  CHECK(cmd[0] == 0x01 || cmd[0] == 0x81);
+
+  memset(reply, 0, sizeof(reply));
+  reply[0] = 0x02;
+  reply[1] = cmd[1];
+  reply[2] = lego_command(cmd, len, reply, &reply_len);
+
+  if (cmd[0] == 0x81)
+    return NXT_OK;
+
+  // The brick only holds so many replies for the host
+  CHECK(brick.n_replies < MAX_REPLIES);
+  memcpy(brick.replies[brick.n_replies], reply, reply_len);
+  brick.reply_len[brick.n_replies++] = reply_len;
+  if (cmd[1] == 0x83)
+    brick.n_acks++;
+
+  return NXT_OK;
+}
+
+static nxt_error_t lego_recv(nxt_t *nxt, char *buf, int len, int *n_read)
+{
+  CHECK(brick.n_replies > 0);
+
+  *n_read = brick.reply_len[0] < len ? brick.reply_len[0] : len;
+  memcpy(buf, brick.replies[0], *n_read);
+  brick.n_replies--;
+  memmove(brick.replies[0], brick.replies[1],
+          brick.n_replies * sizeof(brick.replies[0]));
+  memmove(brick.reply_len, brick.reply_len + 1,
+          brick.n_replies * sizeof(brick.reply_len[0]));
+
+  return NXT_OK;
+}
+
+static void lego_close(nxt_t *nxt)
+{
+}
+
+static const nxt_transport_t lego_transport = {
+  "lego", lego_open, lego_send, lego_recv, lego_close,
+};
+
+static nxt_t *lego_open_brick(void)
+{
+  nxt_t *nxt;
+  int i;
+
+  for (i = 0; i < MAX_FILES; i++)
+    if (brick.files[i].used)
+      delete_file(i);
+  memset(&brick, 0, sizeof(brick));
+  brick.capacity = 1 << 20;
+  brick.fail_writes_after = -1;
+
+  CHECK_OK(nxt_init_transport(&nxt, &lego_transport, NULL, LEGO));
+  CHECK_OK(nxt_open(nxt, NXT_LEGO_INTERFACE));
+  return nxt;
+}
+
+static int open_handles(void)
+{
+  int i, n = 0;
+
+  for (i = 0; i < MAX_HANDLES; i++)
+    n += brick.handles[i].used;
+  return n;
+}
+
+/* Whether the brick holds name, with contents buf. */
+static int brick_holds(const char *name, const char *buf, int len)
+{
+  int f = find_file(name);
+
+  return f >= 0 && brick.files[f].size == len &&
+    memcmp(brick.files[f].data, buf, len) == 0;
+}
+
+static void test_files(void)
+{
+  nxt_t *nxt = lego_open_brick();
+  char *big = malloc(BIG_LEN), *out;
+  nxt_lego_file_t *files;
+  size_t len;
+  int n;
+
+  test_pattern(big, BIG_LEN, 41);
+
+  // Writes only wait for one reply in every NXT_LEGO_WRITE_ACK packets
+  CHECK_OK(nxt_lego_upload(nxt, "big.rxe", big, BIG_LEN));
+  CHECK(brick_holds("big.rxe", big, BIG_LEN));
+  n = (BIG_LEN + NXT_PACKET_SIZE - 4) / (NXT_PACKET_SIZE - 3);
+  CHECK(brick.n_acks == (n + NXT_LEGO_WRITE_ACK - 1) / NXT_LEGO_WRITE_ACK);
+
+  CHECK_OK(nxt_lego_download(nxt, "big.rxe", &out, &len));
+  CHECK(len == BIG_LEN && memcmp(out, big, len) == 0);
+  free(out);
+
+  // Files go in the mode the firmware uses them in
+  CHECK_OK(nxt_lego_upload(nxt, "log.rdt", big, 300));
+  CHECK_OK(nxt_lego_upload(nxt, "notes.txt", big, 10));
+  CHECK_OK(nxt_lego_upload(nxt, "empty.dat", big, 0));
+  CHECK(brick.files[find_file("big.rxe")].opcode == 0x89);
+  CHECK(brick.files[find_file("log.rdt")].opcode == 0x8B);
+  CHECK(brick.files[find_file("notes.txt")].opcode == 0x81);
+
+  // Uploads replace files of the same name
+  CHECK_OK(nxt_lego_upload(nxt, "notes.txt", big + 5, 61));
+  CHECK(brick_holds("notes.txt", big + 5, 61));
+
+  CHECK_OK(nxt_lego_download(nxt, "empty.dat", &out, &len));
+  CHECK(len == 0);
+  free(out);
+
+  CHECK_OK(nxt_lego_list(nxt, "*.*", &files, &n));
+  CHECK(n == 4);
+  free(files);
+  CHECK_OK(nxt_lego_list(nxt, "*.rdt", &files, &n));
+  CHECK(n == 1 && strcmp(files[0].name, "log.rdt") == 0 &&
+        files[0].size == 300);
+  free(files);
+  CHECK_OK(nxt_lego_list(nxt, "*.zzz", &files, &n));
+  CHECK(n == 0 && files == NULL);
+
+  // Refusals come with the brick's reason
+  CHECK_ERR(nxt_lego_download(nxt, "nope", &out, &len), NXT_LEGO_ERROR);
+  CHECK(nxt_lego_status(nxt) == NXT_LEGO_FILE_NOT_FOUND);
+  CHECK_ERR(nxt_lego_delete(nxt, "abcdefghijklmnopqrst"), NXT_LEGO_ERROR);
+  CHECK(nxt_lego_status(nxt) == NXT_LEGO_ILLEGAL_FILENAME);
+  CHECK_OK(nxt_lego_delete(nxt, "notes.txt"));
+  CHECK(find_file("notes.txt") < 0);
+
+  // A write failing mid-stream leaves no file, handle or reply behind
+  brick.fail_writes_after = 20;
+  CHECK_ERR(nxt_lego_upload(nxt, "half.rxe", big, 5000), NXT_LEGO_ERROR);
+  CHECK(nxt_lego_status(nxt) == 0x8E);
+  CHECK(find_file("half.rxe") < 0);
+  CHECK(brick.n_replies == 0);
+  brick.fail_writes_after = -1;
+
+  brick.capacity = space_used() + 1000;
+  CHECK_ERR(nxt_lego_upload(nxt, "full.txt", big, 5000), NXT_LEGO_ERROR);
+  CHECK(nxt_lego_status(nxt) == NXT_LEGO_NO_SPACE);
+  CHECK(open_handles() == 0);
+
+  free(big);
+  nxt_close(nxt);
+}
+
+/* Whether the backup of name in dir holds buf. */
+static int backup_holds(const char *dir, const char *name, const char *buf,
+                        int len)
+{
+  char path[512], *back = malloc(len + 1);
+  FILE *f;
+  int same;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  f = fopen(path, "rb");
+  if (f == NULL)
+    return 0;
+  same = fread(back, 1, len + 1, f) == len && memcmp(back, buf, len) == 0;
+  fclose(f);
+  free(back);
+
+  return same;
+}
+
+static void remove_dir(const char *dir)
+{
+  char path[512];
+  struct dirent *d;
+  DIR *dp = opendir(dir);
+
+  while (dp != NULL && (d = readdir(dp)) != NULL)
+    if (d->d_name[0] != '.')
+      {
+        snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+        unlink(path);
+      }
+  if (dp != NULL)
+    closedir(dp);
+  rmdir(dir);
+}
+
+static void test_defrag(void)
+{
+  nxt_t *nxt = lego_open_brick();
+  char dir[] = "/tmp/libnxt-test-XXXXXX";
+  char *buf = malloc(BIG_LEN);
+
+  test_pattern(buf, BIG_LEN, 42);
+  CHECK_OK(nxt_lego_upload(nxt, "prog.rxe", buf, BIG_LEN));
+  CHECK_OK(nxt_lego_upload(nxt, "log.rdt", buf + 1, 500));
+  CHECK_OK(nxt_lego_upload(nxt, "notes.txt", buf + 2, 70));
+  CHECK(mkdtemp(dir) != NULL);
+
+  // Nothing is erased without a backup of every file
+  CHECK_ERR(nxt_lego_defrag(nxt, "/nonexistent/backup"), NXT_FILE_ERROR);
+  CHECK(brick.n_erases == 0);
+  CHECK(brick_holds("prog.rxe", buf, BIG_LEN));
+
+  CHECK_OK(nxt_lego_defrag(nxt, dir));
+  CHECK(brick.n_erases == 1);
+  CHECK(backup_holds(dir, "prog.rxe", buf, BIG_LEN));
+  CHECK(backup_holds(dir, "log.rdt", buf + 1, 500));
+  CHECK(backup_holds(dir, "notes.txt", buf + 2, 70));
+
+  // The files come back as they were, data files still data files
+  CHECK(brick_holds("prog.rxe", buf, BIG_LEN));
+  CHECK(brick_holds("log.rdt", buf + 1, 500));
+  CHECK(brick_holds("notes.txt", buf + 2, 70));
+  CHECK(brick.files[find_file("prog.rxe")].opcode == 0x89);
+  CHECK(brick.files[find_file("log.rdt")].opcode == 0x8B);
+  CHECK(brick.files[find_file("notes.txt")].opcode == 0x81);
+  CHECK(open_handles() == 0);
+
+  // Without a backup directory, the files only live in memory
+  CHECK_OK(nxt_lego_defrag(nxt, NULL));
+  CHECK(brick.n_erases == 2);
+  CHECK(brick_holds("log.rdt", buf + 1, 500));
+
+  remove_dir(dir);
+  free(buf);
+  nxt_close(nxt);
+}
+
+int main(int argc, char *argv[])
+{
+  test_files();
+  test_defrag();
+
+  return 0;
+}
@@ -0,0 +1,108 @@
+/**
+ * libnxt tests; batched register reads and writes.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <string.h>
+
+#include "agent.h"
+#include "regs.h"
+#include "samba.h"
+#include "stats.h"
+#include "test.h"
+
+#define N_WORDS 600
+#define SCRATCH 0x208000
+#define MC_FSR 0xFFFFFF68
+
+/* How many of cmd the handle has sent, or -1 without statistics. */
+static long commands_sent(nxt_t *nxt, char cmd)
+{
+  nxt_stats_t stats;
+
+  if (nxt_get_stats(nxt, &stats) != NXT_OK)
+    return -1;
+  return stats.commands[(unsigned char)cmd];
+}
+
+static void check_words(nxt_emu_t *emu, int agent)
+{
+  nxt_t *nxt = test_open(emu);
+  nxt_addr_t addrs[N_WORDS];
+  nxt_word_t values[N_WORDS], out[N_WORDS], w;
+  long jumps;
+  int i;
+
+  if (agent)
+    CHECK_OK(nxt_agent_start(nxt));
+
+  // Scattered over the SRAM, and more than a batch holds
+  for (i = 0; i < N_WORDS; i++)
+    {
+      addrs[i] = SCRATCH + (i * 7 % N_WORDS) * 8;
+      values[i] = i * 2654435761U;
+    }
+
+  jumps = commands_sent(nxt, 'G');
+  CHECK_OK(nxt_write_words(nxt, addrs, values, N_WORDS));
+  memset(out, 0, sizeof(out));
+  CHECK_OK(nxt_read_words(nxt, addrs, out, N_WORDS));
+  CHECK(memcmp(out, values, sizeof(out)) == 0);
+
+  // A jump per batch, with the agent doing without
+  if (!agent && jumps >= 0)
+    CHECK(commands_sent(nxt, 'G') - jumps ==
+          2 * ((N_WORDS + NXT_REGS_MAX_OPS - 1) / NXT_REGS_MAX_OPS));
+
+  for (i = 0; i < N_WORDS; i += 97)
+    {
+      CHECK_OK(nxt_read_word(nxt, addrs[i], &w));
+      CHECK(w == values[i]);
+    }
+
+  // Peripheral registers read as they do one at a time
+  addrs[0] = MC_FSR;
+  CHECK_OK(nxt_read_words(nxt, addrs, out, 1));
+  CHECK_OK(nxt_read_word(nxt, MC_FSR, &w));
+  CHECK(out[0] == w);
+
+  CHECK_OK(nxt_read_words(nxt, addrs, out, 0));
+
+  // Unaligned addresses are refused, and the handle stays usable
+  addrs[1] = SCRATCH + 1;
+  CHECK_ERR(nxt_read_words(nxt, addrs, out, 2), NXT_SAMBA_PROTOCOL_ERROR);
+  CHECK_ERR(nxt_write_words(nxt, addrs, values, 2),
+            NXT_SAMBA_PROTOCOL_ERROR);
+  CHECK_OK(nxt_read_word(nxt, SCRATCH, &w));
+
+  if (agent)
+    CHECK_OK(nxt_agent_stop(nxt));
+  nxt_close(nxt);
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_emu_t *emu = nxt_emu_new();
+
+  check_words(emu, 0);
+  check_words(emu, 1);
+
+  nxt_emu_free(emu);
+  return 0;
+}
@@ -0,0 +1,221 @@
+/**
+ * libnxt tests; non-blocking requests driven by nxt_process_events().
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <poll.h>
+#include <string.h>
+
+#include "firmware.h"
+#include "regs.h"
+#include "request.h"
+#include "samba.h"
+#include "stats.h"
+#include "test.h"
+
+#define N_BRICKS 4
+#define IMAGE_LEN 30000
+#define MEM_LEN 20000
+#define N_WORDS 300
+#define SCRATCH 0x202000
+#define WORDS_ADDR 0x208000
+
+static int n_callbacks;
+
+static void count_callback(nxt_request_t *req, void *data)
+{
+  n_callbacks++;
+  if (data != NULL)
+    nxt_request_free(req);
+}
+
+/* Run the requests to completion, the way an event loop would. */
+static void run_events(void)
+{
+  struct pollfd fds[N_BRICKS];
+  int n, timeout_ms;
+
+  while (nxt_process_events() > 0)
+    {
+      n = nxt_get_pollfds(fds, N_BRICKS, &timeout_ms);
+      CHECK(n <= N_BRICKS);
+      poll(fds, n, timeout_ms);
+    }
+}
+
+/* How many pages the handle has flashed, or -1 without statistics. */
+static long pages_flashed(nxt_t *nxt)
+{
+  nxt_stats_t stats;
+
+  if (nxt_get_stats(nxt, &stats) != NXT_OK)
+    return -1;
+  return stats.pages_flashed;
+}
+
+static void check_done(nxt_request_t *req)
+{
+  CHECK(nxt_request_status(req) == NXT_REQUEST_DONE);
+  CHECK_OK(nxt_request_error(req));
+}
+
+/* Flash every brick, then write and read back words and memory, all
+ * queued up front and run from one thread.
+ */
+static void test_concurrent(nxt_emu_t **emus)
+{
+  nxt_request_t *flash[N_BRICKS], *write_words[N_BRICKS];
+  nxt_request_t *read_words[N_BRICKS], *write[N_BRICKS], *read[N_BRICKS];
+  nxt_t *nxts[N_BRICKS];
+  nxt_addr_t addrs[N_WORDS];
+  nxt_word_t values[N_WORDS];
+  static nxt_word_t out[N_BRICKS][N_WORDS];
+  static char back[N_BRICKS][MEM_LEN];
+  char *image = malloc(IMAGE_LEN), *mem = malloc(MEM_LEN);
+  nxt_flash_plan_t plan;
+  long pages;
+  nxt_emu_t *ref;
+  nxt_t *nxt;
+  int i;
+
+  test_pattern(image, IMAGE_LEN, 31);
+  test_pattern(mem, MEM_LEN, 32);
+  CHECK_OK(nxt_flash_plan_load(test_temp_file(image, IMAGE_LEN), &plan));
+  for (i = 0; i < N_WORDS; i++)
+    {
+      addrs[i] = WORDS_ADDR + i * 8;
+      values[i] = i * 0x01000193U;
+    }
+
+  // What flashing the plan the blocking way counts
+  ref = nxt_emu_new();
+  nxt = test_open(ref);
+  CHECK_OK(nxt_firmware_flash_plan(nxt, &plan));
+  pages = pages_flashed(nxt);
+  nxt_close(nxt);
+  nxt_emu_free(ref);
+
+  n_callbacks = 0;
+  for (i = 0; i < N_BRICKS; i++)
+    {
+      nxts[i] = test_open(emus[i]);
+      CHECK_OK(nxt_request_flash_plan(&flash[i], nxts[i], &plan));
+      CHECK_OK(nxt_request_write_words(&write_words[i], nxts[i], addrs,
+                                       values, N_WORDS));
+      CHECK_OK(nxt_request_read_words(&read_words[i], nxts[i], addrs,
+                                      out[i], N_WORDS));
+      CHECK_OK(nxt_request_write_mem(&write[i], nxts[i], SCRATCH, mem,
+                                     MEM_LEN));
+      CHECK_OK(nxt_request_read_mem(&read[i], nxts[i], SCRATCH, back[i],
+                                    MEM_LEN));
+      nxt_request_set_callback(read_words[i], count_callback, NULL);
+      nxt_request_set_callback(read[i], count_callback, NULL);
+
+      // Nothing moves until the events are processed
+      CHECK(nxt_request_status(flash[i]) == NXT_REQUEST_RUNNING);
+      CHECK(nxt_request_status(read_words[i]) == NXT_REQUEST_QUEUED);
+    }
+
+  run_events();
+  CHECK(n_callbacks == 2 * N_BRICKS);
+
+  for (i = 0; i < N_BRICKS; i++)
+    {
+      check_done(flash[i]);
+      check_done(write_words[i]);
+      check_done(read_words[i]);
+      check_done(write[i]);
+      check_done(read[i]);
+
+      CHECK(memcmp(nxt_emu_flash(emus[i]), image, IMAGE_LEN) == 0);
+      CHECK(memcmp(out[i], values, sizeof(values)) == 0);
+      CHECK(memcmp(back[i], mem, MEM_LEN) == 0);
+      CHECK(pages_flashed(nxts[i]) == pages);
+
+      nxt_request_free(flash[i]);
+      nxt_request_free(write_words[i]);
+      nxt_request_free(read_words[i]);
+      nxt_request_free(write[i]);
+      nxt_request_free(read[i]);
+    }
+
+  // The flash took, as the blocking calls see it
+  CHECK_OK(nxt_firmware_verify_plan(nxts[0], &plan));
+
+  for (i = 0; i < N_BRICKS; i++)
+    nxt_close(nxts[i]);
+  nxt_flash_plan_free(&plan);
+  free(image);
+  free(mem);
+}
+
+/* A failed request fails those queued behind it on its handle, and
+ * no others.
+ */
+static void test_failure(nxt_emu_t **emus)
+{
+  nxt_request_t *jump, *behind, *other, *freed;
+  nxt_t *nxt = test_open(emus[0]), *other_nxt = test_open(emus[1]);
+  char buf[16], other_buf[16];
+
+  // Jumping to code that isn't libnxt's stops the emulated brick
+  CHECK_OK(nxt_request_jump(&jump, nxt, 0x100000));
+  CHECK_OK(nxt_request_read_mem(&behind, nxt, SCRATCH, buf, 16));
+  CHECK_OK(nxt_request_read_mem(&other, other_nxt, SCRATCH, other_buf, 16));
+  nxt_set_timeout(nxt, 100);
+  run_events();
+
+  check_done(jump);
+  CHECK(nxt_request_status(behind) == NXT_REQUEST_FAILED);
+  CHECK(nxt_request_error(behind) != NXT_OK);
+  check_done(other);
+  nxt_request_free(jump);
+  nxt_request_free(behind);
+  nxt_request_free(other);
+  nxt_close(nxt);
+  nxt_emu_reset(emus[0]);
+
+  // Requests freed while queued never run; callbacks may free theirs
+  n_callbacks = 0;
+  CHECK_OK(nxt_request_read_mem(&other, other_nxt, SCRATCH, other_buf, 16));
+  CHECK_OK(nxt_request_read_mem(&freed, other_nxt, SCRATCH, other_buf, 16));
+  nxt_request_free(freed);
+  nxt_request_set_callback(other, count_callback, (void *)1);
+  run_events();
+  CHECK(n_callbacks == 1);
+  CHECK(nxt_process_events() == 0);
+
+  nxt_close(other_nxt);
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_emu_t *emus[N_BRICKS];
+  int i;
+
+  for (i = 0; i < N_BRICKS; i++)
+    emus[i] = nxt_emu_new();
+
+  test_concurrent(emus);
+  test_failure(emus);
+
+  for (i = 0; i < N_BRICKS; i++)
+    nxt_emu_free(emus[i]);
+  return 0;
+}
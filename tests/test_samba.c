@@ -0,0 +1,209 @@
+/**
+ * libnxt tests; SAM-BA handshake, memory access and batching.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <string.h>
+#include <sys/uio.h>
+
+#include "samba.h"
+#include "stats.h"
+#include "test.h"
+
+#define SCRATCH 0x204000
+
+static void test_handshake(nxt_emu_t *emu)
+{
+  nxt_t *nxt = test_open(emu);
+  char version[5];
+
+  // Handshakes can be repeated at any time between commands
+  CHECK_OK(nxt_handshake(nxt));
+  CHECK_OK(nxt_samba_version(nxt, version));
+  CHECK(strcmp(version, "v1.4") == 0);
+  CHECK_OK(nxt_handshake(nxt));
+
+  nxt_close(nxt);
+}
+
+static void test_words(nxt_emu_t *emu)
+{
+  nxt_t *nxt = test_open(emu);
+  nxt_byte_t b;
+  nxt_hword_t hw;
+  nxt_word_t w;
+
+  CHECK_OK(nxt_write_word(nxt, SCRATCH, 0x12345678));
+  CHECK_OK(nxt_read_word(nxt, SCRATCH, &w));
+  CHECK(w == 0x12345678);
+
+  CHECK_OK(nxt_write_hword(nxt, SCRATCH + 2, 0xABCD));
+  CHECK_OK(nxt_write_byte(nxt, SCRATCH, 0xEF));
+  CHECK_OK(nxt_read_word(nxt, SCRATCH, &w));
+  CHECK(w == 0xABCD56EF);
+  CHECK_OK(nxt_read_hword(nxt, SCRATCH, &hw));
+  CHECK(hw == 0x56EF);
+  CHECK_OK(nxt_read_byte(nxt, SCRATCH + 3, &b));
+  CHECK(b == 0xAB);
+
+  nxt_close(nxt);
+}
+
+/* Sizes around the 64 byte packets, and over a chunk, at odd
+ * addresses.
+ */
+static void test_memory(nxt_emu_t *emu)
+{
+  static const int sizes[] = { 1, 63, 64, 65, 128, 1000, NXT_MEM_CHUNK + 3 };
+  nxt_t *nxt = test_open(emu);
+  char *buf = malloc(NXT_MEM_CHUNK + 3), *back = malloc(NXT_MEM_CHUNK + 3);
+  struct iovec iov[3];
+  nxt_word_t w;
+  int i;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+      test_pattern(buf, sizes[i], i);
+      CHECK_OK(nxt_write_mem(nxt, SCRATCH + i, buf, sizes[i]));
+      memset(back, 0, sizes[i]);
+      CHECK_OK(nxt_read_mem(nxt, SCRATCH + i, back, sizes[i]));
+      CHECK(memcmp(buf, back, sizes[i]) == 0);
+
+      // Whatever follows is still in step with its reply
+      CHECK_OK(nxt_write_word(nxt, SCRATCH - 4, i));
+      CHECK_OK(nxt_read_word(nxt, SCRATCH - 4, &w));
+      CHECK(w == i);
+    }
+
+  // Gathered writes and scattered reads see the same bytes
+  test_pattern(buf, 300, 99);
+  iov[0].iov_base = buf;
+  iov[0].iov_len = 7;
+  iov[1].iov_base = buf + 7;
+  iov[1].iov_len = 0;
+  iov[2].iov_base = buf + 7;
+  iov[2].iov_len = 293;
+  CHECK_OK(nxt_write_memv(nxt, SCRATCH + 1, iov, 3));
+  CHECK_OK(nxt_read_mem(nxt, SCRATCH + 1, back, 300));
+  CHECK(memcmp(buf, back, 300) == 0);
+
+  memset(back, 0, 300);
+  iov[0].iov_base = back;
+  iov[1].iov_base = back + 7;
+  iov[2].iov_base = back + 7;
+  CHECK_OK(nxt_read_memv(nxt, SCRATCH + 1, iov, 3));
+  CHECK(memcmp(buf, back, 300) == 0);
+
+  // Ranges running past the end of the address space are refused
+  CHECK_ERR(nxt_write_mem(nxt, 0xFFFFFFF0, buf, 32),
+            NXT_SAMBA_PROTOCOL_ERROR);
+
+  free(buf);
+  free(back);
+  nxt_close(nxt);
+}
+
+/* Replies filling their last packet end without a short packet, so
+ * the read for them must not ask for any more.
+ */
+static void test_whole_packets(nxt_emu_t *emu)
+{
+  nxt_t *nxt = test_open(emu);
+  char buf[128], back[128];
+
+  test_pattern(buf, sizeof(buf), 3);
+  CHECK_OK(nxt_write_mem(nxt, SCRATCH, buf, sizeof(buf)));
+
+  CHECK_OK(nxt_read_mem(nxt, SCRATCH, back, 64));
+  CHECK_OK(nxt_read_mem(nxt, SCRATCH + 64, back + 64, 64));
+  CHECK(memcmp(buf, back, sizeof(buf)) == 0);
+  CHECK_OK(nxt_read_mem(nxt, SCRATCH, back, 128));
+  CHECK(memcmp(buf, back, sizeof(buf)) == 0);
+
+  nxt_close(nxt);
+}
+
+static unsigned long transfers_out(nxt_t *nxt)
+{
+  nxt_stats_t stats;
+
+  if (nxt_get_stats(nxt, &stats) != NXT_OK)
+    return 0;
+  return stats.transfers_out;
+}
+
+static void test_batch(nxt_emu_t *emu)
+{
+  nxt_t *nxt = test_open(emu);
+  unsigned long before;
+  nxt_word_t w;
+  char buf[32];
+
+  CHECK_OK(nxt_write_word(nxt, SCRATCH, 0));
+
+  // Three writes fit in one packet, and go out at the end
+  before = transfers_out(nxt);
+  nxt_batch_begin(nxt);
+  CHECK_OK(nxt_write_word(nxt, SCRATCH, 1));
+  CHECK_OK(nxt_write_word(nxt, SCRATCH + 4, 2));
+  nxt_batch_begin(nxt);
+  CHECK_OK(nxt_write_word(nxt, SCRATCH + 8, 3));
+  CHECK_OK(nxt_batch_end(nxt));
+  CHECK(transfers_out(nxt) == before);
+  CHECK_OK(nxt_batch_end(nxt));
+  CHECK(transfers_out(nxt) == before + 1 || before == 0);
+  CHECK_OK(nxt_read_word(nxt, SCRATCH + 8, &w));
+  CHECK(w == 3);
+
+  // A read in a batch flushes what was queued before it first
+  nxt_batch_begin(nxt);
+  CHECK_OK(nxt_write_word(nxt, SCRATCH, 4));
+  CHECK_OK(nxt_read_word(nxt, SCRATCH, &w));
+  CHECK(w == 4);
+  CHECK_OK(nxt_batch_end(nxt));
+
+  /* A cancelled batch drops what it queued, and leaves the handle
+   * sending commands straight away again.
+   */
+  nxt_batch_begin(nxt);
+  CHECK_OK(nxt_write_word(nxt, SCRATCH, 5));
+  CHECK_ERR(nxt_batch_cancel(nxt, nxt_write_mem(nxt, 0xFFFFFFF0, buf, 32)),
+            NXT_SAMBA_PROTOCOL_ERROR);
+  before = transfers_out(nxt);
+  CHECK_OK(nxt_write_word(nxt, SCRATCH + 4, 6));
+  CHECK(transfers_out(nxt) == before + 1 || before == 0);
+  CHECK_OK(nxt_read_word(nxt, SCRATCH, &w));
+  CHECK(w == 4);
+
+  nxt_close(nxt);
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_emu_t *emu = nxt_emu_new();
+
+  test_handshake(emu);
+  test_words(emu);
+  test_memory(emu);
+  test_whole_packets(emu);
+  test_batch(emu);
+
+  nxt_emu_free(emu);
+  return 0;
+}
@@ -0,0 +1,141 @@
+/**
+ * libnxt tests; capturing USB traffic and replaying it.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <string.h>
+
+#include "firmware.h"
+#include "samba.h"
+#include "trace.h"
+#include "test.h"
+
+#define IMAGE_LEN 20000
+#define SCRATCH 0x204000
+#define N_READS 2000
+
+/* Run a flash and verify of image over an open handle. */
+static void flash_session(nxt_t *nxt, char *image)
+{
+  CHECK_OK(nxt_handshake(nxt));
+  CHECK_OK(nxt_firmware_flash_buffer(nxt, image, IMAGE_LEN));
+  CHECK_OK(nxt_firmware_verify_buffer(nxt, image, IMAGE_LEN));
+}
+
+static void test_replay(nxt_emu_t *emu)
+{
+  char *path = test_temp_file("", 0);
+  char *image = malloc(IMAGE_LEN);
+  nxt_trace_t *trace;
+  nxt_word_t w;
+  nxt_t *nxt;
+  int i;
+
+  test_pattern(image, IMAGE_LEN, 5);
+
+  CHECK_OK(nxt_emu_init(&nxt, emu));
+  CHECK_OK(nxt_open(nxt, 1));
+  CHECK_OK(nxt_capture_start(nxt, path));
+  flash_session(nxt, image);
+  CHECK_OK(nxt_close(nxt));
+
+  CHECK_OK(nxt_trace_load(path, &trace));
+  CHECK(trace->n_dropped == 0 && trace->n_records > 0);
+  CHECK(trace->firmware == SAMBA);
+  for (i = 0; i < trace->n_records; i++)
+    CHECK(trace->records[i].status == NXT_OK);
+  CHECK(trace->records[0].direction == NXT_TRACE_OUT);
+
+  // The same session plays back against the trace alone
+  CHECK_OK(nxt_replay_init(&nxt, trace, 0));
+  CHECK_OK(nxt_open(nxt, 1));
+  flash_session(nxt, image);
+
+  // Past its last record, the trace has nothing more to give
+  CHECK_ERR(nxt_read_word(nxt, SCRATCH, &w), NXT_SAMBA_PROTOCOL_ERROR);
+  nxt_close(nxt);
+
+  // A different session diverges from it
+  image[100] ^= 1;
+  CHECK_OK(nxt_replay_init(&nxt, trace, 0));
+  CHECK_OK(nxt_open(nxt, 1));
+  CHECK_OK(nxt_handshake(nxt));
+  CHECK_ERR(nxt_firmware_flash_buffer(nxt, image, IMAGE_LEN),
+            NXT_SAMBA_PROTOCOL_ERROR);
+  nxt_close(nxt);
+
+  nxt_trace_free(trace);
+  free(image);
+}
+
+/* Many small transfers, as fast as the emulator takes them, to push
+ * the capture ring: every transfer is either written or counted.
+ */
+static void test_capture_burst(nxt_emu_t *emu)
+{
+  char *path = test_temp_file("", 0);
+  nxt_word_t w, values[N_READS];
+  nxt_trace_t *trace;
+  nxt_t *nxt = test_open(emu);
+  int i;
+
+  for (i = 0; i < N_READS; i++)
+    {
+      values[i] = i * 2654435761U;
+      CHECK_OK(nxt_write_word(nxt, SCRATCH + i * 4, values[i]));
+    }
+
+  CHECK_OK(nxt_capture_start(nxt, path));
+  for (i = 0; i < N_READS; i++)
+    {
+      CHECK_OK(nxt_read_word(nxt, SCRATCH + i * 4, &w));
+      CHECK(w == values[i]);
+    }
+  CHECK_OK(nxt_capture_stop(nxt));
+  nxt_close(nxt);
+
+  CHECK_OK(nxt_trace_load(path, &trace));
+  CHECK(trace->n_records + trace->n_dropped == 2 * N_READS);
+
+  // When nothing was dropped, the reads play back in full
+  if (trace->n_dropped == 0)
+    {
+      CHECK_OK(nxt_replay_init(&nxt, trace, 0));
+      CHECK_OK(nxt_open(nxt, 1));
+      for (i = 0; i < N_READS; i++)
+        {
+          CHECK_OK(nxt_read_word(nxt, SCRATCH + i * 4, &w));
+          CHECK(w == values[i]);
+        }
+      nxt_close(nxt);
+    }
+
+  nxt_trace_free(trace);
+}
+
+int main(int argc, char *argv[])
+{
+  nxt_emu_t *emu = nxt_emu_new();
+
+  test_replay(emu);
+  test_capture_burst(emu);
+
+  nxt_emu_free(emu);
+  return 0;
+}
@@ -0,0 +1,447 @@
+/**
+ * NXT bootstrap interface; USB traffic capture and replay.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "error.h"
+#include "lowlevel.h"
+#include "transport.h"
+#include "samba.h"
+#include "trace.h"
+
+/* Enough for a few hundred full flash batches. */
+#define TRACE_RING_SIZE (4*1024*1024)
+
+/* The ring is written by the thread doing transfers and drained by
+ * the writer thread. head and tail only ever grow, and each side only
+ * stores its own, so records go in without taking the lock. The lock
+ * is only there for the writer thread to sleep on while the ring is
+ * empty, and to be woken up.
+ */
+struct nxt_trace_writer {
+  FILE *f;
+  nxt_firmware firmware;
+  long long start;
+
+  char *ring;
+  unsigned long head;
+  unsigned long tail;
+  unsigned long n_dropped;
+  int sleeping;
+  int stop;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+
+long long
+nxt_trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static void
+nxt_trace_header(nxt_trace_writer_t *w, char *buf)
+{
+  memcpy(buf, NXT_TRACE_MAGIC, 8);
+  nxt_store_word(buf + 8, NXT_TRACE_VERSION);
+  nxt_store_word(buf + 12, w->n_dropped);
+  nxt_store_word(buf + 16, w->firmware);
+}
+
+
+static void *
+nxt_trace_writer_main(void *arg)
+{
+  nxt_trace_writer_t *w = arg;
+
+  for (;;)
+    {
+      unsigned long head, from, n;
+
+      /* Say we are going to sleep before looking at head for the last
+       * time, so that either we see the new record or its writer sees
+       * us asleep.
+       */
+      head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+      if (head == w->tail)
+        {
+          pthread_mutex_lock(&w->lock);
+          __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+          while ((head = __atomic_load_n(&w->head, __ATOMIC_SEQ_CST)) ==
+                 w->tail && !w->stop)
+            pthread_cond_wait(&w->cond, &w->lock);
+          __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+          pthread_mutex_unlock(&w->lock);
+
+          if (head == w->tail)
+            return NULL;
+        }
+
+      // The pending bytes may wrap around the end of the ring
+      from = w->tail % TRACE_RING_SIZE;
+      n = head - w->tail;
+      if (from + n > TRACE_RING_SIZE)
+        {
+          fwrite(w->ring + from, 1, TRACE_RING_SIZE - from, w->f);
+          fwrite(w->ring, 1, n - (TRACE_RING_SIZE - from), w->f);
+        }
+      else
+        fwrite(w->ring + from, 1, n, w->f);
+
+      __atomic_store_n(&w->tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+
+nxt_error_t
+nxt_trace_writer_open(nxt_trace_writer_t **writer, char *path,
+                      nxt_firmware fw)
+{
+  nxt_trace_writer_t *w = calloc(1, sizeof(*w));
+  char header[NXT_TRACE_HEADER_SIZE];
+
+  if (w == NULL)
+    return NXT_FILE_ERROR;
+
+  w->ring = malloc(TRACE_RING_SIZE);
+  w->f = fopen(path, "wb");
+  if (w->ring == NULL || w->f == NULL)
+    {
+      if (w->f != NULL)
+        fclose(w->f);
+      free(w->ring);
+      free(w);
+      return NXT_FILE_ERROR;
+    }
+
+  w->firmware = fw;
+  w->start = nxt_trace_now();
+  nxt_trace_header(w, header);
+  fwrite(header, 1, sizeof(header), w->f);
+
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  if (pthread_create(&w->thread, NULL, nxt_trace_writer_main, w) != 0)
+    {
+      pthread_mutex_destroy(&w->lock);
+      pthread_cond_destroy(&w->cond);
+      fclose(w->f);
+      free(w->ring);
+      free(w);
+      return NXT_FILE_ERROR;
+    }
+
+  *writer = w;
+  return NXT_OK;
+}
+
+
+static void
+nxt_trace_copy(nxt_trace_writer_t *w, unsigned long pos, char *buf, int len)
+{
+  unsigned long from = pos % TRACE_RING_SIZE;
+
+  if (from + len > TRACE_RING_SIZE)
+    {
+      memcpy(w->ring + from, buf, TRACE_RING_SIZE - from);
+      memcpy(w->ring, buf + (TRACE_RING_SIZE - from),
+             len - (TRACE_RING_SIZE - from));
+    }
+  else
+    memcpy(w->ring + from, buf, len);
+}
+
+
+void
+nxt_trace_write(nxt_trace_writer_t *w, int direction, int endpoint,
+                nxt_error_t status, char *buf, int len, long long start)
+{
+  long long end = nxt_trace_now();
+  char rec[NXT_TRACE_RECORD_SIZE];
+  unsigned long used, head;
+
+  head = w->head;
+  used = head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+  if (TRACE_RING_SIZE - used < NXT_TRACE_RECORD_SIZE + len)
+    {
+      w->n_dropped++;
+      return;
+    }
+
+  start -= w->start;
+  nxt_store_word(rec, start & 0xFFFFFFFF);
+  nxt_store_word(rec + 4, start >> 32);
+  nxt_store_word(rec + 8, (end - w->start - start) / 1000);
+  rec[12] = direction;
+  rec[13] = endpoint;
+  rec[14] = status;
+  rec[15] = 0;
+  nxt_store_word(rec + 16, len);
+
+  nxt_trace_copy(w, head, rec, NXT_TRACE_RECORD_SIZE);
+  nxt_trace_copy(w, head + NXT_TRACE_RECORD_SIZE, buf, len);
+
+  // Only wake the writer thread up when it went to sleep
+  __atomic_store_n(&w->head, head + NXT_TRACE_RECORD_SIZE + len,
+                   __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+    {
+      pthread_mutex_lock(&w->lock);
+      pthread_cond_signal(&w->cond);
+      pthread_mutex_unlock(&w->lock);
+    }
+}
+
+
+nxt_error_t
+nxt_trace_writer_close(nxt_trace_writer_t *w)
+{
+  char header[NXT_TRACE_HEADER_SIZE];
+  nxt_error_t err = NXT_OK;
+
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+
+  // Now that it is known, record how much was dropped
+  nxt_trace_header(w, header);
+  if (fseek(w->f, 0, SEEK_SET) != 0 ||
+      fwrite(header, 1, sizeof(header), w->f) != sizeof(header))
+    err = NXT_FILE_ERROR;
+  if (fclose(w->f) != 0)
+    err = NXT_FILE_ERROR;
+
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  free(w->ring);
+  free(w);
+
+  return err;
+}
+
+
+nxt_error_t
+nxt_trace_load(char *path, nxt_trace_t **trace)
+{
+  nxt_trace_t *t;
+  FILE *f;
+  long size, pos;
+  int n, pass;
+
+  f = fopen(path, "rb");
+  if (f == NULL)
+    return NXT_FILE_ERROR;
+
+  t = calloc(1, sizeof(*t));
+  if (t == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0)
+    {
+      free(t);
+      fclose(f);
+      return NXT_FILE_ERROR;
+    }
+  rewind(f);
+
+  t->raw = malloc(size);
+  if (t->raw == NULL || fread(t->raw, 1, size, f) != size)
+    {
+      fclose(f);
+      nxt_trace_free(t);
+      return NXT_FILE_ERROR;
+    }
+  fclose(f);
+
+  if (size < NXT_TRACE_HEADER_SIZE ||
+      memcmp(t->raw, NXT_TRACE_MAGIC, 8) != 0 ||
+      nxt_load_word(t->raw + 8) != NXT_TRACE_VERSION)
+    {
+      nxt_trace_free(t);
+      return NXT_FILE_ERROR;
+    }
+
+  t->n_dropped = nxt_load_word(t->raw + 12);
+  t->firmware = nxt_load_word(t->raw + 16);
+
+  // Count the records, then index them
+  for (pass = 0; pass < 2; pass++)
+    {
+      n = 0;
+      for (pos = NXT_TRACE_HEADER_SIZE;
+           pos + NXT_TRACE_RECORD_SIZE <= size; n++)
+        {
+          char *rec = t->raw + pos;
+          int len = nxt_load_word(rec + 16);
+
+          if (len < 0 || pos + NXT_TRACE_RECORD_SIZE + len > size)
+            break;
+
+          if (t->records != NULL)
+            {
+              nxt_trace_record_t *r = &t->records[n];
+
+              r->start_ns = nxt_load_word(rec) |
+                ((uint64_t)nxt_load_word(rec + 4) << 32);
+              r->duration_us = nxt_load_word(rec + 8);
+              r->direction = rec[12];
+              r->endpoint = (unsigned char)rec[13];
+              r->status = rec[14];
+              r->len = len;
+              r->data = rec + NXT_TRACE_RECORD_SIZE;
+            }
+
+          pos += NXT_TRACE_RECORD_SIZE + len;
+        }
+
+      if (t->records == NULL)
+        {
+          t->records = calloc(n + 1, sizeof(*t->records));
+          if (t->records == NULL)
+            {
+              nxt_trace_free(t);
+              return NXT_FILE_ERROR;
+            }
+        }
+    }
+
+  t->n_records = n;
+  *trace = t;
+  return NXT_OK;
+}
+
+
+void
+nxt_trace_free(nxt_trace_t *trace)
+{
+  free(trace->records);
+  free(trace->raw);
+  free(trace);
+}
+
+
+static void
+nxt_replay_delay(nxt_trace_t *t, nxt_trace_record_t *r)
+{
+  double ns = r->duration_us * 1e3 * t->speed;
+  struct timespec ts;
+
+  if (ns <= 0)
+    return;
+
+  ts.tv_sec = ns / 1e9;
+  ts.tv_nsec = ns - ts.tv_sec * 1e9;
+  nanosleep(&ts, NULL);
+}
+
+
+static nxt_error_t
+nxt_replay_open(nxt_t *nxt, int interface)
+{
+  return NXT_OK;
+}
+
+
+/* The library must send exactly what it sent when the trace was
+ * recorded, or the recorded answers don't apply anymore.
+ */
+static nxt_error_t
+nxt_replay_send(nxt_t *nxt, char *buf, int len)
+{
+  nxt_trace_t *t = nxt_transport_data(nxt);
+  nxt_trace_record_t *r;
+
+  if (t->next >= t->n_records)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  r = &t->records[t->next];
+  if (r->direction != NXT_TRACE_OUT || r->len != len ||
+      memcmp(r->data, buf, len) != 0)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  t->next++;
+  nxt_replay_delay(t, r);
+  return r->status;
+}
+
+
+static nxt_error_t
+nxt_replay_recv(nxt_t *nxt, char *buf, int len, int *n_read)
+{
+  nxt_trace_t *t = nxt_transport_data(nxt);
+  nxt_trace_record_t *r;
+
+  *n_read = 0;
+  if (t->next >= t->n_records)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  r = &t->records[t->next];
+  if (r->direction != NXT_TRACE_IN || r->len > len)
+    return NXT_SAMBA_PROTOCOL_ERROR;
+
+  t->next++;
+  nxt_replay_delay(t, r);
+  memcpy(buf, r->data, r->len);
+  *n_read = r->len;
+  return r->status;
+}
+
+
+static void
+nxt_replay_close(nxt_t *nxt)
+{
+}
+
+
+static const nxt_transport_t nxt_replay_transport = {
+  "replay",
+  nxt_replay_open,
+  nxt_replay_send,
+  nxt_replay_recv,
+  nxt_replay_close,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+};
+
+
+nxt_error_t
+nxt_replay_init(nxt_t **nxt, nxt_trace_t *trace, double speed)
+{
+  trace->next = 0;
+  trace->speed = speed;
+
+  return nxt_init_transport(nxt, &nxt_replay_transport, trace,
+                            trace->firmware);
+}
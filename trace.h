@@ -0,0 +1,106 @@
+/**
+ * NXT bootstrap interface; USB traffic capture and replay.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include "error.h"
+#include "lowlevel.h"
+
+/* Trace files start with a 20 byte header: the magic "NXTTRACE", the
+ * format version, the number of records dropped during capture and
+ * the firmware the device was running. Each transfer follows as a 20
+ * byte record header and its payload:
+ *
+ *   u64 start      nanoseconds since the capture started
+ *   u32 duration   microseconds the transfer took
+ *   u8  direction  NXT_TRACE_OUT or NXT_TRACE_IN
+ *   u8  endpoint   0x01 or 0x82
+ *   u8  status     nxt_error_t of the transfer
+ *   u8  reserved
+ *   u32 len        bytes of payload, as sent or as received
+ *
+ * All fields are little-endian.
+ */
+#define NXT_TRACE_MAGIC "NXTTRACE"
+#define NXT_TRACE_VERSION 1
+#define NXT_TRACE_HEADER_SIZE 20
+#define NXT_TRACE_RECORD_SIZE 20
+
+#define NXT_TRACE_OUT 0
+#define NXT_TRACE_IN  1
+
+typedef struct
+{
+  uint64_t start_ns;
+  uint32_t duration_us;
+  int direction;
+  int endpoint;
+  nxt_error_t status;
+  int len;
+  char *data;
+} nxt_trace_record_t;
+
+typedef struct
+{
+  nxt_firmware firmware;
+  unsigned long n_dropped;
+  int n_records;
+  nxt_trace_record_t *records;
+  char *raw;
+
+  // Replay state
+  int next;
+  double speed;
+} nxt_trace_t;
+
+/* Capture every transfer of an open handle to a trace file, until
+ * nxt_capture_stop() or nxt_close(). Records are copied to a ring
+ * buffer which a background thread writes out, so capturing doesn't
+ * wait on the disk. When the ring fills up, records are dropped and
+ * counted in the file header instead.
+ */
+nxt_error_t nxt_capture_start(nxt_t *nxt, char *path);
+nxt_error_t nxt_capture_stop(nxt_t *nxt);
+
+/* Load a whole trace file into memory. */
+nxt_error_t nxt_trace_load(char *path, nxt_trace_t **trace);
+void nxt_trace_free(nxt_trace_t *trace);
+
+/* Create a handle playing a trace back. Sends must match the recorded
+ * ones, and receives return the recorded data. Each transfer takes its
+ * recorded duration scaled by speed, or no time at all if speed is 0.
+ */
+nxt_error_t nxt_replay_init(nxt_t **nxt, nxt_trace_t *trace, double speed);
+
+/* The capture side, used by lowlevel.c. */
+typedef struct nxt_trace_writer nxt_trace_writer_t;
+
+long long nxt_trace_now(void);
+nxt_error_t nxt_trace_writer_open(nxt_trace_writer_t **writer, char *path,
+                                  nxt_firmware fw);
+void nxt_trace_write(nxt_trace_writer_t *writer, int direction,
+                     int endpoint, nxt_error_t status, char *buf, int len,
+                     long long start);
+nxt_error_t nxt_trace_writer_close(nxt_trace_writer_t *writer);
+
+#endif /* __TRACE_H__ */
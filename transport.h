@@ -0,0 +1,97 @@
+/**
+ * NXT bootstrap interface; pluggable transports.
+ *
+ * Copyright 2006 David Anderson <david.anderson@calixo.net>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <poll.h>
+#include "error.h"
+#include "lowlevel.h"
+
+/* The link between a handle and its brick. lowlevel.c provides the
+ * USB transports, which nxt_init() handles use. Others, such as the
+ * emulator, plug in through nxt_init_transport().
+ *
+ * send() and recv() behave like bulk transfers: recv() completes once
+ * len bytes have arrived, or when the device has nothing more to send
+ * for now, and reports how many bytes it got in n_read.
+ */
+typedef struct nxt_transport {
+  const char *name;
+  nxt_error_t (*open)(nxt_t *nxt, int interface);
+  nxt_error_t (*send)(nxt_t *nxt, char *buf, int len);
+  nxt_error_t (*recv)(nxt_t *nxt, char *buf, int len, int *n_read);
+  void (*close)(nxt_t *nxt);
+
+  /* Recover a broken link. Optional, closing and reopening is used
+   * when NULL.
+   */
+  nxt_error_t (*reconnect)(nxt_t *nxt, int timeout_ms);
+
+  /* Describe where the brick is, for nxt_get_location(). Optional,
+   * the transport's name is used when NULL.
+   */
+  void (*location)(nxt_t *nxt, char *buf, int len);
+
+  /* Non-blocking operation, for the requests of request.h. Optional,
+   * all four or none: requests on transports without them make
+   * blocking transfers.
+   *
+   * can_send() says whether send() would return at once. available()
+   * gives how many of the len bytes wanted recv() can return at once,
+   * 0 for a transfer that ended empty, or -1 when nothing has come in
+   * yet, starting the transfer if need be. pollfds() fills in up to
+   * max descriptors to wait on for that to change, returning how many
+   * there are, and may shorten *timeout_ms (-1 for no limit). events()
+   * handles whatever happened on them, without waiting.
+   */
+  int (*can_send)(nxt_t *nxt);
+  int (*available)(nxt_t *nxt, int len);
+  int (*pollfds)(nxt_t *nxt, struct pollfd *fds, int max, int *timeout_ms);
+  nxt_error_t (*events)(nxt_t *nxt);
+} nxt_transport_t;
+
+/* Create a handle talking over a custom transport to a device running
+ * the given firmware. data is the transport's own state, which it gets
+ * back with nxt_transport_data().
+ */
+nxt_error_t nxt_init_transport(nxt_t **nxt, const nxt_transport_t *transport,
+                               void *data, nxt_firmware fw);
+void *nxt_transport_data(nxt_t *nxt);
+
+/* Move a handle that isn't open yet over to a custom transport, as
+ * the nxt_find() family does when the nxtd daemon holds the bricks.
+ */
+void nxt_set_transport(nxt_t *nxt, const nxt_transport_t *transport,
+                       void *data, nxt_firmware fw);
+
+/* The non-blocking hooks of a handle's transport, for request.c.
+ * Without them, nxt_transport_pollable() is 0, nothing is polled,
+ * sends are always ready, and so are len bytes to receive.
+ */
+int nxt_transport_pollable(nxt_t *nxt);
+int nxt_can_send(nxt_t *nxt);
+int nxt_recv_available(nxt_t *nxt, int len);
+int nxt_transport_pollfds(nxt_t *nxt, struct pollfd *fds, int max,
+                          int *timeout_ms);
+nxt_error_t nxt_transport_events(nxt_t *nxt);
+
+#endif /* __TRANSPORT_H__ */